@@ -19,20 +19,32 @@
 
 //#include "HardwareProfile.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 //#include <timers.h>
 //#include "FatFS/ff.h"
 //#include "FatFS/diskio.h"
+#include "esp_heap_caps.h"
 #include "fileio.h"
+#include "integer.h"
+#include "crc.h"
 #include "trs_hard.h"
 #include "trs_extra.h"
 
 // subcommands
 #define IM_OPEN		   0
 #define IM_READSEC	   1
+#define IM_WRITESEC	   2	// followed by a 256 byte data transfer
+#define IM_FLUSH	   3
+
+#define IM_NO_UNIT		0xff
 
 // DMK
 #define DMK_HEADER_LEN	16
+#define DMK_TKHDR_SIZE	0x80	// space reserved for IDAM pointers
+#define DMK_MAX_IDAMS	(DMK_TKHDR_SIZE / 2)
+#define DMK_TRACKLEN_MAX 0x4000
+#define DMK_CACHE_TRACKS 2		// number of cached DMK tracks
 
 // JV3
 #define JV3_DENSITY		0x80	// 1=dden 0=sden
@@ -61,6 +73,9 @@
 #define LDOS_DATA_NOT_FOUND 5
 #define LDOS_SYSTEM_REC		6
 #define LDOS_NOT_AVAIL		8
+#define LDOS_WRITE_NOT_FOUND 13
+#define LDOS_WRITE_FAULT	14
+#define LDOS_WRITE_PROT		15
 #define LDOS_NOT_FOUND		24
 
 
@@ -69,15 +84,20 @@
 
 static void dmk_open(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity);
 static void dmk_readsec(UCHAR unit, UCHAR track, UCHAR sector);
+static void dmk_writesec(UCHAR unit, UCHAR track, UCHAR sector);
+static void dmk_flush(UCHAR unit);
+static void dmk_close(UCHAR unit);
 static void jv3_open(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity);
 static void jv3_readsec(UCHAR unit, UCHAR track, UCHAR sector);
+static void jv3_writesec(UCHAR unit, UCHAR track, UCHAR sector);
+static void jv3_close(UCHAR unit);
 static void jv1_open(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity);
 static void jv1_readsec(UCHAR unit, UCHAR track, UCHAR sector);
+static void jv1_writesec(UCHAR unit, UCHAR track, UCHAR sector);
 
 
 /*
  * Guess the image type. Code borrowed from xtrs/trs_disk.c
- * (Must enter with file pointer at 0)
  */
 static im_type_t
 set_disk_emutype(UCHAR unit)
@@ -86,7 +106,7 @@ set_disk_emutype(UCHAR unit)
 	USHORT count;
 	UINT nbytes;
 
-	res = f_read(&im_file, extra_buffer, 16, &nbytes);
+	res = f_pread(&im[unit].file, extra_buffer, 16, 0, &nbytes);
 	if (res != FR_OK || nbytes < 16) {
 		return IM_NONE;
 	}
@@ -96,6 +116,7 @@ set_disk_emutype(UCHAR unit)
 			count = (USHORT)extra_buffer[2];
 			count |= (USHORT)extra_buffer[3] << 8;
 			if (count >= 16 && count <= 0x4000) {
+				if (extra_buffer[0] == 0xff) im[unit].writeprot = 1;
 				return IM_DMK;
 			}
 		}
@@ -107,14 +128,12 @@ set_disk_emutype(UCHAR unit)
 	if (extra_buffer[0] == 0 && extra_buffer[1] == 0xfe) {
 		return IM_JV1;
 	}
-	res = f_lseek(&im_file, JV3_SECSPERBLK * 3);
-	if (res == FR_OK) {
-		res = f_read(&im_file, extra_buffer, 8, &nbytes);
-	}	
+	res = f_pread(&im[unit].file, extra_buffer, 8, JV3_SECSPERBLK * 3, &nbytes);
 	if (res != FR_OK || nbytes < 8) {
 		return IM_NONE;
 	}
 	if (extra_buffer[0] == 0 || extra_buffer[0] == 0xff) {
+		if (extra_buffer[0] == 0) im[unit].writeprot = 1;
 		return IM_JV3;
 	}
 
@@ -123,49 +142,211 @@ set_disk_emutype(UCHAR unit)
 
 
 
+/*
+ * Each unit keeps its own file handle and parsed image metadata, so that
+ * alternating between units does not re-open and re-parse images. At most
+ * IM_MAX_OPEN handles are kept open; the least recently used one is closed
+ * when the limit is reached or when the file system runs out of handles.
+ */
+static USHORT im_clock;
+
+/*
+ * JV1 and JV3 sector writes are handed to the file system asynchronously.
+ * A read of the same unit waits for the write first. A failed write is
+ * kept in im[unit].wb_error and reported by the next IM_READSEC,
+ * IM_WRITESEC or IM_FLUSH of that unit.
+ */
+static BYTE im_wb_buf[256];
+static FFUTURE im_wb_future;
+static UCHAR im_wb_unit = IM_NO_UNIT;
+
+/* pending IM_WRITESEC, waiting for its data */
+static UCHAR im_wr_unit = IM_NO_UNIT;
+static UCHAR im_wr_track;
+static UCHAR im_wr_sector;
+
+
+static void
+im_wb_wait(void)
+{
+	UINT nbytes;
+
+	if (im_wb_unit == IM_NO_UNIT) return;
+	if (f_wait(&im_wb_future, &nbytes) != FR_OK || nbytes != 256) {
+		im[im_wb_unit].wb_error = LDOS_WRITE_FAULT;
+	}
+	im_wb_unit = IM_NO_UNIT;
+}
+
+
+/*
+ * Report and clear the failed write-behind of a unit, if any.
+ */
+static UCHAR
+im_wb_take_error(UCHAR unit)
+{
+	UCHAR err;
+
+	if (im_wb_unit == unit) {
+		im_wb_wait();
+	}
+	err = im[unit].wb_error;
+	im[unit].wb_error = LDOS_OK;
+	return err;
+}
+
+
+static void
+im_wb_write(UCHAR unit, DWORD offset)
+{
+	im_wb_wait();
+	memcpy(im_wb_buf, extra_buffer, 256);
+	if (f_pwrite_async(&im[unit].file, im_wb_buf, 256, offset, &im_wb_future) != FR_OK) {
+		state_error2 = LDOS_WRITE_FAULT;
+		return;
+	}
+	im_wb_unit = unit;
+	state_error2 = LDOS_OK;
+}
+
+
+static void
+im_close(UCHAR unit)
+{
+	if (im[unit].open) {
+		// pending writes need the handle
+		if (im_wb_unit == unit) {
+			im_wb_wait();
+		}
+		if (im[unit].type == IM_DMK) {
+			dmk_flush(unit);
+		}
+		f_close(&im[unit].file);
+		im[unit].open = 0;
+	}
+}
+
+
+static UCHAR
+im_close_lru(UCHAR except)
+{
+	UCHAR i, lru;
+
+	lru = 0xff;
+	for (i = 0; i < 8; i++) {
+		if (i == except || !im[i].open) continue;
+		if (lru == 0xff ||
+			(USHORT)(im_clock - im[i].last_used) > (USHORT)(im_clock - im[lru].last_used)) {
+			lru = i;
+		}
+	}
+	if (lru == 0xff) {
+		return 0;
+	}
+	im_close(lru);
+	return 1;
+}
+
+
+/*
+ * Images closed here are reopened on their next use.
+ */
+void
+im_close_all(void)
+{
+	UCHAR i;
+
+	for (i = 0; i < 8; i++) {
+		im_close(i);
+	}
+}
+
+
+static FRESULT
+im_open_file(UCHAR unit)
+{
+	UCHAR i, n;
+	BYTE mode;
+	FRESULT res;
+
+	if (!im[unit].open) {
+		n = 0;
+		for (i = 0; i < 8; i++) {
+			if (im[i].open) n++;
+		}
+		if (n >= IM_MAX_OPEN) {
+			im_close_lru(unit);
+		}
+		mode = FA_OPEN_EXISTING | FA_READ;
+		if (!im[unit].writeprot) {
+			mode |= FA_WRITE;
+		}
+		while ((res = f_open(&im[unit].file, im[unit].filename, mode)) != FR_OK) {
+			if (res == FR_TOO_MANY_OPEN_FILES && im_close_lru(unit)) {
+				continue;
+			}
+			if ((mode & FA_WRITE) &&
+				(res == FR_DENIED || res == FR_WRITE_PROTECTED)) {
+				// read-only file or share
+				mode &= ~FA_WRITE;
+				im[unit].writeprot = 1;
+				continue;
+			}
+			return res;
+		}
+		im[unit].open = 1;
+	}
+	im[unit].last_used = ++im_clock;
+
+	return FR_OK;
+}
+
+
 static void
 open_dsk_image(UCHAR unit, const char *filename)
 {
 	UCHAR ntrack = 0;
 	UCHAR sside = 0;
 	UCHAR sdensity = 0;
-	FRESULT res;
 
 	// assume ok
 	state_error2 = LDOS_OK;
-	
-	// already open ?	
-	if (filename == NULL && cur_unit == unit) {
+
+	// re-opening an image that was mounted before: metadata is retained
+	if (filename == NULL) {
+		if (im_open_file(unit) != FR_OK) {
+			state_error2 = LDOS_NOT_FOUND;
+		}
 		return;
 	}
-	// close previous
-	if (cur_unit != -1) {
-		f_close(&im_file);
-		cur_unit = -1;
-	}
 
 	// open new image
-	if (filename && filename[0] != '\0') {
+	im_close(unit);
+	if (im[unit].type == IM_JV3) {
+		jv3_close(unit);
+	} else if (im[unit].type == IM_DMK) {
+		dmk_close(unit);
+	}
+	im[unit].type = IM_NONE;
+	im[unit].writeprot = 0;
+	im[unit].wb_error = LDOS_OK;
+	if (im_wr_unit == unit) {
+		im_wr_unit = IM_NO_UNIT;
+	}
+	if (filename[0] != '\0') {
 		strcpy(im[unit].filename, filename);
 	}
-	res = f_open(&im_file, im[unit].filename, FA_OPEN_EXISTING | FA_READ);
-	if (res != FR_OK) {
+	if (im_open_file(unit) != FR_OK) {
 		state_error2 = LDOS_NOT_FOUND;
 		return;
 	}
-	cur_unit = unit;
-
-	// if we are re-opening an old file, we are done
-	if (filename == NULL) {
-		return;
-	}
 
 	// find image type
 	im[unit].type = set_disk_emutype(unit);
-	f_lseek(&im_file, 0);
 	
 	switch (im[unit].type) {
 	case IM_NONE:
+		im_close(unit);
 		state_error2 = LDOS_NOT_AVAIL;
 		return;
 	case IM_DMK:
@@ -183,12 +364,45 @@ open_dsk_image(UCHAR unit, const char *filename)
 	extra_buffer[0] = ntrack;
 	extra_buffer[1] = sside;
 	extra_buffer[2] = sdensity;
-	extra_buffer[3] = 1;			// write-protected, we don't support writes
+	extra_buffer[3] = im[unit].writeprot;
 	extra_buffer[4] = im[unit].type;
 	state_size2 = 5;
 }
 
 
+/*
+ * IM_WRITESEC only carries the unit, track and sector. The next image
+ * command must be a 256 byte transfer holding the sector data.
+ */
+static void
+write_dsk_sector(void)
+{
+	UCHAR unit;
+
+	unit = im_wr_unit;
+	im_wr_unit = IM_NO_UNIT;
+	open_dsk_image(unit, NULL);
+	if (state_error2 != LDOS_OK) {
+		return;
+	}
+	switch (im[unit].type) {
+	case IM_NONE:
+		state_error2 = LDOS_WRITE_NOT_FOUND;
+		break;
+	case IM_DMK:
+		dmk_writesec(unit, im_wr_track, im_wr_sector);
+		break;
+	case IM_JV3:
+		jv3_writesec(unit, im_wr_track, im_wr_sector);
+		break;
+	case IM_JV1:
+		jv1_writesec(unit, im_wr_track, im_wr_sector);
+		break;
+	}
+	state_size2 = 0;
+}
+
+
 /*
  * Called after TRS80 has written data and bytescount2 matches size2
  */
@@ -196,13 +410,24 @@ void process_image_cmd(void)
 {
 	UCHAR unit;
 
+	state_bytesdone2 = 0;
+
+	if (state_size2 == 256) {
+		// data of a preceding IM_WRITESEC
+		if (im_wr_unit == IM_NO_UNIT) {
+			state_error2 = LDOS_WRITE_NOT_FOUND;
+			return;
+		}
+		write_dsk_sector();
+		return;
+	}
+	im_wr_unit = IM_NO_UNIT;
+
 	unit = extra_buffer[0];
 	if (unit > 7) {
 		state_error2 = LDOS_DATA_NOT_FOUND;
 		return;
 	}
-	
-	state_bytesdone2 = 0;
 
 	switch (extra_buffer[1]) {
 	case IM_OPEN:
@@ -210,16 +435,18 @@ void process_image_cmd(void)
 		break;
 
 	case IM_READSEC:
-		if (cur_unit != unit) {
-			// re-open our file
+		if (im[unit].type != IM_NONE) {
+			// re-open our file if it was closed in the meantime
 			open_dsk_image(unit, NULL);
-			if (im[unit].type == IM_DMK) {
-				im[unit].u.dmk.cur_track = -1;
-			}
 			if (state_error2 != LDOS_OK) {
 				return;
 			}	
 		}
+		// the sector may still be on its way to the file
+		if ((state_error2 = im_wb_take_error(unit)) != LDOS_OK) {
+			state_size2 = 0;
+			break;
+		}
 		switch (im[unit].type) {
 		case IM_NONE:
 			state_error2 = LDOS_DATA_NOT_FOUND;
@@ -235,6 +462,38 @@ void process_image_cmd(void)
 			break;
 		}
 		break;
+
+	case IM_WRITESEC:
+		state_size2 = 0;
+		if ((state_error2 = im_wb_take_error(unit)) != LDOS_OK) {
+			break;
+		}
+		if (im[unit].type == IM_NONE) {
+			state_error2 = LDOS_WRITE_NOT_FOUND;
+			break;
+		}
+		if (im[unit].writeprot) {
+			state_error2 = LDOS_WRITE_PROT;
+			break;
+		}
+		im_wr_unit = unit;
+		im_wr_track = extra_buffer[2];
+		im_wr_sector = extra_buffer[3];
+		state_error2 = LDOS_OK;
+		break;
+
+	case IM_FLUSH:
+		state_size2 = 0;
+		if (im[unit].type == IM_DMK && im[unit].open) {
+			dmk_flush(unit);
+		}
+		state_error2 = im_wb_take_error(unit);
+		// written sectors must reach the medium, not just the cache
+		if (state_error2 == LDOS_OK && im[unit].open &&
+			f_sync(&im[unit].file) != FR_OK) {
+			state_error2 = LDOS_WRITE_FAULT;
+		}
+		break;
 	}
 }
 
@@ -245,35 +504,187 @@ void process_image_cmd(void)
  *																			 *
  *****************************************************************************/
 
-static int
-dmk_get_track_header(UCHAR unit, UCHAR track, UCHAR side)
+/*
+ * Whole DMK tracks are cached for the units in use, together with an index
+ * of their IDAMs. Reading all sectors of a track costs a single read from
+ * the file system. Track buffers are allocated from PSRAM when available.
+ * Sector writes modify the cached track, which is written back as a whole
+ * when it is evicted, the image is closed or on IM_FLUSH.
+ */
+typedef struct {
+	UCHAR track;		// track, side and sector from the IDAM
+	UCHAR side;
+	UCHAR sector;
+	UCHAR dam;			// data address mark, 0 if none was found
+	UCHAR incr;			// 2 if single density bytes are written twice
+	UCHAR ddensity;
+	USHORT idamp;		// offset of the IDAM in the track buffer
+	USHORT data;		// offset of the sector data in the track buffer
+} dmk_sec_t;
+
+typedef struct {
+	UCHAR unit;			// IM_NO_UNIT if unused
+	USHORT slot;		// track index within the image file
+	USHORT last_used;
+	USHORT tlen;
+	USHORT bufsize;
+	UCHAR dirty;
+	BYTE *buf;
+	UCHAR nsecs;
+	dmk_sec_t secs[DMK_MAX_IDAMS];
+} dmk_track_t;
+
+static dmk_track_t dmk_cache[DMK_CACHE_TRACKS] = {
+	[0 ... DMK_CACHE_TRACKS - 1] = { .unit = IM_NO_UNIT }
+};
+static USHORT dmk_clock;
+
+
+static void
+dmk_index_track(UCHAR unit, dmk_track_t *t)
 {
 	dmk_t *dmk = &im[unit].u.dmk;
-	USHORT u16;
+	dmk_sec_t *sec;
+	USHORT idamp, k, damlimit;
+	UCHAR i, ddensity, incr;
+	BYTE *p;
+
+	t->nsecs = 0;
+	for (i = 0; i < DMK_TKHDR_SIZE; i+=2) {
+		idamp = (USHORT)t->buf[i] + ((USHORT)t->buf[i+1] << 8);
+		if (idamp == 0) {
+			break;
+		}
+		// bit 15 means double-density sector
+		ddensity = (idamp & 0x8000) ? 1 : 0;
+		idamp &= 0x3fff;
+		incr = (dmk->sdensity || ddensity) ? 1 : 2;
+
+		// IDAM marker, track, side, sector, size code and CRC
+		if (idamp + 7 * incr > t->tlen) continue;
+		p = &t->buf[idamp];
+		if (p[0] != 0xFE) continue;
+
+		sec = &t->secs[t->nsecs++];
+		sec->track = p[incr];
+		sec->side = p[2 * incr] & 0x1;
+		sec->sector = p[3 * incr];
+		sec->incr = incr;
+		sec->ddensity = ddensity;
+		sec->idamp = idamp;
+
+		// look for the DAM
+		sec->dam = 0;
+		idamp += 7 * incr;
+		damlimit = (ddensity ? 43 : 30) * incr;
+		for (k = 0; k < damlimit && idamp + k < t->tlen; k += incr) {
+			if (0xf8 <= t->buf[idamp + k] && t->buf[idamp + k] <= 0xfb) {
+				sec->dam = t->buf[idamp + k];
+				sec->data = idamp + k + incr;
+				break;
+			}
+		}
+		// sector data and CRC must be within the track
+		if (sec->dam && sec->data + 258 * incr > t->tlen) {
+			sec->dam = 0;
+		}
+	}
+}
+
+
+static void
+dmk_write_track(dmk_track_t *t)
+{
 	FRESULT res;
 	UINT nbytes;
 
-	// load track header
-	u16 = track;
-	if (!dmk->sside) u16 <<= 1;
-	u16 += side;
-	dmk->offset = (DWORD)u16;
-	dmk->offset *= dmk->tlen;
-	dmk->offset += DMK_HEADER_LEN;
+	if (!t->dirty) return;
+	t->dirty = 0;
+	res = f_pwrite(&im[t->unit].file, t->buf, t->tlen,
+				   DMK_HEADER_LEN + (DWORD)t->slot * t->tlen, &nbytes);
+	if (res != FR_OK || nbytes != t->tlen) {
+		im[t->unit].wb_error = LDOS_WRITE_FAULT;
+	}
+}
+
+
+static dmk_track_t *
+dmk_get_track(UCHAR unit, USHORT slot)
+{
+	dmk_t *dmk = &im[unit].u.dmk;
+	dmk_track_t *t, *victim;
+	FRESULT res;
+	UINT nbytes;
+	UCHAR i;
 
-	res = f_lseek(&im_file, dmk->offset);
-	if (res == FR_OK) {
-		res = f_read(&im_file, im_buf, 0x80, &nbytes);
+	victim = NULL;
+	for (i = 0; i < DMK_CACHE_TRACKS; i++) {
+		t = &dmk_cache[i];
+		if (t->unit == unit && t->slot == slot) {
+			t->last_used = ++dmk_clock;
+			return t;
+		}
+		if (victim == NULL ||
+			(victim->unit != IM_NO_UNIT &&
+			 (t->unit == IM_NO_UNIT ||
+			  (USHORT)(dmk_clock - t->last_used) > (USHORT)(dmk_clock - victim->last_used)))) {
+			victim = t;
+		}
 	}
-	if (res != FR_OK || nbytes < 0x80) {
-		state_error2 = LDOS_DATA_NOT_FOUND;
-	} else {
-		dmk->cur_track = track;
-		dmk->cur_side = side;
-		state_error2 = LDOS_OK;
+
+	t = victim;
+	if (t->unit != IM_NO_UNIT) {
+		// the image of a dirty track is still open, see im_close()
+		dmk_write_track(t);
 	}
+	t->unit = IM_NO_UNIT;
+	if (t->bufsize < dmk->tlen) {
+		free(t->buf);
+		t->buf = (BYTE *)heap_caps_malloc_prefer(dmk->tlen, 2, MALLOC_CAP_SPIRAM,
+												 MALLOC_CAP_8BIT);
+		t->bufsize = (t->buf == NULL) ? 0 : dmk->tlen;
+		if (t->buf == NULL) {
+			return NULL;
+		}
+	}
+	t->tlen = dmk->tlen;
+	res = f_pread(&im[unit].file, t->buf, t->tlen,
+				  DMK_HEADER_LEN + (DWORD)slot * t->tlen, &nbytes);
+	if (res != FR_OK || nbytes < t->tlen) {
+		return NULL;
+	}
+	t->unit = unit;
+	t->slot = slot;
+	t->last_used = ++dmk_clock;
+	dmk_index_track(unit, t);
+
+	return t;
+}
+
+
+static void
+dmk_flush(UCHAR unit)
+{
+	UCHAR i;
+
+	for (i = 0; i < DMK_CACHE_TRACKS; i++) {
+		if (dmk_cache[i].unit == unit) {
+			dmk_write_track(&dmk_cache[i]);
+		}
+	}
+}
+
 
-	return (state_error2);
+static void
+dmk_close(UCHAR unit)
+{
+	UCHAR i;
+
+	for (i = 0; i < DMK_CACHE_TRACKS; i++) {
+		if (dmk_cache[i].unit == unit) {
+			dmk_cache[i].unit = IM_NO_UNIT;
+		}
+	}
 }
 
 
@@ -281,71 +692,32 @@ static void
 dmk_analyze(UCHAR unit, UCHAR *sside, UCHAR *sdensity)
 {
 	dmk_t *dmk = &im[unit].u.dmk;
-	UCHAR i, j, incr, ddensity;
-	FRESULT res;
-	DWORD offset;
-	USHORT idamp;
-	UINT nbytes;
+	dmk_track_t *t;
+	UCHAR i;
 
 	// consider single-side single-density for now
 	*sside = 1;
 	*sdensity = 1;
 
-	// load track header of given track, side 1
-	offset = (DWORD)dmk->tlen;
-	offset += DMK_HEADER_LEN;
-	res = f_lseek(&im_file, offset);
-	if (res == FR_OK) {
-		res = f_read(&im_file, im_buf, 0x80, &nbytes);
-	}	
-	if (res != FR_OK && nbytes < 0x80) return;
-
+	// analyze the second track of the image
 	dmk->nsectors = 0;
-	// analyze this header
-	for (i = 0; i < 0x40; i+=2) {
-		idamp = (USHORT)im_buf[i] + ((USHORT)im_buf[i+1] << 8);
-		if (idamp == 0) {
-			break;
-		}
-		// bit 15 means double-density sector
-		ddensity = (idamp & 0x8000) ? 1 : 0;
-		idamp &= 0x3fff;
-		dmk->nsectors++;
-		if (ddensity) *sdensity = 0;
-		incr = (dmk->sdensity || ddensity) ? 1 : 2;
-		// read sector id
-		res = f_lseek(&im_file, offset + (DWORD)idamp);
-		if (res == FR_OK) {
-			res = f_read(&im_file, extra_buffer, 14, &nbytes);
-		}
-		if (res != FR_OK || nbytes < 14) {
-			break;	
-		}	
-		j = 0;
-		// check IDAM marker
-		if (extra_buffer[j] != 0xFE) continue;
-		j += incr;
-		// skip track
-		j += incr;
-		// check side
-		if (extra_buffer[j] & 0x1) {
-			*sside = 0;
+	t = dmk_get_track(unit, 1);
+	if (t != NULL) {
+		for (i = 0; i < t->nsecs; i++) {
+			dmk->nsectors++;
+			if (t->secs[i].ddensity) *sdensity = 0;
+			if (t->secs[i].side) *sside = 0;
 		}
 	}
 
 	if (dmk->nsectors == 0) {
 		// single-side... must still check double-density
-		dmk_get_track_header(unit, 0, 0);
-		for (i = 0; i < 0x40; i += 2) {
-			idamp = (USHORT)im_buf[i] + ((USHORT)im_buf[i+1] << 8);
-			if (idamp == 0) {
-				break;
+		t = dmk_get_track(unit, 0);
+		if (t != NULL) {
+			for (i = 0; i < t->nsecs; i++) {
+				dmk->nsectors++;
+				if (t->secs[i].ddensity) *sdensity = 0;
 			}
-			// bit 15 means double-density sector
-			ddensity = (idamp & 0x8000) ? 1 : 0;
-			idamp &= 0x3fff;
-			dmk->nsectors++;
-			if (ddensity) *sdensity = 0;
 		}
 	}
 
@@ -362,18 +734,20 @@ dmk_open(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity)
 	FRESULT res;
 	UINT nbytes;
 
-	res = f_read(&im_file, im_buf, 16, &nbytes);
+	res = f_pread(&im[unit].file, extra_buffer, 16, 0, &nbytes);
 	if (res != FR_OK || nbytes < 16) {
 		state_error2 = LDOS_DATA_NOT_FOUND;
 		return;
 	}
 	// parse DMK header
-	*ntrack = im_buf[1] - 1;
-	dmk->sside = im_buf[4] & 0x10;
-	dmk->sdensity = im_buf[4] & 0x40;
-	dmk->tlen = (USHORT)im_buf[2] | ((USHORT)im_buf[3] << 8);
-	dmk->cur_track = -1;
-	dmk->cur_side = -1;
+	*ntrack = extra_buffer[1] - 1;
+	dmk->sside = extra_buffer[4] & 0x10;
+	dmk->sdensity = extra_buffer[4] & 0x40;
+	dmk->tlen = (USHORT)extra_buffer[2] | ((USHORT)extra_buffer[3] << 8);
+	if (dmk->tlen < DMK_TKHDR_SIZE || dmk->tlen > DMK_TRACKLEN_MAX) {
+		state_error2 = LDOS_NOT_AVAIL;
+		return;
+	}
 	// guess real density and number of sides of this image
 	dmk_analyze(unit, sside, sdensity);
 
@@ -381,133 +755,102 @@ dmk_open(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity)
 }
 
 
-static void
-dmk_readsec(UCHAR unit, UCHAR track, UCHAR sector)
+static dmk_sec_t *
+dmk_find_sector(UCHAR unit, UCHAR track, UCHAR sector, dmk_track_t **tp)
 {
 	dmk_t *dmk = &im[unit].u.dmk;
-	UCHAR side;
-	USHORT idamp;
-	UCHAR ddensity;
-	UCHAR i, j, k;
-	UCHAR incr;
-	UCHAR *p1, *p2;
-	UCHAR damlimit;
-	UCHAR dam;
-	UINT nbytes;
-	FRESULT res;
+	dmk_track_t *t;
+	dmk_sec_t *sec;
+	USHORT slot;
+	UCHAR side, i;
 
 	side = (sector >= dmk->nsectors);
 	if (side) sector -= dmk->nsectors;
 
-	if (dmk->cur_track != track || dmk->cur_side != side) {
-		res = dmk_get_track_header(unit, track, side);
-		if (res != 0) {
-			goto not_found;
-		}
+	slot = track;
+	if (!dmk->sside) slot <<= 1;
+	slot += side;
+	t = dmk_get_track(unit, slot);
+	if (t == NULL) {
+		return NULL;
 	}
 
-	for (i = 0; i < 0x40; i+=2) {
-		idamp = (USHORT)im_buf[i] + ((USHORT)im_buf[i+1] << 8);
-		if (idamp == 0) {
-			goto not_found;
+	for (i = 0; i < t->nsecs; i++) {
+		sec = &t->secs[i];
+		if (sec->track == track && sec->side == side && sec->sector == sector) {
+			*tp = t;
+			// a missing DAM means the sector can't be found
+			return sec->dam ? sec : NULL;
 		}
-		// bit 15 means double-density sector
-		ddensity = (idamp & 0x8000) ? 1 : 0;
-		idamp &= 0x3fff;
+	}
+	return NULL;
+}
 
-		incr = (dmk->sdensity || ddensity) ? 1 : 2;
 
-		// read sector id
-		res = f_lseek(&im_file, dmk->offset + (DWORD)idamp);
-		if (res == FR_OK) {
-			res = f_read(&im_file, extra_buffer, 14, &nbytes);
-		}
-		if (res != FR_OK || nbytes < 14) {
-			goto not_found;
-		}	
-
-		j = 0;
-		// check IDAM marker
-		if (extra_buffer[j] != 0xFE) continue;
-		j += incr;
-
-		// check track
-		if (extra_buffer[j] != track) continue;
-		j += incr;
-
-		// check side
-		if ((extra_buffer[j]  & 0x1) != side) continue;
-		j += incr;
-
-		// check sector
-		if (extra_buffer[j] != sector) continue;
-		j += incr;
-
-		// size code
-		j += incr;
-		
-		// CRC
-		j += incr;
-		j += incr;
-
-		// if we are here, we found our sector !
-		damlimit = ddensity ? 43 : 30;
-		damlimit *= incr;
-		res = f_lseek(&im_file, dmk->offset + (DWORD)(idamp + j));
-		if (res == FR_OK) {
-			res = f_read(&im_file, extra_buffer, damlimit, &nbytes);
-		}	
-		if (res != FR_OK || nbytes < damlimit) {
-			goto not_found;
-		}	
-		dam = 0xff;
-		for (k = 0; k < damlimit; k += incr) {
-			if (0xf8 <= extra_buffer[k] && extra_buffer[k] <= 0xfb) {
-				dam = extra_buffer[k];
-				break;
-			}
-		}
-		if (dam == 0xff) {
-			// DAM not found
-			goto not_found;
-		}
-		k += incr;
-
-		// read the sector
-		res = f_lseek(&im_file, dmk->offset + (DWORD)(idamp + j + k));
-		if (res != FR_OK) {
-			goto not_found;
-		}	
-		if (incr == 1) {
-			res = f_read(&im_file, extra_buffer, 256, &nbytes);
-		} else {
-			p1 = extra_buffer;
-			res = f_read(&im_file, sector_buffer, 256, &nbytes);
-			if (res != FR_OK || nbytes < 256) {
-				goto not_found;
-			}	
-			p2 = sector_buffer;
-			for (k = 0; k < 128; k++) {
-				*(p1++) = *(p2++);
-				p2++;
-			}
-			res = f_read(&im_file, sector_buffer, 256, &nbytes);
-			if (res != FR_OK || nbytes < 256) {
-				goto not_found;
-			}	
-			p2 = sector_buffer;
-			for (k = 0; k < 128; k++) {
-				*(p1++) = *(p2++);
-				p2++;
-			}
+static void
+dmk_readsec(UCHAR unit, UCHAR track, UCHAR sector)
+{
+	dmk_track_t *t;
+	dmk_sec_t *sec;
+	USHORT k;
+	BYTE *p;
+
+	sec = dmk_find_sector(unit, track, sector, &t);
+	if (sec == NULL) {
+		state_error2 = LDOS_DATA_NOT_FOUND;
+		return;
+	}
+	p = &t->buf[sec->data];
+	if (sec->incr == 1) {
+		memcpy(extra_buffer, p, 256);
+	} else {
+		for (k = 0; k < 256; k++) {
+			extra_buffer[k] = *p;
+			p += 2;
 		}
-		state_error2 = (dam == 0xf8 || dam == 0xfa) ? LDOS_SYSTEM_REC : LDOS_OK;
-		state_size2 = 256;
+	}
+	state_error2 = (sec->dam == 0xf8 || sec->dam == 0xfa) ? LDOS_SYSTEM_REC : LDOS_OK;
+	state_size2 = 256;
+}
+
+
+static void
+dmk_putbyte(BYTE **p, UCHAR incr, BYTE c)
+{
+	**p = c;
+	if (incr == 2) {
+		*(*p + 1) = c;
+	}
+	*p += incr;
+}
+
+
+static void
+dmk_writesec(UCHAR unit, UCHAR track, UCHAR sector)
+{
+	dmk_track_t *t;
+	dmk_sec_t *sec;
+	Uint16 crc;
+	USHORT k;
+	BYTE *p;
+
+	sec = dmk_find_sector(unit, track, sector, &t);
+	if (sec == NULL) {
+		state_error2 = LDOS_WRITE_NOT_FOUND;
 		return;
 	}
-not_found:
-	state_error2 = LDOS_DATA_NOT_FOUND;
-	return;
+	// data CRC covers the DAM and the data (and a1 a1 a1 in double density)
+	crc = sec->ddensity ? 0xcdb4 : 0xffff;
+	crc = calc_crc(crc, sec->dam);
+	p = &t->buf[sec->data];
+	for (k = 0; k < 256; k++) {
+		crc = calc_crc(crc, extra_buffer[k]);
+		dmk_putbyte(&p, sec->incr, extra_buffer[k]);
+	}
+	dmk_putbyte(&p, sec->incr, crc >> 8);
+	dmk_putbyte(&p, sec->incr, crc & 0xff);
+	t->dirty = 1;
+	state_error2 = LDOS_OK;
 }
 
 
@@ -517,80 +860,142 @@ not_found:
  *																			 *
  *****************************************************************************/
 
-static void
-jv3_open(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity)
+/*
+ * The sector headers of both header blocks are parsed once when the image
+ * is mounted. Sectors are bucketed per (track, side): sectors of bucket b
+ * are secs[track_start[b]] .. secs[track_start[b + 1] - 1]. Reading a
+ * sector is a lookup in its bucket followed by a single read.
+ */
+#define JV3_BUCKET(track, side)	((USHORT)(track) * 2 + (side))
+#define JV3_NBUCKETS			JV3_BUCKET(JV3_FREE, 0)
+
+static UCHAR
+jv3_scan(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity)
 {
-	UCHAR i;
-	USHORT n;
+	jv3_t *jv3 = &im[unit].u.jv3;
+	jv3_sec_t *sec;
+	USHORT n, b;
+	UCHAR i, j, blk;
 	FRESULT res;
 	UINT nbytes;
+	DWORD hdr, offset;
+
+	offset = 0;
+	for (blk = 0; blk < 2; blk++) {
+		hdr = offset;
+		offset += 3*JV3_SECSPERBLK + 1;
+		n = 0;
+		while (n < JV3_SECSPERBLK) {
+			res = f_pread(&im[unit].file, extra_buffer, 255, hdr, &nbytes);
+			if (res != FR_OK || nbytes < 255) {
+				// the second header block is optional
+				return (blk > 0);
+			}
+			hdr += 255;
+			for (i = 0; i < 255 && n < JV3_SECSPERBLK; i+=3, n++) {
+				if (extra_buffer[i] != JV3_FREE) {
+					b = JV3_BUCKET(extra_buffer[i], (extra_buffer[i+2] & JV3_SIDE) ? 1 : 0);
+					if (jv3->secs == NULL) {
+						// first pass: count sectors and guess geometry
+						jv3->track_start[b]++;
+						if (extra_buffer[i] > *ntrack) {
+							*ntrack = extra_buffer[i];
+						}
+						if (extra_buffer[i+1] > jv3->nsectors) {
+							jv3->nsectors = extra_buffer[i+1];
+						}
+						if (extra_buffer[i+2] & JV3_DENSITY) *sdensity = 0;
+						if (extra_buffer[i+2] & JV3_SIDE) *sside = 0;
+					} else {
+						// second pass: fill buckets from the end
+						sec = &jv3->secs[--jv3->track_start[b]];
+						sec->sector = extra_buffer[i+1];
+						sec->flags = extra_buffer[i+2];
+						sec->offset = offset;
+					}
+				}
+				// increment offset
+				j = (extra_buffer[i+2] & JV3_SIZE) ^ ((extra_buffer[i] == JV3_FREE) ? 2 : 1);
+				offset += ((DWORD)128 << j);
+			}
+		}
+	}
+	return 1;
+}
+
+
+static void
+jv3_open(UCHAR unit, UCHAR *ntrack, UCHAR *sside, UCHAR *sdensity)
+{
 	jv3_t *jv3 = &im[unit].u.jv3;
+	USHORT b, total;
 
 	*ntrack = 0;
 	*sside = 1;
 	*sdensity = 1;
 	jv3->nsectors = 0;
+	jv3->secs = NULL;
+	jv3->track_start = (USHORT *)calloc(JV3_NBUCKETS + 1, sizeof (USHORT));
+	if (jv3->track_start == NULL) {
+		goto fail;
+	}
 
-	n = 0;
-	while (n < JV3_SECSPERBLK) {
-		res = f_read(&im_file, extra_buffer, 255, &nbytes);
-		if (res != FR_OK || nbytes < 255) {
-			return;
-		}	
-		for (i = 0; i < 255 && n < JV3_SECSPERBLK; i+=3, n++) {
-			if (extra_buffer[i] != 0xff) {
-				if (extra_buffer[i] > *ntrack) {
-					*ntrack = extra_buffer[i];
-				}
-				if (extra_buffer[i+1] > jv3->nsectors) {
-					jv3->nsectors = extra_buffer[i+1];
-				}
-				if (extra_buffer[i+2] & JV3_DENSITY) *sdensity = 0;
-				if (extra_buffer[i+2] & JV3_SIDE) *sside = 0;
-			}
-		}
+	if (!jv3_scan(unit, ntrack, sside, sdensity)) {
+		goto fail;
+	}
+	// turn counts into bucket end positions
+	total = 0;
+	for (b = 0; b <= JV3_NBUCKETS; b++) {
+		total += jv3->track_start[b];
+		jv3->track_start[b] = total;
+	}
+	jv3->secs = (jv3_sec_t *)malloc((total ? total : 1) * sizeof (jv3_sec_t));
+	if (jv3->secs == NULL || !jv3_scan(unit, ntrack, sside, sdensity)) {
+		goto fail;
 	}
+	jv3->nbuckets = JV3_BUCKET(*ntrack + 1, 0);
     jv3->nsectors++;
+	return;
+
+fail:
+	jv3_close(unit);
+	state_error2 = LDOS_NOT_AVAIL;
 }
 
 
-static UCHAR
+static void
+jv3_close(UCHAR unit)
+{
+	jv3_t *jv3 = &im[unit].u.jv3;
+
+	free(jv3->secs);
+	free(jv3->track_start);
+	jv3->secs = NULL;
+	jv3->track_start = NULL;
+	jv3->nbuckets = 0;
+}
+
+
+static jv3_sec_t *
 jv3_find_sector(UCHAR unit, UCHAR track, UCHAR sector, UCHAR side)
 {
 	jv3_t *jv3 = &im[unit].u.jv3;
-	USHORT n;
-	UCHAR i, j;
-	UCHAR fside;
-	UINT nbytes;
-	FRESULT res;
+	jv3_sec_t *sec, *found;
+	USHORT b, k;
 
-	res = f_lseek(&im_file, jv3->offset);
-	if (res != FR_OK) {
-		return 0;
-	}	
-	jv3->offset += 3*JV3_SECSPERBLK + 1;
-	n = 0;
-	while (n < JV3_SECSPERBLK) {
-		res = f_read(&im_file, extra_buffer, 255, &nbytes);
-		if (res != FR_OK || nbytes < 255) {
-			return 0;
-		}	
-		for (i = 0; i < 255 && n < JV3_SECSPERBLK; i+=3, n++) {
-			if (extra_buffer[i] != 0xff && extra_buffer[i] == track &&
-				extra_buffer[i+1] == sector) {
-				fside = (extra_buffer[i+2] & JV3_SIDE) ? 1 : 0;
-				if (side == fside) {
-					jv3->dam = extra_buffer[i+2] & (JV3_DENSITY | JV3_DAM);
-					return 1;
-				}
-			}
-			// increment offset
-			j = (extra_buffer[i+2] & JV3_SIZE) ^ ((extra_buffer[i] == JV3_FREE) ? 2 : 1);
-			jv3->offset += ((DWORD)128 << j);
+	b = JV3_BUCKET(track, side);
+	if (b >= jv3->nbuckets) {
+		return NULL;
+	}
+	found = NULL;
+	for (k = jv3->track_start[b]; k < jv3->track_start[b + 1]; k++) {
+		sec = &jv3->secs[k];
+		// if a sector id appears twice, the first one in the file wins
+		if (sec->sector == sector && (found == NULL || sec->offset < found->offset)) {
+			found = sec;
 		}
 	}
-	// not found
-	return 0;
+	return found;
 }
 
 
@@ -598,34 +1003,29 @@ static void
 jv3_readsec(UCHAR unit, UCHAR track, UCHAR sector)
 {
 	jv3_t *jv3 = &im[unit].u.jv3;
+	jv3_sec_t *sec;
 	FRESULT res;
 	UINT nbytes;
-	UCHAR side;
+	UCHAR side, dam;
 
 	side = (sector >= jv3->nsectors);
 	if (side) sector -= jv3->nsectors;
 
 	// find the track/sector/side offset
-	jv3->offset = 0;
-	if (!jv3_find_sector(unit, track, sector, side)) {
-		// try 2nd header
-		if (!jv3_find_sector(unit, track, sector, side)) {
-			// failure
-			state_error2 = LDOS_DATA_NOT_FOUND;
-			return;
-		}
+	sec = jv3_find_sector(unit, track, sector, side);
+	if (sec == NULL) {
+		state_error2 = LDOS_DATA_NOT_FOUND;
+		return;
 	}
 
-	res = f_lseek(&im_file, jv3->offset);
-	if (res == FR_OK) {
-		res = f_read(&im_file, extra_buffer, 256, &nbytes);
-	}
+	res = f_pread(&im[unit].file, extra_buffer, 256, sec->offset, &nbytes);
 	if (res != FR_OK || nbytes < 256) {
 		state_error2 = LDOS_DATA_NOT_FOUND;
 		return;
 	}
-	if (jv3->dam == (JV3_DENSITY | JV3_DAMDDF8) ||
-	  jv3->dam == JV3_DAMSDF8 || jv3->dam == JV3_DAMSDFA) {
+	dam = sec->flags & (JV3_DENSITY | JV3_DAM);
+	if (dam == (JV3_DENSITY | JV3_DAMDDF8) ||
+	  dam == JV3_DAMSDF8 || dam == JV3_DAMSDFA) {
 		state_error2 = LDOS_SYSTEM_REC;
 	} else {
 		state_error2 = LDOS_OK;
@@ -635,6 +1035,27 @@ jv3_readsec(UCHAR unit, UCHAR track, UCHAR sector)
 
 
 
+static void
+jv3_writesec(UCHAR unit, UCHAR track, UCHAR sector)
+{
+	jv3_t *jv3 = &im[unit].u.jv3;
+	jv3_sec_t *sec;
+	UCHAR side;
+
+	side = (sector >= jv3->nsectors);
+	if (side) sector -= jv3->nsectors;
+
+	sec = jv3_find_sector(unit, track, sector, side);
+	// only 256 byte sectors are supported
+	if (sec == NULL || (sec->flags & JV3_SIZE) != 0) {
+		state_error2 = LDOS_WRITE_NOT_FOUND;
+		return;
+	}
+	im_wb_write(unit, sec->offset);
+}
+
+
+
 /*****************************************************************************
  *																			 *
  * JV1																		 *
@@ -666,10 +1087,7 @@ jv1_readsec(UCHAR unit, UCHAR track, UCHAR sector)
 	jv1->offset += sector;
 	jv1->offset <<= 8;
 
-	res = f_lseek(&im_file, jv1->offset);
-	if (res == FR_OK) {
-		res = f_read(&im_file, extra_buffer, 256, &nbytes);
-	}
+	res = f_pread(&im[unit].file, extra_buffer, 256, jv1->offset, &nbytes);
 	if (res != FR_OK || nbytes < 256) {
 		state_error2 = LDOS_NOT_FOUND;
 		return;
@@ -678,4 +1096,21 @@ jv1_readsec(UCHAR unit, UCHAR track, UCHAR sector)
 	state_error2 = (track == 17) ? LDOS_SYSTEM_REC : LDOS_OK;
 }
 
+
+static void
+jv1_writesec(UCHAR unit, UCHAR track, UCHAR sector)
+{
+	DWORD offset;
+
+	if (sector >= JV1_SECPERTRK) {
+		state_error2 = LDOS_WRITE_NOT_FOUND;
+		return;
+	}
+	offset = track;
+	offset *= JV1_SECPERTRK;
+	offset += sector;
+	offset <<= 8;
+	im_wb_write(unit, offset);
+}
+
 #endif // EXTRA_IM_SUPPORT
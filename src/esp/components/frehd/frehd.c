@@ -17,8 +17,6 @@ FIL state_file2;
 #if _USE_FASTSEEK
 DWORD im_stbl[FAST_SEEK_LEN];
 #endif
-FIL im_file;
-BYTE im_buf[0x80];
 #endif
 BYTE sector_buffer[MAX_SECTOR_SIZE];
 #if EXTRA_IM_SUPPORT
@@ -31,7 +29,6 @@ FILINFO state_fno;
 UCHAR state_dir_open;
 UCHAR state_file2_open;
 UCHAR fs_mounted;
-UCHAR cur_unit;
 UCHAR led_count;
 
 BYTE action_flags;
@@ -76,6 +73,27 @@ void pic_init(void)
   }
 }
 
+/*
+ * Closes all files and directories FreHD has open, before the file system
+ * they are on goes away. Drives are reopened by open_drives(), images on
+ * their next use.
+ */
+void frehd_close_files()
+{
+  close_drives();
+  if (state_file2_open) {
+    f_close(&state_file2);
+    state_file2_open = 0;
+  }
+  if (state_dir_open) {
+    f_closedir(&state_dir);
+    state_dir_open = 0;
+  }
+#if EXTRA_IM_SUPPORT
+  im_close_all();
+#endif
+}
+
 void frehd_check_action()
 {
   if (action_flags & ACTION_TRS) {
@@ -10,8 +10,10 @@ extern "C" {
 
 void frehd_check_action();
 void init_frehd();
+void frehd_close_files();
 uint8_t frehd_in(uint8_t p);
 void frehd_out(uint8_t p, uint8_t v);
+void trs_disk_poll();
 
 #ifdef __cplusplus
 }
@@ -56,6 +56,8 @@ extern void trs_disk_remove(int drive);
 
 extern int trs_diskset_save(const char *filename);
 extern int trs_diskset_load(const char *filename);
+extern int trs_disk_snapshot_save(const char *filename, int full);
+extern int trs_disk_snapshot_load(const char *filename);
 
 extern int trs_disk_doubler;
 extern char trs_disk_dir[FILENAME_MAX];
@@ -49,6 +49,9 @@
 #define TRS_EXTRA_MOUNT_CREATE	0x02	// create if needed
 #define TRS_EXTRA_MOUNT_RO		0x04	// read-only
 
+// maximum number of image files kept open at the same time
+#define IM_MAX_OPEN		4
+
 typedef enum {
     IM_NONE,
     IM_DMK,
@@ -58,18 +61,22 @@ typedef enum {
 
 typedef struct {
     USHORT tlen;
-    UCHAR cur_track;
-    UCHAR cur_side;
     UCHAR sside;        // 1 if single side in header flag
     UCHAR sdensity;     // 1 if single density in header flag
     UCHAR nsectors;
-    long offset;
 } dmk_t;
 
+typedef struct {
+    UCHAR sector;
+    UCHAR flags;        // JV3 header flags
+    DWORD offset;       // offset of the sector data in the image
+} jv3_sec_t;
+
 typedef struct {
     UCHAR nsectors;
-    UCHAR dam;
-    DWORD offset;
+    USHORT nbuckets;
+    USHORT *track_start; // per (track, side) index into secs
+    jv3_sec_t *secs;
 } jv3_t;
 
 typedef struct {
@@ -79,6 +86,11 @@ typedef struct {
 typedef struct {
     im_type_t type;
     char filename[13];
+    FIL file;
+    UCHAR open;
+    UCHAR writeprot;
+    UCHAR wb_error;     // failed write-behind, LDOS error code
+    USHORT last_used;
     union {
         dmk_t dmk;
         jv3_t jv3;
@@ -108,5 +120,6 @@ UCHAR trs_extra_read_header(UCHAR);
 
 // dsk.c
 void process_image_cmd(void);
+void im_close_all(void);
 
 #endif
@@ -53,6 +53,7 @@ typedef struct {
 	CHAR filename[13];
 	UCHAR avail;		// 1 if drive open and available
 	USHORT dirty;		// countdown before calling fsync() (in ms)
+	FRESULT wb_error;	// failed write-behind or sync, reported by the next write
 
 	/* values decoded from rhh */
 	UCHAR writeprot;
@@ -287,9 +288,6 @@ extern UCHAR foo;
 extern DIR_ state_dir;
 extern UCHAR state_dir_open;
 extern FILINFO state_fno;
-extern FIL im_file;
-extern BYTE im_buf[];
-extern UCHAR cur_unit;
 extern image_t im[];
 #if _USE_FASTSEEK
 extern DWORD im_stbl[];
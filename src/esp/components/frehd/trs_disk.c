@@ -71,6 +71,9 @@
 //#include "trs_stringy.h"
 //#include "trs_state_save.h"
 #include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "fileio.h"
+#include "xtensa/hal.h"
 
 typedef unsigned long long tstate_t;
 
@@ -259,6 +262,7 @@ typedef struct {
   time_t empty_timeout;           /* real_empty valid until this time */
   unsigned int fmt_nbytes;        /* number of PC format command bytes */
   int fmt_fill;                   /* fill byte for data sectors */
+  int fd;                         /* raw device; __linux only */
   Uint8 buf[MAXSECSIZE];
 } RealState;
 
@@ -296,7 +300,7 @@ typedef struct {
   int curtrack, curside;          /* track/side in track buffer, or -1/-1 */
   int curbyte;                    /* index in buf for current op */
   int nextidam;                   /* index in buf to put next idam */
-  Uint8 buf[DMK_TRACKLEN_MAX];
+  Uint8 *buf;                     /* from the track buffer pool, or NULL */
 } DMKState;
 
 typedef struct {
@@ -305,7 +309,11 @@ typedef struct {
   int emutype;
   int inches;                     /* 5 or 8, as seen by TRS-80 */
   int real_step;                  /* 1=normal, 2=double-step if REAL */
-  FILE* file;
+  FIL* file;                      /* &fil if an image is open, else NULL */
+  FIL fil;
+  FSIZE_t pos;                    /* file position for disk_* calls */
+  FSIZE_t line_base;              /* file offset of first cache line */
+  UINT line_size;                 /* bytes per cache line, 0 = uncached */
   char filename[FILENAME_MAX];
   union {
     JV3State jv3;                 /* valid if emutype = JV3 */
@@ -316,6 +324,253 @@ typedef struct {
 
 static DiskState disk[NDRIVES] EXT_RAM_ATTR;
 
+/*
+ * Image files are accessed through TRS_FS and a track cache shared by
+ * all drives. Each drive's file is cut into track-sized lines starting at
+ * line_base; bytes before line_base (the image headers) bypass the cache.
+ * A byte access costs at most one line fill plus the write-back of one
+ * evicted line, whether the image lives on the SD card or on a share.
+ * Dirty bytes are written back by disk_flush().
+ */
+#define TRACK_CACHE_LINES 6
+#define JV3_LINE_SIZE (18 * 256)  /* about one double density track */
+
+typedef struct {
+  DiskState *d;                   /* owner, NULL if free */
+  FSIZE_t base;                   /* file offset of buf[0] */
+  UINT len;                       /* valid bytes in buf */
+  UINT dirty_lo, dirty_hi;        /* dirty range, empty if lo == hi */
+  Uint16 last_used;
+  Uint8 *buf;                     /* DMK_TRACKLEN_MAX bytes */
+} TrackLine;
+
+static TrackLine track_cache[TRACK_CACHE_LINES];
+static Uint16 track_clock;
+
+static void
+disk_set_lines(DiskState *d, FSIZE_t base, UINT size)
+{
+  d->line_base = base;
+  d->line_size = size;
+}
+
+static int
+track_line_writeback(TrackLine *t)
+{
+  UINT n;
+  FRESULT res;
+
+  if (t->dirty_lo == t->dirty_hi) return 0;
+  res = f_pwrite(&t->d->fil, t->buf + t->dirty_lo, t->dirty_hi - t->dirty_lo,
+		 t->base + t->dirty_lo, &n);
+  t->dirty_lo = t->dirty_hi = 0;
+  return (res == FR_OK && n > 0) ? 0 : EOF;
+}
+
+/* Return the line holding file offset pos, filling it if needed */
+static TrackLine *
+track_line_get(DiskState *d, FSIZE_t pos)
+{
+  TrackLine *t, *victim = NULL;
+  FSIZE_t base;
+  UINT n;
+  int i;
+
+  base = pos - (pos - d->line_base) % d->line_size;
+  for (i = 0; i < TRACK_CACHE_LINES; i++) {
+    t = &track_cache[i];
+    if (t->d == d && t->base == base) {
+      t->last_used = ++track_clock;
+      return t;
+    }
+    if (victim == NULL || t->d == NULL ||
+	(victim->d != NULL &&
+	 (Uint16) (track_clock - t->last_used) >
+	 (Uint16) (track_clock - victim->last_used))) {
+      victim = t;
+    }
+  }
+  t = victim;
+  if (t->d != NULL && track_line_writeback(t) == EOF) {
+    state.status |= TRSDISK_WRITEFLT;
+  }
+  t->d = NULL;
+  if (t->buf == NULL) {
+    t->buf = (Uint8 *) heap_caps_malloc_prefer(DMK_TRACKLEN_MAX, 2,
+					       MALLOC_CAP_SPIRAM,
+					       MALLOC_CAP_8BIT);
+    if (t->buf == NULL) return NULL;
+  }
+  if (f_pread(&d->fil, t->buf, d->line_size, base, &n) != FR_OK) {
+    return NULL;
+  }
+  t->d = d;
+  t->base = base;
+  t->len = n;
+  t->dirty_lo = t->dirty_hi = 0;
+  t->last_used = ++track_clock;
+  return t;
+}
+
+static void
+disk_seek(DiskState *d, FSIZE_t pos)
+{
+  d->pos = pos;
+}
+
+/* Like fread, on the current position of drive d */
+static size_t
+disk_read(void *buf, size_t size, size_t count, DiskState *d)
+{
+  size_t want = size * count, done = 0;
+  TrackLine *t;
+  UINT n, ofs;
+
+  if (size == 0) return 0;
+  while (done < want) {
+    if (d->line_size == 0 || d->pos < d->line_base) {
+      n = want - done;
+      if (d->line_size != 0 && d->pos + n > d->line_base) {
+	n = d->line_base - d->pos;
+      }
+      if (f_pread(&d->fil, (Uint8 *) buf + done, n, d->pos, &n) != FR_OK) {
+	break;
+      }
+    } else {
+      t = track_line_get(d, d->pos);
+      if (t == NULL) break;
+      ofs = d->pos - t->base;
+      n = (ofs < t->len) ? t->len - ofs : 0;
+      if (n > want - done) n = want - done;
+      memcpy((Uint8 *) buf + done, t->buf + ofs, n);
+    }
+    if (n == 0) break;
+    d->pos += n;
+    done += n;
+  }
+  return done / size;
+}
+
+/* Like fwrite, on the current position of drive d */
+static size_t
+disk_write(const void *buf, size_t size, size_t count, DiskState *d)
+{
+  size_t want = size * count, done = 0;
+  TrackLine *t;
+  UINT n, ofs;
+
+  if (size == 0) return 0;
+  while (done < want) {
+    if (d->line_size == 0 || d->pos < d->line_base) {
+      n = want - done;
+      if (d->line_size != 0 && d->pos + n > d->line_base) {
+	n = d->line_base - d->pos;
+      }
+      if (f_pwrite(&d->fil, (const Uint8 *) buf + done, n, d->pos, &n)
+	  != FR_OK) {
+	break;
+      }
+    } else {
+      t = track_line_get(d, d->pos);
+      if (t == NULL) break;
+      ofs = d->pos - t->base;
+      n = d->line_size - ofs;
+      if (n > want - done) n = want - done;
+      if (ofs > t->len) {
+	/* Writing past the end of the file; the gap reads as zeros */
+	memset(t->buf + t->len, 0, ofs - t->len);
+      }
+      memcpy(t->buf + ofs, (const Uint8 *) buf + done, n);
+      if (ofs + n > t->len) t->len = ofs + n;
+      if (t->dirty_lo == t->dirty_hi) {
+	t->dirty_lo = ofs;
+	t->dirty_hi = ofs + n;
+      } else {
+	if (ofs < t->dirty_lo) t->dirty_lo = ofs;
+	if (ofs + n > t->dirty_hi) t->dirty_hi = ofs + n;
+      }
+    }
+    if (n == 0) break;
+    d->pos += n;
+    done += n;
+  }
+  return done / size;
+}
+
+static int
+disk_getc(DiskState *d)
+{
+  Uint8 c;
+  return (disk_read(&c, 1, 1, d) == 1) ? c : EOF;
+}
+
+static int
+disk_putc(int c, DiskState *d)
+{
+  Uint8 b = c;
+  return (disk_write(&b, 1, 1, d) == 1) ? b : EOF;
+}
+
+/* Write back the dirty cache lines of drive d */
+static int
+disk_flush(DiskState *d)
+{
+  int i, c = 0;
+
+  for (i = 0; i < TRACK_CACHE_LINES; i++) {
+    if (track_cache[i].d == d && track_line_writeback(&track_cache[i]) == EOF) {
+      c = EOF;
+    }
+  }
+  return c;
+}
+
+static int
+disk_close(DiskState *d)
+{
+  int i, c;
+
+  c = disk_flush(d);
+  for (i = 0; i < TRACK_CACHE_LINES; i++) {
+    if (track_cache[i].d == d) track_cache[i].d = NULL;
+  }
+  if (f_close(d->file) != FR_OK) c = EOF;
+  d->file = NULL;
+  return c;
+}
+
+/*
+ * Track buffers for DMK drives. A drive borrows one on its first
+ * dmk_get_track() and returns it on eject, so only DMK drives that are
+ * actually in use hold 16 KB of PSRAM. Returned buffers are kept for the
+ * next DMK drive rather than freed, which bounds the pool by the largest
+ * number of DMK drives that were ever active at once.
+ */
+static Uint8 *dmk_buf_pool[NDRIVES];
+static int dmk_buf_nfree;
+
+static Uint8 *
+dmk_buf_borrow(DiskState *d)
+{
+  if (d->u.dmk.buf != NULL) return d->u.dmk.buf;
+  if (dmk_buf_nfree > 0) {
+    d->u.dmk.buf = dmk_buf_pool[--dmk_buf_nfree];
+  } else {
+    d->u.dmk.buf = (Uint8 *) heap_caps_malloc_prefer(DMK_TRACKLEN_MAX, 2,
+						     MALLOC_CAP_SPIRAM,
+						     MALLOC_CAP_8BIT);
+  }
+  return d->u.dmk.buf;
+}
+
+static void
+dmk_buf_return(DiskState *d)
+{
+  if (d->emutype != DMK || d->u.dmk.buf == NULL) return;
+  dmk_buf_pool[dmk_buf_nfree++] = d->u.dmk.buf;
+  d->u.dmk.buf = NULL;
+}
+
 /* Emulate interleave in JV1 mode */
 static const Uint8 jv1_interleave[10] = {0, 5, 1, 6, 2, 7, 3, 8, 4, 9};
 
@@ -329,6 +584,7 @@ static void real_readadr(void);
 static void real_readtrk(void);
 static void real_writetrk(void);
 static int  real_check_empty(DiskState *d);
+int trs_disk_motoroff(void);
 
 /********************************************************************************************
  * TRS-IO compat
@@ -344,13 +600,205 @@ static const Uint16 Z80_PC = 0;
 
 static const int trs_show_led = 0;
 
+/* Bus clock of the Model I */
+#define Z80_CLOCK_MHZ 1.77408
+
+/* ESP32 CPU cycles per T-state in 16.16 fixed point */
+#define CCOUNT_PER_TSTATE \
+  ((uint32_t) (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 65536.0 / Z80_CLOCK_MHZ))
+
+/* Longest wait between two polls that look at the clock (CPU cycles) */
+#define CCOUNT_MAX_SLEEP 0x40000000
+
+/*
+ * There is no Z80 counting T-states here. t_count is estimated from the
+ * CPU cycle counter of the ESP32 and advanced whenever the floppy
+ * controller looks at the time. The counter wraps every 2^32 cycles
+ * (17.9 s at 240 MHz), so the time has to be looked at more often than
+ * that: trs_disk_poll() runs in the idle loop of the bus task and updates
+ * at least every CCOUNT_MAX_SLEEP cycles. Longer gaps, which would go
+ * unnoticed, are not expected as that task never blocks.
+ */
+static struct {
+  float clockMHz;
+  tstate_t t_count;
+  tstate_t sched;
+  uint32_t ccount;              /* Cycle counter at last update */
+  uint64_t ccount_frac;         /* Cycles not yet converted (16.16) */
+} z80_state = {Z80_CLOCK_MHZ};
+
+#define TSTATE_T_MID (((tstate_t) -1LL)/2ULL)
+
+static void
+trs_update_t_count(void)
+{
+  uint32_t now = xthal_get_ccount();
+
+  z80_state.ccount_frac += (uint64_t) (now - z80_state.ccount) << 16;
+  z80_state.ccount = now;
+  z80_state.t_count += z80_state.ccount_frac / CCOUNT_PER_TSTATE;
+  z80_state.ccount_frac %= CCOUNT_PER_TSTATE;
+}
+
+/*
+ * Hashed timer wheel. Each slot covers 2^TRS_WHEEL_SHIFT T-states; events
+ * further out than one revolution stay in their slot until their round
+ * comes up. Insert and cancel are O(1), and a bitmap of non-empty slots
+ * lets trs_disk_poll() skip straight to the next slot with work in it.
+ */
+#define TRS_WHEEL_SHIFT 6
+#define TRS_WHEEL_SLOTS 64
+#define TRS_WHEEL_MASK (TRS_WHEEL_SLOTS - 1)
+
+typedef struct trs_timer {
+  struct trs_timer *next;
+  struct trs_timer *prev;
+  tstate_t when;
+  trs_event_func func;
+  int arg;
+  int slot;                     /* -1 if not scheduled */
+} trs_timer_t;
+
 static struct {
-  int clockMHz;
-  long long t_count;
-  long long sched;
-} z80_state;
+  trs_timer_t *slots[TRS_WHEEL_SLOTS];
+  uint64_t busy;                /* Bit n set if slots[n] is non-empty */
+  tstate_t tick;                /* Last tick looked at by trs_disk_poll() */
+  uint32_t poll_ccount;         /* Cycle count at which to look again */
+} wheel;
+
+static trs_timer_t disk_event = {.slot = -1};
+static trs_timer_t motor_event = {.slot = -1};
+
+static inline uint64_t
+rotr64(uint64_t x, int n)
+{
+  return (n == 0) ? x : (x >> n) | (x << (64 - n));
+}
+
+static void
+trs_timer_set_poll(tstate_t when)
+{
+  tstate_t dt = (when > z80_state.t_count) ? when - z80_state.t_count : 0;
+  uint32_t cycles;
+
+  if (dt >= (CCOUNT_MAX_SLEEP / CCOUNT_PER_TSTATE) << 16) {
+    cycles = CCOUNT_MAX_SLEEP;
+  } else {
+    cycles = (dt * CCOUNT_PER_TSTATE) >> 16;
+  }
+  if ((int32_t) (z80_state.ccount + cycles - wheel.poll_ccount) < 0) {
+    wheel.poll_ccount = z80_state.ccount + cycles;
+  }
+}
+
+static void
+trs_timer_cancel(trs_timer_t *t)
+{
+  if (t->slot < 0) {
+    return;
+  }
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    wheel.slots[t->slot] = t->next;
+    if (t->next == NULL) {
+      wheel.busy &= ~(1ULL << t->slot);
+    }
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  t->slot = -1;
+}
+
+static void
+trs_timer_schedule(trs_timer_t *t, trs_event_func f, int arg, int tstates)
+{
+  tstate_t tick;
+
+  trs_timer_cancel(t);
+  trs_update_t_count();
+  t->func = f;
+  t->arg = arg;
+  t->when = z80_state.t_count + (tstates > 0 ? tstates : 0);
+  tick = t->when >> TRS_WHEEL_SHIFT;
+  if (tick < wheel.tick) {
+    tick = wheel.tick;
+  }
+  t->slot = tick & TRS_WHEEL_MASK;
+  t->prev = NULL;
+  t->next = wheel.slots[t->slot];
+  if (t->next != NULL) {
+    t->next->prev = t;
+  }
+  wheel.slots[t->slot] = t;
+  wheel.busy |= 1ULL << t->slot;
+  trs_timer_set_poll(t->when);
+}
+
+/* Fire every event in a slot that is due. Events may reschedule or
+   cancel other events, so restart the scan after each one. */
+static void
+trs_timer_run_slot(int slot)
+{
+  trs_timer_t *t = wheel.slots[slot];
+
+  while (t != NULL) {
+    if (t->when > z80_state.t_count) {
+      t = t->next;
+      continue;
+    }
+    trs_timer_cancel(t);
+    t->func(t->arg);
+    t = wheel.slots[slot];
+  }
+}
+
+/*
+ * Called from the idle loop of the bus task. Cheap unless an event might
+ * be due.
+ *
+ * This is groundwork: the bus code does not route the FDC addresses
+ * (0x37e0-0x37ef) to trs_disk_command_write() and the other register
+ * functions yet, and nothing inserts a disk. Until then no events are
+ * scheduled and this only keeps t_count current.
+ */
+void
+trs_disk_poll(void)
+{
+  tstate_t now_tick;
+  uint64_t pending;
+  int slot, dist;
+
+  if ((int32_t) (xthal_get_ccount() - wheel.poll_ccount) < 0) {
+    return;
+  }
+  trs_update_t_count();
+  now_tick = z80_state.t_count >> TRS_WHEEL_SHIFT;
 
-#define TSTATE_T_MID 0
+  /* Slots covering ticks wheel.tick .. now_tick */
+  if (now_tick - wheel.tick >= TRS_WHEEL_SLOTS - 1) {
+    pending = wheel.busy;
+  } else {
+    int first = wheel.tick & TRS_WHEEL_MASK;
+    int n = now_tick - wheel.tick + 1;
+    pending = wheel.busy & rotr64((1ULL << n) - 1, -first & TRS_WHEEL_MASK);
+  }
+  wheel.tick = now_tick;
+  while (pending != 0) {
+    slot = __builtin_ctzll(pending);
+    pending &= pending - 1;
+    trs_timer_run_slot(slot);
+  }
+
+  /* Look again when the next non-empty slot comes up */
+  wheel.poll_ccount = z80_state.ccount + CCOUNT_MAX_SLEEP;
+  pending = wheel.busy;
+  if (pending != 0) {
+    dist = __builtin_ctzll(rotr64(pending, now_tick & TRS_WHEEL_MASK));
+    trs_timer_set_poll((now_tick + (dist ? dist : 1)) << TRS_WHEEL_SHIFT);
+  }
+}
 
 static void error(const char* fmt, ...)
 {
@@ -372,39 +820,60 @@ void trs_disk_led(int drive, int on_off)
   // Do nothing
 }
 
+/* xtrs has a single pending event; it is kept in disk_event. */
 void trs_schedule_event(trs_event_func f, int arg, int tstates)
 {
-  assert(0);
+  trs_timer_schedule(&disk_event, f, arg, tstates);
+  z80_state.sched = disk_event.when;
+}
+
+void trs_cancel_event()
+{
+  trs_timer_cancel(&disk_event);
+  z80_state.sched = 0;
 }
 
 void trs_do_event()
 {
-  assert(0);
+  trs_event_func f = disk_event.func;
+  int arg = disk_event.arg;
+
+  if (disk_event.slot < 0) {
+    return;
+  }
+  trs_cancel_event();
+  f(arg);
 }
 
-void trs_disk_motoroff_interrupt(int arg)
+trs_event_func trs_event_scheduled()
 {
-  assert(0);
+  return (disk_event.slot < 0) ? NULL : disk_event.func;
 }
 
-void trs_disk_intrq_interrupt(int arg)
+/* The Model I interrupt latch is not wired to the bus; just record the
+   state of the lines. */
+static int disk_intrq, disk_drq, disk_motoroff;
+
+void trs_disk_motoroff_interrupt(int arg)
 {
-  assert(0);
+  disk_motoroff = arg;
 }
 
-void trs_disk_drq_interrupt(int arg)
+void trs_disk_intrq_interrupt(int arg)
 {
-  assert(0);
+  disk_intrq = arg;
 }
 
-trs_event_func trs_event_scheduled()
+void trs_disk_drq_interrupt(int arg)
 {
-  return NULL;
+  disk_drq = arg;
 }
 
-void trs_cancel_event()
+static void trs_disk_motor_timeout(int arg)
 {
-  //assert(0);
+  if (trs_disk_motoroff()) {
+    trs_disk_motoroff_interrupt(1);
+  }
 }
 
 
@@ -554,6 +1023,11 @@ trs_disk_init(int poweron)
   //trs_hard_init(poweron);
   //stringy_init();
   trs_cancel_event();
+  trs_timer_cancel(&motor_event);
+  if (poweron) {
+    z80_state.ccount = xthal_get_ccount();
+    wheel.poll_ccount = z80_state.ccount;
+  }
 
 /*
  * Emulate no controller if there is no disk in drive 0 at reset time,
@@ -715,10 +1189,10 @@ idoffset(DiskState *d, int id_index)
       if (d->u.jv3.nblocks == 1) {
         /* Initialize new block of ids */
 	int c;
-	fseek(d->file, idstart2, 0);
-        c = fwrite((void*)&d->u.jv3.id[JV3_SECSPERBLK], JV3_SECSTART, 1, d->file);
-	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
-	c = fflush(d->file);
+	disk_seek(d, idstart2);
+        c = disk_write((void*)&d->u.jv3.id[JV3_SECSPERBLK], JV3_SECSTART, 1, d);
+	if (c != 1) state.status |= TRSDISK_WRITEFLT;
+	c = disk_flush(d);
 	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	d->u.jv3.nblocks = 2;
       }
@@ -766,30 +1240,18 @@ jv3_free_sector(DiskState *d, int id_index)
   d->u.jv3.id[id_index].sector = JV3_FREE;
   d->u.jv3.id[id_index].flags =
     (d->u.jv3.id[id_index].flags | JV3_FREEF) ^ JV3_SIZE;
-  fseek(d->file, idoffset(d, id_index), 0);
-  c = fwrite(&d->u.jv3.id[id_index], sizeof(SectorId), 1, d->file);
-  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
+  disk_seek(d, idoffset(d, id_index));
+  c = disk_write(&d->u.jv3.id[id_index], sizeof(SectorId), 1, d);
+  if (c != 1) state.status |= TRSDISK_WRITEFLT;
 
   if (id_index == d->u.jv3.last_used_id) {
-    int newlen;
     while (d->u.jv3.id[d->u.jv3.last_used_id].track == JV3_FREE) {
       d->u.jv3.last_used_id--;
     }
-    c = fflush(d->file);
-    if (c == EOF) state.status |= TRSDISK_WRITEFLT;
-    rewind(d->file);
-    if (d->u.jv3.last_used_id >= 0) {
-      newlen = offset(d, d->u.jv3.last_used_id) +
-	id_index_to_size(d, d->u.jv3.last_used_id);
-    } else {
-      newlen = offset(d, 0);
-    }
-#ifdef _WIN32
-    chsize(fileno(d->file), newlen);
-#else
-    c = ftruncate(fileno(d->file), newlen);
+    c = disk_flush(d);
     if (c == EOF) state.status |= TRSDISK_WRITEFLT;
-#endif
+    /* TRS_FS cannot truncate a file; the free sectors at the end of
+       the image are simply left in place. */
   }
 }
 
@@ -802,23 +1264,23 @@ trs_disk_emutype(DiskState *d)
   char fmt[4];
   int count;
 
-  fseek(d->file, 0, 0);
-  c = getc(d->file);
+  disk_seek(d, 0);
+  c = disk_getc(d);
   if (c == -1) {
     d->emutype = JV1;
     return;
   }
   if (c == 0 || c == 0xff) {
-    fseek(d->file, DMK_FORMAT, 0);
-    count = fread(fmt, 1, DMK_FORMAT_SIZE, d->file);
+    disk_seek(d, DMK_FORMAT);
+    count = disk_read(fmt, 1, DMK_FORMAT_SIZE, d);
     if (count != DMK_FORMAT_SIZE) {
       d->emutype = JV1;
       return;
     }
     if (fmt[0] == 0 && fmt[1] == 0 && fmt[2] == 0 && fmt[3] == 0) {
-      fseek(d->file, DMK_TRACKLEN, 0);
-      count = (Uint8) getc(d->file);
-      count += (Uint8) getc(d->file) << 8;
+      disk_seek(d, DMK_TRACKLEN);
+      count = (Uint8) disk_getc(d);
+      count += (Uint8) disk_getc(d) << 8;
       if (count >= 16 && count <= DMK_TRACKLEN_MAX) {
 	d->emutype = DMK;
 	d->writeprot = d->writeprot || (c == 0xff);
@@ -828,20 +1290,19 @@ trs_disk_emutype(DiskState *d)
     if (fmt[0] == 0x78 && fmt[1] == 0x56 && fmt[2] == 0x34 && fmt[3] == 0x12) {
       error("Real disk specifier file from DMK emulator not supported");
       d->emutype = NONE;
-      fclose(d->file);
-      d->file = NULL;
+      disk_close(d);
       return;
     }
   }
   if (c == 0) {
-    fseek(d->file, 1, 0);
-    if (getc(d->file) == 0xfe) {
+    disk_seek(d, 1);
+    if (disk_getc(d) == 0xfe) {
       d->emutype = JV1;
       return;
     }
   }
-  fseek(d->file, JV3_SECSPERBLK*sizeof(SectorId), 0);
-  c = getc(d->file);
+  disk_seek(d, JV3_SECSPERBLK*sizeof(SectorId));
+  c = disk_getc(d);
   if (c == 0 || c == 0xff) {
     d->emutype = JV3;
     d->writeprot = d->writeprot || (c == 0);
@@ -850,14 +1311,26 @@ trs_disk_emutype(DiskState *d)
   d->emutype = JV1;
 }
 
+static int
+trs_disk_close(DiskState *d)
+{
+  dmk_buf_return(d);
+#if __linux
+  if (d->emutype == REAL) {
+    d->file = NULL;
+    return close(d->u.real.fd) == 0 ? 0 : EOF;
+  }
+#endif
+  return disk_close(d);
+}
+
 void
 trs_disk_remove(int drive)
 {
   DiskState *d = &disk[drive];
 
   if (d->file != NULL) {
-    if (fclose(d->file) == EOF) state.status |= TRSDISK_WRITEFLT;
-    d->file = NULL;
+    if (trs_disk_close(d) == EOF) state.status |= TRSDISK_WRITEFLT;
     d->filename[0] = 0;
   }
   d->writeprot = 0;
@@ -867,22 +1340,17 @@ void
 trs_disk_insert(int drive, const char *diskname)
 {
   DiskState *d = &disk[drive];
+#if __linux
   struct stat st;
+#endif
   int c;
 
   if (d->file != NULL) {
-    c = fclose(d->file);
+    c = trs_disk_close(d);
     if (c == EOF) state.status |= TRSDISK_WRITEFLT;
   }
-  if (stat(diskname, &st) == -1) {
-    d->file = NULL;
-    d->filename[0] = 0;
-    d->writeprot = 0;
-    error("failed to open disk image %s: %s", diskname, strerror(errno));
-    return;
-  }
   #if __linux
-  if (S_ISBLK(st.st_mode)) {
+  if (stat(diskname, &st) == 0 && S_ISBLK(st.st_mode)) {
     /* Real floppy drive */
     int fd;
     int reset_now = 0;
@@ -895,16 +1363,11 @@ trs_disk_insert(int drive, const char *diskname)
       d->emutype = JV3;
       return;
     }
-    d->file = fdopen(fd, "r+");
-    if (d->file == NULL) {
-      error("%s: %s", diskname, strerror(errno));
-      d->filename[0] = 0;
-      d->emutype = JV3;
-      return;
-    }
+    d->u.real.fd = fd;
+    d->file = &d->fil;
     d->writeprot = 0;
-    ioctl(fileno(d->file), FDRESET, &reset_now);
-    ioctl(fileno(d->file), FDGETDRVPRM, &fdp);
+    ioctl(fd, FDRESET, &reset_now);
+    ioctl(fd, FDGETDRVPRM, &fdp);
     d->u.real.rps = fdp.rps;
     d->u.real.size_code = 1; /* initial guess: 256 bytes */
     d->u.real.empty_timeout = 0;
@@ -917,26 +1380,35 @@ trs_disk_insert(int drive, const char *diskname)
   } else
 #endif
   {
-    d->file = fopen(diskname, "rb+");
-    if (d->file == NULL) {
-      d->file = fopen(diskname, "rb");
-      if (d->file == NULL) return;
+    if (f_open(&d->fil, diskname, FA_READ | FA_WRITE) == FR_OK) {
+      d->writeprot = 0;
+    } else if (f_open(&d->fil, diskname, FA_READ) == FR_OK) {
       d->writeprot = 1;
     } else {
+      d->file = NULL;
+      d->filename[0] = 0;
       d->writeprot = 0;
+      error("failed to open disk image %s", diskname);
+      return;
     }
+    d->file = &d->fil;
+    disk_set_lines(d, 0, 0);
     trs_disk_emutype(d);
+    if (d->file == NULL) return;
     snprintf(d->filename, FILENAME_MAX, "%s", diskname);
   }
-  if (d->emutype == JV3) {
+  if (d->emutype == JV1) {
+    disk_set_lines(d, 0, JV1_SECPERTRK * JV1_SECSIZE);
+  } else if (d->emutype == JV3) {
     int id_index, n;
     int ofst;
 
+    disk_set_lines(d, JV3_SECSTART, JV3_LINE_SIZE);
     memset((void*)d->u.jv3.id, JV3_FREE, sizeof(d->u.jv3.id));
 
     /* Read first block of ids */
-    fseek(d->file, JV3_IDSTART, 0);
-    n = fread((void*)&d->u.jv3.id[0], 3, JV3_SECSPERBLK, d->file);
+    disk_seek(d, JV3_IDSTART);
+    n = disk_read((void*)&d->u.jv3.id[0], 3, JV3_SECSPERBLK, d);
 
     /* Scan to find their offsets */
     ofst = JV3_SECSTART;
@@ -946,8 +1418,8 @@ trs_disk_insert(int drive, const char *diskname)
     }
 
     /* Read second block of ids, if any */
-    fseek(d->file, ofst, 0);
-    n = fread((void*)&d->u.jv3.id[JV3_SECSPERBLK], 3, JV3_SECSPERBLK, d->file);
+    disk_seek(d, ofst);
+    n = disk_read((void*)&d->u.jv3.id[JV3_SECSPERBLK], 3, JV3_SECSPERBLK, d);
     d->u.jv3.nblocks = n > 0 ? 2 : 1;
 
     /* Scan to find their offsets */
@@ -974,15 +1446,17 @@ trs_disk_insert(int drive, const char *diskname)
     }
     jv3_sort_ids(drive);
   } else if (d->emutype == DMK) {
-    fseek(d->file, DMK_NTRACKS, 0);
-    d->u.dmk.ntracks = (Uint8) getc(d->file);
-    d->u.dmk.tracklen = (Uint8) getc(d->file);
-    d->u.dmk.tracklen += ((Uint8) getc(d->file)) << 8;
-    c = getc(d->file);
+    d->u.dmk.buf = NULL;
+    disk_seek(d, DMK_NTRACKS);
+    d->u.dmk.ntracks = (Uint8) disk_getc(d);
+    d->u.dmk.tracklen = (Uint8) disk_getc(d);
+    d->u.dmk.tracklen += ((Uint8) disk_getc(d)) << 8;
+    c = disk_getc(d);
     d->u.dmk.nsides = (c & DMK_SSIDE_OPT) ? 1 : 2;
     d->u.dmk.sden = (c & DMK_SDEN_OPT) != 0;
     d->u.dmk.ignden = (c & DMK_IGNDEN_OPT) != 0;
     d->u.dmk.curtrack = d->u.dmk.curside = -1;
+    disk_set_lines(d, DMK_HDR_SIZE, d->u.dmk.tracklen);
 
     if (trs_disk_debug_flags & DISKDEBUG_DMK) {
       debug("DMK drv=%d wp=%d #tk=%d tklen=0x%x nsides=%d sden=%d ignden=%d\n",
@@ -1044,26 +1518,28 @@ trs_disk_motoroff(void)
   return stopped;
 }
 
-/* Get the on-disk track data from the current track/side into the buffer */
-static void
+/* Get the on-disk track data from the current track/side into the buffer.
+   Returns -1 if no track buffer could be allocated. */
+static int
 dmk_get_track(DiskState* d)
 {
+  if (dmk_buf_borrow(d) == NULL) return -1;
   if (d->phytrack == d->u.dmk.curtrack &&
-      state.curside == d->u.dmk.curside) return;
+      state.curside == d->u.dmk.curside) return 0;
   d->u.dmk.curtrack = d->phytrack;
   d->u.dmk.curside = state.curside;
   if (d->u.dmk.curtrack >= d->u.dmk.ntracks ||
       (d->u.dmk.curside && d->u.dmk.nsides == 1)) {
-    memset(d->u.dmk.buf, 0, sizeof(d->u.dmk.buf));
-    return;
+    memset(d->u.dmk.buf, 0, DMK_TRACKLEN_MAX);
+    return 0;
   }
-  fseek(d->file, (DMK_HDR_SIZE +
+  disk_seek(d, (DMK_HDR_SIZE +
 		  (d->u.dmk.curtrack * d->u.dmk.nsides + d->u.dmk.curside)
-		  * d->u.dmk.tracklen), 0);
-  if (fread(d->u.dmk.buf, d->u.dmk.tracklen, 1, d->file) != 1) {
-    memset(d->u.dmk.buf, 0, sizeof(d->u.dmk.buf));
-    return;
+		  * d->u.dmk.tracklen));
+  if (disk_read(d->u.dmk.buf, d->u.dmk.tracklen, 1, d) != 1) {
+    memset(d->u.dmk.buf, 0, DMK_TRACKLEN_MAX);
   }
+  return 0;
 }
 
 
@@ -1124,7 +1600,10 @@ search(int sector, int side)
     int incr = dmk_incr(d);
 
     /* get current phytrack into buffer */
-    dmk_get_track(d);
+    if (dmk_get_track(d) < 0) {
+      state.status |= TRSDISK_NOTFOUND;
+      return -1;
+    }
 
     /* loop through IDAMs in track */
     for (i = 0; i < DMK_TKHDR_SIZE; i += 2) {
@@ -1261,6 +1740,7 @@ angle(void)
   int revus = d->inches == 5 ? 200000 /* 300 RPM */ : 166666 /* 360 RPM */;
 #if TSTATEREV
   /* Lock revolution rate to emulated time measured in T-states */
+  trs_update_t_count();
   /* Minor bug: there will be a glitch when t_count wraps around on
      a 32-bit machine */
   int revt = (int)(revus * z80_state.clockMHz);
@@ -1393,9 +1873,12 @@ trs_disk_select_write(Uint8 data)
     DiskState *d = &disk[state.curdrive];
 
     /* Retrigger emulated motor timeout */
+    trs_update_t_count();
     state.motor_timeout = z80_state.t_count +
       MOTOR_USEC * z80_state.clockMHz;
     trs_disk_motoroff_interrupt(0);
+    trs_timer_schedule(&motor_event, trs_disk_motor_timeout, 0,
+		       MOTOR_USEC * z80_state.clockMHz);
 
     /* Update our knowledge of whether there is a real disk present */
     if (d->emutype == REAL) real_check_empty(d);
@@ -1502,7 +1985,7 @@ trs_disk_data_read(void)
 	state.crc = calc_crc(state.crc, c);
 	d->u.dmk.curbyte += dmk_incr(d);
       } else {
-	c = getc(d->file);
+	c = disk_getc(d);
 	if (c == EOF) {
 	  c = 0xe5;
 	  if (d->emutype == JV1) {
@@ -1680,13 +2163,13 @@ trs_disk_data_write(Uint8 data)
 	}
 	break;
       }
-      c = putc(data, d->file);
+      c = disk_putc(data, d);
       if (c == EOF) state.status |= TRSDISK_WRITEFLT;
       if (d->emutype == DMK) {
 	d->u.dmk.buf[d->u.dmk.curbyte++] = data;
 	if (dmk_incr(d) == 2) {
 	  d->u.dmk.buf[d->u.dmk.curbyte++] = data;
-	  c = putc(data, d->file);
+	  c = disk_putc(data, d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	}
 	state.crc = calc_crc(state.crc, data);
@@ -1697,20 +2180,20 @@ trs_disk_data_write(Uint8 data)
 	  int idamp, i, j;
 	  c = state.crc >> 8;
 	  d->u.dmk.buf[d->u.dmk.curbyte++] = c;
-	  c = putc(c, d->file);
+	  c = disk_putc(c, d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  if (dmk_incr(d) == 2) {
 	    d->u.dmk.buf[d->u.dmk.curbyte++] = c;
-	    c = putc(c, d->file);
+	    c = disk_putc(c, d);
 	    if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  }
 	  c = state.crc & 0xff;
 	  d->u.dmk.buf[d->u.dmk.curbyte++] = c;
-	  c = putc(c, d->file);
+	  c = disk_putc(c, d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  if (dmk_incr(d) == 2) {
 	    d->u.dmk.buf[d->u.dmk.curbyte++] = c;
-	    c = putc(c, d->file);
+	    c = disk_putc(c, d);
 	    if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  }
 	  /* Check if we smashed one or more following IDAMs; can
@@ -1738,10 +2221,10 @@ trs_disk_data_write(Uint8 data)
 	    while (j < DMK_TKHDR_SIZE) {
 	      d->u.dmk.buf[j++] = 0;
 	    }
-	    fseek(d->file, DMK_HDR_SIZE +
+	    disk_seek(d, DMK_HDR_SIZE +
 		  (d->phytrack * d->u.dmk.nsides + state.curside) *
-		  d->u.dmk.tracklen, 0);
-	    c = fwrite(d->u.dmk.buf, DMK_TKHDR_SIZE, 1, d->file);
+		  d->u.dmk.tracklen);
+	    c = disk_write(d->u.dmk.buf, DMK_TKHDR_SIZE, 1, d);
 	    if (c != 1) state.status |= TRSDISK_WRITEFLT;
 	  }
 	}
@@ -1752,7 +2235,7 @@ trs_disk_data_write(Uint8 data)
 	  trs_cancel_event();
 	}
 	trs_schedule_event(trs_disk_done, 0, 64);
-	c = fflush(d->file);
+	c = disk_flush(d);
 	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
       }
     }
@@ -1769,17 +2252,17 @@ trs_disk_data_write(Uint8 data)
 	  state.format = FMT_DONE;
 	  state.status &= ~TRSDISK_DRQ;
 	  /* Done: write modified track */
-	  fseek(d->file, DMK_HDR_SIZE +
+	  disk_seek(d, DMK_HDR_SIZE +
 		(d->phytrack * d->u.dmk.nsides + state.curside) *
-		d->u.dmk.tracklen, 0);
-	  c = fwrite(d->u.dmk.buf, d->u.dmk.tracklen, 1, d->file);
+		d->u.dmk.tracklen);
+	  c = disk_write(d->u.dmk.buf, d->u.dmk.tracklen, 1, d);
 	  if (c != 1) state.status |= TRSDISK_WRITEFLT;
 	  if (d->phytrack >= d->u.dmk.ntracks) {
 	    d->u.dmk.ntracks = d->phytrack + 1;
-	    fseek(d->file, DMK_NTRACKS, 0);
-	    putc(d->u.dmk.ntracks, d->file);
+	    disk_seek(d, DMK_NTRACKS);
+	    disk_putc(d->u.dmk.ntracks, d);
 	  }
-	  c = fflush(d->file);
+	  c = disk_flush(d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  trs_disk_drq_interrupt(0);
 	  if (trs_event_scheduled() == trs_disk_lostdata) {
@@ -1888,10 +2371,10 @@ trs_disk_data_write(Uint8 data)
 	  warn("recording false sector ID as CRC error");
 
 	  /* Write the sector id */
-	  fseek(d->file, idoffset(d, state.format_sec), 0);
-	  c = fwrite(&d->u.jv3.id[state.format_sec],
-		     sizeof(SectorId), 1, d->file);
-	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
+	  disk_seek(d, idoffset(d, state.format_sec));
+	  c = disk_write(&d->u.jv3.id[state.format_sec],
+		     sizeof(SectorId), 1, d);
+	  if (c != 1) state.status |= TRSDISK_WRITEFLT;
 	}
       } else if (state.format != FMT_GAP3) {
 	/* If not in FMT_GAP3 state, format data was either too long,
@@ -1919,7 +2402,7 @@ trs_disk_data_write(Uint8 data)
       if (d->emutype == REAL) {
 	real_writetrk();
       } else {
-	c = fflush(d->file);
+	c = disk_flush(d);
 	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
       }
       trs_disk_drq_interrupt(0);
@@ -2138,7 +2621,7 @@ trs_disk_data_write(Uint8 data)
 	}
 	if (d->emutype == JV3) {
 	  /* Prepare to write the data */
-	  fseek(d->file, offset(d, state.format_sec), 0);
+	  disk_seek(d, offset(d, state.format_sec));
 	  state.format_bytecount = id_index_to_size(d, state.format_sec);
 	} else if (d->emutype == JV1) {
 	  state.format_bytecount = JV1_SECSIZE;
@@ -2158,9 +2641,9 @@ trs_disk_data_write(Uint8 data)
 	  d->u.jv3.id[state.format_sec].flags |= JV3_ERROR;
 
 	  /* Write the sector id */
-	  fseek(d->file, idoffset(d, state.format_sec), 0);
-	  c = fwrite(&d->u.jv3.id[state.format_sec], sizeof(SectorId), 1, d->file);
-	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
+	  disk_seek(d, idoffset(d, state.format_sec));
+	  c = disk_write(&d->u.jv3.id[state.format_sec], sizeof(SectorId), 1, d);
+	  if (c != 1) state.status |= TRSDISK_WRITEFLT;
 	}
 	goto got_idam2;
       } else {
@@ -2180,17 +2663,17 @@ trs_disk_data_write(Uint8 data)
 		  d->u.jv3.id[state.format_sec].sector);
 	  }
 	  /* Write the sector id */
-	  fseek(d->file, idoffset(d, state.format_sec), 0);
-	  c = fwrite(&d->u.jv3.id[state.format_sec],
-		     sizeof(SectorId), 1, d->file);
-	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
+	  disk_seek(d, idoffset(d, state.format_sec));
+	  c = disk_write(&d->u.jv3.id[state.format_sec],
+		     sizeof(SectorId), 1, d);
+	  if (c != 1) state.status |= TRSDISK_WRITEFLT;
 	  goto got_idam;
 	} else {
 	  trs_disk_unimpl(state.currcommand, "JV1 non-IBM sector");
 	}
       }
       if (d->emutype == JV3) {
-	c = putc(data, d->file);
+	c = disk_putc(data, d);
 	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
       } else if (d->emutype == REAL) {
 	d->u.real.fmt_fill = data;
@@ -2212,9 +2695,9 @@ trs_disk_data_write(Uint8 data)
       }
       if (d->emutype == JV3) {
 	/* Write the sector id */
-	fseek(d->file, idoffset(d, state.format_sec), 0);
-	c = fwrite(&d->u.jv3.id[state.format_sec], sizeof(SectorId), 1, d->file);
-	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
+	disk_seek(d, idoffset(d, state.format_sec));
+	c = disk_write(&d->u.jv3.id[state.format_sec], sizeof(SectorId), 1, d);
+	if (c != 1) state.status |= TRSDISK_WRITEFLT;
       }
       state.format = FMT_GAP3;
       break;
@@ -2311,10 +2794,10 @@ trs_disk_command_write(Uint8 cmd)
     }
 
     /* Fetch old IDAM pointers if any */
-    fseek(d->file, DMK_HDR_SIZE +
+    disk_seek(d, DMK_HDR_SIZE +
 	  (d->phytrack * d->u.dmk.nsides + state.curside) *
-	  d->u.dmk.tracklen, 0);
-    c = fread(oldtkhdr, DMK_TKHDR_SIZE, 1, d->file);
+	  d->u.dmk.tracklen);
+    c = disk_read(oldtkhdr, DMK_TKHDR_SIZE, 1, d);
     if (c == 1) {
       /* Copy any pointers to IDAMs that are not being overwritten */
       i = 0;
@@ -2348,16 +2831,16 @@ trs_disk_command_write(Uint8 cmd)
       }
     }
     /* Write modified portion of track only */
-    fseek(d->file, DMK_HDR_SIZE +
+    disk_seek(d, DMK_HDR_SIZE +
 	  (d->phytrack * d->u.dmk.nsides + state.curside) *
-	  d->u.dmk.tracklen, 0);
-    fwrite(d->u.dmk.buf, d->u.dmk.curbyte, 1, d->file);
+	  d->u.dmk.tracklen);
+    disk_write(d->u.dmk.buf, d->u.dmk.curbyte, 1, d);
     if (d->phytrack >= d->u.dmk.ntracks) {
       d->u.dmk.ntracks = d->phytrack + 1;
-      fseek(d->file, DMK_NTRACKS, 0);
-      putc(d->u.dmk.ntracks, d->file);
+      disk_seek(d, DMK_NTRACKS);
+      disk_putc(d->u.dmk.ntracks, d);
     }
-    fflush(d->file);
+    disk_flush(d);
 
     /* Invalidate buffer since not all data is here */
     d->u.dmk.curtrack = d->u.dmk.curside = -1;
@@ -2496,7 +2979,7 @@ trs_disk_command_write(Uint8 cmd)
 	  }
 	}
 	state.bytecount = JV1_SECSIZE;
-	fseek(d->file, offset(d, id_index), 0);
+	disk_seek(d, offset(d, id_index));
 
       } else if (d->emutype == JV3) {
 
@@ -2555,7 +3038,7 @@ trs_disk_command_write(Uint8 cmd)
 	} else {
 	  state.bytecount = id_index_to_size(d, id_index);
 	}
-	fseek(d->file, offset(d, id_index), 0);
+	disk_seek(d, offset(d, id_index));
 
       } else /* d->emutype == DMK */ {
 
@@ -2760,7 +3243,7 @@ trs_disk_command_write(Uint8 cmd)
 	  break;
 	}
 	state.bytecount = JV1_SECSIZE;
-	fseek(d->file, offset(d, id_index), 0);
+	disk_seek(d, offset(d, id_index));
 
       } else if (d->emutype == JV3) {
 	SectorId *sid = &d->u.jv3.id[id_index];
@@ -2769,11 +3252,11 @@ trs_disk_command_write(Uint8 cmd)
 	newflags |= jv3dam;
 	if (newflags != sid->flags) {
 	  int c;
-	  fseek(d->file, idoffset(d, id_index)
-		         + ((char *) &sid->flags) - ((char *) sid), 0);
-	  c = putc(newflags, d->file);
+	  disk_seek(d, idoffset(d, id_index)
+		         + ((char *) &sid->flags) - ((char *) sid));
+	  c = disk_putc(newflags, d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
-	  c = fflush(d->file);
+	  c = disk_flush(d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  sid->flags = newflags;
 	}
@@ -2792,7 +3275,7 @@ trs_disk_command_write(Uint8 cmd)
 		      state.track, i, j);
 	      }
 	      jv3_free_sector(d, j);
-	      c = fflush(d->file);
+	      c = disk_flush(d);
 	      if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	    }
 	    /* Smash only one for non-IBM write */
@@ -2806,7 +3289,7 @@ trs_disk_command_write(Uint8 cmd)
 	} else {
 	  state.bytecount = id_index_to_size(d, id_index);
 	}
-	fseek(d->file, offset(d, id_index), 0);
+	disk_seek(d, offset(d, id_index));
 
       } else /* d->emutype == DMK */ {
 	int c, nzeros, i;
@@ -2821,29 +3304,29 @@ trs_disk_command_write(Uint8 cmd)
 
 	/* Skip initial part of gap, per 1771 and 179x data sheets */
 	id_index += 11 * (state.density ? 2 : 1) * dmk_incr(d);
-	fseek(d->file, (DMK_HDR_SIZE +
+	disk_seek(d, (DMK_HDR_SIZE +
 			(d->u.dmk.curtrack*d->u.dmk.nsides + d->u.dmk.curside)
-			* d->u.dmk.tracklen + id_index), 0);
+			* d->u.dmk.tracklen + id_index));
 
 	/* Write remaining gap (per data sheets) and DAM */
 	nzeros = 6 * (state.density ? 2 : 1) * dmk_incr(d);
 	for (i = 0; i < nzeros; i++) {
-	  c = putc(0, d->file);
+	  c = disk_putc(0, d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  d->u.dmk.buf[id_index++] = 0;
 	}
 	if (state.density) {
 	  for (i = 0; i < 3; i++) {
-	    c = putc(0xa1, d->file);
+	    c = disk_putc(0xa1, d);
 	    if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	    d->u.dmk.buf[id_index++] = 0xa1;
 	  }
 	}
-	c = putc(dam, d->file);
+	c = disk_putc(dam, d);
 	if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	d->u.dmk.buf[id_index++] = dam;
 	if (dmk_incr(d) == 2) {
-	  c = putc(dam, d->file);
+	  c = disk_putc(dam, d);
 	  if (c == EOF) state.status |= TRSDISK_WRITEFLT;
 	  d->u.dmk.buf[id_index++] = dam;
 	}
@@ -2992,7 +3475,10 @@ trs_disk_command_write(Uint8 cmd)
       int ib = 0;
       int i, j, idamp, dden, prev_idamp, prev_dden, ts;
 
-      dmk_get_track(d);
+      if (dmk_get_track(d) < 0) {
+	trs_disk_unimpl(cmd, "no memory for DMK track buffer");
+	break;
+      }
 
       for (j = 0; j < 2; j++) {
 	idamp = d->u.dmk.buf[0] + (d->u.dmk.buf[1] << 8);
@@ -3063,7 +3549,10 @@ trs_disk_command_write(Uint8 cmd)
       trs_disk_unimpl(cmd, "read track");
       break;
     }
-    dmk_get_track(d);
+    if (dmk_get_track(d) < 0) {
+      trs_disk_unimpl(cmd, "no memory for DMK track buffer");
+      break;
+    }
     d->u.dmk.curbyte = DMK_TKHDR_SIZE;
     if (disk[state.curdrive].inches == 5) {
       state.bytecount = TRKSIZE_DD;  /* decrement by 2's if SD */
@@ -3126,9 +3615,13 @@ trs_disk_command_write(Uint8 cmd)
 	  error("DMK disk created as single sided only");
 	  state.status |= TRSDISK_WRITEFLT;
 	}
+	if (dmk_buf_borrow(d) == NULL) {
+	  trs_disk_unimpl(cmd, "no memory for DMK track buffer");
+	  break;
+	}
 	d->u.dmk.curtrack = d->phytrack;
 	d->u.dmk.curside = state.curside;
-	memset(d->u.dmk.buf, 0, sizeof(d->u.dmk.buf));
+	memset(d->u.dmk.buf, 0, DMK_TRACKLEN_MAX);
 	d->u.dmk.curbyte = DMK_TKHDR_SIZE;
 	d->u.dmk.nextidam = 0;
       }
@@ -3219,7 +3712,7 @@ real_check_empty(DiskState *d)
     return 1;
   }
 
-  ioctl(fileno(d->file), FDRESET, &reset_now);
+  ioctl(d->u.real.fd, FDRESET, &reset_now);
 
   /* Do a read id command.  Assume a disk is in the drive iff
      we get a nonnegative status back from the ioctl. */
@@ -3231,7 +3724,7 @@ real_check_empty(DiskState *d)
   raw_cmd.cmd_count = i;
   raw_cmd.data = NULL;
   raw_cmd.length = 0;
-  if (ioctl(fileno(d->file), FDRAWCMD, &raw_cmd) < 0) {
+  if (ioctl(d->u.real.fd, FDRAWCMD, &raw_cmd) < 0) {
     real_error(d, raw_cmd.flags, "check_empty");
   } else {
     real_ok(d);
@@ -3261,7 +3754,7 @@ real_restore(int curdrive)
   raw_cmd.cmd[i++] = FD_RECALIBRATE;
   raw_cmd.cmd[i++] = 0;
   raw_cmd.cmd_count = i;
-  if (ioctl(fileno(d->file), FDRAWCMD, &raw_cmd) < 0) {
+  if (ioctl(d->u.real.fd, FDRAWCMD, &raw_cmd) < 0) {
     real_error(d, raw_cmd.flags, "restore");
     state.status |= TRSDISK_SEEKERR;
     return;
@@ -3297,7 +3790,7 @@ real_seek(void)
   raw_cmd.cmd[i++] = 0;
   raw_cmd.cmd[i++] = d->phytrack * d->real_step;
   raw_cmd.cmd_count = i;
-  if (ioctl(fileno(d->file), FDRAWCMD, &raw_cmd) < 0) {
+  if (ioctl(d->u.real.fd, FDRAWCMD, &raw_cmd) < 0) {
     real_error(d, raw_cmd.flags, "seek");
     state.status |= TRSDISK_SEEKERR;
     return;
@@ -3336,7 +3829,7 @@ real_read(void)
     raw_cmd.cmd_count = i;
     raw_cmd.data = (void*) d->u.real.buf;
     raw_cmd.length = 128 << d->u.real.size_code;
-    if (ioctl(fileno(d->file), FDRAWCMD, &raw_cmd) < 0) {
+    if (ioctl(d->u.real.fd, FDRAWCMD, &raw_cmd) < 0) {
       real_error(d, raw_cmd.flags, "read");
       new_status |= TRSDISK_NOTFOUND;
     } else {
@@ -3434,7 +3927,7 @@ real_write(void)
   raw_cmd.cmd_count = i;
   raw_cmd.data = (void*) d->u.real.buf;
   raw_cmd.length = 128 << d->u.real.size_code;
-  if (ioctl(fileno(d->file), FDRAWCMD, &raw_cmd) < 0) {
+  if (ioctl(d->u.real.fd, FDRAWCMD, &raw_cmd) < 0) {
     real_error(d, raw_cmd.flags, "write");
     state.status |= TRSDISK_NOTFOUND;
   } else {
@@ -3500,7 +3993,7 @@ real_readadr(void)
   raw_cmd.data = NULL;
   raw_cmd.length = 0;
   state.bytecount = 0;
-  if (ioctl(fileno(d->file), FDRAWCMD, &raw_cmd) < 0) {
+  if (ioctl(d->u.real.fd, FDRAWCMD, &raw_cmd) < 0) {
     real_error(d, raw_cmd.flags, "readadr");
     new_status |= TRSDISK_NOTFOUND;
   } else {
@@ -3613,7 +4106,7 @@ real_writetrk(void)
     debug("\n");
   }
 
-  if (ioctl(fileno(d->file), FDRAWCMD, &raw_cmd) < 0) {
+  if (ioctl(d->u.real.fd, FDRAWCMD, &raw_cmd) < 0) {
     real_error(d, raw_cmd.flags, "writetrk");
     state.status |= TRSDISK_WRITEFLT;
   } else {
@@ -3712,242 +4205,435 @@ int trs_diskset_load(const char *filename)
 }
 #endif
 
-#if 0
-static void trs_fdc_save(FILE *file, FDCState *fdc)
-{
-  trs_save_uint8(file, &fdc->status, 1);
-  trs_save_uint8(file, &fdc->track, 1);
-  trs_save_uint8(file, &fdc->sector, 1);
-  trs_save_uint8(file, &fdc->data, 1);
-  trs_save_uint8(file, &fdc->currcommand, 1);
-  trs_save_int(file, &fdc->lastdirection, 1);
-  trs_save_int(file, &fdc->bytecount, 1);
-  trs_save_int(file, &fdc->format, 1);
-  trs_save_int(file, &fdc->format_bytecount, 1);
-  trs_save_int(file, &fdc->format_sec, 1);
-  trs_save_int(file, &fdc->format_gapcnt, 1);
-  trs_save_int(file, fdc->format_gap, 5);
-  trs_save_uint16(file, &fdc->crc, 1);
-  trs_save_uint32(file, &fdc->curdrive, 1);
-  trs_save_int(file, &fdc->curside, 1);
-  trs_save_int(file, &fdc->density, 1);
-  trs_save_uint8(file, &fdc->controller, 1);
-  trs_save_int(file, &fdc->last_readadr, 1);
-  trs_save_uint64(file, &fdc->motor_timeout, 1);
-}
-
-static void trs_fdc_load(FILE *file, FDCState *fdc)
-{
-  trs_load_uint8(file, &fdc->status, 1);
-  trs_load_uint8(file, &fdc->track, 1);
-  trs_load_uint8(file, &fdc->sector, 1);
-  trs_load_uint8(file, &fdc->data, 1);
-  trs_load_uint8(file, &fdc->currcommand, 1);
-  trs_load_int(file, &fdc->lastdirection, 1);
-  trs_load_int(file, &fdc->bytecount, 1);
-  trs_load_int(file, &fdc->format, 1);
-  trs_load_int(file, &fdc->format_bytecount, 1);
-  trs_load_int(file, &fdc->format_sec, 1);
-  trs_load_int(file, &fdc->format_gapcnt, 1);
-  trs_load_int(file, fdc->format_gap, 5);
-  trs_load_uint16(file, &fdc->crc, 1);
-  trs_load_uint32(file, &fdc->curdrive, 1);
-  trs_load_int(file, &fdc->curside, 1);
-  trs_load_int(file, &fdc->density, 1);
-  trs_load_uint8(file, &fdc->controller, 1);
-  trs_load_int(file, &fdc->last_readadr, 1);
-  trs_load_uint64(file, &fdc->motor_timeout, 1);
-}
-
-static void trs_save_sectorid(FILE *file, SectorId *id)
-{
-  trs_save_uint8(file, &id->track, 1);
-  trs_save_uint8(file, &id->sector, 1);
-  trs_save_uint8(file, &id->flags, 1);
-}
-
-static void trs_load_sectorid(FILE *file, SectorId *id)
-{
-  trs_load_uint8(file, &id->track, 1);
-  trs_load_uint8(file, &id->sector, 1);
-  trs_load_uint8(file, &id->flags, 1);
-}
-
-static void trs_save_jv3state(FILE *file, JV3State *jv3)
+/*
+ * Snapshots of the floppy controller state.
+ *
+ * A snapshot file is a 5 byte header ("TRSD" and a version byte)
+ * followed by checkpoints. A checkpoint is a list of records, each a
+ * type byte, a unit byte and a 16-bit little endian payload length,
+ * closed by a SNAP_END record. The first checkpoint in a file holds
+ * every record; later ones hold only the records whose contents changed
+ * since the previous checkpoint. Loading replays all checkpoints up to
+ * the last complete one.
+ *
+ * Image contents are not part of a snapshot; the track cache is flushed
+ * to the image files instead. The only track data recorded is a DMK
+ * track that is being formatted, since it lives only in the track
+ * buffer until the format completes.
+ */
+#define SNAP_MAGIC    "TRSD"
+#define SNAP_VERSION  1
+#define SNAP_HDR_SIZE 5
+#define SNAP_REC_HDR  4
+#define SNAP_REC_MAX  (32 + FILENAME_MAX)
+#define SNAP_FDC_LEN  37          /* payload of SNAP_FDC */
+
+/* Record types */
+#define SNAP_FDC      1           /* unit 0 = state, 1 = other_state */
+#define SNAP_DRIVE    2
+#define SNAP_TRACK    3
+#define SNAP_END      0xff
+
+/* SNAP_DRIVE flags */
+#define SNAP_PRESENT  0x01
+#define SNAP_WRITEPROT 0x02
+
+/* One slot per record that can appear in a checkpoint */
+#define SNAP_SLOT_FDC(u)   (u)
+#define SNAP_SLOT_DRIVE(u) (2 + (u))
+#define SNAP_SLOT_TRACK(u) (2 + NDRIVES + (u))
+#define SNAP_SLOTS         (2 + 2 * NDRIVES)
+
+static struct {
+  char filename[FILENAME_MAX];    /* file of the last checkpoint, or "" */
+  FSIZE_t size;                   /* end of the last complete checkpoint */
+  uint32_t seq;
+  Uint16 crc[SNAP_SLOTS];         /* CRC of each record last written */
+  Uint8 rec[SNAP_REC_MAX];
+} snap;
+
+static Uint8 *
+snap_put16(Uint8 *p, unsigned v)
 {
-  int i;
+  *p++ = v & 0xff;
+  *p++ = (v >> 8) & 0xff;
+  return p;
+}
 
-  trs_save_int(file, jv3->free_id, 4);
-  trs_save_int(file, &jv3->last_used_id, 1);
-  trs_save_int(file, &jv3->nblocks, 1);
-  trs_save_int(file, &jv3->sorted_valid, 1);
-  for (i = 0; i < JV3_SECSMAX + 1; i++)
-    trs_save_sectorid(file, &jv3->id[i]);
-  trs_save_int(file, jv3->offset, JV3_SECSMAX + 1);
-  trs_save_short(file, jv3->sorted_id, JV3_SECSMAX + 1);
-  for (i = 0; i < MAXTRACKS; i++)
-    trs_save_short(file, jv3->track_start[i], JV3_SIDES);
+static Uint8 *
+snap_put32(Uint8 *p, uint32_t v)
+{
+  p = snap_put16(p, v & 0xffff);
+  return snap_put16(p, v >> 16);
 }
 
-static void trs_load_jv3state(FILE *file, JV3State *jv3)
+static unsigned
+snap_get16(const Uint8 *p)
 {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+snap_get32(const Uint8 *p)
+{
+  return snap_get16(p) | ((uint32_t) snap_get16(p + 2) << 16);
+}
+
+static Uint16
+snap_crc(Uint16 crc, const Uint8 *p, int len)
+{
+  while (len-- > 0) {
+    crc = calc_crc(crc, *p++);
+  }
+  return crc;
+}
+
+/* Build a record in snap.rec; returns its total length */
+static int
+snap_fdc_rec(int unit, FDCState *fdc)
+{
+  Uint8 *p = snap.rec + SNAP_REC_HDR;
+  uint32_t motor = 0;
   int i;
 
-  trs_load_int(file, jv3->free_id, 4);
-  trs_load_int(file, &jv3->last_used_id, 1);
-  trs_load_int(file, &jv3->nblocks, 1);
-  trs_load_int(file, &jv3->sorted_valid, 1);
-  for (i = 0; i < JV3_SECSMAX + 1; i++)
-    trs_load_sectorid(file, &jv3->id[i]);
-  trs_load_int(file, jv3->offset, JV3_SECSMAX + 1);
-  trs_load_short(file, jv3->sorted_id, JV3_SECSMAX + 1);
-  for (i = 0; i < MAXTRACKS; i++)
-    trs_load_short(file, jv3->track_start[i], JV3_SIDES);
-}
-
-static void trs_save_dmkstate(FILE *file, DMKState *dmk)
-{
-  trs_save_int(file, &dmk->ntracks, 1);
-  trs_save_int(file, &dmk->tracklen, 1);
-  trs_save_int(file, &dmk->nsides, 1);
-  trs_save_int(file, &dmk->sden, 1);
-  trs_save_int(file, &dmk->ignden, 1);
-  trs_save_int(file, &dmk->curtrack, 1);
-  trs_save_int(file, &dmk->curside, 1);
-  trs_save_int(file, &dmk->curbyte, 1);
-  trs_save_int(file, &dmk->nextidam, 1);
-  trs_save_uint8(file, dmk->buf, DMK_TRACKLEN_MAX);
-}
-
-static void trs_load_dmkstate(FILE *file, DMKState *dmk)
-{
-  trs_load_int(file, &dmk->ntracks, 1);
-  trs_load_int(file, &dmk->tracklen, 1);
-  trs_load_int(file, &dmk->nsides, 1);
-  trs_load_int(file, &dmk->sden, 1);
-  trs_load_int(file, &dmk->ignden, 1);
-  trs_load_int(file, &dmk->curtrack, 1);
-  trs_load_int(file, &dmk->curside, 1);
-  trs_load_int(file, &dmk->curbyte, 1);
-  trs_load_int(file, &dmk->nextidam, 1);
-  trs_load_uint8(file, dmk->buf, DMK_TRACKLEN_MAX);
-}
-
-static void trs_save_realstate(FILE *file, RealState *real)
-{
-  trs_save_int(file, &real->rps, 1);
-  trs_save_int(file, &real->size_code, 1);
-  trs_save_int(file, &real->empty, 1);
-  trs_save_int(file, (int *)&real->empty_timeout, 1);
-  trs_save_uint32(file, &real->fmt_nbytes, 1);
-  trs_save_int(file, &real->fmt_fill, 1);
-  trs_save_uint8(file, real->buf, MAXSECSIZE);
-}
-
-static void trs_load_realstate(FILE *file, RealState *real)
-{
-  trs_load_int(file, &real->rps, 1);
-  trs_load_int(file, &real->size_code, 1);
-  trs_load_int(file, &real->empty, 1);
-  trs_load_int(file, (int *)&real->empty_timeout, 1);
-  trs_load_uint32(file, &real->fmt_nbytes, 1);
-  trs_load_int(file, &real->fmt_fill, 1);
-  trs_load_uint8(file, real->buf, MAXSECSIZE);
-}
-
-static void trs_save_diskstate(FILE *file, DiskState *d)
-{
-  int file_not_null = (d->file != NULL);
-
-  trs_save_int(file, &d->writeprot, 1);
-  trs_save_int(file, &d->phytrack, 1);
-  trs_save_int(file, &d->emutype, 1);
-  trs_save_int(file, &d->real_step, 1);
-  trs_save_int(file, &file_not_null, 1);
-  trs_save_filename(file, d->filename);
-  if (d->emutype == JV3)
-    trs_save_jv3state(file, &d->u.jv3);
-  else if (d->emutype == REAL)
-    trs_save_realstate(file, &d->u.real);
-  else
-    trs_save_dmkstate(file, &d->u.dmk);
-}
-
-static void trs_load_diskstate(FILE *file, DiskState *d)
-{
-  int file_not_null;
-
-  trs_load_int(file, &d->writeprot, 1);
-  trs_load_int(file, &d->phytrack, 1);
-  trs_load_int(file, &d->emutype, 1);
-  trs_load_int(file, &d->real_step, 1);
-  trs_load_int(file, &file_not_null, 1);
-  if (file_not_null)
-    d->file = (FILE *) 1;
-  else
-    d->file = NULL;
-  trs_load_filename(file, d->filename);
-  if (d->emutype == JV3)
-    trs_load_jv3state(file, &d->u.jv3);
-  else if (d->emutype == REAL)
-    trs_load_realstate(file, &d->u.real);
-  else
-    trs_load_dmkstate(file, &d->u.dmk);
+  if (unit == 0 && state.motor_timeout - z80_state.t_count <= TSTATE_T_MID) {
+    motor = state.motor_timeout - z80_state.t_count;
+  }
+  *p++ = fdc->status;
+  *p++ = fdc->track;
+  *p++ = fdc->sector;
+  *p++ = fdc->data;
+  *p++ = fdc->currcommand;
+  *p++ = fdc->lastdirection;
+  p = snap_put16(p, fdc->bytecount);
+  *p++ = fdc->format;
+  p = snap_put16(p, fdc->format_bytecount);
+  p = snap_put16(p, fdc->format_sec);
+  p = snap_put16(p, fdc->format_gapcnt);
+  for (i = 0; i < 5; i++) {
+    p = snap_put16(p, fdc->format_gap[i]);
+  }
+  p = snap_put16(p, fdc->crc);
+  *p++ = fdc->curdrive;
+  *p++ = fdc->curside;
+  *p++ = fdc->density;
+  *p++ = fdc->controller;
+  p = snap_put16(p, fdc->last_readadr);
+  p = snap_put32(p, motor);
+  return p - snap.rec;
 }
 
-void trs_disk_save(FILE *file)
+static void
+snap_fdc_apply(int unit, FDCState *fdc, const Uint8 *p)
 {
+  uint32_t motor;
   int i;
 
-  trs_save_int(file, &trs_disk_nocontroller, 1);
-  trs_save_int(file, &trs_disk_doubler, 1);
-  trs_save_float(file, &trs_disk_holewidth, 1);
-  trs_save_int(file, &trs_disk_truedam, 1);
-  trs_save_int(file, &trs_disk_debug_flags, 1);
+  fdc->status = *p++;
+  fdc->track = *p++;
+  fdc->sector = *p++;
+  fdc->data = *p++;
+  fdc->currcommand = *p++;
+  fdc->lastdirection = (signed char) *p++;
+  fdc->bytecount = snap_get16(p); p += 2;
+  fdc->format = *p++;
+  fdc->format_bytecount = snap_get16(p); p += 2;
+  fdc->format_sec = (short) snap_get16(p); p += 2;
+  fdc->format_gapcnt = snap_get16(p); p += 2;
+  for (i = 0; i < 5; i++) {
+    fdc->format_gap[i] = snap_get16(p); p += 2;
+  }
+  fdc->crc = snap_get16(p); p += 2;
+  fdc->curdrive = *p++;
+  fdc->curside = *p++;
+  fdc->density = *p++;
+  fdc->controller = *p++;
+  fdc->last_readadr = (short) snap_get16(p); p += 2;
+  motor = snap_get32(p);
+  if (unit == 0) {
+    trs_update_t_count();
+    fdc->motor_timeout = motor ? z80_state.t_count + motor : 0;
+    if (motor) {
+      trs_timer_schedule(&motor_event, trs_disk_motor_timeout, 0, motor);
+    } else {
+      trs_timer_cancel(&motor_event);
+    }
+  }
+}
+
+static int
+snap_drive_rec(int unit)
+{
+  DiskState *d = &disk[unit];
+  Uint8 *p = snap.rec + SNAP_REC_HDR;
+  int n;
+
+  *p++ = (d->file != NULL ? SNAP_PRESENT : 0) |
+    (d->writeprot ? SNAP_WRITEPROT : 0);
+  *p++ = d->phytrack;
+  *p++ = d->emutype;
+  *p++ = d->inches;
+  *p++ = d->real_step;
+  n = strlen(d->filename);
+  memcpy(p, d->filename, n);
+  return p + n - snap.rec;
+}
 
-  trs_fdc_save(file, &state);
-  trs_fdc_save(file, &other_state);
-  for (i = 0; i < NDRIVES; i++) {
-    trs_save_diskstate(file, &disk[i]);
+static void
+snap_drive_apply(int unit, const Uint8 *p, int len)
+{
+  DiskState *d = &disk[unit];
+  char name[FILENAME_MAX];
+  int flags = p[0];
+
+  len -= 5;
+  memcpy(name, p + 5, len);
+  name[len] = '\0';
+  if (!(flags & SNAP_PRESENT)) {
+    trs_disk_remove(unit);
+    return;
+  }
+  if (d->file == NULL || strcmp(d->filename, name) != 0) {
+    trs_disk_insert(unit, name);
+    if (d->file == NULL) return;
+  }
+  d->writeprot |= (flags & SNAP_WRITEPROT) != 0;
+  d->phytrack = p[1];
+  d->inches = p[3];
+  d->real_step = p[4];
+  if (d->emutype == DMK) {
+    d->u.dmk.curtrack = d->u.dmk.curside = -1;
   }
 }
 
-void trs_disk_load(FILE *file)
+/* Is a track being formatted on DMK drive unit? */
+static int
+snap_track_live(int unit)
 {
-  int i;
+  return disk[unit].emutype == DMK && disk[unit].u.dmk.buf != NULL &&
+    state.curdrive == unit && state.format != FMT_DONE &&
+    (state.currcommand & TRSDISK_CMDMASK) == TRSDISK_WRITETRK;
+}
 
-  for (i = 0; i < NDRIVES; i++) {
-    if (disk[i].file != NULL)
-      fclose(disk[i].file);
-  }
-  trs_load_int(file, &trs_disk_nocontroller, 1);
-  trs_load_int(file, &trs_disk_doubler, 1);
-  trs_load_float(file, &trs_disk_holewidth, 1);
-  trs_load_int(file, &trs_disk_truedam, 1);
-  trs_load_int(file, &trs_disk_debug_flags, 1);
-  trs_fdc_load(file, &state);
-  trs_fdc_load(file, &other_state);
-  for (i = 0; i < NDRIVES; i++) {
-    trs_load_diskstate(file, &disk[i]);
-     if (disk[i].file != NULL) {
-      disk[i].file = fopen(disk[i].filename, "rb+");
-      if (disk[i].file == NULL) {
-        disk[i].file = fopen(disk[i].filename, "rb");
-        if (disk[i].file == NULL) {
-          error("failed to load disk%d: %s: %s", i, disk[i].filename,
-              strerror(errno));
-          disk[i].emutype = NONE;
-          disk[i].writeprot = 0;
-          disk[i].filename[0] = 0;
-          continue;
-        }
-        disk[i].writeprot = 1;
-      } else {
-        disk[i].writeprot = 0;
+static int
+snap_track_rec(int unit)
+{
+  DiskState *d = &disk[unit];
+  Uint8 *p = snap.rec + SNAP_REC_HDR;
+
+  *p++ = d->u.dmk.curside;
+  p = snap_put16(p, d->u.dmk.curbyte);
+  p = snap_put16(p, d->u.dmk.nextidam);
+  return p - snap.rec;
+}
+
+static int
+snap_write(FIL *f, FSIZE_t *ofs, const void *buf, int len)
+{
+  UINT n;
+
+  if (f_pwrite(f, buf, len, *ofs, &n) != FR_OK || n != len) return -1;
+  *ofs += len;
+  return 0;
+}
+
+/* Save a checkpoint of the controller and drive state. Unless full is
+   set and if the last checkpoint went to the same file, only what
+   changed since then is appended. Returns 0 on success. */
+int
+trs_disk_snapshot_save(const char *filename, int full)
+{
+  Uint16 crc[SNAP_SLOTS];
+  FSIZE_t ofs;
+  FIL f;
+  int i, len, extra, slot, err = 0;
+
+  if (strcmp(filename, snap.filename) != 0) full = 1;
+  if (f_open(&f, filename, full ? (FA_CREATE_ALWAYS | FA_WRITE)
+	     : (FA_READ | FA_WRITE)) != FR_OK) {
+    return -1;
+  }
+  ofs = 0;
+  if (full) {
+    memcpy(snap.rec, SNAP_MAGIC, 4);
+    snap.rec[4] = SNAP_VERSION;
+    err |= snap_write(&f, &ofs, snap.rec, SNAP_HDR_SIZE);
+    memset(snap.crc, 0, sizeof(snap.crc));
+    snap.seq = 0;
+  } else {
+    ofs = snap.size;
+  }
+  trs_update_t_count();
+  memcpy(crc, snap.crc, sizeof(crc));
+
+  for (slot = 0; slot < SNAP_SLOTS && !err; slot++) {
+    extra = 0;
+    if (slot < SNAP_SLOT_DRIVE(0)) {
+      snap.rec[0] = SNAP_FDC;
+      snap.rec[1] = slot;
+      len = snap_fdc_rec(slot, slot == 0 ? &state : &other_state);
+    } else if (slot < SNAP_SLOT_TRACK(0)) {
+      i = slot - SNAP_SLOT_DRIVE(0);
+      if (disk[i].file != NULL && disk_flush(&disk[i]) == EOF) err = -1;
+      snap.rec[0] = SNAP_DRIVE;
+      snap.rec[1] = i;
+      len = snap_drive_rec(i);
+    } else {
+      i = slot - SNAP_SLOT_TRACK(0);
+      if (!snap_track_live(i)) continue;
+      snap.rec[0] = SNAP_TRACK;
+      snap.rec[1] = i;
+      len = snap_track_rec(i);
+      extra = disk[i].u.dmk.curbyte;
+    }
+    snap_put16(snap.rec + 2, len - SNAP_REC_HDR + extra);
+    crc[slot] = snap_crc(0xffff, snap.rec, len);
+    if (extra > 0) {
+      crc[slot] = snap_crc(crc[slot], disk[i].u.dmk.buf, extra);
+    }
+    if (!full && crc[slot] == snap.crc[slot]) continue;
+    err |= snap_write(&f, &ofs, snap.rec, len);
+    if (extra > 0) err |= snap_write(&f, &ofs, disk[i].u.dmk.buf, extra);
+  }
+
+  snap.rec[0] = SNAP_END;
+  snap.rec[1] = 0;
+  snap_put16(snap.rec + 2, 4);
+  snap_put32(snap.rec + SNAP_REC_HDR, snap.seq + 1);
+  if (!err) err |= snap_write(&f, &ofs, snap.rec, SNAP_REC_HDR + 4);
+  if (f_close(&f) != FR_OK) err = -1;
+  if (err) {
+    /* The file no longer matches snap; start over next time */
+    snap.filename[0] = '\0';
+    return -1;
+  }
+  snprintf(snap.filename, FILENAME_MAX, "%s", filename);
+  snap.size = ofs;
+  snap.seq++;
+  memcpy(snap.crc, crc, sizeof(crc));
+  return 0;
+}
+
+/* Apply the record of a slot stored at file offset ofs, if any */
+static void
+snap_apply(FIL *f, int slot, FSIZE_t ofs)
+{
+  const Uint8 *p = snap.rec + SNAP_REC_HDR;
+  DiskState *d;
+  UINT n;
+  int unit, len;
+
+  if (ofs == 0 || f_pread(f, snap.rec, SNAP_REC_MAX, ofs, &n) != FR_OK ||
+      n < SNAP_REC_HDR) {
+    return;
+  }
+  len = snap_get16(snap.rec + 2);
+  if (slot < SNAP_SLOT_DRIVE(0)) {
+    if (len < SNAP_FDC_LEN) return;
+    snap_fdc_apply(slot, slot == 0 ? &state : &other_state, p);
+  } else if (slot < SNAP_SLOT_TRACK(0)) {
+    if (len < 5 || len - 5 >= FILENAME_MAX) return;
+    snap_drive_apply(slot - SNAP_SLOT_DRIVE(0), p, len);
+  } else {
+    unit = slot - SNAP_SLOT_TRACK(0);
+    d = &disk[unit];
+    if (len < 5 || d->emutype != DMK || dmk_buf_borrow(d) == NULL ||
+	!snap_track_live(unit)) {
+      return;
+    }
+    memset(d->u.dmk.buf, 0, DMK_TRACKLEN_MAX);
+    d->u.dmk.curtrack = d->phytrack;
+    d->u.dmk.curside = p[0];
+    d->u.dmk.curbyte = snap_get16(p + 1);
+    d->u.dmk.nextidam = snap_get16(p + 3);
+    if (d->u.dmk.curbyte > DMK_TRACKLEN_MAX) d->u.dmk.curbyte = 0;
+    f_pread(f, d->u.dmk.buf, d->u.dmk.curbyte, ofs + SNAP_REC_HDR + 5, &n);
+    return;
+  }
+  snap.crc[slot] = snap_crc(0xffff, snap.rec, SNAP_REC_HDR + len);
+}
+
+/* Restore the state saved by trs_disk_snapshot_save(). Images are
+   reinserted if needed. Returns 0 on success. */
+int
+trs_disk_snapshot_load(const char *filename)
+{
+  FSIZE_t pending[SNAP_SLOTS], committed[SNAP_SLOTS];
+  FSIZE_t ofs, end = 0;
+  Uint8 hdr[SNAP_REC_HDR];
+  uint32_t seq = 0;
+  FIL f;
+  UINT n;
+  int i, len;
+
+  if (f_open(&f, filename, FA_READ) != FR_OK) return -1;
+  if (f_pread(&f, snap.rec, SNAP_HDR_SIZE, 0, &n) != FR_OK ||
+      n != SNAP_HDR_SIZE || memcmp(snap.rec, SNAP_MAGIC, 4) != 0 ||
+      snap.rec[4] != SNAP_VERSION) {
+    f_close(&f);
+    return -1;
+  }
+
+  /* Find the last record of each slot in complete checkpoints */
+  for (i = 0; i < SNAP_SLOTS; i++) {
+    pending[i] = committed[i] = 0;
+  }
+  ofs = SNAP_HDR_SIZE;
+  while (f_pread(&f, hdr, SNAP_REC_HDR, ofs, &n) == FR_OK &&
+	 n == SNAP_REC_HDR) {
+    len = snap_get16(hdr + 2);
+    if (hdr[1] >= NDRIVES) break;
+    switch (hdr[0]) {
+    case SNAP_FDC:
+      pending[SNAP_SLOT_FDC(hdr[1] & 1)] = ofs;
+      break;
+    case SNAP_DRIVE:
+      pending[SNAP_SLOT_DRIVE(hdr[1])] = ofs;
+      break;
+    case SNAP_TRACK:
+      pending[SNAP_SLOT_TRACK(hdr[1])] = ofs;
+      break;
+    case SNAP_END:
+      if (f_pread(&f, snap.rec, 4, ofs + SNAP_REC_HDR, &n) != FR_OK ||
+	  n != 4) {
+	break;
       }
+      seq = snap_get32(snap.rec);
+      memcpy(committed, pending, sizeof(committed));
+      end = ofs + SNAP_REC_HDR + len;
+      break;
     }
+    ofs += SNAP_REC_HDR + len;
   }
+  if (end == 0) {
+    f_close(&f);
+    return -1;
+  }
+
+  /* Apply drives first, then the controller, then tracks being
+     formatted (which depend on the controller state). */
+  trs_cancel_event();
+  memset(snap.crc, 0, sizeof(snap.crc));
+  for (i = 0; i < NDRIVES; i++) {
+    snap_apply(&f, SNAP_SLOT_DRIVE(i), committed[SNAP_SLOT_DRIVE(i)]);
+  }
+  for (i = 0; i < 2; i++) {
+    snap_apply(&f, SNAP_SLOT_FDC(i), committed[SNAP_SLOT_FDC(i)]);
+  }
+  for (i = 0; i < NDRIVES; i++) {
+    snap_apply(&f, SNAP_SLOT_TRACK(i), committed[SNAP_SLOT_TRACK(i)]);
+  }
+  f_close(&f);
+
+  /* A command that was in progress now times out */
+  if (state.status & TRSDISK_BUSY) {
+    trs_schedule_event(trs_disk_lostdata, state.currcommand,
+		       500000 * z80_state.clockMHz);
+  }
+  snprintf(snap.filename, FILENAME_MAX, "%s", filename);
+  snap.size = end;
+  snap.seq = seq;
+  return 0;
 }
-#endif
 
 #endif // CONFIG_TRS_IO_MODEL_1
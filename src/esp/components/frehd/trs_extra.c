@@ -336,6 +336,11 @@ UCHAR trs_extra_bootloader(UCHAR step)
 UCHAR trs_extra_opendir(UCHAR step)
 {
 	if (step == 1) {
+		// a previous opendir may not have been read to the end
+		if (state_dir_open) {
+			f_closedir(&state_dir);
+			state_dir_open = 0;
+		}
 		state_error2 = f_opendir(&state_dir, (const TCHAR *)&extra_buffer[0]);
 		if (state_error2 != FR_OK) {
 			state_size2 = 0;
@@ -457,12 +462,14 @@ UCHAR trs_extra_infodrive(UCHAR step)
 	
 
 /*
- * JV1, JV3 and DMK image support (read-only)
+ * JV1, JV3 and DMK image support
  * 1. TRS sends command and waits
  * 2. TRS reads size2 and DATA2 (DATA2 contains subcommand)
  * 3. TRS waits
  * 4. TRS gets error status in ERROR2, and acts accordingly
  * 5. (optional if no error)  TRS gets DATA2
+ * A sector write (IM_WRITESEC) is followed by a second command whose
+ * DATA2 is the 256 byte sector.
  */
 UCHAR trs_extra_image(UCHAR step)
 {
@@ -495,14 +502,11 @@ UCHAR trs_extra_read_header(UCHAR step)
 		if (d->avail == 0) {
 			return (TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR);
 		}
-		state_error2 = f_lseek(&d->file, 0);
-		if (state_error2 == FR_OK) {
-			state_error2 = f_read(&d->file, extra_buffer, 256, &n);
-			if (state_error2 != FR_OK) {
-				return (TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR);
-			}
-			state_size2 = n;
-		}		
+		state_error2 = f_pread(&d->file, extra_buffer, 256, 0, &n);
+		if (state_error2 != FR_OK) {
+			return (TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR);
+		}
+		state_size2 = n;
 	}
 	
 	return DEFAULT_STATUS;
@@ -36,6 +36,9 @@
 
 extern void handle_int2(void);
 
+static void flush_write_behind(void);
+static void cancel_read_ahead(void);
+
 /* update status (using the SPI port) */
 void update_status(UCHAR new_status) {
 	state_status = new_status;
@@ -157,7 +160,7 @@ FRESULT open_drive(UCHAR drive_num, UCHAR options)
 	}	
 
 	/* read the header */
-	res = f_read(&d->file, &sector_buffer[0], 256, &nbytes);
+	res = f_pread(&d->file, &sector_buffer[0], 256, 0, &nbytes);
 	if (res != FR_OK) {
 		goto fail;
 	}
@@ -241,8 +244,11 @@ void close_drive(UCHAR drive_num)
 	
 	// close drive
 	if (state_d[drive_num].avail) {
+		flush_write_behind();
+		cancel_read_ahead();
 		f_close(&state_d[drive_num].file);
 		state_d[drive_num].avail = 0;
+		state_d[drive_num].wb_error = FR_OK;
 		state_d[drive_num].filename[0] = '\0';
 	}
 	update_present();		
@@ -259,56 +265,164 @@ void close_drives(void)
 }
 
 
-static FRESULT find_sector(void)
+static FRESULT find_sector(DWORD *offset)
 {
 	Drive *d;
-	DWORD offset;
-	FRESULT res;
 
 	d = &state_d[state_drive];
 	if (state_head >= d->heads || state_secnum > d->secs) {
 		return FR_INVALID_PARAMETER;
 	}
-	offset = (DWORD)state_cyl * d->heads * d->secs;
-	offset += (DWORD)state_head * d->secs;
-	offset += (DWORD)state_secnum % d->secs;
-	offset *= (DWORD)state_secsize16;
-	offset += (DWORD)sizeof(ReedHardHeader);
-	res = f_lseek(&d->file, offset);
-	if (res != FR_OK) {
-		return res;
-	}
+	*offset = (DWORD)state_cyl * d->heads * d->secs;
+	*offset += (DWORD)state_head * d->secs;
+	*offset += (DWORD)state_secnum % d->secs;
+	*offset *= (DWORD)state_secsize16;
+	*offset += (DWORD)sizeof(ReedHardHeader);
 
 	return (FR_OK);
 }
 
 
-static FRESULT read_sector(void)
+/*
+ * Sector writes are handed to the file system asynchronously (write-behind)
+ * and, while sectors are read in order, the sector following a read is
+ * fetched ahead of time (read-ahead), so that network round trips overlap
+ * with the Z80 transferring data through the data port. With a synchronous
+ * backend both complete immediately, which is why random reads do not read
+ * ahead: it would cost a second read every time. An error of a
+ * write-behind is kept in the drive and reported by its next write.
+ */
+static BYTE wb_buffer[MAX_SECTOR_SIZE];
+static FFUTURE wb_future;
+static UCHAR wb_pending;
+static UCHAR wb_drive;
+static USHORT wb_size;
+
+static BYTE ra_buffer[MAX_SECTOR_SIZE];
+static FFUTURE ra_future;
+static UCHAR ra_pending;
+static UCHAR ra_drive;
+static DWORD ra_offset;
+static USHORT ra_size;
+// Drive and offset following the previous sector read
+static UCHAR last_read_drive = 0xff;
+static DWORD last_read_end;
+
+
+static void flush_write_behind(void)
+{
+	UINT nbytes;
+	FRESULT res;
+
+	if (!wb_pending) return;
+	wb_pending = 0;
+	res = f_wait(&wb_future, &nbytes);
+	if (res == FR_OK && nbytes != wb_size) {
+		res = FR_DISK_ERR;
+	}
+	if (res != FR_OK && state_d[wb_drive].wb_error == FR_OK) {
+		state_d[wb_drive].wb_error = res;
+	}
+}
+
+
+static void cancel_read_ahead(void)
+{
+	UINT nbytes;
+
+	if (!ra_pending) return;
+	ra_pending = 0;
+	f_wait(&ra_future, &nbytes);
+}
+
+
+static FRESULT take_write_behind_error(Drive *d)
+{
+	FRESULT res;
+
+	flush_write_behind();
+	res = d->wb_error;
+	d->wb_error = FR_OK;
+	return res;
+}
+
+
+static void start_read_ahead(DWORD offset)
+{
+	Drive *d;
+
+	d = &state_d[state_drive];
+	if (f_pread_async(&d->file, ra_buffer, state_secsize16, offset, &ra_future) == FR_OK) {
+		ra_pending = 1;
+		ra_drive = state_drive;
+		ra_offset = offset;
+		ra_size = state_secsize16;
+	}
+}
+
+
+static FRESULT read_sector(DWORD offset)
 {
 	Drive *d;
 	UINT nbytes;
 	FRESULT res;
+	UCHAR hit;
+
+	// the sector may still be on its way to the file
+	if (wb_pending && wb_drive == state_drive) {
+		flush_write_behind();
+	}
 
 	d = &state_d[state_drive];
-	res = f_read(&d->file, sector_buffer, state_secsize16, &nbytes);
-	if (res == FR_OK && d->dirty) {
-		// reset sync delay
-		d->dirty = SYNC_DELAY;
-	}	
+	hit = 0;
+	if (ra_pending && ra_drive == state_drive && ra_offset == offset &&
+	    ra_size == state_secsize16) {
+		ra_pending = 0;
+		res = f_wait(&ra_future, &nbytes);
+		if (res == FR_OK && nbytes == ra_size) {
+			memcpy(sector_buffer, ra_buffer, ra_size);
+			hit = 1;
+		}
+	} else {
+		cancel_read_ahead();
+	}
+	if (!hit) {
+		res = f_pread(&d->file, sector_buffer, state_secsize16, offset, &nbytes);
+	}
+	if (res == FR_OK) {
+		if (last_read_drive == state_drive && last_read_end == offset) {
+			start_read_ahead(offset + state_secsize16);
+		}
+		last_read_drive = state_drive;
+		last_read_end = offset + state_secsize16;
+		if (d->dirty) {
+			// reset sync delay
+			d->dirty = SYNC_DELAY;
+		}
+	}
 
 	return res;
 }
 
 
-static FRESULT write_sector(void)
+static FRESULT write_sector(DWORD offset)
 {
 	Drive *d;
-	UINT nbytes;
 	FRESULT res;
 
+	cancel_read_ahead();
 	d = &state_d[state_drive];
-	res = f_write(&d->file, (const void *)sector_buffer, state_secsize16, &nbytes);
+	res = take_write_behind_error(d);
+	if (res != FR_OK) {
+		return res;
+	}
+
+	memcpy(wb_buffer, sector_buffer, state_secsize16);
+	res = f_pwrite_async(&d->file, (const void *)wb_buffer, state_secsize16, offset, &wb_future);
 	if (res == FR_OK) {
+		wb_pending = 1;
+		wb_drive = state_drive;
+		wb_size = state_secsize16;
 		d->dirty = SYNC_DELAY;
 	}
 
@@ -319,6 +433,7 @@ static FRESULT write_sector(void)
 void trs_sync(void)
 {
 	UCHAR i, clean, found;
+	FRESULT res;
 	Drive *d;
 
 	clean = 1;
@@ -331,7 +446,11 @@ void trs_sync(void)
 				d->dirty--;
 				if (d->dirty == 0) {
                                   //INTCONbits.GIEH = 0;
-					f_sync(&d->file);
+					flush_write_behind();
+					res = f_sync(&d->file);
+					if (res != FR_OK && d->wb_error == FR_OK) {
+						d->wb_error = res;
+					}
 #if 0
 					if (GAL_INT == 0) {
 						_asm
@@ -365,10 +484,12 @@ void frehd_init(void)
  */
 void trs_action(void)
 {
+	DWORD offset;
+
   f_log("trs_action: %x", action_type);
 	switch (action_type) {
 	case ACTION_HARD_SEEK:
-		if (find_sector() != FR_OK) {
+		if (find_sector(&offset) != FR_OK) {
 			action_status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
     		state_error = TRS_HARD_NFERR;
 		} else {
@@ -378,10 +499,10 @@ void trs_action(void)
 
 	case ACTION_HARD_READ:
 		action_status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_DRQ;
-		if (find_sector() != FR_OK) {
+		if (find_sector(&offset) != FR_OK) {
 			action_status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
     		state_error = TRS_HARD_NFERR;
-		} else if (read_sector() != FR_OK) {
+		} else if (read_sector(offset) != FR_OK) {
 			action_status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
     		state_error = TRS_HARD_DATAERR;
 		}
@@ -389,10 +510,10 @@ void trs_action(void)
 
 	case ACTION_HARD_WRITE:
 		action_status = TRS_HARD_READY | TRS_HARD_SEEKDONE;
-		if (find_sector() != FR_OK) {
+		if (find_sector(&offset) != FR_OK) {
 			action_status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
     		state_error = TRS_HARD_NFERR;
-		} else if (write_sector() != FR_OK) {
+		} else if (write_sector(offset) != FR_OK) {
 			action_status = TRS_HARD_READY | TRS_HARD_SEEKDONE | TRS_HARD_ERR;
     		state_error = TRS_HARD_DATAERR;
 		}
@@ -1,6 +1,9 @@
 #include <strings.h>
 #include "utils.h"
 #include <strings.h>
+#ifdef ESP_PLATFORM
+#include "resolver.h"
+#endif
 
 bool connect_server(int* fd)
 {
@@ -8,7 +11,6 @@ bool connect_server(int* fd)
   const int port = RETROSTORE_PORT;
   
   struct sockaddr_in serv_addr;
-  struct hostent* server;
 
   
   *fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -16,16 +18,23 @@ bool connect_server(int* fd)
     // Error opening socket
     return false;
   }
-  server = gethostbyname(host);
+  bzero((char*) &serv_addr, sizeof(serv_addr));
+#ifdef ESP_PLATFORM
+  if (!resolve_now(host, &serv_addr.sin_addr)) {
+    // No such host
+    return false;
+  }
+#else
+  struct hostent* server = gethostbyname(host);
   if (server == NULL) {
     // No such host
     return false;
   }
-  bzero((char*) &serv_addr, sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
   bcopy((char*) server->h_addr,
         (char*) &serv_addr.sin_addr.s_addr,
         server->h_length);
+#endif
+  serv_addr.sin_family = AF_INET;
   serv_addr.sin_port = htons(port);
   if (connect(*fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
     // Error connecting
@@ -11,7 +11,7 @@
 #include <sys/types.h>
 
 #define IP_VERSION_MAJOR 1
-#define IP_VERSION_MINOR 0
+#define IP_VERSION_MINOR 3
 
 #define IP_COMMAND_SUCCESS  0
 #define IP_COMMAND_ERROR    1
@@ -50,6 +50,22 @@
 #define IP_COMMAND_RECV       5
 #define IP_COMMAND_RECVFROM   6
 #define IP_COMMAND_CLOSE      7
+// Command numbers from here on are the module's command indices
+#define IP_COMMAND_POLL       9
+#define IP_COMMAND_AVAILABLE  10
+#define IP_COMMAND_PREFETCH   11
+#define IP_COMMAND_DNS_STATS  12
+
+// Outcome of a lookup returned by PREFETCH
+#define IP_HOST_RESOLVED  0
+#define IP_HOST_PENDING   1
+#define IP_HOST_UNKNOWN   2
+
+// Readiness flags returned by POLL for every socket
+#define IP_POLL_READABLE  0x01
+#define IP_POLL_WRITABLE  0x02
+#define IP_POLL_ERROR     0x04
+#define IP_POLL_CLOSED    0x08
 
 #define IP_ERROR_NONE                         0
 #define IP_ERROR_UNKNOWN_COMMAND              100
@@ -57,6 +73,7 @@
 #define IP_ERROR_UNSUPPORTED_COMMAND_OPTION   102
 #define IP_ERROR_BAD_SOCKET_FD                103
 #define IP_ERROR_UNKNOWN_HOST                 104
+#define IP_ERROR_HOST_PENDING                 105
 
 int tcp_z80_out(uint8_t value);
 void tcp_get_send_buffer(uint8_t** buf, int* size);
@@ -1,14 +1,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <unordered_map>
+#include <vector>
 
 #include "trs-io.h"
 #include "tcpip.h"
+#include "resolver.h"
 
 #ifdef ESP_PLATFORM
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "freertos/event_groups.h"
@@ -25,6 +29,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <errno.h>
 
 #endif
@@ -43,15 +49,42 @@ For TCP: (each <item> represents a single byte)
 <TCPIP><SEND><SOCKFD><L4><L3><L2><L1><DATA...>
 <TCPIP><RECV><SOCKFD><L4><L3><L2><L1>
 <TCPIP><CLOSE><SOCKFD>
+<TCPIP><POLL><TIMEOUT2><TIMEOUT1>
+<TCPIP><AVAILABLE>
+<TCPIP><PREFETCH><HOSTNAME>
+<TCPIP><DNS STATS>
 
 ****/
 
 using namespace std;
 
 
+/*
+ * Once a socket is connected, a task drains it into a ring buffer so that
+ * RECV only copies from RAM. The task stops reading a socket whose buffer
+ * holds TCPIP_RX_HIGH_WATER bytes; the data then piles up in lwIP until
+ * the TCP window closes and the peer has to wait.
+ */
+#define TCPIP_RX_BUFFER_SIZE (CONFIG_TRS_IO_TCPIP_RX_BUFFER_KB * 1024)
+#if CONFIG_TRS_IO_TCPIP_RX_HIGH_WATER_KB < CONFIG_TRS_IO_TCPIP_RX_BUFFER_KB
+#define TCPIP_RX_HIGH_WATER (CONFIG_TRS_IO_TCPIP_RX_HIGH_WATER_KB * 1024)
+#else
+#define TCPIP_RX_HIGH_WATER TCPIP_RX_BUFFER_SIZE
+#endif
+// Sockets that were connected or drained meanwhile are picked up after this (ms)
+#define TCPIP_RX_POLL_MS 20
+// Longest wait of a blocking RECV (ms). It then returns what has arrived
+#define TCPIP_RECV_TIMEOUT_MS CONFIG_TRS_IO_TCPIP_RECV_TIMEOUT_MS
+
 typedef struct {
   int fd;
   int family;
+  int type;          // SOCK_STREAM or SOCK_DGRAM
+  uint8_t* rxBuf;    // Ring buffer filled by the receive task
+  uint32_t rxHead;   // Next byte to hand to the Z80
+  uint32_t rxCount;  // Number of bytes in rxBuf
+  bool rxClosed;     // The peer closed the connection
+  int rxErr;         // errno of a failed recv()
 } SocketInfo;
 
 #define TCPIP_MODULE_ID 1
@@ -62,8 +95,159 @@ private:
   uint8_t clientVersionMinor;
   
   uint8_t nextSocketFd = 0;
+  // Entries are added and removed by the command handlers only. The lock
+  // guards the map against the receive task and the ring buffers
   unordered_map<uint8_t, SocketInfo> socketMap;
-  
+  SemaphoreHandle_t lock = NULL;
+  // Given by the receive task whenever the state of a ring buffer changed
+  SemaphoreHandle_t rxEvent = NULL;
+  TaskHandle_t rxTask = NULL;
+
+  void lockMap() {
+    if (lock != NULL) {
+      xSemaphoreTake(lock, portMAX_DELAY);
+    }
+  }
+
+  void unlockMap() {
+    if (lock != NULL) {
+      xSemaphoreGive(lock);
+    }
+  }
+
+  SocketInfo* getSocket(uint8_t fd) {
+    auto it = socketMap.find(fd);
+    if (it == socketMap.end()) {
+      addByte(IP_COMMAND_ERROR);
+      addByte(IP_ERROR_BAD_SOCKET_FD);
+      return NULL;
+    }
+    return &it->second;
+  }
+
+  static void rxTaskMain(void* p) {
+    ((TCPIPModule*) p)->drain();
+  }
+
+  void drain() {
+    while (true) {
+      fd_set readfds;
+      int maxFd = -1;
+
+      FD_ZERO(&readfds);
+      xSemaphoreTake(lock, portMAX_DELAY);
+      for (auto& it : socketMap) {
+        SocketInfo& s = it.second;
+        if (s.rxBuf != NULL && !s.rxClosed && s.rxErr == 0 &&
+            s.rxCount < TCPIP_RX_HIGH_WATER) {
+          FD_SET(s.fd, &readfds);
+          if (s.fd > maxFd) {
+            maxFd = s.fd;
+          }
+        }
+      }
+      xSemaphoreGive(lock);
+
+      if (maxFd < 0) {
+        vTaskDelay(pdMS_TO_TICKS(TCPIP_RX_POLL_MS));
+        continue;
+      }
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = TCPIP_RX_POLL_MS * 1000;
+      if (select(maxFd + 1, &readfds, NULL, NULL, &tv) <= 0) {
+        // A socket may have been closed while waiting for it
+        continue;
+      }
+
+      bool changed = false;
+      xSemaphoreTake(lock, portMAX_DELAY);
+      for (auto& it : socketMap) {
+        SocketInfo& s = it.second;
+        if (s.rxBuf == NULL || !FD_ISSET(s.fd, &readfds) ||
+            s.rxClosed || s.rxErr != 0 || s.rxCount >= TCPIP_RX_HIGH_WATER) {
+          continue;
+        }
+        // Fill the free space up to the end of the ring. The rest follows
+        // on the next round
+        uint32_t tail = (s.rxHead + s.rxCount) % TCPIP_RX_BUFFER_SIZE;
+        uint32_t len = TCPIP_RX_BUFFER_SIZE - s.rxCount;
+        if (len > TCPIP_RX_BUFFER_SIZE - tail) {
+          len = TCPIP_RX_BUFFER_SIZE - tail;
+        }
+        int n = recv(s.fd, s.rxBuf + tail, len, MSG_DONTWAIT);
+        if (n > 0) {
+          s.rxCount += n;
+        } else if (n == 0) {
+          s.rxClosed = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          s.rxErr = errno;
+        } else {
+          continue;
+        }
+        changed = true;
+      }
+      xSemaphoreGive(lock);
+      if (changed) {
+        xSemaphoreGive(rxEvent);
+      }
+    }
+  }
+
+  // Hands a connected TCP socket to the receive task. Datagrams are read
+  // directly so that they keep their boundaries
+  void startReceiving(SocketInfo* s) {
+    if (s->type != SOCK_STREAM || s->rxBuf != NULL) {
+      return;
+    }
+    uint8_t* buf = (uint8_t*) heap_caps_malloc_prefer(TCPIP_RX_BUFFER_SIZE, 2,
+                                                       MALLOC_CAP_SPIRAM,
+                                                       MALLOC_CAP_8BIT);
+    if (buf == NULL) {
+      // RECV falls back to reading the socket directly
+      return;
+    }
+    if (rxTask == NULL) {
+      lock = xSemaphoreCreateMutex();
+      rxEvent = xSemaphoreCreateBinary();
+      xTaskCreatePinnedToCore(rxTaskMain, "tcp-rx", 3000, this, 1, &rxTask, 0);
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    s->rxBuf = buf;
+    s->rxHead = 0;
+    s->rxCount = 0;
+    s->rxClosed = false;
+    s->rxErr = 0;
+    xSemaphoreGive(lock);
+  }
+
+  // Reads from the socket while no receive task is draining it
+  void recvDirect(SocketInfo* s, int option, uint32_t length) {
+    addByte(IP_COMMAND_SUCCESS);
+    uint8_t* buf = startBlob32();
+    int bytesWritten = recv(s->fd, buf, length, option);
+    if (bytesWritten == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      rewind();
+      addByte(IP_COMMAND_ERROR);
+      addByte(errno);
+      return;
+    }
+    if (bytesWritten == -1) {
+      bytesWritten = 0;
+    }
+    skip(bytesWritten);
+    endBlob32();
+  }
+
+  // Waits up to timeout ticks for the receive task to report a change
+  void waitForData(TickType_t timeout) {
+    if (rxEvent != NULL) {
+      xSemaphoreTake(rxEvent, timeout);
+    } else {
+      vTaskDelay(timeout);
+    }
+  }
+
 public:
   TCPIPModule(int id) : TrsIO(id) {
     addCommand(static_cast<cmd_t>(&TCPIPModule::doVersion), "BB");
@@ -75,6 +259,10 @@ public:
     addCommand(static_cast<cmd_t>(&TCPIPModule::doRecv), "BBL");
     addCommand(static_cast<cmd_t>(&TCPIPModule::doRecvFrom), "");
     addCommand(static_cast<cmd_t>(&TCPIPModule::doClose), "B");
+    addCommand(IP_COMMAND_POLL, static_cast<cmd_t>(&TCPIPModule::doPoll), "I");
+    addCommand(IP_COMMAND_AVAILABLE, static_cast<cmd_t>(&TCPIPModule::doAvailable), "");
+    addCommand(IP_COMMAND_PREFETCH, static_cast<cmd_t>(&TCPIPModule::doPrefetchHost), "S");
+    addCommand(IP_COMMAND_DNS_STATS, static_cast<cmd_t>(&TCPIPModule::doResolverStats), "");
   }
 
   void doVersion() {
@@ -113,46 +301,62 @@ public:
       addByte(IP_COMMAND_ERROR);
       addByte(errno);
     } else {
+      // Bounds a blocking RECV that reads the socket directly
+      struct timeval tv;
+      tv.tv_sec = TCPIP_RECV_TIMEOUT_MS / 1000;
+      tv.tv_usec = (TCPIP_RECV_TIMEOUT_MS % 1000) * 1000;
+      setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
       uint8_t fd = nextSocketFd++;
-      socketMap[fd].fd = socketFd;
-      socketMap[fd].family = ipSocketFamily;
+      SocketInfo info = {};
+      info.fd = socketFd;
+      info.family = ipSocketFamily;
+      info.type = ipSocketType;
+      lockMap();
+      socketMap[fd] = info;
+      unlockMap();
       addByte(IP_COMMAND_SUCCESS);
       addByte(fd);
     }
   }
 
   void doConnectHost() {
-    int socketFd = socketMap[B(0)].fd;
-    int ipSocketFamily = socketMap[B(0)].family;
+    SocketInfo* s = getSocket(B(0));
+    if (s == NULL) {
+      return;
+    }
     const char* hostname = S(0);
     short port = I(0);
     
-    struct hostent* server = gethostbyname(hostname);
-  
-    if (server == NULL) {
+    struct sockaddr_in serv_addr;
+    bzero((char*) &serv_addr, sizeof(serv_addr));
+    resolve_result_t res;
+    if (clientVersionMajor > 1 || (clientVersionMajor == 1 && clientVersionMinor >= 3)) {
+      res = resolve(hostname, &serv_addr.sin_addr);
+    } else {
+      // Older clients do not know that they have to ask again
+      res = resolve_now(hostname, &serv_addr.sin_addr) ? RESOLVE_OK : RESOLVE_FAILED;
+    }
+    if (res != RESOLVE_OK) {
       addByte(IP_COMMAND_ERROR);
-      addByte(IP_ERROR_UNKNOWN_HOST);
+      addByte(res == RESOLVE_PENDING ? IP_ERROR_HOST_PENDING : IP_ERROR_UNKNOWN_HOST);
       return;
     }
-    
-    struct sockaddr_in serv_addr;
-    bzero((char*) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = ipSocketFamily;
-    bcopy((char*) server->h_addr,
-          (char*) &serv_addr.sin_addr.s_addr,
-          server->h_length);
+    serv_addr.sin_family = s->family;
     serv_addr.sin_port = htons(port);
-    if (connect(socketFd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+    if (connect(s->fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
       addByte(IP_COMMAND_ERROR);
       addByte(errno);
     } else {
+      startReceiving(s);
       addByte(IP_COMMAND_SUCCESS);
     }
   }
 
   void doConnectIP() {
-    int socketFd = socketMap[B(0)].fd;
-    int ipSocketFamily = socketMap[B(0)].family;
+    SocketInfo* s = getSocket(B(0));
+    if (s == NULL) {
+      return;
+    }
     short port = I(0);
 
     char ipAddress[16];
@@ -160,26 +364,30 @@ public:
     
     struct sockaddr_in tcpServerAddr;
     tcpServerAddr.sin_addr.s_addr = inet_addr(ipAddress);
-    tcpServerAddr.sin_family = ipSocketFamily;
+    tcpServerAddr.sin_family = s->family;
     tcpServerAddr.sin_port = htons(port);
       
-    if (connect(socketFd, (struct sockaddr *) &tcpServerAddr, sizeof(tcpServerAddr)) < 0) {
+    if (connect(s->fd, (struct sockaddr *) &tcpServerAddr, sizeof(tcpServerAddr)) < 0) {
       addByte(IP_COMMAND_ERROR);
       addByte(errno);
     } else {
+      startReceiving(s);
       addByte(IP_COMMAND_SUCCESS);
     }
   }
   
   void doSend() {
-    int socketFd = socketMap[B(0)].fd;
+    SocketInfo* s = getSocket(B(0));
+    if (s == NULL) {
+      return;
+    }
     uint32_t dataLength = XL(0);
     uint8_t* buffer = X(0);
 
     uint32_t left = dataLength;
     
     while(left > 0) {
-      int wrote = write(socketFd, buffer, left);
+      int wrote = write(s->fd, buffer, left);
       if (wrote < 0) {
         addByte(IP_COMMAND_ERROR);
         addByte(errno);
@@ -197,7 +405,10 @@ public:
   }
   
   void doRecv() {
-    int socketFd = socketMap[B(0)].fd;
+    SocketInfo* s = getSocket(B(0));
+    if (s == NULL) {
+      return;
+    }
     int recvOption = B(1);
     uint32_t length = L(0);
   
@@ -215,22 +426,54 @@ public:
       return;
     }
 
-    addByte(IP_COMMAND_SUCCESS);
-    uint8_t* buf = startBlob32();
-    if (length > getSendBufferFreeSize()) {
-      length = getSendBufferFreeSize();
+    // Room behind the status byte and the blob length
+    uint32_t room = getSendBufferFreeSize() - 1 - sizeof(uint32_t);
+    if (length > room) {
+      length = room;
     }
-    int bytesWritten = recv(socketFd, buf, length, option);
-    if (bytesWritten == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-      rewind();
+    if (s->rxBuf == NULL) {
+      recvDirect(s, option, length);
+      return;
+    }
+
+    if (option == MSG_WAITALL) {
+      // Never wait for more than the receive task is willing to buffer
+      uint32_t want = (length < TCPIP_RX_HIGH_WATER) ? length : TCPIP_RX_HIGH_WATER;
+      TickType_t start = xTaskGetTickCount();
+      TickType_t timeout = pdMS_TO_TICKS(TCPIP_RECV_TIMEOUT_MS);
+      while (true) {
+        lockMap();
+        bool done = s->rxCount >= want || s->rxClosed || s->rxErr != 0;
+        unlockMap();
+        TickType_t waited = xTaskGetTickCount() - start;
+        if (done || waited >= timeout) {
+          break;
+        }
+        waitForData(timeout - waited);
+      }
+    }
+
+    lockMap();
+    if (s->rxCount == 0 && s->rxErr != 0) {
+      int err = s->rxErr;
+      unlockMap();
       addByte(IP_COMMAND_ERROR);
-      addByte(errno);
+      addByte(err);
       return;
     }
-    if (bytesWritten == -1) {
-      bytesWritten = 0;
+    uint32_t n = (s->rxCount < length) ? s->rxCount : length;
+    uint32_t first = TCPIP_RX_BUFFER_SIZE - s->rxHead;
+    if (first > n) {
+      first = n;
     }
-    skip(bytesWritten);
+    addByte(IP_COMMAND_SUCCESS);
+    uint8_t* buf = startBlob32();
+    memcpy(buf, s->rxBuf + s->rxHead, first);
+    memcpy(buf + first, s->rxBuf, n - first);
+    s->rxHead = (s->rxHead + n) % TCPIP_RX_BUFFER_SIZE;
+    s->rxCount -= n;
+    unlockMap();
+    skip(n);
     endBlob32();
   }
 
@@ -239,8 +482,16 @@ public:
   }
   
   void doClose() {
-    int socketFd = socketMap[B(0)].fd;
+    SocketInfo* s = getSocket(B(0));
+    if (s == NULL) {
+      return;
+    }
+    int socketFd = s->fd;
+    uint8_t* rxBuf = s->rxBuf;
+    lockMap();
     socketMap.erase(B(0));
+    unlockMap();
+    heap_caps_free(rxBuf);
     int c = close(socketFd);
     if (c == -1) {
       addByte(IP_COMMAND_ERROR);
@@ -249,6 +500,150 @@ public:
     }
     addByte(IP_COMMAND_SUCCESS);
   }
+
+  /*
+   * Waits up to the given number of milliseconds until one of the sockets
+   * is readable or has an error and returns the state of every socket as
+   * <SOCKFD><FLAGS> pairs. Sockets drained by the receive task are
+   * readable while their buffer holds data and count as closed once the
+   * peer closed the connection and the buffer is empty. All others are
+   * checked with select().
+   */
+  void doPoll() {
+    TickType_t timeout = pdMS_TO_TICKS(I(0));
+    TickType_t start = xTaskGetTickCount();
+    vector<uint8_t> ids, flags;
+
+    while (true) {
+      fd_set readfds, writefds, exceptfds;
+      int maxFd = -1;
+
+      FD_ZERO(&readfds);
+      FD_ZERO(&writefds);
+      FD_ZERO(&exceptfds);
+      for (auto& it : socketMap) {
+        int fd = it.second.fd;
+        if (it.second.rxBuf == NULL) {
+          FD_SET(fd, &readfds);
+        }
+        FD_SET(fd, &writefds);
+        FD_SET(fd, &exceptfds);
+        if (fd > maxFd) {
+          maxFd = fd;
+        }
+      }
+      struct timeval tv;
+      tv.tv_sec = 0;
+      tv.tv_usec = 0;
+      if (select(maxFd + 1, &readfds, &writefds, &exceptfds, &tv) < 0) {
+        addByte(IP_COMMAND_ERROR);
+        addByte(errno);
+        return;
+      }
+
+      bool ready = false;
+      ids.clear();
+      flags.clear();
+      lockMap();
+      for (auto& it : socketMap) {
+        SocketInfo& s = it.second;
+        uint8_t f = 0;
+        if (s.rxBuf != NULL) {
+          if (s.rxCount > 0) {
+            f |= IP_POLL_READABLE;
+          } else if (s.rxClosed) {
+            f |= IP_POLL_CLOSED;
+          }
+          if (s.rxErr != 0) {
+            f |= IP_POLL_ERROR;
+          }
+        } else if (FD_ISSET(s.fd, &readfds)) {
+          uint8_t c;
+          int n = recv(s.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+          if (n > 0) {
+            f |= IP_POLL_READABLE;
+          } else if (n == 0) {
+            f |= IP_POLL_CLOSED;
+          } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            f |= IP_POLL_ERROR;
+          }
+        }
+        if (FD_ISSET(s.fd, &exceptfds)) {
+          f |= IP_POLL_ERROR;
+        }
+        if (f != 0) {
+          ready = true;
+        }
+        if (FD_ISSET(s.fd, &writefds)) {
+          f |= IP_POLL_WRITABLE;
+        }
+        ids.push_back(it.first);
+        flags.push_back(f);
+      }
+      unlockMap();
+
+      TickType_t waited = xTaskGetTickCount() - start;
+      if (ready || waited >= timeout) {
+        break;
+      }
+      // Sockets without a receive task are looked at again after a while
+      TickType_t wait = timeout - waited;
+      if (wait > pdMS_TO_TICKS(TCPIP_RX_POLL_MS)) {
+        wait = pdMS_TO_TICKS(TCPIP_RX_POLL_MS);
+      }
+      waitForData(wait);
+    }
+
+    addByte(IP_COMMAND_SUCCESS);
+    addByte(ids.size());
+    for (size_t i = 0; i < ids.size(); i++) {
+      addByte(ids[i]);
+      addByte(flags[i]);
+    }
+  }
+
+  /*
+   * Returns the number of bytes that can be received from every socket
+   * without waiting as <SOCKFD><L1><L2><L3><L4> records.
+   */
+  void doAvailable() {
+    addByte(IP_COMMAND_SUCCESS);
+    lockMap();
+    addByte(socketMap.size());
+    for (auto& it : socketMap) {
+      SocketInfo& s = it.second;
+      int n = 0;
+      if (s.rxBuf != NULL) {
+        n = s.rxCount;
+      } else if (ioctl(s.fd, FIONREAD, &n) < 0) {
+        n = 0;
+      }
+      addByte(it.first);
+      addLong(n);
+    }
+    unlockMap();
+  }
+
+  // Resolves the host name in the background for a later CONNECT and
+  // reports how far the lookup got
+  void doPrefetchHost() {
+    struct in_addr addr;
+    resolve_result_t res = resolve(S(0), &addr);
+    addByte(IP_COMMAND_SUCCESS);
+    addByte(res == RESOLVE_OK ? IP_HOST_RESOLVED :
+            (res == RESOLVE_PENDING ? IP_HOST_PENDING : IP_HOST_UNKNOWN));
+  }
+
+  void doResolverStats() {
+    resolver_stats_t stats;
+    resolver_get_stats(&stats);
+    addByte(IP_COMMAND_SUCCESS);
+    addLong(stats.hits);
+    addLong(stats.negative_hits);
+    addLong(stats.misses);
+    addLong(stats.lookups);
+    addLong(stats.failures);
+  }
 };
 
 TCPIPModule theTCPIPModule(TCPIP_MODULE_ID);
@@ -0,0 +1,232 @@
+
+#include "dircache.h"
+
+#include "freertos/task.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+typedef struct {
+  dir_listing_t* listing;
+  int next;
+} dir_cursor_t;
+
+
+class DirCacheLock {
+private:
+  SemaphoreHandle_t lock;
+public:
+  DirCacheLock(SemaphoreHandle_t lock) : lock(lock) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+  }
+  ~DirCacheLock() {
+    xSemaphoreGive(lock);
+  }
+};
+
+
+DirCache::DirCache()
+{
+  lock = xSemaphoreCreateMutex();
+  memset(slots, 0, sizeof(slots));
+}
+
+DirCache::~DirCache()
+{
+  invalidate();
+  vSemaphoreDelete(lock);
+}
+
+const char* DirCache::normalize(const char* path)
+{
+  if ((strcmp(path, ".") == 0) || (strcmp(path, "/") == 0)) {
+    return "";
+  }
+  return path;
+}
+
+void DirCache::release(dir_listing_t* listing)
+{
+  if (--listing->refs > 0) {
+    return;
+  }
+  free(listing->entries);
+  free(listing->path);
+  free(listing);
+}
+
+static void* new_cursor(dir_listing_t* listing)
+{
+  dir_cursor_t* cursor = (dir_cursor_t*) malloc(sizeof(dir_cursor_t));
+  if (cursor == NULL) {
+    return NULL;
+  }
+  listing->refs++;
+  cursor->listing = listing;
+  cursor->next = 0;
+  return cursor;
+}
+
+void* DirCache::lookup(const char* path)
+{
+  DirCacheLock l(lock);
+  path = normalize(path);
+  TickType_t now = xTaskGetTickCount();
+
+  for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+    dir_listing_t* listing = slots[i];
+    if (listing == NULL || strcmp(listing->path, path) != 0) {
+      continue;
+    }
+    if (now - listing->loaded > pdMS_TO_TICKS(DIR_CACHE_TTL_MS)) {
+      slots[i] = NULL;
+      release(listing);
+      return NULL;
+    }
+    return new_cursor(listing);
+  }
+  return NULL;
+}
+
+dir_listing_t* DirCache::create(const char* path)
+{
+  dir_listing_t* listing = (dir_listing_t*) calloc(1, sizeof(dir_listing_t));
+  if (listing == NULL) {
+    return NULL;
+  }
+  listing->path = strdup(normalize(path));
+  if (listing->path == NULL) {
+    free(listing);
+    return NULL;
+  }
+  // A modification while the listing is being read makes it stale
+  listing->generation = generation;
+  listing->refs = 1;
+  return listing;
+}
+
+bool DirCache::add(dir_listing_t* listing, const char* name, FSIZE_t size,
+                   BYTE attrib, time_t mtime)
+{
+  if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+    return true;
+  }
+  if (strlen(name) > 12) {
+    return true;
+  }
+  if (listing->count == listing->size) {
+    int size = (listing->size == 0) ? 16 : listing->size * 2;
+    FILINFO* entries = (FILINFO*) realloc(listing->entries, size * sizeof(FILINFO));
+    if (entries == NULL) {
+      return false;
+    }
+    listing->entries = entries;
+    listing->size = size;
+  }
+
+  FILINFO* fno = &listing->entries[listing->count++];
+  strcpy(fno->fname, name);
+  fno->fsize = size;
+  fno->fattrib = attrib;
+  set_fattime(fno, mtime);
+  return true;
+}
+
+void DirCache::set_fattime(FILINFO* fno, time_t mtime)
+{
+  struct tm tm;
+
+  fno->fdate = 0;
+  fno->ftime = 0;
+  if (mtime != 0 && localtime_r(&mtime, &tm) != NULL && tm.tm_year >= 80) {
+    fno->fdate = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    fno->ftime = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+  }
+}
+
+void* DirCache::publish(dir_listing_t* listing)
+{
+  DirCacheLock l(lock);
+  void* cursor = new_cursor(listing);
+  listing->loaded = xTaskGetTickCount();
+
+  if (listing->generation != generation) {
+    // Directory changed while it was read. Hand it out but do not keep it
+    release(listing);
+    return cursor;
+  }
+
+  // Replace an older listing of the same path, else the oldest one
+  int victim = 0;
+  for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+    if (slots[i] == NULL) {
+      victim = i;
+      continue;
+    }
+    if (strcmp(slots[i]->path, listing->path) == 0) {
+      victim = i;
+      break;
+    }
+    if (slots[victim] != NULL && (TickType_t) (slots[victim]->loaded - slots[i]->loaded) < 0x80000000u) {
+      victim = i;
+    }
+  }
+  if (slots[victim] != NULL) {
+    release(slots[victim]);
+  }
+  slots[victim] = listing;
+  return cursor;
+}
+
+void DirCache::discard(dir_listing_t* listing)
+{
+  release(listing);
+}
+
+FRESULT DirCache::read(DIR_* dp, FILINFO* fno)
+{
+  dir_cursor_t* cursor = (dir_cursor_t*) dp->dir;
+
+  if (cursor == NULL) {
+    fno->fname[0] = '\0';
+    return FR_OK;
+  }
+  dir_listing_t* listing = cursor->listing;
+  if (cursor->next < listing->count) {
+    *fno = listing->entries[cursor->next++];
+    return FR_OK;
+  }
+
+  // End of directory. Readers need not close directories explicitly
+  close(dp);
+  fno->fname[0] = '\0';
+  return FR_OK;
+}
+
+FRESULT DirCache::close(DIR_* dp)
+{
+  dir_cursor_t* cursor = (dir_cursor_t*) dp->dir;
+
+  if (cursor == NULL) {
+    return FR_OK;
+  }
+  {
+    DirCacheLock l(lock);
+    release(cursor->listing);
+  }
+  free(cursor);
+  dp->dir = NULL;
+  return FR_OK;
+}
+
+void DirCache::invalidate()
+{
+  DirCacheLock l(lock);
+  generation++;
+  for (int i = 0; i < DIR_CACHE_SLOTS; i++) {
+    if (slots[i] != NULL) {
+      release(slots[i]);
+      slots[i] = NULL;
+    }
+  }
+}
@@ -76,6 +76,137 @@ FRESULT f_readdir (
   return err;
 }
 
+FRESULT f_closedir (
+                    DIR_* dp  /* [IN] Directory object */
+                    ) {
+  f_log("f_closedir");
+  CHECK();
+  FRESULT err = trs_fs->f_closedir(dp);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_pread (
+                 FIL* fp,     /* [IN] File object */
+                 void* buff,  /* [OUT] Buffer to store read data */
+                 UINT btr,    /* [IN] Number of bytes to read */
+                 FSIZE_t ofs, /* [IN] File offset to read from */
+                 UINT* br     /* [OUT] Number of bytes read */
+                 ) {
+  f_log("f_pread");
+  CHECK();
+  FRESULT err = trs_fs->f_pread(fp, buff, btr, ofs, br);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_pwrite (
+                  FIL* fp,          /* [IN] File object */
+                  const void* buff, /* [IN] Pointer to the data to be written */
+                  UINT btw,         /* [IN] Number of bytes to write */
+                  FSIZE_t ofs,      /* [IN] File offset to write to */
+                  UINT* bw          /* [OUT] Number of bytes written */
+                  ) {
+  f_log("f_pwrite");
+  CHECK();
+  FRESULT err = trs_fs->f_pwrite(fp, buff, btw, ofs, bw);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_pread_async (
+                       FIL* fp,     /* [IN] File object */
+                       void* buff,  /* [OUT] Buffer to store read data */
+                       UINT btr,    /* [IN] Number of bytes to read */
+                       FSIZE_t ofs, /* [IN] File offset to read from */
+                       FFUTURE* fut /* [OUT] Completion record */
+                       ) {
+  f_log("f_pread_async");
+  CHECK();
+  FRESULT err = trs_fs->f_pread_async(fp, buff, btr, ofs, fut);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_pwrite_async (
+                        FIL* fp,          /* [IN] File object */
+                        const void* buff, /* [IN] Pointer to the data to be written */
+                        UINT btw,         /* [IN] Number of bytes to write */
+                        FSIZE_t ofs,      /* [IN] File offset to write to */
+                        FFUTURE* fut      /* [OUT] Completion record */
+                        ) {
+  f_log("f_pwrite_async");
+  CHECK();
+  FRESULT err = trs_fs->f_pwrite_async(fp, buff, btw, ofs, fut);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_wait (
+                FFUTURE* fut, /* [IN] Completion record */
+                UINT* n       /* [OUT] Number of bytes transferred */
+                ) {
+  f_log("f_wait");
+  CHECK();
+  FRESULT err = trs_fs->f_wait(fut, n);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_read32 (
+                 FIL* fp,     /* [IN] File object */
+                 void* buff,  /* [OUT] Buffer to store read data */
+                 DWORD btr,   /* [IN] Number of bytes to read */
+                 DWORD* br    /* [OUT] Number of bytes read */
+                 ) {
+  f_log("f_read32");
+  CHECK();
+  FRESULT err = trs_fs->f_read32(fp, buff, btr, br);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_write32 (
+                  FIL* fp,          /* [IN] Pointer to the file object structure */
+                  const void* buff, /* [IN] Pointer to the data to be written */
+                  DWORD btw,        /* [IN] Number of bytes to write */
+                  DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                  ) {
+  f_log("f_write32");
+  CHECK();
+  FRESULT err = trs_fs->f_write32(fp, buff, btw, bw);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_pread32 (
+                   FIL* fp,     /* [IN] File object */
+                   void* buff,  /* [OUT] Buffer to store read data */
+                   DWORD btr,   /* [IN] Number of bytes to read */
+                   FSIZE_t ofs, /* [IN] File offset to read from */
+                   DWORD* br    /* [OUT] Number of bytes read */
+                   ) {
+  f_log("f_pread32");
+  CHECK();
+  FRESULT err = trs_fs->f_pread32(fp, buff, btr, ofs, br);
+  f_log("err: %d", err);
+  return err;
+}
+
+FRESULT f_pwrite32 (
+                    FIL* fp,          /* [IN] File object */
+                    const void* buff, /* [IN] Pointer to the data to be written */
+                    DWORD btw,        /* [IN] Number of bytes to write */
+                    FSIZE_t ofs,      /* [IN] File offset to write to */
+                    DWORD* bw         /* [OUT] Number of bytes written */
+                    ) {
+  f_log("f_pwrite32");
+  CHECK();
+  FRESULT err = trs_fs->f_pwrite32(fp, buff, btw, ofs, bw);
+  f_log("err: %d", err);
+  return err;
+}
+
 FSIZE_t f_tell (
                 FIL* fp   /* [IN] File object */
                 ) {
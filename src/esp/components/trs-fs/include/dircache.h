@@ -0,0 +1,63 @@
+#ifndef TRS_FS_DIRCACHE_H
+#define TRS_FS_DIRCACHE_H
+
+#include "fileio.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include <time.h>
+
+// Number of directory listings kept in RAM
+#define DIR_CACHE_SLOTS 4
+// Listings older than this (ms) are reloaded from the backend
+#define DIR_CACHE_TTL_MS 10000
+
+/*
+ * A complete directory listing. Listings are reference counted: the cache
+ * holds one reference and every open DIR_ holds another, so that a listing
+ * that is invalidated while somebody is still reading it stays valid until
+ * the reader is done.
+ */
+typedef struct {
+  char* path;
+  uint32_t generation;
+  TickType_t loaded;
+  int refs;
+  int count;
+  int size;
+  FILINFO* entries;
+} dir_listing_t;
+
+class DirCache {
+private:
+  SemaphoreHandle_t lock;
+  dir_listing_t* slots[DIR_CACHE_SLOTS];
+  volatile uint32_t generation = 0;
+
+  static const char* normalize(const char* path);
+  void release(dir_listing_t* listing);
+public:
+  DirCache();
+  ~DirCache();
+
+  // Returns an open cursor on a valid cached listing of path or NULL
+  void* lookup(const char* path);
+  // Starts a new listing that the backend fills in with add()
+  dir_listing_t* create(const char* path);
+  bool add(dir_listing_t* listing, const char* name, FSIZE_t size,
+           BYTE attrib, time_t mtime);
+  // Enters a completed listing into the cache and returns a cursor on it
+  void* publish(dir_listing_t* listing);
+  // Discards a listing whose backend read failed
+  void discard(dir_listing_t* listing);
+  FRESULT read(DIR_* dp, FILINFO* fno);
+  // Releases the cursor of a directory that was not read to its end
+  FRESULT close(DIR_* dp);
+  // Drops all cached listings. Called whenever the backend is modified
+  void invalidate();
+  // Sets the FAT date and time fields of fno from a POSIX timestamp
+  static void set_fattime(FILINFO* fno, time_t mtime);
+};
+
+#endif
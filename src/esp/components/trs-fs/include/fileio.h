@@ -26,6 +26,16 @@ typedef int16_t WORD;
 #define f_write _f_write
 #define f_read _f_read
 #define f_readdir _f_readdir
+#define f_closedir _f_closedir
+#define f_pread _f_pread
+#define f_pwrite _f_pwrite
+#define f_read32 _f_read32
+#define f_write32 _f_write32
+#define f_pread32 _f_pread32
+#define f_pwrite32 _f_pwrite32
+#define f_pread_async _f_pread_async
+#define f_pwrite_async _f_pwrite_async
+#define f_wait _f_wait
 #define f_tell _f_tell
 #define f_sync _f_sync
 #define f_lseek _f_lseek
@@ -66,6 +76,9 @@ typedef enum {
 #define	FA_OPEN_ALWAYS		0x10
 #define	FA_OPEN_APPEND		0x30
 
+#define	AM_RDO	0x01	/* Read only */
+#define	AM_DIR	0x10	/* Directory */
+
 
 #define FF_MAX_SS 256
 
@@ -88,6 +101,17 @@ typedef struct {
     void*  dir;        /* Object identifier */
 } DIR_;
 
+/*
+ * Completion record for f_pread_async()/f_pwrite_async(). Owned by the
+ * caller and must stay valid (together with the data buffer) until
+ * f_wait() has returned.
+ */
+typedef struct {
+    volatile BYTE done; /* Set once the request has completed */
+    FRESULT res;        /* Result of the request */
+    UINT    n;          /* Number of bytes transferred */
+} FFUTURE;
+
 void f_log(const char* format, ...);
 
 FRESULT f_open (
@@ -120,6 +144,81 @@ FRESULT f_readdir (
         FILINFO* fno  /* [OUT] File information structure */
 );
 
+FRESULT f_closedir (
+        DIR_* dp  /* [IN] Directory object */
+);
+
+FRESULT f_pread (
+        FIL* fp,     /* [IN] File object */
+        void* buff,  /* [OUT] Buffer to store read data */
+        UINT btr,    /* [IN] Number of bytes to read */
+        FSIZE_t ofs, /* [IN] File offset to read from */
+        UINT* br     /* [OUT] Number of bytes read */
+);
+
+FRESULT f_pwrite (
+        FIL* fp,          /* [IN] File object */
+        const void* buff, /* [IN] Pointer to the data to be written */
+        UINT btw,         /* [IN] Number of bytes to write */
+        FSIZE_t ofs,      /* [IN] File offset to write to */
+        UINT* bw          /* [OUT] Number of bytes written */
+);
+
+FRESULT f_pread_async (
+        FIL* fp,     /* [IN] File object */
+        void* buff,  /* [OUT] Buffer to store read data */
+        UINT btr,    /* [IN] Number of bytes to read */
+        FSIZE_t ofs, /* [IN] File offset to read from */
+        FFUTURE* fut /* [OUT] Completion record */
+);
+
+FRESULT f_pwrite_async (
+        FIL* fp,          /* [IN] File object */
+        const void* buff, /* [IN] Pointer to the data to be written */
+        UINT btw,         /* [IN] Number of bytes to write */
+        FSIZE_t ofs,      /* [IN] File offset to write to */
+        FFUTURE* fut      /* [OUT] Completion record */
+);
+
+FRESULT f_wait (
+        FFUTURE* fut, /* [IN] Completion record */
+        UINT* n       /* [OUT] Number of bytes transferred */
+);
+
+/*
+ * Variants of f_read()/f_write()/f_pread()/f_pwrite() with 32-bit transfer
+ * sizes. UINT only covers 64 KB.
+ */
+FRESULT f_read32 (
+        FIL* fp,     /* [IN] File object */
+        void* buff,  /* [OUT] Buffer to store read data */
+        DWORD btr,   /* [IN] Number of bytes to read */
+        DWORD* br    /* [OUT] Number of bytes read */
+);
+
+FRESULT f_write32 (
+        FIL* fp,          /* [IN] Pointer to the file object structure */
+        const void* buff, /* [IN] Pointer to the data to be written */
+        DWORD btw,        /* [IN] Number of bytes to write */
+        DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+);
+
+FRESULT f_pread32 (
+        FIL* fp,     /* [IN] File object */
+        void* buff,  /* [OUT] Buffer to store read data */
+        DWORD btr,   /* [IN] Number of bytes to read */
+        FSIZE_t ofs, /* [IN] File offset to read from */
+        DWORD* br    /* [OUT] Number of bytes read */
+);
+
+FRESULT f_pwrite32 (
+        FIL* fp,          /* [IN] File object */
+        const void* buff, /* [IN] Pointer to the data to be written */
+        DWORD btw,        /* [IN] Number of bytes to write */
+        FSIZE_t ofs,      /* [IN] File offset to write to */
+        DWORD* bw         /* [OUT] Number of bytes written */
+);
+
 FSIZE_t f_tell (
         FIL* fp   /* [IN] File object */
 );
@@ -1,16 +1,70 @@
 #ifndef TRS_FS_POSIX_H
 #define TRS_FS_POSIX_H
 
+#ifdef ESP_PLATFORM
 #include "driver/sdmmc_types.h"
+#endif
 #include "trs-fs.h"
+#include "dircache.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Allocation unit of the SD card. Also the size of the per-file buffer
+#define POSIX_CLUSTER_SIZE (16 * 1024)
+// Longest absolute path including the mount point
+#define POSIX_MAX_PATH 280
 
+typedef struct posix_file {
+  struct posix_file* next_open; // List of open files
+  SemaphoreHandle_t lock;       // Protects the buffer and the positions
+  char* path;      // Absolute path, to find the open files in f_stat()
+  int fd;
+  FSIZE_t pos;     // Current file position
+  FSIZE_t next;    // Position following the previous read
+  UINT streak;     // Number of reads in a row that started at next
+  FSIZE_t buf_pos; // File position of buf[0]
+  UINT buf_len;    // Number of valid bytes in buf
+  bool dirty;      // buf holds data that has not been written yet
+  uint8_t* buf;
+  volatile FSIZE_t end; // End of the data written through this file
+  FRESULT err;     // Failure to write buf, retried by the next call
+} posix_file_t;
+
+/*
+ * Files are accessed through their descriptors with pread() and pwrite().
+ * Each file has a buffer of one cluster. Once two reads in a row continued
+ * where the previous one ended, the next one loads the cluster around it.
+ * Small writes collect in the buffer until they leave the cluster.
+ * Transfers of a cluster or more bypass the buffer. A buffer that could
+ * not be written is kept and written again by the next call on the file,
+ * which reports the error if that fails as well. f_stat() reports the size
+ * including what open files have written but not yet flushed or synced.
+ */
 class TRS_FS_POSIX : virtual public TRS_FS {
 private:
   const char* mount = "/sdcard";
+  size_t mount_len;
+#ifdef ESP_PLATFORM
   sdmmc_card_t* card;
+#endif
+  DirCache dir_cache;
+  // Protects the list of open files. Each file has its own lock, which is
+  // held while its descriptor is accessed
+  SemaphoreHandle_t lock;
+  posix_file_t* files = NULL;
 
+  bool abs_path(char* buf, const char* path);
+  FRESULT flush(posix_file_t* f);
+  FRESULT retry_flush(posix_file_t* f);
+  FRESULT read_at(posix_file_t* f, uint8_t* buff, DWORD btr, FSIZE_t ofs, DWORD* br);
+  FRESULT write_at(posix_file_t* f, const uint8_t* buff, DWORD btw, FSIZE_t ofs, DWORD* bw);
 public:
+#ifdef ESP_PLATFORM
   TRS_FS_POSIX();
+#endif
+  // Uses a directory that is already mounted, e.g. for host builds
+  TRS_FS_POSIX(const char* mount);
   virtual ~TRS_FS_POSIX();
   FS_TYPE type();
   bool has_sd_card_reader();
@@ -40,6 +94,49 @@ public:
                      DIR_* dp,      /* [IN] Directory object */
                      FILINFO* fno  /* [OUT] File information structure */
                      );
+  FRESULT f_closedir (
+                      DIR_* dp  /* [IN] Directory object */
+                      );
+  FRESULT f_pread (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  FSIZE_t ofs, /* [IN] File offset to read from */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_pwrite (
+                   FIL* fp,          /* [IN] File object */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   FSIZE_t ofs,      /* [IN] File offset to write to */
+                   UINT* bw          /* [OUT] Number of bytes written */
+                   );
+  FRESULT f_read32 (
+                    FIL* fp,     /* [IN] File object */
+                    void* buff,  /* [OUT] Buffer to store read data */
+                    DWORD btr,   /* [IN] Number of bytes to read */
+                    DWORD* br    /* [OUT] Number of bytes read */
+                    );
+  FRESULT f_write32 (
+                     FIL* fp,          /* [IN] Pointer to the file object structure */
+                     const void* buff, /* [IN] Pointer to the data to be written */
+                     DWORD btw,        /* [IN] Number of bytes to write */
+                     DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                     );
+  FRESULT f_pread32 (
+                     FIL* fp,     /* [IN] File object */
+                     void* buff,  /* [OUT] Buffer to store read data */
+                     DWORD btr,   /* [IN] Number of bytes to read */
+                     FSIZE_t ofs, /* [IN] File offset to read from */
+                     DWORD* br    /* [OUT] Number of bytes read */
+                     );
+  FRESULT f_pwrite32 (
+                      FIL* fp,          /* [IN] File object */
+                      const void* buff, /* [IN] Pointer to the data to be written */
+                      DWORD btw,        /* [IN] Number of bytes to write */
+                      FSIZE_t ofs,      /* [IN] File offset to write to */
+                      DWORD* bw         /* [OUT] Number of bytes written */
+                      );
   FSIZE_t f_tell (
                   FIL* fp   /* [IN] File object */
                   );
@@ -0,0 +1,144 @@
+#ifndef TRS_FS_READAHEAD_H
+#define TRS_FS_READAHEAD_H
+
+#include "trs-fs.h"
+
+// Size of the per-file read-ahead buffer
+#define TRS_FS_READAHEAD_SIZE (32 * 1024)
+
+typedef struct {
+  FIL fil;         // File of the wrapped backend
+  FSIZE_t pos;     // Current file position
+  FSIZE_t next;    // Position following the previous f_read()
+  FSIZE_t buf_pos; // File position of buf[0]
+  UINT buf_len;    // Number of valid bytes in buf
+  uint8_t* buf;
+} ra_file_t;
+
+/*
+ * Wraps another TRS_FS and turns sequences of small sequential f_read()
+ * calls into a few large reads from the backend. A read that continues
+ * where the previous one ended fills a buffer of TRS_FS_READAHEAD_SIZE
+ * bytes; all other accesses go straight to the backend. Writes through
+ * the same file object keep the buffer up to date, writes through another
+ * file object of the same file are seen once the buffer is refilled.
+ */
+class TRS_FS_READAHEAD : virtual public TRS_FS {
+private:
+  TRS_FS* fs;
+
+  void patch(ra_file_t* f, FSIZE_t ofs, const void* buff, DWORD len);
+public:
+  TRS_FS_READAHEAD(TRS_FS* fs);
+  FS_TYPE type();
+  void f_log(const char* msg);
+  FRESULT f_open (
+                  FIL* fp,           /* [OUT] Pointer to the file object structure */
+                  const TCHAR* path, /* [IN] File name */
+                  BYTE mode          /* [IN] Mode flags */
+                  );
+  FRESULT f_opendir (
+                     DIR_* dp,           /* [OUT] Pointer to the directory object structure */
+                     const TCHAR* path  /* [IN] Directory name */
+                     );
+  FRESULT f_write (
+                   FIL* fp,          /* [IN] Pointer to the file object structure */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
+                   );
+  FRESULT f_read (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_readdir (
+                     DIR_* dp,      /* [IN] Directory object */
+                     FILINFO* fno  /* [OUT] File information structure */
+                     );
+  FRESULT f_closedir (
+                      DIR_* dp  /* [IN] Directory object */
+                      );
+  FRESULT f_pread (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  FSIZE_t ofs, /* [IN] File offset to read from */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_pwrite (
+                   FIL* fp,          /* [IN] File object */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   FSIZE_t ofs,      /* [IN] File offset to write to */
+                   UINT* bw          /* [OUT] Number of bytes written */
+                   );
+  FRESULT f_read32 (
+                    FIL* fp,     /* [IN] File object */
+                    void* buff,  /* [OUT] Buffer to store read data */
+                    DWORD btr,   /* [IN] Number of bytes to read */
+                    DWORD* br    /* [OUT] Number of bytes read */
+                    );
+  FRESULT f_write32 (
+                     FIL* fp,          /* [IN] Pointer to the file object structure */
+                     const void* buff, /* [IN] Pointer to the data to be written */
+                     DWORD btw,        /* [IN] Number of bytes to write */
+                     DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                     );
+  FRESULT f_pread32 (
+                     FIL* fp,     /* [IN] File object */
+                     void* buff,  /* [OUT] Buffer to store read data */
+                     DWORD btr,   /* [IN] Number of bytes to read */
+                     FSIZE_t ofs, /* [IN] File offset to read from */
+                     DWORD* br    /* [OUT] Number of bytes read */
+                     );
+  FRESULT f_pwrite32 (
+                      FIL* fp,          /* [IN] File object */
+                      const void* buff, /* [IN] Pointer to the data to be written */
+                      DWORD btw,        /* [IN] Number of bytes to write */
+                      FSIZE_t ofs,      /* [IN] File offset to write to */
+                      DWORD* bw         /* [OUT] Number of bytes written */
+                      );
+  FRESULT f_pread_async (
+                        FIL* fp,     /* [IN] File object */
+                        void* buff,  /* [OUT] Buffer to store read data */
+                        UINT btr,    /* [IN] Number of bytes to read */
+                        FSIZE_t ofs, /* [IN] File offset to read from */
+                        FFUTURE* fut /* [OUT] Completion record */
+                        );
+  FRESULT f_pwrite_async (
+                         FIL* fp,          /* [IN] File object */
+                         const void* buff, /* [IN] Pointer to the data to be written */
+                         UINT btw,         /* [IN] Number of bytes to write */
+                         FSIZE_t ofs,      /* [IN] File offset to write to */
+                         FFUTURE* fut      /* [OUT] Completion record */
+                         );
+  FRESULT f_wait (
+                 FFUTURE* fut, /* [IN] Completion record */
+                 UINT* n       /* [OUT] Number of bytes transferred */
+                 );
+  FSIZE_t f_tell (
+                  FIL* fp   /* [IN] File object */
+                  );
+  FRESULT f_sync (
+                  FIL* fp     /* [IN] File object */
+                  );
+  FRESULT f_lseek (
+                   FIL*    fp,  /* [IN] File object */
+                   FSIZE_t ofs  /* [IN] File read/write pointer */
+                   );
+  FRESULT f_close (
+                   FIL* fp     /* [IN] Pointer to the file object */
+                   );
+  FRESULT f_unlink (
+                    const TCHAR* path  /* [IN] Object name */
+                    );
+  FRESULT f_stat (
+                  const TCHAR* path,  /* [IN] Object name */
+                  FILINFO* fno        /* [OUT] FILINFO structure */
+                  );
+
+};
+
+#endif
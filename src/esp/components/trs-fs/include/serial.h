@@ -3,9 +3,115 @@
 
 #include "trs-fs.h"
 
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#endif
+
+/*
+ * Frames exchanged with the server (org.trsio.fs in modules/trs-io-fs):
+ *
+ *   SYNC0 SYNC1 seq cmd len(2) payload[len] crc(2)
+ *
+ * All numbers are little endian. The CRC16 (CCITT, initial value 0xffff)
+ * covers seq, cmd, len and the payload. A reply carries the sequence
+ * number of its request and cmd | SERIAL_REPLY; its payload starts with
+ * the FRESULT. Up to SERIAL_WINDOW requests may be outstanding. The server
+ * handles them strictly in sequence order and answers repeated requests
+ * from a history of replies, so the client recovers from a lost or
+ * corrupted frame by sending everything outstanding again.
+ */
+#define SERIAL_SYNC0 0xa5
+#define SERIAL_SYNC1 0x5a
+#define SERIAL_REPLY 0x80
+#define SERIAL_VERSION 2
+#define SERIAL_HEADER_SIZE 6
+// Largest amount of file data in one frame
+#define SERIAL_BLOCK_SIZE 4096
+#define SERIAL_MAX_PAYLOAD (SERIAL_BLOCK_SIZE + 16)
+#define SERIAL_MAX_FRAME (SERIAL_HEADER_SIZE + SERIAL_MAX_PAYLOAD + 2)
+#define SERIAL_MAX_PATH 256
+// Maximum number of requests in flight
+#define SERIAL_WINDOW 4
+// Everything outstanding is sent again if no reply arrives within this (ms)
+#define SERIAL_TIMEOUT_MS 1000
+#define SERIAL_RETRIES 3
+#define SERIAL_DEFAULT_BAUD 115200
+#define SERIAL_MAX_BAUD 921600
+// The server returns to SERIAL_DEFAULT_BAUD if no valid frame arrives within
+// this after switching (ms). Shorter than the client takes to give up
+#define SERIAL_BAUD_TIMEOUT_MS 2000
+
+// Byte stream to the server, e.g. the UART or a pseudo-terminal
+class SerialPort {
+public:
+  virtual ~SerialPort() {}
+  // Returns the number of bytes received before timeout_ms expired
+  virtual int read(void* buf, int len, int timeout_ms) = 0;
+  virtual void write(const void* buf, int len) = 0;
+  // Waits until everything written has been sent
+  virtual void drain() = 0;
+  virtual bool set_baud(int baud) = 0;
+};
+
+typedef struct {
+  bool in_use;
+  uint32_t age;     // Order in which outstanding requests were sent
+  uint8_t* frame;   // Request as sent, kept for retransmission
+  int frame_len;
+  FFUTURE* fut;
+  void* data;       // Receives the reply payload after the FRESULT
+  UINT data_len;
+} serial_req_t;
+
+typedef struct {
+  uint16_t id;
+  FSIZE_t pos;
+  bool append;
+} serial_file_t;
+
 class TRS_FS_SERIAL : virtual public TRS_FS {
+private:
+  SerialPort* port;
+  int window = SERIAL_WINDOW;
+  UINT block = SERIAL_BLOCK_SIZE;
+  uint8_t next_seq = 0;
+  uint32_t next_age = 0;
+  int outstanding = 0;
+  int retries = 0;
+  int max_baud;
+  uint32_t baud = SERIAL_DEFAULT_BAUD; // Current rate of the link
+  bool resync = false;                 // Requests were given up on
+  serial_req_t reqs[SERIAL_WINDOW];
+  uint8_t* rx = NULL;
+#ifdef ESP_PLATFORM
+  SemaphoreHandle_t lock;
+#endif
+
+  serial_req_t* begin(uint8_t cmd);
+  FRESULT send(serial_req_t* req, FFUTURE* fut, void* data, UINT data_len);
+  FRESULT call(serial_req_t* req, void* data, UINT data_len, UINT* n);
+  bool receive(int timeout_ms);
+  void dispatch(uint8_t seq, uint8_t cmd, uint8_t* payload, int len);
+  void pump();
+  void retransmit();
+  void fail_all(FRESULT res);
+  FRESULT wait(FFUTURE* fut);
+  void init(SerialPort* port, int max_baud);
+  FRESULT transfer(FIL* fp, uint8_t* buff, DWORD len, FSIZE_t ofs,
+                   DWORD* done, bool write);
+  FRESULT hello(uint32_t baud, uint32_t* agreed);
+  const char* connect();
+  void reconnect();
 public:
+#ifdef ESP_PLATFORM
   TRS_FS_SERIAL();
+#endif
+  TRS_FS_SERIAL(SerialPort* port, int max_baud);
+  virtual ~TRS_FS_SERIAL();
+  // Limits the number of requests in flight (1 .. SERIAL_WINDOW)
+  void set_window(int n);
+  FS_TYPE type();
   void f_log(const char* msg);
   FRESULT f_open (
                   FIL* fp,           /* [OUT] Pointer to the file object structure */
@@ -32,6 +138,64 @@ public:
                      DIR_* dp,      /* [IN] Directory object */
                      FILINFO* fno  /* [OUT] File information structure */
                      );
+  FRESULT f_pread (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  FSIZE_t ofs, /* [IN] File offset to read from */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_pwrite (
+                   FIL* fp,          /* [IN] File object */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   FSIZE_t ofs,      /* [IN] File offset to write to */
+                   UINT* bw          /* [OUT] Number of bytes written */
+                   );
+  FRESULT f_read32 (
+                    FIL* fp,     /* [IN] File object */
+                    void* buff,  /* [OUT] Buffer to store read data */
+                    DWORD btr,   /* [IN] Number of bytes to read */
+                    DWORD* br    /* [OUT] Number of bytes read */
+                    );
+  FRESULT f_write32 (
+                     FIL* fp,          /* [IN] Pointer to the file object structure */
+                     const void* buff, /* [IN] Pointer to the data to be written */
+                     DWORD btw,        /* [IN] Number of bytes to write */
+                     DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                     );
+  FRESULT f_pread32 (
+                     FIL* fp,     /* [IN] File object */
+                     void* buff,  /* [OUT] Buffer to store read data */
+                     DWORD btr,   /* [IN] Number of bytes to read */
+                     FSIZE_t ofs, /* [IN] File offset to read from */
+                     DWORD* br    /* [OUT] Number of bytes read */
+                     );
+  FRESULT f_pwrite32 (
+                      FIL* fp,          /* [IN] File object */
+                      const void* buff, /* [IN] Pointer to the data to be written */
+                      DWORD btw,        /* [IN] Number of bytes to write */
+                      FSIZE_t ofs,      /* [IN] File offset to write to */
+                      DWORD* bw         /* [OUT] Number of bytes written */
+                      );
+  FRESULT f_pread_async (
+                        FIL* fp,     /* [IN] File object */
+                        void* buff,  /* [OUT] Buffer to store read data */
+                        UINT btr,    /* [IN] Number of bytes to read */
+                        FSIZE_t ofs, /* [IN] File offset to read from */
+                        FFUTURE* fut /* [OUT] Completion record */
+                        );
+  FRESULT f_pwrite_async (
+                         FIL* fp,          /* [IN] File object */
+                         const void* buff, /* [IN] Pointer to the data to be written */
+                         UINT btw,         /* [IN] Number of bytes to write */
+                         FSIZE_t ofs,      /* [IN] File offset to write to */
+                         FFUTURE* fut      /* [OUT] Completion record */
+                         );
+  FRESULT f_wait (
+                 FFUTURE* fut, /* [IN] Completion record */
+                 UINT* n       /* [OUT] Number of bytes transferred */
+                 );
   FSIZE_t f_tell (
                   FIL* fp   /* [IN] File object */
                   );
@@ -1,21 +1,139 @@
 #ifndef TRS_FS_SMB_H
 #define TRS_FS_SMB_H
 
+#include <atomic>
+
 #include "smb2.h"
 
 #include "trs-fs.h"
+#include "dircache.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 
 #define SMB_KEY_URL "smb_url"
 #define SMB_KEY_USER "smb_user"
 #define SMB_KEY_PASSWD "smb_passwd"
 
+// Maximum number of asynchronous requests in flight on the SMB connection
+#define SMB_MAX_IN_FLIGHT 8
+// Large transfers are split into requests of this size that are in flight
+// at the same time
+#define SMB_CHUNK_SIZE (32 * 1024)
+// Poll interval (ms) while waiting for asynchronous replies
+#define SMB_POLL_MS 10
+// Number of f_stat() results remembered
+#define SMB_STAT_CACHE_SIZE 16
+// Remembered f_stat() results expire after this (ms)
+#define SMB_STAT_CACHE_TTL_MS 5000
+// Number of closed handles kept open for reuse by the next f_open()
+#define SMB_HANDLE_POOL_SIZE 4
+// Parked handles are really closed after this (ms)
+#define SMB_HANDLE_POOL_TTL_MS 2000
+// Maximum length of a path on the share
+#define SMB_MAX_PATH 256
+// Number of connections to the share. Every task that uses the share gets
+// a connection of its own until they are all taken
+#define SMB_MAX_SESSIONS 3
+// Sessions other than the first are given back after this long without
+// use (ms), e.g. because their task was deleted. Also the time before
+// another session is connected after connecting one failed
+#define SMB_SESSION_IDLE_MS 30000
+
+struct smb_session;
+
+typedef struct {
+  struct smb_session* session;
+  FFUTURE* fut;
+  bool in_use;
+  // Bumped when a write completes, NULL for reads
+  std::atomic<uint32_t>* generation;
+} smb_async_req_t;
+
+typedef struct {
+  struct smb2fh* fh;
+  char* path;
+  int flags;
+  TickType_t closed;
+  // Handles only work on the connection they were opened on
+  struct smb_session* session;
+} smb_file_t;
+
+/*
+ * One connection to the share. libsmb2 is not thread safe, every access to
+ * smb2 goes through the lock of its session. Sessions are independent of
+ * each other, so tasks on different sessions do not wait for each other.
+ */
+typedef struct smb_session {
+  struct smb2_context* smb2;
+  SemaphoreHandle_t lock;
+  TaskHandle_t owner;
+  TickType_t last_used;
+  int open_files;  // Files opened on this session and not closed yet
+  smb_async_req_t reqs[SMB_MAX_IN_FLIGHT];
+  volatile int in_flight;
+  smb_file_t* handle_pool[SMB_HANDLE_POOL_SIZE];
+} smb_session_t;
+
+typedef struct {
+  char* path;
+  uint32_t generation;
+  TickType_t loaded;
+  FRESULT res;
+  FILINFO fno;
+} smb_stat_entry_t;
+
 
 class TRS_FS_SMB : virtual public TRS_FS {
 private:
-  char* smb_url = NULL;
-  struct smb2_context *smb2 = NULL;
+  // Share and credentials. Read once by init() and kept for connecting
+  // further sessions
+  struct smb2_url* url = NULL;
+  char* user = NULL;
+  char* passwd = NULL;
+  // Directory on the share that the URL points to
+  char* share_path = NULL;
+
+  // The first session is used by the task that created the share and by
+  // all tasks that find no free session
+  smb_session_t sessions[SMB_MAX_SESSIONS];
+  // Protects the assignment of sessions and the stat cache
+  SemaphoreHandle_t lock = NULL;
+  bool connect_failed = false;
+  TickType_t connect_failed_at;
+  TaskHandle_t service_task = NULL;
+  volatile bool service_running = false;
+  DirCache dir_cache;
+  smb_stat_entry_t stat_cache[SMB_STAT_CACHE_SIZE];
+  int stat_next = 0;
+  // Bumped when a modification is issued and again when it completes.
+  // Older stat_cache entries are stale
+  std::atomic<uint32_t> stat_generation{0};
 
   const char* init();
+  const char* connect(smb_session_t* s);
+  smb_session_t* session();
+  void release_idle(smb_session_t* s);
+  bool busy();
+  static void service_task_main(void* arg);
+  static void async_cb(struct smb2_context* smb2, int status,
+                       void* command_data, void* cb_data);
+  smb_async_req_t* alloc_req(smb_session_t* s, FFUTURE* fut);
+  void service(int timeout_ms);
+  void fail_all(smb_session_t* s);
+  void drain(smb_session_t* s);
+  FRESULT transfer32(FIL* fp, uint8_t* buff, DWORD len, FSIZE_t ofs,
+                     DWORD* done, bool write);
+  smb_stat_entry_t* stat_lookup(const char* path);
+  void stat_insert(const char* path, FRESULT res, FILINFO* fno);
+  void invalidate();
+  const char* full_path(const char* path, char* buf);
+  smb_file_t* pool_take(smb_session_t* s, const char* path, int flags);
+  bool pool_put(smb_file_t* f);
+  void pool_close(smb_session_t* s, int i);
+  void pool_expire(smb_session_t* s);
+  void pool_flush(smb_session_t* s);
 public:
   TRS_FS_SMB();
   virtual ~TRS_FS_SMB();
@@ -46,6 +164,67 @@ public:
                      DIR_* dp,      /* [IN] Directory object */
                      FILINFO* fno  /* [OUT] File information structure */
                      );
+  FRESULT f_closedir (
+                      DIR_* dp  /* [IN] Directory object */
+                      );
+  FRESULT f_pread (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  FSIZE_t ofs, /* [IN] File offset to read from */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_pwrite (
+                   FIL* fp,          /* [IN] File object */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   FSIZE_t ofs,      /* [IN] File offset to write to */
+                   UINT* bw          /* [OUT] Number of bytes written */
+                   );
+  FRESULT f_read32 (
+                    FIL* fp,     /* [IN] File object */
+                    void* buff,  /* [OUT] Buffer to store read data */
+                    DWORD btr,   /* [IN] Number of bytes to read */
+                    DWORD* br    /* [OUT] Number of bytes read */
+                    );
+  FRESULT f_write32 (
+                     FIL* fp,          /* [IN] Pointer to the file object structure */
+                     const void* buff, /* [IN] Pointer to the data to be written */
+                     DWORD btw,        /* [IN] Number of bytes to write */
+                     DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                     );
+  FRESULT f_pread32 (
+                     FIL* fp,     /* [IN] File object */
+                     void* buff,  /* [OUT] Buffer to store read data */
+                     DWORD btr,   /* [IN] Number of bytes to read */
+                     FSIZE_t ofs, /* [IN] File offset to read from */
+                     DWORD* br    /* [OUT] Number of bytes read */
+                     );
+  FRESULT f_pwrite32 (
+                      FIL* fp,          /* [IN] File object */
+                      const void* buff, /* [IN] Pointer to the data to be written */
+                      DWORD btw,        /* [IN] Number of bytes to write */
+                      FSIZE_t ofs,      /* [IN] File offset to write to */
+                      DWORD* bw         /* [OUT] Number of bytes written */
+                      );
+  FRESULT f_pread_async (
+                        FIL* fp,     /* [IN] File object */
+                        void* buff,  /* [OUT] Buffer to store read data */
+                        UINT btr,    /* [IN] Number of bytes to read */
+                        FSIZE_t ofs, /* [IN] File offset to read from */
+                        FFUTURE* fut /* [OUT] Completion record */
+                        );
+  FRESULT f_pwrite_async (
+                         FIL* fp,          /* [IN] File object */
+                         const void* buff, /* [IN] Pointer to the data to be written */
+                         UINT btw,         /* [IN] Number of bytes to write */
+                         FSIZE_t ofs,      /* [IN] File offset to write to */
+                         FFUTURE* fut      /* [OUT] Completion record */
+                         );
+  FRESULT f_wait (
+                 FFUTURE* fut, /* [IN] Completion record */
+                 UINT* n       /* [OUT] Number of bytes transferred */
+                 );
   FSIZE_t f_tell (
                   FIL* fp   /* [IN] File object */
                   );
@@ -66,6 +245,10 @@ public:
                   const TCHAR* path,  /* [IN] Object name */
                   FILINFO* fno        /* [OUT] FILINFO structure */
                   );
+  FRESULT f_stat_uncached (
+                           const TCHAR* path,  /* [IN] Object name */
+                           FILINFO* fno        /* [OUT] FILINFO structure */
+                           );
 
 };
 
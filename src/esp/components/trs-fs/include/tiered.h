@@ -0,0 +1,155 @@
+#ifndef TRS_FS_TIERED_H
+#define TRS_FS_TIERED_H
+
+#include "trs-fs.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Files are cached in blocks of this size
+#define TIER_BLOCK_SIZE (64 * 1024)
+// Largest transfer to or from a backend while filling a block
+#define TIER_CHUNK_SIZE (32 * 1024)
+// Files up to TIER_MAX_BLOCKS * TIER_BLOCK_SIZE bytes (32 MB) are cached
+#define TIER_MAX_BLOCKS 512
+// Number of files that can be in the cache at the same time
+#define TIER_MAX_FILES 32
+#define TIER_MAX_PATH 64
+
+#define TIER_MAGIC "TRSC"
+#define TIER_VERSION 1
+#define TIER_INDEX_NAME "SMBCACHE.IDX"
+#define TIER_DATA_NAME "SMBC%02d.DAT"
+
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint16_t max_files;
+  uint32_t block_size;
+  uint32_t seq;         // Counter for last_used
+} tier_header_t;
+
+// One cached file. The index on the SD card is a header and an array of these
+typedef struct {
+  char path[TIER_MAX_PATH]; // Path on the share. Empty if the slot is free
+  uint32_t size;            // Size and FAT time stamp the blocks belong to
+  uint32_t mtime;
+  uint32_t last_used;
+  uint8_t valid[TIER_MAX_BLOCKS / 8];
+} tier_entry_t;
+
+typedef struct {
+  FIL fil;      // File on the share
+  FIL data;     // Copy on the SD card
+  int slot;     // Index entry or -1 if the file is not cached
+  bool direct;  // Opened for appending. Passed through as is
+  bool written;
+  FSIZE_t pos;
+} tier_file_t;
+
+/*
+ * Combines the SMB share with the SD card. The share remains the source of
+ * truth: every write goes there and directory operations are served by it.
+ * Reads are served from copies of 64 KB blocks that are kept on the SD
+ * card. A cached copy is only used if size and time stamp of the file on
+ * the share are still the same as when the blocks were fetched. When the
+ * cache is full the least recently opened file is dropped. A block is only
+ * marked valid once its data is synced, and a slot is only reused once
+ * the index on the card no longer refers to its old contents.
+ */
+class TRS_FS_TIERED : virtual public TRS_FS {
+private:
+  TRS_FS* fs;
+  TRS_FS* cache;
+  SemaphoreHandle_t lock;
+  uint32_t max_blocks;
+  bool index_open = false;
+  FIL index;
+  tier_header_t header;
+  tier_entry_t entries[TIER_MAX_FILES];
+  int open_count[TIER_MAX_FILES];
+  uint8_t* chunk = NULL;
+
+  void load_index();
+  void save_entry(int slot);
+  void clear_entry(int slot);
+  int find_slot(const char* path);
+  bool evict_lru(int keep);
+  int claim_slot();
+  void evict(int slot);
+  uint32_t cached_blocks();
+  void attach(tier_file_t* f, const char* path);
+  bool fill_block(tier_file_t* f, uint32_t block);
+  void set_valid(int slot, uint32_t block, bool valid);
+  bool is_valid(int slot, uint32_t block);
+public:
+  TRS_FS_TIERED(TRS_FS* fs, TRS_FS* cache, uint32_t size_mb);
+  virtual ~TRS_FS_TIERED();
+  FS_TYPE type();
+  void f_log(const char* msg);
+  FRESULT f_open (
+                  FIL* fp,           /* [OUT] Pointer to the file object structure */
+                  const TCHAR* path, /* [IN] File name */
+                  BYTE mode          /* [IN] Mode flags */
+                  );
+  FRESULT f_opendir (
+                     DIR_* dp,           /* [OUT] Pointer to the directory object structure */
+                     const TCHAR* path  /* [IN] Directory name */
+                     );
+  FRESULT f_write (
+                   FIL* fp,          /* [IN] Pointer to the file object structure */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
+                   );
+  FRESULT f_read (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_readdir (
+                     DIR_* dp,      /* [IN] Directory object */
+                     FILINFO* fno  /* [OUT] File information structure */
+                     );
+  FRESULT f_closedir (
+                      DIR_* dp  /* [IN] Directory object */
+                      );
+  FRESULT f_pread (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  FSIZE_t ofs, /* [IN] File offset to read from */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_pwrite (
+                   FIL* fp,          /* [IN] File object */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   FSIZE_t ofs,      /* [IN] File offset to write to */
+                   UINT* bw          /* [OUT] Number of bytes written */
+                   );
+  FSIZE_t f_tell (
+                  FIL* fp   /* [IN] File object */
+                  );
+  FRESULT f_sync (
+                  FIL* fp     /* [IN] File object */
+                  );
+  FRESULT f_lseek (
+                   FIL*    fp,  /* [IN] File object */
+                   FSIZE_t ofs  /* [IN] File read/write pointer */
+                   );
+  FRESULT f_close (
+                   FIL* fp     /* [IN] Pointer to the file object */
+                   );
+  FRESULT f_unlink (
+                    const TCHAR* path  /* [IN] Object name */
+                    );
+  FRESULT f_stat (
+                  const TCHAR* path,  /* [IN] Object name */
+                  FILINFO* fno        /* [OUT] FILINFO structure */
+                  );
+
+};
+
+#endif
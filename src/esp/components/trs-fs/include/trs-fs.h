@@ -16,10 +16,18 @@
 #define F_OPENDIR 6
 #define F_READDIR 7
 #define F_STAT 8
+#define F_HELLO 9
+#define F_PREAD 10
+#define F_PWRITE 11
+
+// Default size of the pieces that the 32-bit transfer functions are split
+// into for backends that only implement the 16-bit ones
+#define TRS_FS_CHUNK32 (32 * 1024)
 
 enum FS_TYPE {
   FS_SMB,
-  FS_POSIX
+  FS_POSIX,
+  FS_SERIAL
 };
 
 const char* init_trs_fs_posix();
@@ -65,6 +73,147 @@ public:
   virtual FRESULT f_readdir(DIR_* dp,          /* [IN] Directory object */
                             FILINFO* fno) = 0; /* [OUT] File information structure */
 
+  /*
+   * Releases a directory that was not read to its end. Reaching the end
+   * releases it as well.
+   */
+  virtual FRESULT f_closedir(DIR_* dp) {  /* [IN] Directory object */
+    return FR_OK;
+  }
+
+  virtual FRESULT f_pread(FIL* fp,          /* [IN] File object */
+                          void* buff,       /* [OUT] Buffer to store read data */
+                          UINT btr,         /* [IN] Number of bytes to read */
+                          FSIZE_t ofs,      /* [IN] File offset to read from */
+                          UINT* br) = 0;    /* [OUT] Number of bytes read */
+
+  virtual FRESULT f_pwrite(FIL* fp,          /* [IN] File object */
+                           const void* buff, /* [IN] Pointer to the data to be written */
+                           UINT btw,         /* [IN] Number of bytes to write */
+                           FSIZE_t ofs,      /* [IN] File offset to write to */
+                           UINT* bw) = 0;    /* [OUT] Number of bytes written */
+
+  /*
+   * Transfers with 32-bit sizes. The defaults split them into calls of the
+   * 16-bit functions; a backend that can do better overrides them.
+   */
+  virtual FRESULT f_read32(FIL* fp,       /* [IN] File object */
+                           void* buff,    /* [OUT] Buffer to store read data */
+                           DWORD btr,     /* [IN] Number of bytes to read */
+                           DWORD* br) {   /* [OUT] Number of bytes read */
+    FRESULT res = FR_OK;
+    *br = 0;
+    while (*br < btr) {
+      UINT len = (btr - *br > TRS_FS_CHUNK32) ? TRS_FS_CHUNK32 : btr - *br;
+      UINT n;
+      res = f_read(fp, (uint8_t*) buff + *br, len, &n);
+      if (res != FR_OK) {
+        break;
+      }
+      *br += n;
+      if (n < len) {
+        break;
+      }
+    }
+    return res;
+  }
+
+  virtual FRESULT f_write32(FIL* fp,          /* [IN] Pointer to the file object structure */
+                            const void* buff, /* [IN] Pointer to the data to be written */
+                            DWORD btw,        /* [IN] Number of bytes to write */
+                            DWORD* bw) {      /* [OUT] Pointer to the variable to return number of bytes written */
+    FRESULT res = FR_OK;
+    *bw = 0;
+    while (*bw < btw) {
+      UINT len = (btw - *bw > TRS_FS_CHUNK32) ? TRS_FS_CHUNK32 : btw - *bw;
+      UINT n;
+      res = f_write(fp, (const uint8_t*) buff + *bw, len, &n);
+      if (res != FR_OK) {
+        break;
+      }
+      *bw += n;
+      if (n < len) {
+        break;
+      }
+    }
+    return res;
+  }
+
+  virtual FRESULT f_pread32(FIL* fp,        /* [IN] File object */
+                            void* buff,     /* [OUT] Buffer to store read data */
+                            DWORD btr,      /* [IN] Number of bytes to read */
+                            FSIZE_t ofs,    /* [IN] File offset to read from */
+                            DWORD* br) {    /* [OUT] Number of bytes read */
+    FRESULT res = FR_OK;
+    *br = 0;
+    while (*br < btr) {
+      UINT len = (btr - *br > TRS_FS_CHUNK32) ? TRS_FS_CHUNK32 : btr - *br;
+      UINT n;
+      res = f_pread(fp, (uint8_t*) buff + *br, len, ofs + *br, &n);
+      if (res != FR_OK) {
+        break;
+      }
+      *br += n;
+      if (n < len) {
+        break;
+      }
+    }
+    return res;
+  }
+
+  virtual FRESULT f_pwrite32(FIL* fp,          /* [IN] File object */
+                             const void* buff, /* [IN] Pointer to the data to be written */
+                             DWORD btw,        /* [IN] Number of bytes to write */
+                             FSIZE_t ofs,      /* [IN] File offset to write to */
+                             DWORD* bw) {      /* [OUT] Number of bytes written */
+    FRESULT res = FR_OK;
+    *bw = 0;
+    while (*bw < btw) {
+      UINT len = (btw - *bw > TRS_FS_CHUNK32) ? TRS_FS_CHUNK32 : btw - *bw;
+      UINT n;
+      res = f_pwrite(fp, (const uint8_t*) buff + *bw, len, ofs + *bw, &n);
+      if (res != FR_OK) {
+        break;
+      }
+      *bw += n;
+      if (n < len) {
+        break;
+      }
+    }
+    return res;
+  }
+
+  /*
+   * Asynchronous variants of f_pread()/f_pwrite(). A backend that can keep
+   * several requests in flight overrides these; the default completes the
+   * request synchronously so that f_wait() returns immediately.
+   */
+  virtual FRESULT f_pread_async(FIL* fp,        /* [IN] File object */
+                                void* buff,     /* [OUT] Buffer to store read data */
+                                UINT btr,       /* [IN] Number of bytes to read */
+                                FSIZE_t ofs,    /* [IN] File offset to read from */
+                                FFUTURE* fut) { /* [OUT] Completion record */
+    fut->res = f_pread(fp, buff, btr, ofs, &fut->n);
+    fut->done = 1;
+    return FR_OK;
+  }
+
+  virtual FRESULT f_pwrite_async(FIL* fp,          /* [IN] File object */
+                                 const void* buff, /* [IN] Pointer to the data to be written */
+                                 UINT btw,         /* [IN] Number of bytes to write */
+                                 FSIZE_t ofs,      /* [IN] File offset to write to */
+                                 FFUTURE* fut) {   /* [OUT] Completion record */
+    fut->res = f_pwrite(fp, buff, btw, ofs, &fut->n);
+    fut->done = 1;
+    return FR_OK;
+  }
+
+  virtual FRESULT f_wait(FFUTURE* fut,  /* [IN] Completion record */
+                         UINT* n) {     /* [OUT] Number of bytes transferred */
+    *n = fut->n;
+    return fut->res;
+  }
+
   virtual FSIZE_t f_tell(FIL* fp) = 0;   /* [IN] File object */
 
   virtual FRESULT f_sync(FIL* fp) = 0;   /* [IN] File object */
@@ -78,6 +227,15 @@ public:
 
   virtual FRESULT f_stat(const TCHAR* path,  /* [IN] Object name */
                          FILINFO* fno) = 0;  /* [OUT] FILINFO structure */
+
+  /*
+   * Like f_stat(), but asks the storage rather than a cache of earlier
+   * results, e.g. to check whether a copy of the file is still current.
+   */
+  virtual FRESULT f_stat_uncached(const TCHAR* path,  /* [IN] Object name */
+                                  FILINFO* fno) {     /* [OUT] FILINFO structure */
+    return f_stat(path, fno);
+  }
 };
 
 extern TRS_FS* trs_fs;
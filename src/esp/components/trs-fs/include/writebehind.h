@@ -0,0 +1,177 @@
+#ifndef TRS_FS_WRITEBEHIND_H
+#define TRS_FS_WRITEBEHIND_H
+
+#include "trs-fs.h"
+
+// Size of the per-file write buffers. Flushes never cross a multiple of it
+#define TRS_FS_WRITEBEHIND_SIZE (16 * 1024)
+// Buffered data older than this (ms) is written out in the background
+#define TRS_FS_WRITEBEHIND_DELAY_MS 250
+
+typedef struct wb_file {
+  struct wb_file* next;
+  TRS_FS* fs;       // Backend the file was opened on
+  FIL fil;          // File of the backend
+  bool direct;      // Not buffered. Files opened for appending
+  FSIZE_t pos;      // Current file position
+  uint8_t* buf;     // Data not yet handed to the backend
+  FSIZE_t buf_pos;  // File position of buf[0]
+  UINT buf_len;
+  int64_t buf_time; // When buf became dirty (us)
+  uint8_t* fly;     // Data of the write in flight
+  FSIZE_t fly_pos;
+  UINT fly_len;
+  FFUTURE fut;
+  FRESULT err;      // Failure of an earlier background write
+} wb_file_t;
+
+typedef struct {
+  uint32_t writes;         // Write calls by the users of the wrapper
+  uint64_t bytes;          // Bytes written by the users of the wrapper
+  uint32_t backend_writes; // Writes issued to the backend
+  uint64_t backend_bytes;  // Bytes written to the backend
+  uint64_t write_us;       // Time the users spent in write calls
+  uint64_t backend_us;     // Time spent blocked on backend writes
+} wb_stats_t;
+
+/*
+ * Wraps another TRS_FS and collects small writes to a file in a buffer
+ * that is handed to the backend with f_pwrite_async() once it is full,
+ * on f_sync() and f_close(), or after TRS_FS_WRITEBEHIND_DELAY_MS. As with
+ * POSIX, a failed background write is reported by the next call on that
+ * file. Reads, f_stat() and directory operations see all data written
+ * before.
+ */
+class TRS_FS_WRITEBEHIND : virtual public TRS_FS {
+private:
+  TRS_FS* fs;
+
+  static wb_file_t* files;
+  static wb_stats_t stats;
+
+  static void flush(wb_file_t* f);
+  static FRESULT complete(wb_file_t* f);
+  static void settle(wb_file_t* f, FSIZE_t ofs, DWORD len);
+  static FRESULT take_err(wb_file_t* f);
+  static FRESULT prepare_read(wb_file_t* f, FSIZE_t ofs, DWORD len);
+  static FRESULT write(wb_file_t* f, const void* buff, UINT btw, FSIZE_t ofs);
+#ifdef ESP_PLATFORM
+  static void flush_task_main(void* arg);
+#endif
+public:
+  TRS_FS_WRITEBEHIND(TRS_FS* fs);
+  static const wb_stats_t* get_stats();
+  // Writes out everything that is buffered, e.g. before a backend goes away
+  static void flush_all();
+  FS_TYPE type();
+  void f_log(const char* msg);
+  FRESULT f_open (
+                  FIL* fp,           /* [OUT] Pointer to the file object structure */
+                  const TCHAR* path, /* [IN] File name */
+                  BYTE mode          /* [IN] Mode flags */
+                  );
+  FRESULT f_opendir (
+                     DIR_* dp,           /* [OUT] Pointer to the directory object structure */
+                     const TCHAR* path  /* [IN] Directory name */
+                     );
+  FRESULT f_write (
+                   FIL* fp,          /* [IN] Pointer to the file object structure */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
+                   );
+  FRESULT f_read (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_readdir (
+                     DIR_* dp,      /* [IN] Directory object */
+                     FILINFO* fno  /* [OUT] File information structure */
+                     );
+  FRESULT f_closedir (
+                      DIR_* dp  /* [IN] Directory object */
+                      );
+  FRESULT f_pread (
+                  FIL* fp,     /* [IN] File object */
+                  void* buff,  /* [OUT] Buffer to store read data */
+                  UINT btr,    /* [IN] Number of bytes to read */
+                  FSIZE_t ofs, /* [IN] File offset to read from */
+                  UINT* br     /* [OUT] Number of bytes read */
+                  );
+  FRESULT f_pwrite (
+                   FIL* fp,          /* [IN] File object */
+                   const void* buff, /* [IN] Pointer to the data to be written */
+                   UINT btw,         /* [IN] Number of bytes to write */
+                   FSIZE_t ofs,      /* [IN] File offset to write to */
+                   UINT* bw          /* [OUT] Number of bytes written */
+                   );
+  FRESULT f_read32 (
+                    FIL* fp,     /* [IN] File object */
+                    void* buff,  /* [OUT] Buffer to store read data */
+                    DWORD btr,   /* [IN] Number of bytes to read */
+                    DWORD* br    /* [OUT] Number of bytes read */
+                    );
+  FRESULT f_write32 (
+                     FIL* fp,          /* [IN] Pointer to the file object structure */
+                     const void* buff, /* [IN] Pointer to the data to be written */
+                     DWORD btw,        /* [IN] Number of bytes to write */
+                     DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                     );
+  FRESULT f_pread32 (
+                     FIL* fp,     /* [IN] File object */
+                     void* buff,  /* [OUT] Buffer to store read data */
+                     DWORD btr,   /* [IN] Number of bytes to read */
+                     FSIZE_t ofs, /* [IN] File offset to read from */
+                     DWORD* br    /* [OUT] Number of bytes read */
+                     );
+  FRESULT f_pwrite32 (
+                      FIL* fp,          /* [IN] File object */
+                      const void* buff, /* [IN] Pointer to the data to be written */
+                      DWORD btw,        /* [IN] Number of bytes to write */
+                      FSIZE_t ofs,      /* [IN] File offset to write to */
+                      DWORD* bw         /* [OUT] Number of bytes written */
+                      );
+  FRESULT f_pread_async (
+                        FIL* fp,     /* [IN] File object */
+                        void* buff,  /* [OUT] Buffer to store read data */
+                        UINT btr,    /* [IN] Number of bytes to read */
+                        FSIZE_t ofs, /* [IN] File offset to read from */
+                        FFUTURE* fut /* [OUT] Completion record */
+                        );
+  FRESULT f_pwrite_async (
+                         FIL* fp,          /* [IN] File object */
+                         const void* buff, /* [IN] Pointer to the data to be written */
+                         UINT btw,         /* [IN] Number of bytes to write */
+                         FSIZE_t ofs,      /* [IN] File offset to write to */
+                         FFUTURE* fut      /* [OUT] Completion record */
+                         );
+  FRESULT f_wait (
+                 FFUTURE* fut, /* [IN] Completion record */
+                 UINT* n       /* [OUT] Number of bytes transferred */
+                 );
+  FSIZE_t f_tell (
+                  FIL* fp   /* [IN] File object */
+                  );
+  FRESULT f_sync (
+                  FIL* fp     /* [IN] File object */
+                  );
+  FRESULT f_lseek (
+                   FIL*    fp,  /* [IN] File object */
+                   FSIZE_t ofs  /* [IN] File read/write pointer */
+                   );
+  FRESULT f_close (
+                   FIL* fp     /* [IN] Pointer to the file object */
+                   );
+  FRESULT f_unlink (
+                    const TCHAR* path  /* [IN] Object name */
+                    );
+  FRESULT f_stat (
+                  const TCHAR* path,  /* [IN] Object name */
+                  FILINFO* fno        /* [OUT] FILINFO structure */
+                  );
+
+};
+
+#endif
@@ -1,4 +1,5 @@
 
+#ifdef ESP_PLATFORM
 #include <driver/sdspi_host.h>
 
 namespace VFS {
@@ -6,11 +7,13 @@ namespace VFS {
 }
 
 #include "sdmmc_cmd.h"
+#include "storage.h"
+#include "io.h"
+#endif
 
 #include "trs-fs.h"
 #include "posix.h"
-#include "storage.h"
-#include "io.h"
+#include "esp_heap_caps.h"
 
 #include <string.h>
 #include <assert.h>
@@ -19,12 +22,29 @@ namespace VFS {
 #include <stdint.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#define POSIX(fp) ((posix_file_t*) (fp)->f)
+
+
+class PosixLock {
+private:
+  SemaphoreHandle_t lock;
+public:
+  PosixLock(SemaphoreHandle_t lock) : lock(lock) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+  }
+  ~PosixLock() {
+    xSemaphoreGive(lock);
+  }
+};
+
+#ifdef ESP_PLATFORM
 #if defined(CONFIG_POCKET_TRS_TTGO_VGA32_SUPPORT)
 #define SPI_CS GPIO_NUM_13
 #elif defined(CONFIG_TRS_IO_MODEL_1)
@@ -36,10 +56,14 @@ namespace VFS {
 // PocketTRS
 #define SPI_CS GPIO_NUM_15
 #endif
+#endif
 
 
+#ifdef ESP_PLATFORM
 TRS_FS_POSIX::TRS_FS_POSIX() {
   err_msg = NULL;
+  mount_len = strlen(mount);
+  lock = xSemaphoreCreateMutex();
 
   if (!has_sd_card_reader()) {
     err_msg = "SD card not supported";
@@ -48,8 +72,8 @@ TRS_FS_POSIX::TRS_FS_POSIX() {
 
   VFS::esp_vfs_fat_sdmmc_mount_config_t mount_config = {
     .format_if_mount_failed = false,
-    .max_files = 5,
-    .allocation_unit_size = 16 * 1024
+    .max_files = CONFIG_TRS_IO_SD_MAX_FILES,
+    .allocation_unit_size = POSIX_CLUSTER_SIZE
   };
 
   sdmmc_host_t host = SDSPI_HOST_DEFAULT();
@@ -67,12 +91,26 @@ TRS_FS_POSIX::TRS_FS_POSIX() {
     }
   }
 }
+#endif
+
+TRS_FS_POSIX::TRS_FS_POSIX(const char* mount) : mount(mount) {
+  err_msg = NULL;
+  mount_len = strlen(mount);
+  lock = xSemaphoreCreateMutex();
+#ifdef ESP_PLATFORM
+  // Nothing to unmount
+  card = NULL;
+#endif
+}
 
 TRS_FS_POSIX::~TRS_FS_POSIX()
 {
-  if (err_msg == NULL) {
+#ifdef ESP_PLATFORM
+  if (err_msg == NULL && card != NULL) {
     VFS::esp_vfs_fat_sdcard_unmount(mount, card);
   }
+#endif
+  vSemaphoreDelete(lock);
 }
 
 FS_TYPE TRS_FS_POSIX::type()
@@ -82,7 +120,11 @@ FS_TYPE TRS_FS_POSIX::type()
 
 bool TRS_FS_POSIX::has_sd_card_reader()
 {
+#ifdef ESP_PLATFORM
   return SPI_CS != GPIO_NUM_0;
+#else
+  return false;
+#endif
 }
 
 void TRS_FS_POSIX::f_log(const char* msg) {
@@ -90,63 +132,326 @@ void TRS_FS_POSIX::f_log(const char* msg) {
   printf("TRS_FS_POSIX: %s\n", msg);
 #endif
 }
-  
+
+/*
+ * Prefixes path with the mount point. The VFS layer only knows absolute
+ * paths, so they are assembled in the caller's buffer of POSIX_MAX_PATH
+ * bytes instead of being allocated for every call.
+ */
+bool TRS_FS_POSIX::abs_path(char* buf, const char* path)
+{
+  if ((strcmp(path, ".") == 0) || (strcmp(path, "/") == 0)) {
+    path = "";
+  }
+  while (*path == '/') {
+    path++;
+  }
+  size_t len = strlen(path);
+  if (mount_len + 1 + len + 1 > POSIX_MAX_PATH) {
+    return false;
+  }
+  memcpy(buf, mount, mount_len);
+  buf[mount_len] = '/';
+  memcpy(buf + mount_len + 1, path, len + 1);
+  return true;
+}
+
+/*
+ * Writes the buffered data of f. The buffer stays valid for reading. If
+ * the write fails, the data stays in the buffer and the error in f->err
+ * until a later flush succeeds.
+ */
+FRESULT TRS_FS_POSIX::flush(posix_file_t* f)
+{
+  if (!f->dirty) {
+    return FR_OK;
+  }
+  UINT done = 0;
+  while (done < f->buf_len) {
+    ssize_t n = pwrite(f->fd, f->buf + done, f->buf_len - done, f->buf_pos + done);
+    if (n <= 0) {
+      f->err = FR_DISK_ERR;
+      return f->err;
+    }
+    done += n;
+  }
+  f->dirty = false;
+  f->err = FR_OK;
+  return FR_OK;
+}
+
+// Called first by every operation on f. Reports a failed flush unless the
+// data can be written now
+FRESULT TRS_FS_POSIX::retry_flush(posix_file_t* f)
+{
+  return (f->err == FR_OK) ? FR_OK : flush(f);
+}
+
+FRESULT TRS_FS_POSIX::read_at(posix_file_t* f, uint8_t* buff, DWORD btr,
+                              FSIZE_t ofs, DWORD* br)
+{
+  // A single read following another one is often just FreHD reading ahead
+  // after a random access
+  f->streak = (ofs == f->next) ? f->streak + 1 : 0;
+  bool sequential = (f->streak >= 2);
+  DWORD done = 0;
+  *br = 0;
+
+  // Buffered writes that overlap the range must reach the file first
+  if (f->dirty && ofs < f->buf_pos + f->buf_len && ofs + btr > f->buf_pos) {
+    FRESULT res = flush(f);
+    if (res != FR_OK) {
+      return res;
+    }
+  }
+
+  while (done < btr) {
+    FSIZE_t pos = ofs + done;
+    if (!f->dirty && pos >= f->buf_pos && pos < f->buf_pos + f->buf_len) {
+      DWORD n = f->buf_pos + f->buf_len - pos;
+      if (n > btr - done) {
+        n = btr - done;
+      }
+      memcpy(buff + done, f->buf + (pos - f->buf_pos), n);
+      done += n;
+      continue;
+    }
+
+    if (!sequential || f->dirty || btr - done >= POSIX_CLUSTER_SIZE) {
+      // Random and large reads go straight to the file
+      ssize_t n = pread(f->fd, buff + done, btr - done, pos);
+      if (n < 0) {
+        return FR_DISK_ERR;
+      }
+      done += n;
+      break;
+    }
+
+    if (f->buf == NULL) {
+      f->buf = (uint8_t*) heap_caps_malloc_prefer(POSIX_CLUSTER_SIZE, 2,
+                                                  MALLOC_CAP_SPIRAM,
+                                                  MALLOC_CAP_8BIT);
+      if (f->buf == NULL) {
+        sequential = false;
+        continue;
+      }
+    }
+    // Load the cluster that contains pos
+    f->buf_pos = pos & ~(FSIZE_t) (POSIX_CLUSTER_SIZE - 1);
+    ssize_t n = pread(f->fd, f->buf, POSIX_CLUSTER_SIZE, f->buf_pos);
+    f->buf_len = (n > 0) ? n : 0;
+    if (n < 0) {
+      return FR_DISK_ERR;
+    }
+    if (pos >= f->buf_pos + f->buf_len) {
+      // End of file
+      break;
+    }
+  }
+  *br = done;
+  f->next = ofs + done;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_POSIX::write_at(posix_file_t* f, const uint8_t* buff, DWORD btw,
+                               FSIZE_t ofs, DWORD* bw)
+{
+  DWORD done = 0;
+  FRESULT res = FR_OK;
+
+  while (done < btw) {
+    FSIZE_t pos = ofs + done;
+    DWORD len = btw - done;
+
+    if (f->dirty) {
+      // The buffer may grow up to the end of the cluster it starts in
+      FSIZE_t limit = (f->buf_pos | (POSIX_CLUSTER_SIZE - 1)) + 1;
+      if (pos >= f->buf_pos && pos <= f->buf_pos + f->buf_len && pos < limit) {
+        DWORD n = (len < limit - pos) ? len : limit - pos;
+        memcpy(f->buf + (pos - f->buf_pos), buff + done, n);
+        if (pos + n > f->buf_pos + f->buf_len) {
+          f->buf_len = pos + n - f->buf_pos;
+        }
+        done += n;
+        continue;
+      }
+      if ((res = flush(f)) != FR_OK) {
+        break;
+      }
+    }
+
+    if (f->buf == NULL && len < POSIX_CLUSTER_SIZE) {
+      f->buf = (uint8_t*) heap_caps_malloc_prefer(POSIX_CLUSTER_SIZE, 2,
+                                                  MALLOC_CAP_SPIRAM,
+                                                  MALLOC_CAP_8BIT);
+    }
+    if (f->buf == NULL || len >= POSIX_CLUSTER_SIZE) {
+      ssize_t n = pwrite(f->fd, buff + done, len, pos);
+      if (n <= 0) {
+        res = FR_DISK_ERR;
+        break;
+      }
+      // Keep the cluster loaded for reading consistent
+      FSIZE_t start = (pos > f->buf_pos) ? pos : f->buf_pos;
+      FSIZE_t end = pos + n;
+      if (end > f->buf_pos + f->buf_len) {
+        end = f->buf_pos + f->buf_len;
+      }
+      if (start < end) {
+        memcpy(f->buf + (start - f->buf_pos), buff + done + (start - pos), end - start);
+      }
+      done += n;
+      continue;
+    }
+
+    // Start collecting writes at pos. This drops the cluster loaded for reading
+    f->buf_pos = pos;
+    f->buf_len = 0;
+    f->dirty = true;
+  }
+  *bw = done;
+  if (ofs + done > f->end) {
+    f->end = ofs + done;
+  }
+  return res;
+}
+
 FRESULT TRS_FS_POSIX::f_open (
                             FIL* fp,           /* [OUT] Pointer to the file object structure */
                             const TCHAR* path, /* [IN] File name */
                             BYTE mode          /* [IN] Mode flags */
                             ) {
-  char* abs_path;
-  const char* m;
-  
+  char p[POSIX_MAX_PATH];
+  int flags;
+
   switch(mode) {
   case FA_READ:
-    m = "r";
+    flags = O_RDONLY;
     break;
   case FA_READ | FA_WRITE:
-    m = "r+";
+    flags = O_RDWR;
     break;
   case FA_CREATE_ALWAYS | FA_WRITE:
-    m = "w";
+  case FA_CREATE_NEW | FA_WRITE:
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
     break;
   case FA_CREATE_ALWAYS | FA_WRITE | FA_READ:
-    m = "w+";
+  case FA_CREATE_NEW | FA_WRITE | FA_READ:
+    flags = O_RDWR | O_CREAT | O_TRUNC;
     break;
   case FA_OPEN_APPEND | FA_WRITE:
-    m = "a";
+    flags = O_WRONLY | O_CREAT;
     break;
   case FA_OPEN_APPEND | FA_WRITE | FA_READ:
-    m = "a+";
-    break;
-  case  FA_CREATE_NEW | FA_WRITE:
-    m = "w";
-    break;
-  case FA_CREATE_NEW | FA_WRITE | FA_READ:
-    m = "w+";
+    flags = O_RDWR | O_CREAT;
     break;
   default:
     assert(0);
   }
 
-  asprintf(&abs_path, "%s/%s", mount, path);
-  fp->f = fopen(abs_path, m);
-  free(abs_path);
-  return (fp->f == NULL) ? FR_NO_FILE : FR_OK;
+  fp->f = NULL;
+  if (!abs_path(p, path)) {
+    return FR_INVALID_NAME;
+  }
+  if (mode & FA_WRITE) {
+    dir_cache.invalidate();
+  }
+
+  posix_file_t* f = (posix_file_t*) calloc(1, sizeof(posix_file_t));
+  if (f == NULL) {
+    return FR_NOT_ENOUGH_CORE;
+  }
+  f->path = strdup(p);
+  if (f->path == NULL) {
+    free(f);
+    return FR_NOT_ENOUGH_CORE;
+  }
+  f->fd = open(p, flags, 0666);
+  if (f->fd < 0) {
+    int err = errno;
+    free(f->path);
+    free(f);
+    if (err == EMFILE || err == ENFILE) {
+      return FR_TOO_MANY_OPEN_FILES;
+    }
+    if (err == EACCES || err == EPERM) {
+      return FR_DENIED;
+    }
+    return (err == EROFS) ? FR_WRITE_PROTECTED : FR_NO_FILE;
+  }
+  f->lock = xSemaphoreCreateMutex();
+  if (mode & FA_OPEN_APPEND) {
+    // Like FatFs, appending only moves the initial position to the end
+    off_t end = lseek(f->fd, 0, SEEK_END);
+    f->pos = (end > 0) ? end : 0;
+  }
+  f->next = f->pos;
+  PosixLock l(lock);
+  f->next_open = files;
+  files = f;
+  fp->f = f;
+  return FR_OK;
 }
 
 FRESULT TRS_FS_POSIX::f_opendir (
                                DIR_* dp,           /* [OUT] Pointer to the directory object structure */
                                const TCHAR* path  /* [IN] Directory name */
                                ) {
-  char* abs_path;
+  char entry_path[POSIX_MAX_PATH];
+
+  dp->dir = dir_cache.lookup(path);
+  if (dp->dir != NULL) {
+    return FR_OK;
+  }
 
   if ((strcmp(path, ".") == 0) || (strcmp(path, "/") == 0)) {
     path = "";
   }
-  asprintf(&abs_path, "%s/%s", mount, path);
-  dp->dir = opendir(abs_path);
-  free(abs_path);
-  return (dp->dir != NULL) ? FR_OK : FR_DISK_ERR;
+  if (!abs_path(entry_path, path)) {
+    return FR_INVALID_NAME;
+  }
+  DIR* dir = opendir(entry_path);
+  if (dir == NULL) {
+    return FR_DISK_ERR;
+  }
+
+  // Read the complete directory in one go. The entry path is assembled in
+  // place behind the directory path for the stat() of each file
+  size_t len = strlen(entry_path);
+  if (entry_path[len - 1] != '/') {
+    entry_path[len++] = '/';
+  }
+  dir_listing_t* listing = dir_cache.create(path);
+  bool ok = (listing != NULL) && (len + 12 + 1 <= POSIX_MAX_PATH);
+  struct dirent* entry;
+  while (ok && (entry = readdir(dir)) != NULL) {
+    if (strlen(entry->d_name) > 12) {
+      continue;
+    }
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (entry->d_type == DT_DIR) {
+      ok = dir_cache.add(listing, entry->d_name, 0, AM_DIR, 0);
+      continue;
+    }
+    struct stat st;
+    strcpy(entry_path + len, entry->d_name);
+    if (stat(entry_path, &st) != 0) {
+      continue;
+    }
+    ok = dir_cache.add(listing, entry->d_name, st.st_size, AM_RDO, st.st_mtime);
+  }
+  closedir(dir);
+
+  if (!ok) {
+    if (listing != NULL) {
+      dir_cache.discard(listing);
+    }
+    return FR_NOT_ENOUGH_CORE;
+  }
+  dp->dir = dir_cache.publish(listing);
+  return (dp->dir != NULL) ? FR_OK : FR_NOT_ENOUGH_CORE;
 }
 
 FRESULT TRS_FS_POSIX::f_write (
@@ -155,9 +460,10 @@ FRESULT TRS_FS_POSIX::f_write (
                              UINT btw,         /* [IN] Number of bytes to write */
                              UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
                              ) {
-  int _bw = fwrite(buff, 1, btw, (FILE*) fp->f);
-  *bw = _bw;
-  return (_bw >= 0) ? FR_OK : FR_DISK_ERR;
+  DWORD n;
+  FRESULT res = f_write32(fp, buff, btw, &n);
+  *bw = n;
+  return res;
 }
 
 FRESULT TRS_FS_POSIX::f_read (
@@ -166,87 +472,215 @@ FRESULT TRS_FS_POSIX::f_read (
                             UINT btr,    /* [IN] Number of bytes to read */
                             UINT* br     /* [OUT] Number of bytes read */
                             ) {
-  int _br = fread(buff, 1, btr, (FILE*) fp->f);
-  *br = _br;
-  return (_br >= 0) ? FR_OK : FR_DISK_ERR;
+  DWORD n;
+  FRESULT res = f_read32(fp, buff, btr, &n);
+  *br = n;
+  return res;
 }
 
 FRESULT TRS_FS_POSIX::f_readdir (
                                DIR_* dp,      /* [IN] Directory object */
                                FILINFO* fno  /* [OUT] File information structure */
                                   ) {
-  while (1) {
-    struct dirent* entry = readdir((DIR*) dp->dir);
-    if (entry == NULL) {
-      closedir((DIR*) dp->dir);
-      fno->fname[0] = '\0';
-      break;
-    }
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
-    if (strlen(entry->d_name) > 12) {
-      continue;
-    }
-    strcpy(fno->fname, entry->d_name);
-    f_stat(fno->fname, fno);
-    //fno->fattrib = 1;
-    break;
+  return dir_cache.read(dp, fno);
+}
+
+FRESULT TRS_FS_POSIX::f_closedir (
+                                  DIR_* dp  /* [IN] Directory object */
+                                  ) {
+  return dir_cache.close(dp);
+}
+
+FRESULT TRS_FS_POSIX::f_pread (
+                               FIL* fp,     /* [IN] File object */
+                               void* buff,  /* [OUT] Buffer to store read data */
+                               UINT btr,    /* [IN] Number of bytes to read */
+                               FSIZE_t ofs, /* [IN] File offset to read from */
+                               UINT* br     /* [OUT] Number of bytes read */
+                               ) {
+  posix_file_t* f = POSIX(fp);
+  PosixLock l(f->lock);
+  DWORD n = 0;
+  FRESULT res = retry_flush(f);
+  if (res == FR_OK) {
+    res = read_at(f, (uint8_t*) buff, btr, ofs, &n);
   }
-  return FR_OK;
+  *br = n;
+  return res;
+}
+
+FRESULT TRS_FS_POSIX::f_pwrite (
+                                FIL* fp,          /* [IN] File object */
+                                const void* buff, /* [IN] Pointer to the data to be written */
+                                UINT btw,         /* [IN] Number of bytes to write */
+                                FSIZE_t ofs,      /* [IN] File offset to write to */
+                                UINT* bw          /* [OUT] Number of bytes written */
+                                ) {
+  posix_file_t* f = POSIX(fp);
+  PosixLock l(f->lock);
+  DWORD n = 0;
+  FRESULT res = retry_flush(f);
+  if (res == FR_OK) {
+    res = write_at(f, (const uint8_t*) buff, btw, ofs, &n);
+  }
+  *bw = n;
+  return res;
+}
+
+FRESULT TRS_FS_POSIX::f_read32 (
+                              FIL* fp,     /* [IN] File object */
+                              void* buff,  /* [OUT] Buffer to store read data */
+                              DWORD btr,   /* [IN] Number of bytes to read */
+                              DWORD* br    /* [OUT] Number of bytes read */
+                              ) {
+  posix_file_t* f = POSIX(fp);
+  PosixLock l(f->lock);
+  *br = 0;
+  FRESULT res = retry_flush(f);
+  if (res == FR_OK) {
+    res = read_at(f, (uint8_t*) buff, btr, f->pos, br);
+  }
+  f->pos += *br;
+  return res;
+}
+
+FRESULT TRS_FS_POSIX::f_write32 (
+                               FIL* fp,          /* [IN] Pointer to the file object structure */
+                               const void* buff, /* [IN] Pointer to the data to be written */
+                               DWORD btw,        /* [IN] Number of bytes to write */
+                               DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                               ) {
+  posix_file_t* f = POSIX(fp);
+  PosixLock l(f->lock);
+  *bw = 0;
+  FRESULT res = retry_flush(f);
+  if (res == FR_OK) {
+    res = write_at(f, (const uint8_t*) buff, btw, f->pos, bw);
+  }
+  f->pos += *bw;
+  return res;
+}
+
+FRESULT TRS_FS_POSIX::f_pread32 (
+                               FIL* fp,     /* [IN] File object */
+                               void* buff,  /* [OUT] Buffer to store read data */
+                               DWORD btr,   /* [IN] Number of bytes to read */
+                               FSIZE_t ofs, /* [IN] File offset to read from */
+                               DWORD* br    /* [OUT] Number of bytes read */
+                               ) {
+  posix_file_t* f = POSIX(fp);
+  PosixLock l(f->lock);
+  *br = 0;
+  FRESULT res = retry_flush(f);
+  return (res == FR_OK) ? read_at(f, (uint8_t*) buff, btr, ofs, br) : res;
+}
+
+FRESULT TRS_FS_POSIX::f_pwrite32 (
+                                FIL* fp,          /* [IN] File object */
+                                const void* buff, /* [IN] Pointer to the data to be written */
+                                DWORD btw,        /* [IN] Number of bytes to write */
+                                FSIZE_t ofs,      /* [IN] File offset to write to */
+                                DWORD* bw         /* [OUT] Number of bytes written */
+                                ) {
+  posix_file_t* f = POSIX(fp);
+  PosixLock l(f->lock);
+  *bw = 0;
+  FRESULT res = retry_flush(f);
+  return (res == FR_OK) ? write_at(f, (const uint8_t*) buff, btw, ofs, bw) : res;
 }
 
 FSIZE_t TRS_FS_POSIX::f_tell (
                             FIL* fp   /* [IN] File object */
                             ) {
-  assert(0);
+  return POSIX(fp)->pos;
 }
 
 FRESULT TRS_FS_POSIX::f_sync (
                             FIL* fp     /* [IN] File object */
                             ) {
-  assert(0);
+  posix_file_t* f = POSIX(fp);
+  PosixLock l(f->lock);
+  FRESULT res = flush(f);
+  if (res == FR_OK && fsync(f->fd) != 0) {
+    res = FR_DISK_ERR;
+  }
+  return res;
 }
 
 FRESULT TRS_FS_POSIX::f_lseek (
                              FIL*    fp,  /* [IN] File object */
                              FSIZE_t ofs  /* [IN] File read/write pointer */
                              ) {
-  fseek((FILE*) fp->f, ofs, SEEK_SET);
+  POSIX(fp)->pos = ofs;
   return FR_OK;
 }
   
 FRESULT TRS_FS_POSIX::f_close (
                              FIL* fp     /* [IN] Pointer to the file object */
                              ) {
-  fclose((FILE*) fp->f);
-  return FR_OK;
+  posix_file_t* f = POSIX(fp);
+  {
+    PosixLock l(lock);
+    for (posix_file_t** p = &files; *p != NULL; p = &(*p)->next_open) {
+      if (*p == f) {
+        *p = f->next_open;
+        break;
+      }
+    }
+  }
+  // Data that cannot be written now is lost
+  FRESULT res = flush(f);
+  if (close(f->fd) != 0 && res == FR_OK) {
+    res = FR_DISK_ERR;
+  }
+  vSemaphoreDelete(f->lock);
+  heap_caps_free(f->buf);
+  free(f->path);
+  free(f);
+  fp->f = NULL;
+  return res;
 }
 
 FRESULT TRS_FS_POSIX::f_unlink (
                               const TCHAR* path  /* [IN] Object name */
                               ) {
-  char* abs_path;
-  asprintf(&abs_path, "%s/%s", mount, path);
-  int r = unlink(abs_path);
-  free(abs_path);
-  return r ? FR_NO_FILE : FR_OK;
+  char p[POSIX_MAX_PATH];
+  if (!abs_path(p, path)) {
+    return FR_INVALID_NAME;
+  }
+  dir_cache.invalidate();
+  return unlink(p) ? FR_NO_FILE : FR_OK;
 }
 
 FRESULT TRS_FS_POSIX::f_stat (
                             const TCHAR* path,  /* [IN] Object name */
                             FILINFO* fno        /* [OUT] FILINFO structure */
                             ) {
-  char* abs_path;
+  char p[POSIX_MAX_PATH];
   struct stat s;
-  asprintf(&abs_path, "%s/%s", mount, path);
-  int r = stat(abs_path, &s);
-  free(abs_path);
-  if (r != 0) {
+  if (!abs_path(p, path)) {
     return FR_NO_FILE;
   }
-  strcpy(fno->fname, path);
-  fno->fsize = s.st_size;
-  fno->fattrib = 1; //XXX
+  if (stat(p, &s) != 0) {
+    return FR_NO_FILE;
+  }
+  FSIZE_t size = s.st_size;
+  {
+    // The size on disk lacks what open files still buffer and, with FAT,
+    // what they wrote since their last sync. end is a single word that
+    // only grows, so it is read without the lock of the file
+    PosixLock l(lock);
+    for (posix_file_t* f = files; f != NULL; f = f->next_open) {
+      // FAT ignores case
+      if (f->end > size && strcasecmp(f->path, p) == 0) {
+        size = f->end;
+      }
+    }
+  }
+  strncpy(fno->fname, path, sizeof(fno->fname) - 1);
+  fno->fname[sizeof(fno->fname) - 1] = '\0';
+  fno->fsize = size;
+  fno->fattrib = S_ISDIR(s.st_mode) ? AM_DIR : AM_RDO;
+  DirCache::set_fattime(fno, s.st_mtime);
   return FR_OK;
 }
@@ -0,0 +1,336 @@
+
+#include "readahead.h"
+#include "esp_heap_caps.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RA(fp) ((ra_file_t*) (fp)->f)
+
+
+TRS_FS_READAHEAD::TRS_FS_READAHEAD(TRS_FS* fs) : fs(fs) {
+  err_msg = fs->get_err_msg();
+}
+
+FS_TYPE TRS_FS_READAHEAD::type()
+{
+  return fs->type();
+}
+
+void TRS_FS_READAHEAD::f_log(const char* msg) {
+  fs->f_log(msg);
+}
+
+/*
+ * Copies data that was written at ofs into the overlapping part of the
+ * read-ahead buffer so that later reads from the buffer see it.
+ */
+void TRS_FS_READAHEAD::patch(ra_file_t* f, FSIZE_t ofs, const void* buff, DWORD len)
+{
+  FSIZE_t start = (ofs > f->buf_pos) ? ofs : f->buf_pos;
+  FSIZE_t end = ofs + len;
+  if (end > f->buf_pos + f->buf_len) {
+    end = f->buf_pos + f->buf_len;
+  }
+  if (start < end) {
+    memcpy(f->buf + (start - f->buf_pos), (const uint8_t*) buff + (start - ofs), end - start);
+  }
+}
+
+FRESULT TRS_FS_READAHEAD::f_open (
+                                  FIL* fp,           /* [OUT] Pointer to the file object structure */
+                                  const TCHAR* path, /* [IN] File name */
+                                  BYTE mode          /* [IN] Mode flags */
+                                  ) {
+  ra_file_t* f = (ra_file_t*) calloc(1, sizeof(ra_file_t));
+  if (f == NULL) {
+    return FR_NOT_ENOUGH_CORE;
+  }
+  FRESULT res = fs->f_open(&f->fil, path, mode);
+  if (res != FR_OK) {
+    free(f);
+    fp->f = NULL;
+    return res;
+  }
+  f->pos = fs->f_tell(&f->fil);
+  f->next = f->pos;
+  fp->f = f;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_READAHEAD::f_opendir (
+                                     DIR_* dp,           /* [OUT] Pointer to the directory object structure */
+                                     const TCHAR* path  /* [IN] Directory name */
+                                     ) {
+  return fs->f_opendir(dp, path);
+}
+
+FRESULT TRS_FS_READAHEAD::f_write (
+                                   FIL* fp,          /* [IN] Pointer to the file object structure */
+                                   const void* buff, /* [IN] Pointer to the data to be written */
+                                   UINT btw,         /* [IN] Number of bytes to write */
+                                   UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
+                                   ) {
+  ra_file_t* f = RA(fp);
+
+  // Reads do not move the position of the backend file
+  FRESULT res = fs->f_lseek(&f->fil, f->pos);
+  if (res == FR_OK) {
+    res = fs->f_write(&f->fil, buff, btw, bw);
+  }
+  if (res != FR_OK) {
+    f->buf_len = 0;
+    return res;
+  }
+  // Files opened for appending write somewhere else than at pos
+  f->pos = fs->f_tell(&f->fil);
+  patch(f, f->pos - *bw, buff, *bw);
+  return FR_OK;
+}
+
+FRESULT TRS_FS_READAHEAD::f_read (
+                                  FIL* fp,     /* [IN] File object */
+                                  void* buff,  /* [OUT] Buffer to store read data */
+                                  UINT btr,    /* [IN] Number of bytes to read */
+                                  UINT* br     /* [OUT] Number of bytes read */
+                                  ) {
+  ra_file_t* f = RA(fp);
+  bool sequential = (f->pos == f->next);
+  FRESULT res = FR_OK;
+  UINT done = 0;
+
+  while (done < btr) {
+    if (f->pos >= f->buf_pos && f->pos < f->buf_pos + f->buf_len) {
+      UINT n = f->buf_pos + f->buf_len - f->pos;
+      if (n > btr - done) {
+        n = btr - done;
+      }
+      memcpy((uint8_t*) buff + done, f->buf + (f->pos - f->buf_pos), n);
+      f->pos += n;
+      done += n;
+      continue;
+    }
+
+    UINT n;
+    if (!sequential || btr - done >= TRS_FS_READAHEAD_SIZE) {
+      // Random or large accesses gain nothing from the buffer
+      res = fs->f_pread(&f->fil, (uint8_t*) buff + done, btr - done, f->pos, &n);
+      if (res == FR_OK) {
+        f->pos += n;
+        done += n;
+      }
+      break;
+    }
+
+    if (f->buf == NULL) {
+      f->buf = (uint8_t*) heap_caps_malloc_prefer(TRS_FS_READAHEAD_SIZE, 2,
+                                                  MALLOC_CAP_SPIRAM,
+                                                  MALLOC_CAP_8BIT);
+      if (f->buf == NULL) {
+        sequential = false;
+        continue;
+      }
+    }
+    f->buf_len = 0;
+    res = fs->f_pread(&f->fil, f->buf, TRS_FS_READAHEAD_SIZE, f->pos, &n);
+    if (res != FR_OK || n == 0) {
+      break;
+    }
+    f->buf_pos = f->pos;
+    f->buf_len = n;
+  }
+
+  f->next = f->pos;
+  *br = done;
+  return (done > 0) ? FR_OK : res;
+}
+
+FRESULT TRS_FS_READAHEAD::f_readdir (
+                                     DIR_* dp,      /* [IN] Directory object */
+                                     FILINFO* fno  /* [OUT] File information structure */
+                                     ) {
+  return fs->f_readdir(dp, fno);
+}
+
+FRESULT TRS_FS_READAHEAD::f_closedir (
+                                      DIR_* dp  /* [IN] Directory object */
+                                      ) {
+  return fs->f_closedir(dp);
+}
+
+FRESULT TRS_FS_READAHEAD::f_pread (
+                                   FIL* fp,     /* [IN] File object */
+                                   void* buff,  /* [OUT] Buffer to store read data */
+                                   UINT btr,    /* [IN] Number of bytes to read */
+                                   FSIZE_t ofs, /* [IN] File offset to read from */
+                                   UINT* br     /* [OUT] Number of bytes read */
+                                   ) {
+  ra_file_t* f = RA(fp);
+
+  if (f->buf_len > 0 && ofs >= f->buf_pos && ofs + btr <= f->buf_pos + f->buf_len) {
+    memcpy(buff, f->buf + (ofs - f->buf_pos), btr);
+    *br = btr;
+    return FR_OK;
+  }
+  return fs->f_pread(&f->fil, buff, btr, ofs, br);
+}
+
+FRESULT TRS_FS_READAHEAD::f_pwrite (
+                                    FIL* fp,          /* [IN] File object */
+                                    const void* buff, /* [IN] Pointer to the data to be written */
+                                    UINT btw,         /* [IN] Number of bytes to write */
+                                    FSIZE_t ofs,      /* [IN] File offset to write to */
+                                    UINT* bw          /* [OUT] Number of bytes written */
+                                    ) {
+  ra_file_t* f = RA(fp);
+  FRESULT res = fs->f_pwrite(&f->fil, buff, btw, ofs, bw);
+  if (res != FR_OK) {
+    f->buf_len = 0;
+    return res;
+  }
+  patch(f, ofs, buff, *bw);
+  return FR_OK;
+}
+
+FRESULT TRS_FS_READAHEAD::f_read32 (
+                                    FIL* fp,     /* [IN] File object */
+                                    void* buff,  /* [OUT] Buffer to store read data */
+                                    DWORD btr,   /* [IN] Number of bytes to read */
+                                    DWORD* br    /* [OUT] Number of bytes read */
+                                    ) {
+  ra_file_t* f = RA(fp);
+  if (btr < TRS_FS_READAHEAD_SIZE) {
+    UINT n;
+    FRESULT res = f_read(fp, buff, btr, &n);
+    *br = n;
+    return res;
+  }
+  // Too large for the buffer. The backend has seen all writes
+  FRESULT res = fs->f_pread32(&f->fil, buff, btr, f->pos, br);
+  if (res == FR_OK) {
+    f->pos += *br;
+  }
+  f->next = f->pos;
+  return res;
+}
+
+FRESULT TRS_FS_READAHEAD::f_write32 (
+                                     FIL* fp,          /* [IN] Pointer to the file object structure */
+                                     const void* buff, /* [IN] Pointer to the data to be written */
+                                     DWORD btw,        /* [IN] Number of bytes to write */
+                                     DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                                     ) {
+  ra_file_t* f = RA(fp);
+
+  FRESULT res = fs->f_lseek(&f->fil, f->pos);
+  if (res == FR_OK) {
+    res = fs->f_write32(&f->fil, buff, btw, bw);
+  }
+  if (res != FR_OK) {
+    f->buf_len = 0;
+    return res;
+  }
+  f->pos = fs->f_tell(&f->fil);
+  patch(f, f->pos - *bw, buff, *bw);
+  return FR_OK;
+}
+
+FRESULT TRS_FS_READAHEAD::f_pread32 (
+                                     FIL* fp,     /* [IN] File object */
+                                     void* buff,  /* [OUT] Buffer to store read data */
+                                     DWORD btr,   /* [IN] Number of bytes to read */
+                                     FSIZE_t ofs, /* [IN] File offset to read from */
+                                     DWORD* br    /* [OUT] Number of bytes read */
+                                     ) {
+  return fs->f_pread32(&RA(fp)->fil, buff, btr, ofs, br);
+}
+
+FRESULT TRS_FS_READAHEAD::f_pwrite32 (
+                                      FIL* fp,          /* [IN] File object */
+                                      const void* buff, /* [IN] Pointer to the data to be written */
+                                      DWORD btw,        /* [IN] Number of bytes to write */
+                                      FSIZE_t ofs,      /* [IN] File offset to write to */
+                                      DWORD* bw         /* [OUT] Number of bytes written */
+                                      ) {
+  ra_file_t* f = RA(fp);
+  FRESULT res = fs->f_pwrite32(&f->fil, buff, btw, ofs, bw);
+  if (res != FR_OK) {
+    f->buf_len = 0;
+    return res;
+  }
+  patch(f, ofs, buff, *bw);
+  return FR_OK;
+}
+
+FRESULT TRS_FS_READAHEAD::f_pread_async (
+                                         FIL* fp,     /* [IN] File object */
+                                         void* buff,  /* [OUT] Buffer to store read data */
+                                         UINT btr,    /* [IN] Number of bytes to read */
+                                         FSIZE_t ofs, /* [IN] File offset to read from */
+                                         FFUTURE* fut /* [OUT] Completion record */
+                                         ) {
+  return fs->f_pread_async(&RA(fp)->fil, buff, btr, ofs, fut);
+}
+
+FRESULT TRS_FS_READAHEAD::f_pwrite_async (
+                                          FIL* fp,          /* [IN] File object */
+                                          const void* buff, /* [IN] Pointer to the data to be written */
+                                          UINT btw,         /* [IN] Number of bytes to write */
+                                          FSIZE_t ofs,      /* [IN] File offset to write to */
+                                          FFUTURE* fut      /* [OUT] Completion record */
+                                          ) {
+  ra_file_t* f = RA(fp);
+  // The outcome is not known yet. Drop the buffer rather than patch it
+  f->buf_len = 0;
+  return fs->f_pwrite_async(&f->fil, buff, btw, ofs, fut);
+}
+
+FRESULT TRS_FS_READAHEAD::f_wait (
+                                  FFUTURE* fut, /* [IN] Completion record */
+                                  UINT* n       /* [OUT] Number of bytes transferred */
+                                  ) {
+  return fs->f_wait(fut, n);
+}
+
+FSIZE_t TRS_FS_READAHEAD::f_tell (
+                                  FIL* fp   /* [IN] File object */
+                                  ) {
+  return RA(fp)->pos;
+}
+
+FRESULT TRS_FS_READAHEAD::f_sync (
+                                  FIL* fp     /* [IN] File object */
+                                  ) {
+  return fs->f_sync(&RA(fp)->fil);
+}
+
+FRESULT TRS_FS_READAHEAD::f_lseek (
+                                   FIL*    fp,  /* [IN] File object */
+                                   FSIZE_t ofs  /* [IN] File read/write pointer */
+                                   ) {
+  RA(fp)->pos = ofs;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_READAHEAD::f_close (
+                                   FIL* fp     /* [IN] Pointer to the file object */
+                                   ) {
+  ra_file_t* f = RA(fp);
+  FRESULT res = fs->f_close(&f->fil);
+  heap_caps_free(f->buf);
+  free(f);
+  return res;
+}
+
+FRESULT TRS_FS_READAHEAD::f_unlink (
+                                    const TCHAR* path  /* [IN] Object name */
+                                    ) {
+  return fs->f_unlink(path);
+}
+
+FRESULT TRS_FS_READAHEAD::f_stat (
+                                  const TCHAR* path,  /* [IN] Object name */
+                                  FILINFO* fno        /* [OUT] FILINFO structure */
+                                  ) {
+  return fs->f_stat(path, fno);
+}
@@ -1,9 +1,15 @@
 
 #include "trs-fs.h"
 #include "serial.h"
+#include "esp_heap_caps.h"
 
+#include <stdlib.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_err.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
+#include "freertos/task.h"
 
 
 #define SERIAL_IO_TXD  GPIO_NUM_1
@@ -11,132 +17,548 @@
 #define SERIAL_IO_RTS  (UART_PIN_NO_CHANGE)
 #define SERIAL_IO_CTS  (UART_PIN_NO_CHANGE)
 
-#define BUF_SIZE 1024
+class UartPort : public SerialPort {
+public:
+  UartPort() {
+    uart_config_t uart_config = {
+      .baud_rate = SERIAL_DEFAULT_BAUD,
+      .data_bits = UART_DATA_8_BITS,
+      .parity    = UART_PARITY_DISABLE,
+      .stop_bits = UART_STOP_BITS_1,
+      .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
+    };
+    uart_param_config(UART_NUM_0, &uart_config);
+    uart_set_pin(UART_NUM_0, SERIAL_IO_TXD, SERIAL_IO_RXD, SERIAL_IO_RTS, SERIAL_IO_CTS);
+    // Room for a full window of replies and for one request being sent
+    uart_driver_install(UART_NUM_0, SERIAL_WINDOW * SERIAL_MAX_FRAME,
+                        SERIAL_MAX_FRAME, 0, NULL, 0);
+  }
+
+  int read(void* buf, int len, int timeout_ms) {
+    int n = uart_read_bytes(UART_NUM_0, (uint8_t*) buf, len, pdMS_TO_TICKS(timeout_ms));
+    return (n < 0) ? 0 : n;
+  }
+
+  void write(const void* buf, int len) {
+    uart_write_bytes(UART_NUM_0, (const char*) buf, len);
+  }
+
+  void drain() {
+    uart_wait_tx_done(UART_NUM_0, portMAX_DELAY);
+  }
+
+  bool set_baud(int baud) {
+    return uart_set_baudrate(UART_NUM_0, baud) == ESP_OK;
+  }
+};
+#endif
+
+#define FILE_(fp) ((serial_file_t*) (fp)->f)
+
+
+class SerialLock {
+#ifdef ESP_PLATFORM
+private:
+  SemaphoreHandle_t lock;
+public:
+  SerialLock(SemaphoreHandle_t lock) : lock(lock) {
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  }
+  ~SerialLock() {
+    xSemaphoreGiveRecursive(lock);
+  }
+#endif
+};
+
+#ifdef ESP_PLATFORM
+#define LOCK() SerialLock l(lock)
+#else
+#define LOCK()
+#endif
 
-static int16_t read_byte() {
-  int len;
-  uint8_t data;
+static uint16_t crc16(const uint8_t* p, int len, uint16_t crc)
+{
+  static const uint16_t table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+  };
 
-  do {
-    uart_get_buffered_data_len(UART_NUM_0, (size_t*)&len);
-  } while (len < 1);
- 
-  uart_read_bytes(UART_NUM_0, &data, 1, 0);
-  return data;
+  while (len-- > 0) {
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (*p >> 4)];
+    crc = (crc << 4) ^ table[(crc >> 12) ^ (*p++ & 0x0f)];
+  }
+  return crc;
 }
 
-static void read_blob(void* buf, int32_t btr) {
-  int len;
-  
-  do {
-    uart_get_buffered_data_len(UART_NUM_0, (size_t*)&len);
-  } while (len < btr);
- 
-  uart_read_bytes(UART_NUM_0, (uint8_t*) buf, btr, 0);
+static uint16_t get16(const uint8_t* p)
+{
+  return p[0] | (p[1] << 8);
 }
 
-static void write_byte(uint8_t b) {
-  uart_write_bytes(UART_NUM_0, (const char*) &b, 1);
+static uint32_t get32(const uint8_t* p)
+{
+  return get16(p) | ((uint32_t) get16(p + 2) << 16);
 }
 
-static void write_blob(const void* buf, int32_t btw) {
-  uart_write_bytes(UART_NUM_0, (const char*) buf, btw);
+static void put8(serial_req_t* req, uint8_t b)
+{
+  req->frame[req->frame_len++] = b;
 }
 
-static FRESULT read_fresult() {
-  return (FRESULT) read_byte();
+static void put16(serial_req_t* req, uint16_t w)
+{
+  put8(req, w & 0xff);
+  put8(req, w >> 8);
 }
 
-static void init_serial_io() {
-  uart_config_t uart_config = {
-    .baud_rate = 115200,
-    .data_bits = UART_DATA_8_BITS,
-    .parity    = UART_PARITY_DISABLE,
-    .stop_bits = UART_STOP_BITS_1,
-    .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
-  };
-  uart_param_config(UART_NUM_0, &uart_config);
-  uart_set_pin(UART_NUM_0, SERIAL_IO_TXD, SERIAL_IO_RXD, SERIAL_IO_RTS, SERIAL_IO_CTS);
-  uart_driver_install(UART_NUM_0, BUF_SIZE * 2, 0, 0, NULL, 0);
+static void put32(serial_req_t* req, uint32_t l)
+{
+  put16(req, l & 0xffff);
+  put16(req, l >> 16);
 }
 
+static void put_data(serial_req_t* req, const void* data, UINT len)
+{
+  memcpy(req->frame + req->frame_len, data, len);
+  req->frame_len += len;
+}
 
-static uint16_t read_word() {
-    return read_byte() | (read_byte() << 8);
+static void put_string(serial_req_t* req, const char* str)
+{
+  put_data(req, str, strlen(str) + 1);
 }
 
-static void write_word(uint16_t w) {
-    write_byte(w & 0xff);
-    write_byte((w >> 8) & 0xff);
+static bool path_ok(const char* path)
+{
+  return strlen(path) < SERIAL_MAX_PATH;
 }
 
-static uint32_t read_long() {
-    return read_word() | (read_word() << 16);
+static void set_fname(FILINFO* fno, const char* path)
+{
+  const char* name = strrchr(path, '/');
+  name = (name == NULL) ? path : name + 1;
+  strncpy(fno->fname, name, sizeof(fno->fname) - 1);
+  fno->fname[sizeof(fno->fname) - 1] = '\0';
 }
 
-static void write_long(uint32_t l) {
-    write_word(l & 0xffff);
-    write_word((l >> 16) & 0xffff);
+
+#ifdef ESP_PLATFORM
+TRS_FS_SERIAL::TRS_FS_SERIAL() {
+  init(new UartPort(), SERIAL_MAX_BAUD);
 }
+#endif
 
-static void write_string(const char *str) {
-    do {
-        write_byte(*str);
-    } while (*str++ != '\0');
+TRS_FS_SERIAL::TRS_FS_SERIAL(SerialPort* port, int max_baud) {
+  init(port, max_baud);
 }
 
-static void read_string(char* str) {
-    do {
-        *str = read_byte();
-    } while (*str++ != '\0');
+TRS_FS_SERIAL::~TRS_FS_SERIAL()
+{
+  for (int i = 0; i < SERIAL_WINDOW; i++) {
+    heap_caps_free(reqs[i].frame);
+  }
+  heap_caps_free(rx);
+#ifdef ESP_PLATFORM
+  vSemaphoreDelete(lock);
+#endif
 }
 
-static void send_marker() {
-    static const char* MARKER = "TRS-IO:FS:";
+void TRS_FS_SERIAL::init(SerialPort* port, int max_baud)
+{
+  this->port = port;
+#ifdef ESP_PLATFORM
+  lock = xSemaphoreCreateRecursiveMutex();
+#endif
+  memset(reqs, 0, sizeof(reqs));
+  for (int i = 0; i < SERIAL_WINDOW; i++) {
+    reqs[i].frame = (uint8_t*) heap_caps_malloc_prefer(SERIAL_MAX_FRAME, 2,
+                                                       MALLOC_CAP_SPIRAM,
+                                                       MALLOC_CAP_8BIT);
+  }
+  rx = (uint8_t*) heap_caps_malloc_prefer(SERIAL_MAX_FRAME, 2,
+                                          MALLOC_CAP_SPIRAM,
+                                          MALLOC_CAP_8BIT);
+  for (int i = 0; i < SERIAL_WINDOW; i++) {
+    if (reqs[i].frame == NULL || rx == NULL) {
+      err_msg = "Out of memory";
+      return;
+    }
+  }
+  this->max_baud = max_baud;
+  err_msg = connect();
+}
 
-    const char* p = MARKER;
-    while (*p != '\0') {
-        write_byte(*p++);
+FRESULT TRS_FS_SERIAL::hello(uint32_t baud, uint32_t* agreed)
+{
+  uint8_t reply[7];
+  UINT n;
+  serial_req_t* req = begin(F_HELLO);
+  put8(req, SERIAL_VERSION);
+  put32(req, baud);
+  FRESULT res = call(req, reply, sizeof(reply), &n);
+  if (res == FR_OK && (n < sizeof(reply) || reply[0] != SERIAL_VERSION)) {
+    res = FR_INT_ERR;
+  }
+  if (res == FR_OK) {
+    *agreed = get32(reply + 1);
+    block = get16(reply + 5);
+    if (block > SERIAL_BLOCK_SIZE) {
+      block = SERIAL_BLOCK_SIZE;
     }
+  }
+  return res;
 }
 
-TRS_FS_SERIAL::TRS_FS_SERIAL() {
-  init_serial_io();
+/*
+ * Agrees on the protocol version and the baud rate with the server. Both
+ * sides switch once the reply to the first F_HELLO has been sent; a second
+ * one verifies that the link works at the new rate. If it does not, the
+ * server returns to the default rate after SERIAL_BAUD_TIMEOUT_MS and the
+ * link is used at that rate.
+ */
+const char* TRS_FS_SERIAL::connect()
+{
+  uint32_t agreed;
+
+  if (hello(max_baud, &agreed) != FR_OK) {
+    return "Serial server not responding";
+  }
+  if (agreed == SERIAL_DEFAULT_BAUD) {
+    return NULL;
+  }
+  port->drain();
+  if (port->set_baud(agreed) && hello(agreed, &agreed) == FR_OK) {
+    baud = agreed;
+    return NULL;
+  }
+  port->set_baud(SERIAL_DEFAULT_BAUD);
+  if (hello(SERIAL_DEFAULT_BAUD, &agreed) != FR_OK) {
+    return "Could not switch baud rate";
+  }
+  return NULL;
+}
+
+/*
+ * Called before the next request once outstanding requests were given up
+ * on. The server still waits for the first of them and drops everything
+ * else until an F_HELLO resets its sequence number. A server that was
+ * restarted meanwhile is back at the default rate.
+ */
+void TRS_FS_SERIAL::reconnect()
+{
+  uint32_t agreed;
+
+  resync = false;
+  if (hello(baud, &agreed) == FR_OK) {
+    return;
+  }
+  if (baud != SERIAL_DEFAULT_BAUD) {
+    port->set_baud(SERIAL_DEFAULT_BAUD);
+    baud = SERIAL_DEFAULT_BAUD;
+    connect();
+  }
+}
+
+void TRS_FS_SERIAL::set_window(int n)
+{
+  window = (n < 1) ? 1 : (n > SERIAL_WINDOW) ? SERIAL_WINDOW : n;
+}
+
+FS_TYPE TRS_FS_SERIAL::type()
+{
+  return FS_SERIAL;
+}
+
+/*
+ * Reserves a request slot and starts its frame. Waits for replies if the
+ * window is full.
+ */
+serial_req_t* TRS_FS_SERIAL::begin(uint8_t cmd)
+{
+  while (outstanding >= window) {
+    pump();
+  }
+  if (resync) {
+    reconnect();
+  }
+  serial_req_t* req = reqs;
+  while (req->in_use) {
+    req++;
+  }
+  req->in_use = true;
+  req->frame_len = 0;
+  put8(req, SERIAL_SYNC0);
+  put8(req, SERIAL_SYNC1);
+  put8(req, next_seq++);
+  put8(req, cmd);
+  put16(req, 0);
+  return req;
+}
+
+FRESULT TRS_FS_SERIAL::send(serial_req_t* req, FFUTURE* fut, void* data, UINT data_len)
+{
+  int len = req->frame_len - SERIAL_HEADER_SIZE;
+  req->frame[4] = len & 0xff;
+  req->frame[5] = len >> 8;
+  uint16_t crc = crc16(req->frame + 2, req->frame_len - 2, 0xffff);
+  put16(req, crc);
+
+  fut->done = 0;
+  fut->n = 0;
+  fut->res = FR_OK;
+  req->fut = fut;
+  req->data = data;
+  req->data_len = data_len;
+  req->age = next_age++;
+  outstanding++;
+  port->write(req->frame, req->frame_len);
+  return FR_OK;
+}
+
+FRESULT TRS_FS_SERIAL::call(serial_req_t* req, void* data, UINT data_len, UINT* n)
+{
+  FFUTURE fut;
+  send(req, &fut, data, data_len);
+  FRESULT res = wait(&fut);
+  if (n != NULL) {
+    *n = fut.n;
+  }
+  return res;
+}
+
+/*
+ * Reads one frame. Returns false if nothing arrived within timeout_ms.
+ * Corrupted frames are dropped; the request is sent again on timeout.
+ */
+bool TRS_FS_SERIAL::receive(int timeout_ms)
+{
+  uint8_t b;
+  int state = 0;
+
+  while (state < 2) {
+    if (port->read(&b, 1, timeout_ms) != 1) {
+      return false;
+    }
+    if (state == 1 && b == SERIAL_SYNC1) {
+      state = 2;
+    } else {
+      state = (b == SERIAL_SYNC0) ? 1 : 0;
+    }
+  }
+  if (port->read(rx, 4, timeout_ms) != 4) {
+    return false;
+  }
+  int len = get16(rx + 2);
+  if (len > SERIAL_MAX_PAYLOAD) {
+    return true;
+  }
+  if (port->read(rx + 4, len + 2, timeout_ms) != len + 2) {
+    return false;
+  }
+  if (crc16(rx, len + 4, 0xffff) != get16(rx + 4 + len)) {
+    return true;
+  }
+  dispatch(rx[0], rx[1], rx + 4, len);
+  return true;
+}
+
+void TRS_FS_SERIAL::dispatch(uint8_t seq, uint8_t cmd, uint8_t* payload, int len)
+{
+  for (int i = 0; i < SERIAL_WINDOW; i++) {
+    serial_req_t* req = &reqs[i];
+    if (!req->in_use || req->frame[2] != seq || (req->frame[3] | SERIAL_REPLY) != cmd) {
+      continue;
+    }
+    FFUTURE* fut = req->fut;
+    if (len < 1) {
+      fut->res = FR_INT_ERR;
+    } else {
+      UINT n = (len - 1 < req->data_len) ? len - 1 : req->data_len;
+      if (n > 0) {
+        memcpy(req->data, payload + 1, n);
+      }
+      fut->res = (FRESULT) payload[0];
+      fut->n = n;
+      if (req->frame[3] == F_PWRITE || req->frame[3] == F_WRITE) {
+        fut->n = (len >= 3) ? get16(payload + 1) : 0;
+      }
+    }
+    req->in_use = false;
+    outstanding--;
+    fut->done = 1;
+    return;
+  }
+  // Reply to a request that was sent twice. Already handled
+}
+
+// Sends all outstanding requests again, oldest first
+void TRS_FS_SERIAL::retransmit()
+{
+  uint32_t age = 0;
+
+  for (int i = 0; i < outstanding; i++) {
+    serial_req_t* next = NULL;
+    for (int j = 0; j < SERIAL_WINDOW; j++) {
+      if (reqs[j].in_use && reqs[j].age >= age &&
+          (next == NULL || reqs[j].age < next->age)) {
+        next = &reqs[j];
+      }
+    }
+    port->write(next->frame, next->frame_len);
+    age = next->age + 1;
+  }
+}
+
+void TRS_FS_SERIAL::fail_all(FRESULT res)
+{
+  for (int i = 0; i < SERIAL_WINDOW; i++) {
+    if (reqs[i].in_use) {
+      reqs[i].fut->n = 0;
+      reqs[i].fut->res = res;
+      reqs[i].in_use = false;
+      reqs[i].fut->done = 1;
+    }
+  }
+  outstanding = 0;
+}
+
+// Handles one reply, or resends the outstanding requests on timeout
+void TRS_FS_SERIAL::pump()
+{
+  if (receive(SERIAL_TIMEOUT_MS)) {
+    retries = 0;
+    return;
+  }
+  if (++retries > SERIAL_RETRIES) {
+    retries = 0;
+    fail_all(FR_TIMEOUT);
+    resync = true;
+    return;
+  }
+  retransmit();
+}
+
+FRESULT TRS_FS_SERIAL::wait(FFUTURE* fut)
+{
+  while (!fut->done) {
+    pump();
+  }
+  return fut->res;
+}
+
+/*
+ * Splits a transfer into blocks and keeps up to window of them in flight.
+ * Everything after a short or failed block is discarded.
+ */
+FRESULT TRS_FS_SERIAL::transfer(FIL* fp, uint8_t* buff, DWORD len,
+                                FSIZE_t ofs, DWORD* done, bool write)
+{
+  FFUTURE fut[SERIAL_WINDOW];
+  UINT chunk[SERIAL_WINDOW];
+  FRESULT res = FR_OK;
+  DWORD issued = 0;
+  int head = 0;
+  int count = 0;
+  bool stop = false;
+
+  *done = 0;
+  while (true) {
+    if (!stop && issued < len && count < window) {
+      int i = (head + count) % SERIAL_WINDOW;
+      chunk[i] = (len - issued > block) ? block : len - issued;
+      res = write ?
+        f_pwrite_async(fp, buff + issued, chunk[i], ofs + issued, &fut[i]) :
+        f_pread_async(fp, buff + issued, chunk[i], ofs + issued, &fut[i]);
+      if (res != FR_OK) {
+        stop = true;
+        continue;
+      }
+      issued += chunk[i];
+      count++;
+      continue;
+    }
+    if (count == 0) {
+      break;
+    }
+    UINT n;
+    FRESULT r = f_wait(&fut[head], &n);
+    if (r != FR_OK) {
+      if (res == FR_OK) {
+        res = r;
+      }
+      stop = true;
+    } else if (!stop) {
+      *done += n;
+      stop = n < chunk[head];
+    }
+    head = (head + 1) % SERIAL_WINDOW;
+    count--;
+  }
+  return res;
 }
-  
+
 void TRS_FS_SERIAL::f_log(const char* msg) {
-  send_marker();
-  write_byte(F_LOG);
-  write_string(msg);
-  read_byte();
+  LOCK();
+  serial_req_t* req = begin(F_LOG);
+  put_data(req, msg, strnlen(msg, SERIAL_MAX_PAYLOAD - 1));
+  put8(req, 0);
+  call(req, NULL, 0, NULL);
 }
-  
+
 FRESULT TRS_FS_SERIAL::f_open (
                                FIL* fp,           /* [OUT] Pointer to the file object structure */
                                const TCHAR* path, /* [IN] File name */
                                BYTE mode          /* [IN] Mode flags */
                                ) {
-  send_marker();
-  write_byte(F_OPEN);
-  write_byte(mode);
-  write_string(path);
-  FRESULT fr = read_fresult();
-  if (fr == FR_OK) {
-    fp->f = (void*) read_word();
+  if (!path_ok(path)) {
+    return FR_INVALID_NAME;
   }
-  return fr;
+  LOCK();
+  uint8_t reply[6];
+  UINT n;
+
+  fp->f = NULL;
+  serial_file_t* f = (serial_file_t*) malloc(sizeof(serial_file_t));
+  if (f == NULL) {
+    return FR_NOT_ENOUGH_CORE;
+  }
+  serial_req_t* req = begin(F_OPEN);
+  put8(req, mode);
+  put_string(req, path);
+  FRESULT fr = call(req, reply, sizeof(reply), &n);
+  if (fr == FR_OK && n < sizeof(reply)) {
+    fr = FR_INT_ERR;
+  }
+  if (fr != FR_OK) {
+    free(f);
+    return fr;
+  }
+  f->id = get16(reply);
+  f->pos = get32(reply + 2);
+  f->append = (mode & FA_OPEN_APPEND) == FA_OPEN_APPEND;
+  fp->f = f;
+  return FR_OK;
 }
 
 FRESULT TRS_FS_SERIAL::f_opendir (
                                   DIR_* dp,           /* [OUT] Pointer to the directory object structure */
                                   const TCHAR* path  /* [IN] Directory name */
                                   ) {
-  send_marker();
-  write_byte(F_OPENDIR);
-  write_string(path);
-  FRESULT fr = read_fresult();
+  if (!path_ok(path)) {
+    return FR_INVALID_NAME;
+  }
+  LOCK();
+  uint8_t reply[2];
+  UINT n;
+
+  serial_req_t* req = begin(F_OPENDIR);
+  put_string(req, path);
+  FRESULT fr = call(req, reply, sizeof(reply), &n);
+  if (fr == FR_OK && n < sizeof(reply)) {
+    fr = FR_INT_ERR;
+  }
   if (fr == FR_OK) {
-    dp->dir = (void*) read_word();
+    dp->dir = (void*) (uintptr_t) get16(reply);
   }
   return fr;
 }
@@ -147,19 +569,9 @@ FRESULT TRS_FS_SERIAL::f_write (
                                 UINT btw,         /* [IN] Number of bytes to write */
                                 UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
                                 ) {
-  send_marker();
-  write_byte(F_WRITE);
-  write_word((uint32_t) fp->f);
-  write_word(btw);
-  write_blob(buff, btw);
-#if 0
-  uint8_t* p = (uint8_t*) buff;
-  for (int i = 0; i < btw; i++) {
-    write_byte(*p++);
-  }
-#endif
-  FRESULT fr = read_fresult();
-  *bw = read_word();
+  DWORD n;
+  FRESULT fr = f_write32(fp, buff, btw, &n);
+  *bw = n;
   return fr;
 }
 
@@ -169,19 +581,9 @@ FRESULT TRS_FS_SERIAL::f_read (
                                UINT btr,    /* [IN] Number of bytes to read */
                                UINT* br     /* [OUT] Number of bytes read */
                                ) {
-  send_marker();
-  write_byte(F_READ);
-  write_word((uint32_t) fp->f);
-  write_word(btr);
-  FRESULT fr = read_fresult();
-  *br = read_word();
-  read_blob(buff, *br);
-#if 0
-  uint8_t* p = (uint8_t*) buff;
-  for (int i = 0; i < *br; i++) {
-    *p++ = read_byte();
-  }
-#endif
+  DWORD n;
+  FRESULT fr = f_read32(fp, buff, btr, &n);
+  *br = n;
   return fr;
 }
 
@@ -189,74 +591,241 @@ FRESULT TRS_FS_SERIAL::f_readdir (
                                   DIR_* dp,      /* [IN] Directory object */
                                   FILINFO* fno  /* [OUT] File information structure */
                                   ) {
-  send_marker();
-  write_byte(F_READDIR);
-  write_word((uint32_t) dp->dir);
-  FRESULT fr = read_fresult();
-  if (fr == FR_OK) {
-    read_string(fno->fname);
-    fno->fsize = read_long();
-    fno->fattrib = read_byte();
+  LOCK();
+  uint8_t reply[sizeof(fno->fname) + 9];
+  UINT n;
+
+  serial_req_t* req = begin(F_READDIR);
+  put16(req, (uintptr_t) dp->dir);
+  FRESULT fr = call(req, reply, sizeof(reply), &n);
+  if (fr != FR_OK) {
+    return fr;
+  }
+  // Name, size, attributes, date and time
+  uint8_t* end = (uint8_t*) memchr(reply, 0, n);
+  if (end == NULL || end - reply >= (int) sizeof(fno->fname) || end + 10 > reply + n) {
+    return FR_INT_ERR;
   }
+  strcpy(fno->fname, (const char*) reply);
+  fno->fsize = get32(end + 1);
+  fno->fattrib = end[5];
+  fno->fdate = get16(end + 6);
+  fno->ftime = get16(end + 8);
+  return FR_OK;
+}
+
+FRESULT TRS_FS_SERIAL::f_pread (
+                                FIL* fp,     /* [IN] File object */
+                                void* buff,  /* [OUT] Buffer to store read data */
+                                UINT btr,    /* [IN] Number of bytes to read */
+                                FSIZE_t ofs, /* [IN] File offset to read from */
+                                UINT* br     /* [OUT] Number of bytes read */
+                                ) {
+  DWORD n;
+  FRESULT fr = f_pread32(fp, buff, btr, ofs, &n);
+  *br = n;
+  return fr;
+}
+
+FRESULT TRS_FS_SERIAL::f_pwrite (
+                                 FIL* fp,          /* [IN] File object */
+                                 const void* buff, /* [IN] Pointer to the data to be written */
+                                 UINT btw,         /* [IN] Number of bytes to write */
+                                 FSIZE_t ofs,      /* [IN] File offset to write to */
+                                 UINT* bw          /* [OUT] Number of bytes written */
+                                 ) {
+  DWORD n;
+  FRESULT fr = f_pwrite32(fp, buff, btw, ofs, &n);
+  *bw = n;
+  return fr;
+}
+
+FRESULT TRS_FS_SERIAL::f_read32 (
+                                 FIL* fp,     /* [IN] File object */
+                                 void* buff,  /* [OUT] Buffer to store read data */
+                                 DWORD btr,   /* [IN] Number of bytes to read */
+                                 DWORD* br    /* [OUT] Number of bytes read */
+                                 ) {
+  LOCK();
+  serial_file_t* f = FILE_(fp);
+  FRESULT fr = transfer(fp, (uint8_t*) buff, btr, f->pos, br, false);
+  f->pos += *br;
+  return fr;
+}
+
+FRESULT TRS_FS_SERIAL::f_write32 (
+                                  FIL* fp,          /* [IN] Pointer to the file object structure */
+                                  const void* buff, /* [IN] Pointer to the data to be written */
+                                  DWORD btw,        /* [IN] Number of bytes to write */
+                                  DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                                  ) {
+  LOCK();
+  serial_file_t* f = FILE_(fp);
+  if (!f->append) {
+    FRESULT fr = transfer(fp, (uint8_t*) buff, btw, f->pos, bw, true);
+    f->pos += *bw;
+    return fr;
+  }
+
+  // Only the server knows where appended data goes
+  *bw = 0;
+  while (*bw < btw) {
+    uint8_t reply[6];
+    UINT len = (btw - *bw > block) ? block : btw - *bw;
+    UINT n;
+    serial_req_t* req = begin(F_WRITE);
+    put16(req, f->id);
+    put_data(req, (const uint8_t*) buff + *bw, len);
+    FRESULT fr = call(req, reply, sizeof(reply), &n);
+    if (fr != FR_OK) {
+      return fr;
+    }
+    f->pos = get32(reply + 2);
+    *bw += n;
+    if (n < len) {
+      break;
+    }
+  }
+  return FR_OK;
+}
+
+FRESULT TRS_FS_SERIAL::f_pread32 (
+                                  FIL* fp,     /* [IN] File object */
+                                  void* buff,  /* [OUT] Buffer to store read data */
+                                  DWORD btr,   /* [IN] Number of bytes to read */
+                                  FSIZE_t ofs, /* [IN] File offset to read from */
+                                  DWORD* br    /* [OUT] Number of bytes read */
+                                  ) {
+  LOCK();
+  return transfer(fp, (uint8_t*) buff, btr, ofs, br, false);
+}
+
+FRESULT TRS_FS_SERIAL::f_pwrite32 (
+                                   FIL* fp,          /* [IN] File object */
+                                   const void* buff, /* [IN] Pointer to the data to be written */
+                                   DWORD btw,        /* [IN] Number of bytes to write */
+                                   FSIZE_t ofs,      /* [IN] File offset to write to */
+                                   DWORD* bw         /* [OUT] Number of bytes written */
+                                   ) {
+  LOCK();
+  return transfer(fp, (uint8_t*) buff, btw, ofs, bw, true);
+}
+
+FRESULT TRS_FS_SERIAL::f_pread_async (
+                                      FIL* fp,     /* [IN] File object */
+                                      void* buff,  /* [OUT] Buffer to store read data */
+                                      UINT btr,    /* [IN] Number of bytes to read */
+                                      FSIZE_t ofs, /* [IN] File offset to read from */
+                                      FFUTURE* fut /* [OUT] Completion record */
+                                      ) {
+  LOCK();
+  if (btr > block) {
+    return TRS_FS::f_pread_async(fp, buff, btr, ofs, fut);
+  }
+  serial_req_t* req = begin(F_PREAD);
+  put16(req, FILE_(fp)->id);
+  put32(req, ofs);
+  put16(req, btr);
+  return send(req, fut, buff, btr);
+}
+
+FRESULT TRS_FS_SERIAL::f_pwrite_async (
+                                       FIL* fp,          /* [IN] File object */
+                                       const void* buff, /* [IN] Pointer to the data to be written */
+                                       UINT btw,         /* [IN] Number of bytes to write */
+                                       FSIZE_t ofs,      /* [IN] File offset to write to */
+                                       FFUTURE* fut      /* [OUT] Completion record */
+                                       ) {
+  LOCK();
+  if (btw > block) {
+    return TRS_FS::f_pwrite_async(fp, buff, btw, ofs, fut);
+  }
+  serial_req_t* req = begin(F_PWRITE);
+  put16(req, FILE_(fp)->id);
+  put32(req, ofs);
+  put_data(req, buff, btw);
+  return send(req, fut, NULL, 0);
+}
+
+FRESULT TRS_FS_SERIAL::f_wait (
+                               FFUTURE* fut, /* [IN] Completion record */
+                               UINT* n       /* [OUT] Number of bytes transferred */
+                               ) {
+  LOCK();
+  FRESULT fr = wait(fut);
+  *n = fut->n;
   return fr;
 }
 
 FSIZE_t TRS_FS_SERIAL::f_tell (
                                FIL* fp   /* [IN] File object */
                                ) {
-  assert(0);
+  return FILE_(fp)->pos;
 }
 
 FRESULT TRS_FS_SERIAL::f_sync (
                                FIL* fp     /* [IN] File object */
                                ) {
-  assert(0);
+  // The server does not buffer writes
+  return FR_OK;
 }
 
 FRESULT TRS_FS_SERIAL::f_lseek (
                                 FIL*    fp,  /* [IN] File object */
                                 FSIZE_t ofs  /* [IN] File read/write pointer */
                                 ) {
-  send_marker();
-  write_byte(F_LSEEK);
-  write_word((uint32_t) fp->f);
-  write_long(ofs);
-  FRESULT fr = read_fresult();
-  return fr;
+  // Reads and writes carry the position
+  FILE_(fp)->pos = ofs;
+  return FR_OK;
 }
-  
+
 FRESULT TRS_FS_SERIAL::f_close (
                                 FIL* fp     /* [IN] Pointer to the file object */
                                 ) {
-  send_marker();
-  write_byte(F_CLOSE);
-  write_word((uint32_t) fp->f);
-  FRESULT fr = read_fresult();
+  LOCK();
+  serial_req_t* req = begin(F_CLOSE);
+  put16(req, FILE_(fp)->id);
+  FRESULT fr = call(req, NULL, 0, NULL);
+  free(fp->f);
+  fp->f = NULL;
   return fr;
 }
 
 FRESULT TRS_FS_SERIAL::f_unlink (
                                  const TCHAR* path  /* [IN] Object name */
                                  ) {
-  send_marker();
-  write_byte(F_UNLINK);
-  write_string(path);
-  FRESULT fr = read_fresult();
-  return fr;
+  if (!path_ok(path)) {
+    return FR_INVALID_NAME;
+  }
+  LOCK();
+  serial_req_t* req = begin(F_UNLINK);
+  put_string(req, path);
+  return call(req, NULL, 0, NULL);
 }
 
 FRESULT TRS_FS_SERIAL::f_stat (
                                const TCHAR* path,  /* [IN] Object name */
                                FILINFO* fno        /* [OUT] FILINFO structure */
                                ) {
-  send_marker();
-  write_byte(F_STAT);
-  write_string(path);
-  FRESULT fr = read_fresult();
+  if (!path_ok(path)) {
+    return FR_INVALID_NAME;
+  }
+  LOCK();
+  uint8_t reply[9];
+  UINT n;
+
+  serial_req_t* req = begin(F_STAT);
+  put_string(req, path);
+  FRESULT fr = call(req, reply, sizeof(reply), &n);
+  if (fr == FR_OK && n < sizeof(reply)) {
+    fr = FR_INT_ERR;
+  }
   if (fr == FR_OK) {
-    strcpy(fno->fname, path);
-    fno->fsize = read_long();
-    fno->fattrib = read_byte();
+    set_fname(fno, path);
+    fno->fsize = get32(reply);
+    fno->fattrib = reply[4];
+    fno->fdate = get16(reply + 5);
+    fno->ftime = get16(reply + 7);
   }
   return fr;
 }
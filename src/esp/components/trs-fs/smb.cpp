@@ -14,6 +14,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/poll.h>
 #include <unistd.h>
 
 #include "smb.h"
@@ -21,22 +22,76 @@
 #include "smb2/libsmb2-raw.h"
 
 
+#define FH(fp) (((smb_file_t*) (fp)->f)->fh)
+#define SESSION(fp) (((smb_file_t*) (fp)->f)->session)
+
+
+class SMBLock {
+private:
+  SemaphoreHandle_t lock;
+public:
+  SMBLock(SemaphoreHandle_t lock) : lock(lock) {
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  }
+  ~SMBLock() {
+    xSemaphoreGiveRecursive(lock);
+  }
+};
+
+
 TRS_FS_SMB::TRS_FS_SMB() {
+  lock = xSemaphoreCreateRecursiveMutex();
+  memset(sessions, 0, sizeof(sessions));
+  for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+    sessions[i].lock = xSemaphoreCreateRecursiveMutex();
+  }
+  memset(stat_cache, 0, sizeof(stat_cache));
   err_msg = init();
+  if (err_msg == NULL) {
+    service_running = true;
+    xTaskCreatePinnedToCore(service_task_main, "smb", 4096, this, 1,
+                            &service_task, 0);
+  }
 }
 
 TRS_FS_SMB::~TRS_FS_SMB()
 {
-  if (smb2 != NULL) {
-    smb2_disconnect_share(smb2);
-    //smb2_destroy_url(url);
-    smb2_destroy_context(smb2);
+  for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+    drain(&sessions[i]);
+  }
+  if (service_task != NULL) {
+    service_running = false;
+    xTaskNotifyGive(service_task);
+    while (service_task != NULL) {
+      vTaskDelay(1);
+    }
   }
 
-  if (smb_url != NULL) {
-    free(smb_url);
-    smb_url = NULL;
+  for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+    smb_session_t* s = &sessions[i];
+    if (s->smb2 != NULL) {
+      pool_flush(s);
+      smb2_disconnect_share(s->smb2);
+      smb2_destroy_context(s->smb2);
+    }
+    vSemaphoreDelete(s->lock);
+  }
+
+  if (url != NULL) {
+    smb2_destroy_url(url);
+  }
+  free(user);
+  free(passwd);
+  if (share_path != NULL) {
+    free(share_path);
+    share_path = NULL;
   }
+
+  for (int i = 0; i < SMB_STAT_CACHE_SIZE; i++) {
+    free(stat_cache[i].path);
+  }
+
+  vSemaphoreDelete(lock);
 }
 
 FS_TYPE TRS_FS_SMB::type()
@@ -46,16 +101,15 @@ FS_TYPE TRS_FS_SMB::type()
 
 const char* TRS_FS_SMB::init()
 {
-  char* smb_user = NULL;
-  char* smb_passwd = NULL;
-  struct smb2_url* url = NULL;
+  char* smb_url = NULL;
 
   if (!storage_has_key(SMB_KEY_URL) || !storage_has_key(SMB_KEY_USER) || !storage_has_key(SMB_KEY_PASSWD)) {
     return "Missing SMB share configuration";
   }
   
-  smb2 = smb2_init_context();
-  if (smb2 == NULL) {
+  smb_session_t* s = &sessions[0];
+  s->smb2 = smb2_init_context();
+  if (s->smb2 == NULL) {
     return "Failed to initialize SMB";
   }
 
@@ -64,30 +118,405 @@ const char* TRS_FS_SMB::init()
   smb_url = (char*) malloc(len);
   storage_get_str(SMB_KEY_URL, smb_url, &len);
 
-  url = smb2_parse_url(smb2, smb_url);
+  url = smb2_parse_url(s->smb2, smb_url);
+  free(smb_url);
   if (url == NULL) {
-    return smb2_get_error(smb2);
+    return smb2_get_error(s->smb2);
   }
+  share_path = strdup((url->path == NULL) ? "" : url->path);
 
   storage_get_str(SMB_KEY_USER, NULL, &len);
-  smb_user = (char*) malloc(len);
-  storage_get_str(SMB_KEY_USER, smb_user, &len);
+  user = (char*) malloc(len);
+  storage_get_str(SMB_KEY_USER, user, &len);
 
   storage_get_str(SMB_KEY_PASSWD, NULL, &len);
-  smb_passwd = (char*) malloc(len);
-  storage_get_str(SMB_KEY_PASSWD, smb_passwd, &len);
+  passwd = (char*) malloc(len);
+  storage_get_str(SMB_KEY_PASSWD, passwd, &len);
+
+  s->owner = xTaskGetCurrentTaskHandle();
+  return connect(s);
+}
+
+// Connects s->smb2 to the share. The context is kept on failure for the error message
+const char* TRS_FS_SMB::connect(smb_session_t* s)
+{
+  if (s->smb2 == NULL) {
+    s->smb2 = smb2_init_context();
+    if (s->smb2 == NULL) {
+      return "Failed to initialize SMB";
+    }
+  }
+  smb2_set_security_mode(s->smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+  smb2_set_user(s->smb2, user);
+  smb2_set_password(s->smb2, passwd);
+
+  int rc = smb2_connect_share(s->smb2, url->server, url->share, url->user);
+  return (rc == 0) ? NULL : smb2_get_error(s->smb2);
+}
+
+/*
+ * Returns the session of the calling task. A task that has none yet gets
+ * a free one connected. If none is left, or connecting fails, the task
+ * shares the first session.
+ */
+smb_session_t* TRS_FS_SMB::session()
+{
+  TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  TickType_t now = xTaskGetTickCount();
+  smb_session_t* s = NULL;
 
-  smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
-  smb2_set_user(smb2, smb_user);
-  smb2_set_password(smb2, smb_passwd);
+  {
+    SMBLock l(lock);
+    for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+      if (sessions[i].owner == task) {
+        sessions[i].last_used = now;
+        return (sessions[i].smb2 != NULL) ? &sessions[i] : &sessions[0];
+      }
+    }
+    if (connect_failed &&
+        now - connect_failed_at < pdMS_TO_TICKS(SMB_SESSION_IDLE_MS)) {
+      return &sessions[0];
+    }
+    for (int i = 1; i < SMB_MAX_SESSIONS && s == NULL; i++) {
+      if (sessions[i].owner == NULL) {
+        s = &sessions[i];
+      }
+    }
+    if (s == NULL) {
+      return &sessions[0];
+    }
+    s->owner = task;
+    s->last_used = now;
+  }
 
-  free(smb_user);
-  free(smb_passwd);
+  // Connecting takes a few round trips. Other sessions are not held up
+  {
+    SMBLock l(s->lock);
+    if (connect(s) == NULL) {
+      return s;
+    }
+    smb2_destroy_context(s->smb2);
+    s->smb2 = NULL;
+  }
+  // The session is free for another attempt later on
+  SMBLock l(lock);
+  s->owner = NULL;
+  connect_failed = true;
+  connect_failed_at = xTaskGetTickCount();
+  return &sessions[0];
+}
 
-  int rc = smb2_connect_share(smb2, url->server, url->share, url->user);
-  smb2_destroy_url(url);
+/*
+ * Disconnects s and makes it available to other tasks once its task has
+ * not used it for SMB_SESSION_IDLE_MS, unless files are still open on it.
+ * This runs under the lock that session() takes, so that the task cannot
+ * pick the session up while it is torn down.
+ */
+void TRS_FS_SMB::release_idle(smb_session_t* s)
+{
+  SMBLock l(lock);
+  if (s->owner == NULL ||
+      xTaskGetTickCount() - s->last_used < pdMS_TO_TICKS(SMB_SESSION_IDLE_MS)) {
+    return;
+  }
+  if (xSemaphoreTakeRecursive(s->lock, 0) != pdTRUE) {
+    return;
+  }
+  if (s->in_flight == 0 && s->open_files == 0) {
+    if (s->smb2 != NULL) {
+      pool_flush(s);
+      smb2_disconnect_share(s->smb2);
+      smb2_destroy_context(s->smb2);
+      s->smb2 = NULL;
+    }
+    s->owner = NULL;
+  }
+  xSemaphoreGiveRecursive(s->lock);
+}
 
-  return (rc == 0) ? NULL : smb2_get_error(smb2);
+bool TRS_FS_SMB::busy()
+{
+  for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+    if (sessions[i].in_flight > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * The service task keeps the connections moving while asynchronous requests
+ * are in flight so that they complete even if nobody is waiting for them
+ * (e.g. write-behind). Callers of f_wait() drive the connections themselves
+ * so that they do not depend on the scheduling of this task.
+ */
+void TRS_FS_SMB::service_task_main(void* arg)
+{
+  TRS_FS_SMB* fs = (TRS_FS_SMB*) arg;
+
+  while (fs->service_running) {
+    if (!fs->busy()) {
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+      for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+        smb_session_t* s = &fs->sessions[i];
+        if (i > 0) {
+          fs->release_idle(s);
+        }
+        SMBLock l(s->lock);
+        if (s->smb2 != NULL) {
+          fs->pool_expire(s);
+        }
+      }
+      continue;
+    }
+    fs->service(SMB_POLL_MS);
+  }
+  fs->service_task = NULL;
+  vTaskDelete(NULL);
+}
+
+void TRS_FS_SMB::async_cb(struct smb2_context* smb2, int status,
+                          void* command_data, void* cb_data)
+{
+  smb_async_req_t* req = (smb_async_req_t*) cb_data;
+  FFUTURE* fut = req->fut;
+
+  fut->n = (status >= 0) ? status : 0;
+  fut->res = (status >= 0) ? FR_OK : FR_DISK_ERR;
+  if (req->generation != NULL) {
+    // A stat of the file may have been answered while the write was on
+    // its way
+    (*req->generation)++;
+  }
+  req->in_use = false;
+  req->session->in_flight--;
+  fut->done = 1;
+}
+
+smb_async_req_t* TRS_FS_SMB::alloc_req(smb_session_t* s, FFUTURE* fut)
+{
+  while (true) {
+    {
+      SMBLock l(s->lock);
+      for (int i = 0; i < SMB_MAX_IN_FLIGHT; i++) {
+        if (!s->reqs[i].in_use) {
+          s->reqs[i].session = s;
+          s->reqs[i].fut = fut;
+          s->reqs[i].generation = NULL;
+          s->reqs[i].in_use = true;
+          s->in_flight++;
+          return &s->reqs[i];
+        }
+      }
+    }
+    // Pipeline is full. Wait for a slot to become available
+    service(SMB_POLL_MS);
+  }
+}
+
+/*
+ * Drives all sessions that have requests in flight. A session that is
+ * locked is skipped: its holder is waiting for a reply on the same
+ * connection, which completes the asynchronous requests as well.
+ */
+void TRS_FS_SMB::service(int timeout_ms)
+{
+  struct pollfd pfd[SMB_MAX_SESSIONS];
+  smb_session_t* busy[SMB_MAX_SESSIONS];
+  int n = 0;
+  bool skipped = false;
+
+  for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+    smb_session_t* s = &sessions[i];
+    if (s->in_flight == 0) {
+      continue;
+    }
+    if (xSemaphoreTakeRecursive(s->lock, 0) != pdTRUE) {
+      skipped = true;
+      continue;
+    }
+    if (s->in_flight > 0) {
+      pfd[n].fd = smb2_get_fd(s->smb2);
+      pfd[n].events = smb2_which_events(s->smb2);
+      pfd[n].revents = 0;
+      busy[n++] = s;
+    }
+    xSemaphoreGiveRecursive(s->lock);
+  }
+  if (n == 0) {
+    if (skipped) {
+      vTaskDelay(1);
+    }
+    return;
+  }
+
+  // Do not hold the locks while waiting for the sockets
+  if (poll(pfd, n, timeout_ms) < 0) {
+    for (int i = 0; i < n; i++) {
+      pfd[i].revents = 0;
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    smb_session_t* s = busy[i];
+    SMBLock l(s->lock);
+    if (s->in_flight == 0) {
+      continue;
+    }
+    // Also called without events so that libsmb2 can expire timed out PDUs
+    if (smb2_service(s->smb2, pfd[i].revents) < 0) {
+      fail_all(s);
+    }
+  }
+}
+
+// Connection is broken. Fails everything that is still outstanding
+void TRS_FS_SMB::fail_all(smb_session_t* s)
+{
+  for (int i = 0; i < SMB_MAX_IN_FLIGHT; i++) {
+    if (s->reqs[i].in_use) {
+      s->reqs[i].fut->n = 0;
+      s->reqs[i].fut->res = FR_DISK_ERR;
+      if (s->reqs[i].generation != NULL) {
+        // The write may have reached the file anyway
+        (*s->reqs[i].generation)++;
+      }
+      s->reqs[i].in_use = false;
+      s->reqs[i].fut->done = 1;
+    }
+  }
+  s->in_flight = 0;
+}
+
+void TRS_FS_SMB::drain(smb_session_t* s)
+{
+  while (s->in_flight > 0) {
+    service(SMB_POLL_MS);
+  }
+}
+
+smb_stat_entry_t* TRS_FS_SMB::stat_lookup(const char* path)
+{
+  TickType_t now = xTaskGetTickCount();
+
+  for (int i = 0; i < SMB_STAT_CACHE_SIZE; i++) {
+    smb_stat_entry_t* e = &stat_cache[i];
+    if (e->path == NULL || e->generation != stat_generation ||
+        now - e->loaded > pdMS_TO_TICKS(SMB_STAT_CACHE_TTL_MS)) {
+      continue;
+    }
+    if (strcmp(e->path, path) == 0) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+void TRS_FS_SMB::stat_insert(const char* path, FRESULT res, FILINFO* fno)
+{
+  char* p = strdup(path);
+  if (p == NULL) {
+    return;
+  }
+  // Entries are replaced round robin. They all expire quickly anyway
+  smb_stat_entry_t* e = &stat_cache[stat_next];
+  stat_next = (stat_next + 1) % SMB_STAT_CACHE_SIZE;
+  free(e->path);
+  e->path = p;
+  e->generation = stat_generation;
+  e->loaded = xTaskGetTickCount();
+  e->res = res;
+  e->fno = *fno;
+}
+
+void TRS_FS_SMB::invalidate()
+{
+  stat_generation++;
+  dir_cache.invalidate();
+}
+
+const char* TRS_FS_SMB::full_path(const char* path, char* buf)
+{
+  if (share_path[0] == '\0') {
+    return path;
+  }
+  if (path[0] == '\0') {
+    return share_path;
+  }
+  snprintf(buf, SMB_MAX_PATH, "%s/%s", share_path, path);
+  return buf;
+}
+
+/*
+ * Closing and reopening the same file costs a CLOSE and a CREATE round trip.
+ * Handles opened without create or truncate semantics are therefore parked
+ * for a short while on f_close() and handed out again by an f_open() of the
+ * same path with the same flags on the same session.
+ */
+smb_file_t* TRS_FS_SMB::pool_take(smb_session_t* s, const char* path, int flags)
+{
+  for (int i = 0; i < SMB_HANDLE_POOL_SIZE; i++) {
+    smb_file_t* f = s->handle_pool[i];
+    if (f != NULL && f->flags == flags && strcmp(f->path, path) == 0) {
+      s->handle_pool[i] = NULL;
+      return f;
+    }
+  }
+  return NULL;
+}
+
+bool TRS_FS_SMB::pool_put(smb_file_t* f)
+{
+  if (f->flags != O_RDONLY && f->flags != O_RDWR) {
+    return false;
+  }
+  smb_file_t** pool = f->session->handle_pool;
+  int victim = 0;
+  for (int i = 0; i < SMB_HANDLE_POOL_SIZE; i++) {
+    if (pool[i] == NULL) {
+      victim = i;
+      break;
+    }
+    if ((TickType_t) (pool[victim]->closed - pool[i]->closed) < 0x80000000u) {
+      victim = i;
+    }
+  }
+  if (pool[victim] != NULL) {
+    pool_close(f->session, victim);
+  }
+  f->closed = xTaskGetTickCount();
+  pool[victim] = f;
+  return true;
+}
+
+void TRS_FS_SMB::pool_close(smb_session_t* s, int i)
+{
+  smb_file_t* f = s->handle_pool[i];
+  s->handle_pool[i] = NULL;
+  smb2_close(s->smb2, f->fh);
+  free(f->path);
+  free(f);
+}
+
+void TRS_FS_SMB::pool_expire(smb_session_t* s)
+{
+  TickType_t now = xTaskGetTickCount();
+
+  for (int i = 0; i < SMB_HANDLE_POOL_SIZE; i++) {
+    if (s->handle_pool[i] != NULL &&
+        now - s->handle_pool[i]->closed > pdMS_TO_TICKS(SMB_HANDLE_POOL_TTL_MS)) {
+      pool_close(s, i);
+    }
+  }
+}
+
+void TRS_FS_SMB::pool_flush(smb_session_t* s)
+{
+  for (int i = 0; i < SMB_HANDLE_POOL_SIZE; i++) {
+    if (s->handle_pool[i] != NULL) {
+      pool_close(s, i);
+    }
+  }
 }
 
 void TRS_FS_SMB::f_log(const char* msg) {
@@ -99,8 +528,6 @@ FRESULT TRS_FS_SMB::f_open (
                             const TCHAR* path, /* [IN] File name */
                             BYTE mode          /* [IN] Mode flags */
                             ) {
-  struct smb2_url *url;
-  char* smb_path;
   int m = 0;
   
   switch(mode) {
@@ -132,27 +559,86 @@ FRESULT TRS_FS_SMB::f_open (
     assert(0);
   }
 
-  asprintf(&smb_path, "%s/%s", smb_url, path);
-  url = smb2_parse_url(smb2, smb_path);
-  free(smb_path);
-  if (url == NULL) {
-    return FR_NO_FILE;
+  if (mode & FA_WRITE) {
+    invalidate();
+  }
+
+  char buf[SMB_MAX_PATH];
+  path = full_path(path, buf);
+  smb_session_t* s = session();
+  SMBLock l(s->lock);
+  smb_file_t* f = pool_take(s, path, m);
+  if (f != NULL) {
+    uint64_t current_offset;
+    smb2_lseek(s->smb2, f->fh, 0, SEEK_SET, &current_offset);
+    s->open_files++;
+    fp->f = f;
+    return FR_OK;
   }
 
-  fp->f = (struct smb2fh*) smb2_open(smb2, url->path, m);
-  smb2_destroy_url(url);
-  return (fp->f == NULL) ? FR_NO_FILE : FR_OK;
+  fp->f = NULL;
+  struct smb2fh* fh = smb2_open(s->smb2, path, m);
+  if (fh == NULL) {
+    // The NT status only shows in the error message
+    const char* err = smb2_get_error(s->smb2);
+    if (strstr(err, "ACCESS_DENIED") != NULL) {
+      return FR_DENIED;
+    }
+    return (strstr(err, "WRITE_PROTECTED") != NULL) ? FR_WRITE_PROTECTED : FR_NO_FILE;
+  }
+  f = (smb_file_t*) malloc(sizeof(smb_file_t));
+  if (f == NULL || (f->path = strdup(path)) == NULL) {
+    free(f);
+    smb2_close(s->smb2, fh);
+    return FR_NOT_ENOUGH_CORE;
+  }
+  f->fh = fh;
+  f->flags = m;
+  f->session = s;
+  s->open_files++;
+  fp->f = f;
+  return FR_OK;
 }
 
 FRESULT TRS_FS_SMB::f_opendir (
                                DIR_* dp,           /* [OUT] Pointer to the directory object structure */
                                const TCHAR* path  /* [IN] Directory name */
                                ) {
+  dp->dir = dir_cache.lookup(path);
+  if (dp->dir != NULL) {
+    return FR_OK;
+  }
+
+  smb_session_t* s = session();
+  SMBLock l(s->lock);
   if ((strcmp(path, ".") == 0) || (strcmp(path, "/") == 0)) {
     path = "";
   }
-  dp->dir = (struct smb2dir*) smb2_opendir(smb2, path);
-  return (dp->dir != NULL) ? FR_OK : FR_DISK_ERR;
+  char buf[SMB_MAX_PATH];
+  struct smb2dir* dir = smb2_opendir(s->smb2, full_path(path, buf));
+  if (dir == NULL) {
+    return FR_DISK_ERR;
+  }
+
+  // The directory entries already carry size and type
+  dir_listing_t* listing = dir_cache.create(path);
+  bool ok = (listing != NULL);
+  struct smb2dirent* entry;
+  while (ok && (entry = smb2_readdir(s->smb2, dir)) != NULL) {
+    bool is_dir = entry->st.smb2_type == SMB2_TYPE_DIRECTORY;
+    ok = dir_cache.add(listing, entry->name, is_dir ? 0 : entry->st.smb2_size,
+                       is_dir ? AM_DIR : AM_RDO, entry->st.smb2_mtime);
+  }
+  smb2_closedir(s->smb2, dir);
+
+  if (!ok) {
+    if (listing != NULL) {
+      dir_cache.discard(listing);
+    }
+    return FR_NOT_ENOUGH_CORE;
+  }
+  dp->dir = dir_cache.publish(listing);
+  return (dp->dir != NULL) ? FR_OK : FR_NOT_ENOUGH_CORE;
 }
 
 FRESULT TRS_FS_SMB::f_write (
@@ -161,7 +647,10 @@ FRESULT TRS_FS_SMB::f_write (
                              UINT btw,         /* [IN] Number of bytes to write */
                              UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
                              ) {
-  int _bw = smb2_write(smb2, (struct smb2fh*) fp->f, (uint8_t*) buff, btw);
+  SMBLock l(SESSION(fp)->lock);
+  stat_generation++;
+  int _bw = smb2_write(SESSION(fp)->smb2, FH(fp), (uint8_t*) buff, btw);
+  stat_generation++;
   *bw = _bw;
   return (_bw >= 0) ? FR_OK : FR_DISK_ERR;
 }
@@ -172,7 +661,8 @@ FRESULT TRS_FS_SMB::f_read (
                             UINT btr,    /* [IN] Number of bytes to read */
                             UINT* br     /* [OUT] Number of bytes read */
                             ) {
-  int _br = smb2_read(smb2, (struct smb2fh*) fp->f, (uint8_t*) buff, btr);
+  SMBLock l(SESSION(fp)->lock);
+  int _br = smb2_read(SESSION(fp)->smb2, FH(fp), (uint8_t*) buff, btr);
   *br = _br;
   return (_br >= 0) ? FR_OK : FR_DISK_ERR;
 }
@@ -181,78 +671,322 @@ FRESULT TRS_FS_SMB::f_readdir (
                                DIR_* dp,      /* [IN] Directory object */
                                FILINFO* fno  /* [OUT] File information structure */
                                   ) {
-  while (1) {
-    struct smb2dirent* entry = smb2_readdir(smb2, (struct smb2dir*) dp->dir);
-    if (entry == NULL) {
-      smb2_closedir(smb2, (struct smb2dir*) dp->dir);
-      fno->fname[0] = '\0';
-      break;
-    }
-    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+  return dir_cache.read(dp, fno);
+}
+
+FRESULT TRS_FS_SMB::f_closedir (
+                                DIR_* dp  /* [IN] Directory object */
+                                ) {
+  return dir_cache.close(dp);
+}
+
+FRESULT TRS_FS_SMB::f_pread (
+                             FIL* fp,     /* [IN] File object */
+                             void* buff,  /* [OUT] Buffer to store read data */
+                             UINT btr,    /* [IN] Number of bytes to read */
+                             FSIZE_t ofs, /* [IN] File offset to read from */
+                             UINT* br     /* [OUT] Number of bytes read */
+                             ) {
+  SMBLock l(SESSION(fp)->lock);
+  int _br = smb2_pread(SESSION(fp)->smb2, FH(fp), (uint8_t*) buff, btr, ofs);
+  *br = (_br >= 0) ? _br : 0;
+  return (_br >= 0) ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT TRS_FS_SMB::f_pwrite (
+                              FIL* fp,          /* [IN] File object */
+                              const void* buff, /* [IN] Pointer to the data to be written */
+                              UINT btw,         /* [IN] Number of bytes to write */
+                              FSIZE_t ofs,      /* [IN] File offset to write to */
+                              UINT* bw          /* [OUT] Number of bytes written */
+                              ) {
+  SMBLock l(SESSION(fp)->lock);
+  stat_generation++;
+  int _bw = smb2_pwrite(SESSION(fp)->smb2, FH(fp), (const uint8_t*) buff, btw, ofs);
+  stat_generation++;
+  *bw = (_bw >= 0) ? _bw : 0;
+  return (_bw >= 0) ? FR_OK : FR_DISK_ERR;
+}
+
+FRESULT TRS_FS_SMB::f_read32 (
+                              FIL* fp,     /* [IN] File object */
+                              void* buff,  /* [OUT] Buffer to store read data */
+                              DWORD btr,   /* [IN] Number of bytes to read */
+                              DWORD* br    /* [OUT] Number of bytes read */
+                              ) {
+  FSIZE_t pos = f_tell(fp);
+  FRESULT res = f_pread32(fp, buff, btr, pos, br);
+  if (res == FR_OK) {
+    res = f_lseek(fp, pos + *br);
+  }
+  return res;
+}
+
+FRESULT TRS_FS_SMB::f_write32 (
+                               FIL* fp,          /* [IN] Pointer to the file object structure */
+                               const void* buff, /* [IN] Pointer to the data to be written */
+                               DWORD btw,        /* [IN] Number of bytes to write */
+                               DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                               ) {
+  if (((smb_file_t*) fp->f)->flags & O_APPEND) {
+    // Only the server knows where appended data goes
+    return TRS_FS::f_write32(fp, buff, btw, bw);
+  }
+  FSIZE_t pos = f_tell(fp);
+  FRESULT res = f_pwrite32(fp, buff, btw, pos, bw);
+  if (res == FR_OK) {
+    res = f_lseek(fp, pos + *bw);
+  }
+  return res;
+}
+
+/*
+ * Splits the transfer into SMB_CHUNK_SIZE requests and keeps up to
+ * SMB_MAX_IN_FLIGHT of them on the wire. The results are collected in
+ * order; everything after a short or failed chunk is discarded.
+ */
+FRESULT TRS_FS_SMB::transfer32(FIL* fp, uint8_t* buff, DWORD len,
+                               FSIZE_t ofs, DWORD* done, bool write)
+{
+  FFUTURE fut[SMB_MAX_IN_FLIGHT];
+  UINT chunk[SMB_MAX_IN_FLIGHT];
+  FRESULT res = FR_OK;
+  DWORD issued = 0;
+  int head = 0;
+  int count = 0;
+  bool stop = false;
+
+  *done = 0;
+  while (true) {
+    if (!stop && issued < len && count < SMB_MAX_IN_FLIGHT) {
+      int i = (head + count) % SMB_MAX_IN_FLIGHT;
+      chunk[i] = (len - issued > SMB_CHUNK_SIZE) ? SMB_CHUNK_SIZE : len - issued;
+      res = write ?
+        f_pwrite_async(fp, buff + issued, chunk[i], ofs + issued, &fut[i]) :
+        f_pread_async(fp, buff + issued, chunk[i], ofs + issued, &fut[i]);
+      if (res != FR_OK) {
+        stop = true;
+        continue;
+      }
+      issued += chunk[i];
+      count++;
       continue;
     }
-    if (strlen(entry->name) > 12) {
-      continue;
+    if (count == 0) {
+      break;
     }
-    strcpy(fno->fname, entry->name);
-    fno->fsize = entry->st.smb2_size;
-    fno->fattrib = 1;
-    break;
+    UINT n;
+    FRESULT r = f_wait(&fut[head], &n);
+    if (r != FR_OK) {
+      if (res == FR_OK) {
+        res = r;
+      }
+      stop = true;
+    } else if (!stop) {
+      *done += n;
+      stop = n < chunk[head];
+    }
+    head = (head + 1) % SMB_MAX_IN_FLIGHT;
+    count--;
   }
+  return res;
+}
+
+FRESULT TRS_FS_SMB::f_pread32 (
+                               FIL* fp,     /* [IN] File object */
+                               void* buff,  /* [OUT] Buffer to store read data */
+                               DWORD btr,   /* [IN] Number of bytes to read */
+                               FSIZE_t ofs, /* [IN] File offset to read from */
+                               DWORD* br    /* [OUT] Number of bytes read */
+                               ) {
+  return transfer32(fp, (uint8_t*) buff, btr, ofs, br, false);
+}
+
+FRESULT TRS_FS_SMB::f_pwrite32 (
+                                FIL* fp,          /* [IN] File object */
+                                const void* buff, /* [IN] Pointer to the data to be written */
+                                DWORD btw,        /* [IN] Number of bytes to write */
+                                FSIZE_t ofs,      /* [IN] File offset to write to */
+                                DWORD* bw         /* [OUT] Number of bytes written */
+                                ) {
+  return transfer32(fp, (uint8_t*) buff, btw, ofs, bw, true);
+}
+
+FRESULT TRS_FS_SMB::f_pread_async (
+                                   FIL* fp,     /* [IN] File object */
+                                   void* buff,  /* [OUT] Buffer to store read data */
+                                   UINT btr,    /* [IN] Number of bytes to read */
+                                   FSIZE_t ofs, /* [IN] File offset to read from */
+                                   FFUTURE* fut /* [OUT] Completion record */
+                                   ) {
+  fut->done = 0;
+  fut->n = 0;
+  fut->res = FR_OK;
+  smb_session_t* s = SESSION(fp);
+  smb_async_req_t* req = alloc_req(s, fut);
+  SMBLock l(s->lock);
+  if (smb2_pread_async(s->smb2, FH(fp), (uint8_t*) buff, btr, ofs,
+                       async_cb, req) < 0) {
+    req->in_use = false;
+    s->in_flight--;
+    return FR_DISK_ERR;
+  }
+  xTaskNotifyGive(service_task);
   return FR_OK;
 }
 
+FRESULT TRS_FS_SMB::f_pwrite_async (
+                                    FIL* fp,          /* [IN] File object */
+                                    const void* buff, /* [IN] Pointer to the data to be written */
+                                    UINT btw,         /* [IN] Number of bytes to write */
+                                    FSIZE_t ofs,      /* [IN] File offset to write to */
+                                    FFUTURE* fut      /* [OUT] Completion record */
+                                    ) {
+  fut->done = 0;
+  fut->n = 0;
+  fut->res = FR_OK;
+  smb_session_t* s = SESSION(fp);
+  smb_async_req_t* req = alloc_req(s, fut);
+  SMBLock l(s->lock);
+  stat_generation++;
+  req->generation = &stat_generation;
+  if (smb2_pwrite_async(s->smb2, FH(fp), (const uint8_t*) buff, btw, ofs,
+                        async_cb, req) < 0) {
+    req->in_use = false;
+    s->in_flight--;
+    return FR_DISK_ERR;
+  }
+  xTaskNotifyGive(service_task);
+  return FR_OK;
+}
+
+FRESULT TRS_FS_SMB::f_wait (
+                            FFUTURE* fut, /* [IN] Completion record */
+                            UINT* n       /* [OUT] Number of bytes transferred */
+                            ) {
+  while (!fut->done) {
+    service(SMB_POLL_MS);
+  }
+  *n = fut->n;
+  return fut->res;
+}
+
 FSIZE_t TRS_FS_SMB::f_tell (
                             FIL* fp   /* [IN] File object */
                             ) {
-  assert(0);
+  uint64_t current_offset;
+
+  SMBLock l(SESSION(fp)->lock);
+  if (smb2_lseek(SESSION(fp)->smb2, FH(fp), 0, SEEK_CUR, &current_offset) < 0) {
+    return 0;
+  }
+  return current_offset;
 }
 
 FRESULT TRS_FS_SMB::f_sync (
                             FIL* fp     /* [IN] File object */
                             ) {
-  assert(0);
+  smb_session_t* s = SESSION(fp);
+  drain(s);
+  SMBLock l(s->lock);
+  return (smb2_fsync(s->smb2, FH(fp)) == 0) ? FR_OK : FR_DISK_ERR;
 }
 
 FRESULT TRS_FS_SMB::f_lseek (
                              FIL*    fp,  /* [IN] File object */
                              FSIZE_t ofs  /* [IN] File read/write pointer */
                              ) {
+  SMBLock l(SESSION(fp)->lock);
   uint64_t current_offset;
   
-  smb2_lseek(smb2, (struct smb2fh*) fp->f, ofs, SEEK_SET, &current_offset);
+  smb2_lseek(SESSION(fp)->smb2, FH(fp), ofs, SEEK_SET, &current_offset);
   return FR_OK;
 }
   
 FRESULT TRS_FS_SMB::f_close (
                              FIL* fp     /* [IN] Pointer to the file object */
                              ) {
-  smb2_close(smb2, (struct smb2fh*) fp->f);
+  smb_file_t* f = (smb_file_t*) fp->f;
+  smb_session_t* s = f->session;
+  // Outstanding requests may still refer to this handle
+  drain(s);
+  SMBLock l(s->lock);
+  s->open_files--;
+  pool_expire(s);
+  if (!pool_put(f)) {
+    smb2_close(s->smb2, f->fh);
+    free(f->path);
+    free(f);
+  }
   return FR_OK;
 }
 
 FRESULT TRS_FS_SMB::f_unlink (
                               const TCHAR* path  /* [IN] Object name */
                               ) {
-  return smb2_unlink(smb2, path) ? FR_NO_FILE : FR_OK;
+  invalidate();
+  // A parked handle would keep the file from being deleted
+  for (int i = 0; i < SMB_MAX_SESSIONS; i++) {
+    SMBLock l(sessions[i].lock);
+    pool_flush(&sessions[i]);
+  }
+  smb_session_t* s = session();
+  SMBLock l(s->lock);
+  char buf[SMB_MAX_PATH];
+  return smb2_unlink(s->smb2, full_path(path, buf)) ? FR_NO_FILE : FR_OK;
 }
 
 FRESULT TRS_FS_SMB::f_stat (
                             const TCHAR* path,  /* [IN] Object name */
                             FILINFO* fno        /* [OUT] FILINFO structure */
                             ) {
-  struct smb2fh* fh = smb2_open(smb2, path, O_RDONLY);
-  if (fh == NULL) {
-    return FR_NO_FILE;
+  {
+    SMBLock l(lock);
+    smb_stat_entry_t* e = stat_lookup(path);
+    if (e != NULL) {
+      if (e->res == FR_OK) {
+        *fno = e->fno;
+      }
+      return e->res;
+    }
   }
+  return f_stat_uncached(path, fno);
+}
+
+FRESULT TRS_FS_SMB::f_stat_uncached (
+                                     const TCHAR* path,  /* [IN] Object name */
+                                     FILINFO* fno        /* [OUT] FILINFO structure */
+                                     ) {
+  // smb2_stat() sends CREATE, QUERY_INFO and CLOSE as one compound request
   struct smb2_stat_64 st;
-  if (smb2_fstat(smb2, fh, &st) != 0) {
-    smb2_close(smb2, fh);
-    return FR_NO_FILE;
-  }
-  strcpy(fno->fname, path);
-  fno->fsize = st.smb2_size;
-  fno->fattrib = 1; //XXX
-  smb2_close(smb2, fh);
-  return FR_OK;
+  FILINFO info;
+  FRESULT res = FR_NO_FILE;
+  memset(&info, 0, sizeof(info));
+  char buf[SMB_MAX_PATH];
+  uint32_t generation = stat_generation;
+  smb_session_t* s = session();
+  int rc;
+  {
+    SMBLock l(s->lock);
+    rc = smb2_stat(s->smb2, full_path(path, buf), &st);
+  }
+  if (rc == 0) {
+    const char* name = strrchr(path, '/');
+    name = (name == NULL) ? path : name + 1;
+    strncpy(info.fname, name, sizeof(info.fname) - 1);
+    info.fsize = st.smb2_size;
+    info.fattrib = (st.smb2_type == SMB2_TYPE_DIRECTORY) ? AM_DIR : AM_RDO;
+    DirCache::set_fattime(&info, st.smb2_mtime);
+    res = FR_OK;
+  }
+  // Misses are remembered as well, mounts probe for files that are not there.
+  // Not if the share was modified in the meantime
+  SMBLock l(lock);
+  if (generation == stat_generation) {
+    stat_insert(path, res, &info);
+  }
+  if (res == FR_OK) {
+    *fno = info;
+  }
+  return res;
 }
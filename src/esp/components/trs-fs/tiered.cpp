@@ -0,0 +1,540 @@
+
+#include "tiered.h"
+#include "esp_heap_caps.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TIER(fp) ((tier_file_t*) (fp)->f)
+
+
+class TierLock {
+private:
+  SemaphoreHandle_t lock;
+public:
+  TierLock(SemaphoreHandle_t lock) : lock(lock) {
+    xSemaphoreTakeRecursive(lock, portMAX_DELAY);
+  }
+  ~TierLock() {
+    xSemaphoreGiveRecursive(lock);
+  }
+};
+
+
+TRS_FS_TIERED::TRS_FS_TIERED(TRS_FS* fs, TRS_FS* cache, uint32_t size_mb)
+  : fs(fs), cache(cache) {
+  err_msg = fs->get_err_msg();
+  lock = xSemaphoreCreateRecursiveMutex();
+  max_blocks = size_mb * (1024 * 1024 / TIER_BLOCK_SIZE);
+  memset(open_count, 0, sizeof(open_count));
+  chunk = (uint8_t*) heap_caps_malloc_prefer(TIER_CHUNK_SIZE, 2,
+                                             MALLOC_CAP_SPIRAM,
+                                             MALLOC_CAP_8BIT);
+  if (chunk != NULL) {
+    load_index();
+  }
+}
+
+TRS_FS_TIERED::~TRS_FS_TIERED()
+{
+  if (index_open) {
+    cache->f_close(&index);
+  }
+  heap_caps_free(chunk);
+  vSemaphoreDelete(lock);
+}
+
+FS_TYPE TRS_FS_TIERED::type()
+{
+  return fs->type();
+}
+
+void TRS_FS_TIERED::f_log(const char* msg) {
+  fs->f_log(msg);
+}
+
+/*
+ * Reads the index from the SD card. An index that does not match the
+ * current layout is discarded together with everything it describes.
+ */
+void TRS_FS_TIERED::load_index()
+{
+  UINT n = 0;
+
+  memset(entries, 0, sizeof(entries));
+  if (cache->f_open(&index, TIER_INDEX_NAME, FA_READ | FA_WRITE) == FR_OK) {
+    index_open = true;
+    if (cache->f_pread(&index, &header, sizeof(header), 0, &n) != FR_OK) {
+      n = 0;
+    }
+    if (n == sizeof(header) && memcmp(header.magic, TIER_MAGIC, 4) == 0 &&
+        header.version == TIER_VERSION && header.max_files == TIER_MAX_FILES &&
+        header.block_size == TIER_BLOCK_SIZE &&
+        cache->f_pread(&index, entries, sizeof(entries), sizeof(header), &n) == FR_OK &&
+        n == sizeof(entries)) {
+      return;
+    }
+    cache->f_close(&index);
+    index_open = false;
+  }
+
+  if (cache->f_open(&index, TIER_INDEX_NAME, FA_CREATE_ALWAYS | FA_WRITE | FA_READ) != FR_OK) {
+    return;
+  }
+  index_open = true;
+  memset(entries, 0, sizeof(entries));
+  memcpy(header.magic, TIER_MAGIC, 4);
+  header.version = TIER_VERSION;
+  header.max_files = TIER_MAX_FILES;
+  header.block_size = TIER_BLOCK_SIZE;
+  header.seq = 0;
+  if (cache->f_pwrite(&index, &header, sizeof(header), 0, &n) != FR_OK ||
+      cache->f_pwrite(&index, entries, sizeof(entries), sizeof(header), &n) != FR_OK) {
+    cache->f_close(&index);
+    index_open = false;
+  }
+}
+
+void TRS_FS_TIERED::save_entry(int slot)
+{
+  UINT n;
+
+  cache->f_pwrite(&index, &header, sizeof(header), 0, &n);
+  cache->f_pwrite(&index, &entries[slot], sizeof(tier_entry_t),
+                  sizeof(header) + slot * sizeof(tier_entry_t), &n);
+}
+
+int TRS_FS_TIERED::find_slot(const char* path)
+{
+  for (int i = 0; i < TIER_MAX_FILES; i++) {
+    if (strcmp(entries[i].path, path) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Frees slot in the index on the card before its data file is reused
+void TRS_FS_TIERED::clear_entry(int slot)
+{
+  memset(&entries[slot], 0, sizeof(tier_entry_t));
+  save_entry(slot);
+  cache->f_sync(&index);
+}
+
+void TRS_FS_TIERED::evict(int slot)
+{
+  char name[16];
+
+  clear_entry(slot);
+  snprintf(name, sizeof(name), TIER_DATA_NAME, slot);
+  cache->f_unlink(name);
+}
+
+/*
+ * Drops the least recently used cached file that is not open. Slot keep is
+ * never dropped. Returns false if there is no such file.
+ */
+bool TRS_FS_TIERED::evict_lru(int keep)
+{
+  int victim = -1;
+
+  for (int i = 0; i < TIER_MAX_FILES; i++) {
+    if (i == keep || open_count[i] > 0 || entries[i].path[0] == '\0') {
+      continue;
+    }
+    if (victim == -1 || entries[i].last_used < entries[victim].last_used) {
+      victim = i;
+    }
+  }
+  if (victim == -1) {
+    return false;
+  }
+  evict(victim);
+  return true;
+}
+
+/*
+ * Returns a free slot, dropping the least recently used file that is not
+ * open if necessary, or -1.
+ */
+int TRS_FS_TIERED::claim_slot()
+{
+  do {
+    for (int i = 0; i < TIER_MAX_FILES; i++) {
+      if (open_count[i] == 0 && entries[i].path[0] == '\0') {
+        return i;
+      }
+    }
+  } while (evict_lru(-1));
+  return -1;
+}
+
+uint32_t TRS_FS_TIERED::cached_blocks()
+{
+  uint32_t n = 0;
+
+  for (int i = 0; i < TIER_MAX_FILES; i++) {
+    for (int j = 0; j < TIER_MAX_BLOCKS / 8; j++) {
+      n += __builtin_popcount(entries[i].valid[j]);
+    }
+  }
+  return n;
+}
+
+void TRS_FS_TIERED::set_valid(int slot, uint32_t block, bool valid)
+{
+  if (valid) {
+    entries[slot].valid[block / 8] |= 1 << (block % 8);
+  } else {
+    entries[slot].valid[block / 8] &= ~(1 << (block % 8));
+  }
+}
+
+bool TRS_FS_TIERED::is_valid(int slot, uint32_t block)
+{
+  return (entries[slot].valid[block / 8] & (1 << (block % 8))) != 0;
+}
+
+void TRS_FS_TIERED::attach(tier_file_t* f, const char* path)
+{
+  FILINFO fno;
+  char name[16];
+
+  if (!index_open || strlen(path) >= TIER_MAX_PATH) {
+    return;
+  }
+  // Cached results of f_stat() may predate a change by another client
+  if (fs->f_stat_uncached(path, &fno) != FR_OK ||
+      fno.fsize > (FSIZE_t) TIER_MAX_BLOCKS * TIER_BLOCK_SIZE) {
+    return;
+  }
+  uint32_t mtime = ((uint32_t) (uint16_t) fno.fdate << 16) | (uint16_t) fno.ftime;
+
+  int slot = find_slot(path);
+  bool fresh = slot != -1 && entries[slot].size == fno.fsize &&
+    entries[slot].mtime == mtime;
+  if (fresh) {
+    snprintf(name, sizeof(name), TIER_DATA_NAME, slot);
+    fresh = cache->f_open(&f->data, name, FA_READ | FA_WRITE) == FR_OK;
+  }
+  if (!fresh) {
+    if (slot != -1 && open_count[slot] > 0) {
+      // Another file object still works with the old contents
+      return;
+    }
+    if (slot == -1 && (slot = claim_slot()) == -1) {
+      return;
+    }
+    tier_entry_t* e = &entries[slot];
+    clear_entry(slot);
+    snprintf(name, sizeof(name), TIER_DATA_NAME, slot);
+    if (cache->f_open(&f->data, name, FA_CREATE_ALWAYS | FA_WRITE | FA_READ) != FR_OK) {
+      return;
+    }
+    strcpy(e->path, path);
+    e->size = fno.fsize;
+    e->mtime = mtime;
+  }
+  entries[slot].last_used = ++header.seq;
+  save_entry(slot);
+  open_count[slot]++;
+  f->slot = slot;
+}
+
+/*
+ * Copies a block from the share to the SD card. Returns false if the block
+ * could not be cached; the caller then reads from the share directly.
+ */
+bool TRS_FS_TIERED::fill_block(tier_file_t* f, uint32_t block)
+{
+  tier_entry_t* e = &entries[f->slot];
+
+  while (cached_blocks() >= max_blocks) {
+    if (!evict_lru(f->slot)) {
+      return false;
+    }
+  }
+
+  FSIZE_t end = (block + 1) * TIER_BLOCK_SIZE;
+  if (end > e->size) {
+    end = e->size;
+  }
+  for (FSIZE_t ofs = block * TIER_BLOCK_SIZE; ofs < end; ofs += TIER_CHUNK_SIZE) {
+    UINT len = (end - ofs > TIER_CHUNK_SIZE) ? TIER_CHUNK_SIZE : end - ofs;
+    UINT n;
+    if (fs->f_pread(&f->fil, chunk, len, ofs, &n) != FR_OK || n != len) {
+      return false;
+    }
+    if (cache->f_pwrite(&f->data, chunk, len, ofs, &n) != FR_OK || n != len) {
+      // Most likely the SD card is full. Make room for the next attempt
+      evict_lru(f->slot);
+      return false;
+    }
+  }
+  // The valid bit must not reach the card before the data does
+  if (cache->f_sync(&f->data) != FR_OK) {
+    return false;
+  }
+  set_valid(f->slot, block, true);
+  save_entry(f->slot);
+  return true;
+}
+
+FRESULT TRS_FS_TIERED::f_open (
+                               FIL* fp,           /* [OUT] Pointer to the file object structure */
+                               const TCHAR* path, /* [IN] File name */
+                               BYTE mode          /* [IN] Mode flags */
+                               ) {
+  TierLock l(lock);
+  tier_file_t* f = (tier_file_t*) calloc(1, sizeof(tier_file_t));
+  if (f == NULL) {
+    return FR_NOT_ENOUGH_CORE;
+  }
+  FRESULT res = fs->f_open(&f->fil, path, mode);
+  if (res != FR_OK) {
+    free(f);
+    fp->f = NULL;
+    return res;
+  }
+  f->slot = -1;
+  f->direct = (mode & FA_OPEN_APPEND) == FA_OPEN_APPEND;
+  f->pos = fs->f_tell(&f->fil);
+  if (!f->direct) {
+    attach(f, path);
+  }
+  fp->f = f;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_TIERED::f_opendir (
+                                  DIR_* dp,           /* [OUT] Pointer to the directory object structure */
+                                  const TCHAR* path  /* [IN] Directory name */
+                                  ) {
+  return fs->f_opendir(dp, path);
+}
+
+FRESULT TRS_FS_TIERED::f_write (
+                                FIL* fp,          /* [IN] Pointer to the file object structure */
+                                const void* buff, /* [IN] Pointer to the data to be written */
+                                UINT btw,         /* [IN] Number of bytes to write */
+                                UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
+                                ) {
+  tier_file_t* f = TIER(fp);
+  if (f->direct) {
+    return fs->f_write(&f->fil, buff, btw, bw);
+  }
+  FRESULT res = f_pwrite(fp, buff, btw, f->pos, bw);
+  if (res == FR_OK) {
+    f->pos += *bw;
+  }
+  return res;
+}
+
+FRESULT TRS_FS_TIERED::f_read (
+                               FIL* fp,     /* [IN] File object */
+                               void* buff,  /* [OUT] Buffer to store read data */
+                               UINT btr,    /* [IN] Number of bytes to read */
+                               UINT* br     /* [OUT] Number of bytes read */
+                               ) {
+  tier_file_t* f = TIER(fp);
+  if (f->direct) {
+    return fs->f_read(&f->fil, buff, btr, br);
+  }
+  FRESULT res = f_pread(fp, buff, btr, f->pos, br);
+  if (res == FR_OK) {
+    f->pos += *br;
+  }
+  return res;
+}
+
+FRESULT TRS_FS_TIERED::f_readdir (
+                                  DIR_* dp,      /* [IN] Directory object */
+                                  FILINFO* fno  /* [OUT] File information structure */
+                                  ) {
+  return fs->f_readdir(dp, fno);
+}
+
+FRESULT TRS_FS_TIERED::f_closedir (
+                                   DIR_* dp  /* [IN] Directory object */
+                                   ) {
+  return fs->f_closedir(dp);
+}
+
+FRESULT TRS_FS_TIERED::f_pread (
+                                FIL* fp,     /* [IN] File object */
+                                void* buff,  /* [OUT] Buffer to store read data */
+                                UINT btr,    /* [IN] Number of bytes to read */
+                                FSIZE_t ofs, /* [IN] File offset to read from */
+                                UINT* br     /* [OUT] Number of bytes read */
+                                ) {
+  TierLock l(lock);
+  tier_file_t* f = TIER(fp);
+  if (f->slot == -1) {
+    return fs->f_pread(&f->fil, buff, btr, ofs, br);
+  }
+
+  tier_entry_t* e = &entries[f->slot];
+  uint8_t* p = (uint8_t*) buff;
+  UINT done = 0;
+  while (done < btr) {
+    FSIZE_t o = ofs + done;
+    if (o >= e->size) {
+      // Beyond what the cache knows about, e.g. appended by this file object
+      UINT n;
+      FRESULT res = fs->f_pread(&f->fil, p + done, btr - done, o, &n);
+      if (res != FR_OK) {
+        return res;
+      }
+      done += n;
+      break;
+    }
+    uint32_t block = o / TIER_BLOCK_SIZE;
+    FSIZE_t end = (block + 1) * TIER_BLOCK_SIZE;
+    if (end > e->size) {
+      end = e->size;
+    }
+    UINT len = (end - o < (FSIZE_t) (btr - done)) ? end - o : btr - done;
+    UINT n;
+    if ((is_valid(f->slot, block) || fill_block(f, block)) &&
+        cache->f_pread(&f->data, p + done, len, o, &n) == FR_OK && n == len) {
+      done += len;
+      continue;
+    }
+    if (is_valid(f->slot, block)) {
+      set_valid(f->slot, block, false);
+      save_entry(f->slot);
+    }
+    FRESULT res = fs->f_pread(&f->fil, p + done, len, o, &n);
+    if (res != FR_OK) {
+      return res;
+    }
+    done += n;
+    if (n < len) {
+      break;
+    }
+  }
+  *br = done;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_TIERED::f_pwrite (
+                                 FIL* fp,          /* [IN] File object */
+                                 const void* buff, /* [IN] Pointer to the data to be written */
+                                 UINT btw,         /* [IN] Number of bytes to write */
+                                 FSIZE_t ofs,      /* [IN] File offset to write to */
+                                 UINT* bw          /* [OUT] Number of bytes written */
+                                 ) {
+  TierLock l(lock);
+  tier_file_t* f = TIER(fp);
+  FRESULT res = fs->f_pwrite(&f->fil, buff, btw, ofs, bw);
+  f->written = true;
+  if (f->slot == -1) {
+    return res;
+  }
+
+  // Keep cached blocks in step with the share
+  const uint8_t* p = (const uint8_t*) buff;
+  bool changed = false;
+  for (FSIZE_t o = ofs; o < ofs + *bw; ) {
+    uint32_t block = o / TIER_BLOCK_SIZE;
+    FSIZE_t end = (block + 1) * TIER_BLOCK_SIZE;
+    if (end > ofs + *bw) {
+      end = ofs + *bw;
+    }
+    UINT n;
+    if (is_valid(f->slot, block) &&
+        (cache->f_pwrite(&f->data, p + (o - ofs), end - o, o, &n) != FR_OK ||
+         n != end - o)) {
+      set_valid(f->slot, block, false);
+      changed = true;
+    }
+    o = end;
+  }
+  if (changed) {
+    save_entry(f->slot);
+  }
+  return res;
+}
+
+FSIZE_t TRS_FS_TIERED::f_tell (
+                               FIL* fp   /* [IN] File object */
+                               ) {
+  tier_file_t* f = TIER(fp);
+  return f->direct ? fs->f_tell(&f->fil) : f->pos;
+}
+
+FRESULT TRS_FS_TIERED::f_sync (
+                               FIL* fp     /* [IN] File object */
+                               ) {
+  return fs->f_sync(&TIER(fp)->fil);
+}
+
+FRESULT TRS_FS_TIERED::f_lseek (
+                                FIL*    fp,  /* [IN] File object */
+                                FSIZE_t ofs  /* [IN] File read/write pointer */
+                                ) {
+  tier_file_t* f = TIER(fp);
+  if (f->direct) {
+    return fs->f_lseek(&f->fil, ofs);
+  }
+  f->pos = ofs;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_TIERED::f_close (
+                                FIL* fp     /* [IN] Pointer to the file object */
+                                ) {
+  TierLock l(lock);
+  tier_file_t* f = TIER(fp);
+  FRESULT res = fs->f_close(&f->fil);
+
+  if (f->slot != -1) {
+    tier_entry_t* e = &entries[f->slot];
+    cache->f_close(&f->data);
+    open_count[f->slot]--;
+    if (f->written) {
+      // The cached blocks were written through. Adopt the new time stamp
+      // so that the next f_open() does not throw them away
+      FILINFO fno;
+      if (fs->f_stat_uncached(e->path, &fno) == FR_OK) {
+        if (fno.fsize != e->size) {
+          // The tail of the last block was not fetched
+          for (uint32_t b = e->size / TIER_BLOCK_SIZE; b < TIER_MAX_BLOCKS; b++) {
+            set_valid(f->slot, b, false);
+          }
+        }
+        e->size = fno.fsize;
+        e->mtime = ((uint32_t) (uint16_t) fno.fdate << 16) | (uint16_t) fno.ftime;
+        if (e->size > (FSIZE_t) TIER_MAX_BLOCKS * TIER_BLOCK_SIZE) {
+          e->mtime = 0;
+        }
+      } else {
+        e->mtime = 0;
+      }
+      save_entry(f->slot);
+    }
+  }
+  free(f);
+  return res;
+}
+
+FRESULT TRS_FS_TIERED::f_unlink (
+                                 const TCHAR* path  /* [IN] Object name */
+                                 ) {
+  TierLock l(lock);
+  FRESULT res = fs->f_unlink(path);
+  int slot = find_slot(path);
+  if (slot != -1 && open_count[slot] == 0) {
+    evict(slot);
+  }
+  return res;
+}
+
+FRESULT TRS_FS_TIERED::f_stat (
+                               const TCHAR* path,  /* [IN] Object name */
+                               FILINFO* fno        /* [OUT] FILINFO structure */
+                               ) {
+  return fs->f_stat(path, fno);
+}
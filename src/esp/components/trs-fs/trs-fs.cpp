@@ -4,16 +4,23 @@
 #include "serial.h"
 #include "smb.h"
 #include "posix.h"
+#include "readahead.h"
+#include "writebehind.h"
+#include "tiered.h"
 #include "storage.h"
 
 #include "fileio.h"
+#include "frehd.h"
 
 extern "C" {
 #include "trs_hard.h"
 }
 
 #define TRS_FS_VERSION_MAJOR 1
-#define TRS_FS_VERSION_MINOR 0
+#define TRS_FS_VERSION_MINOR 1
+
+// Largest packed FILINFO record: size, date, time, attributes and name
+#define TRS_FS_FILINFO_MAX (4 + 2 + 2 + 1 + sizeof(((FILINFO*) 0)->fname))
 
 #define TRS_FS_MODULE_ID 4
 
@@ -21,22 +28,94 @@ TRS_FS* trs_fs = NULL;
 static TRS_FS* current_trs_fs = NULL;
 static TRS_FS_POSIX* trs_fs_posix = NULL;
 static TRS_FS_SMB* trs_fs_smb = NULL;
+static TRS_FS_WRITEBEHIND* trs_fs_writebehind = NULL;
+static TRS_FS_READAHEAD* trs_fs_readahead = NULL;
+#ifdef CONFIG_TRS_IO_SMB_SD_CACHE
+static TRS_FS_TIERED* trs_fs_tiered = NULL;
+#endif
+
+static void close_module_files();
+
+static void drop_tiered() {
+#ifdef CONFIG_TRS_IO_SMB_SD_CACHE
+  if (trs_fs_tiered != NULL) {
+    delete trs_fs_tiered;
+    trs_fs_tiered = NULL;
+  }
+#endif
+}
+
+/*
+ * Closes everything that is open on the current stack of wrappers and
+ * deletes it. A file stays on the backend it was opened on, so this has
+ * to happen before that backend is replaced or deleted.
+ */
+static void drop_stack() {
+  if (trs_fs == NULL) {
+    return;
+  }
+  frehd_close_files();
+  close_module_files();
+  delete trs_fs_readahead;
+  delete trs_fs_writebehind;
+  trs_fs_readahead = NULL;
+  trs_fs_writebehind = NULL;
+  trs_fs = NULL;
+  current_trs_fs = NULL;
+}
+
+// Called before backend is deleted
+static void release_backend(TRS_FS* backend) {
+  bool in_use = (current_trs_fs == backend);
+#ifdef CONFIG_TRS_IO_SMB_SD_CACHE
+  in_use |= (trs_fs_tiered != NULL && current_trs_fs == trs_fs_tiered);
+#endif
+  if (in_use) {
+    drop_stack();
+  }
+  drop_tiered();
+}
 
 static void set_fs() {
+  TRS_FS* fs;
+
   if (trs_fs_posix != NULL && trs_fs_posix->get_err_msg() == NULL) {
     // We have a mounted SD card. This has higher precedent
-    trs_fs = trs_fs_posix;
+    fs = trs_fs_posix;
   } else {
-    trs_fs = trs_fs_smb;
+    fs = trs_fs_smb;
+  }
+#ifdef CONFIG_TRS_IO_SMB_SD_CACHE
+  if (trs_fs_posix != NULL && trs_fs_posix->get_err_msg() == NULL &&
+      trs_fs_smb != NULL && trs_fs_smb->get_err_msg() == NULL) {
+    // Use the SD card as a cache for the SMB share
+    if (trs_fs_tiered == NULL) {
+      trs_fs_tiered = new TRS_FS_TIERED(trs_fs_smb, trs_fs_posix,
+                                        CONFIG_TRS_IO_SMB_SD_CACHE_MB);
+    }
+    fs = trs_fs_tiered;
+  }
+#endif
+  if (fs == current_trs_fs) {
+    // Same backend: the wrappers and the files open on them are kept
+    return;
   }
-  if (trs_fs != current_trs_fs && trs_fs->get_err_msg() == NULL) {
+  // The previous backend is still alive at this point
+  drop_stack();
+  if (fs != NULL) {
+    trs_fs_writebehind = new TRS_FS_WRITEBEHIND(fs);
+    trs_fs_readahead = new TRS_FS_READAHEAD(trs_fs_writebehind);
+    trs_fs = trs_fs_readahead;
+  }
+  current_trs_fs = fs;
+  if (fs != NULL && fs->get_err_msg() == NULL) {
     open_drives();
   }
-  current_trs_fs = trs_fs;
 }
 
 const char* init_trs_fs_posix() {
   if (trs_fs_posix != NULL) {
+    release_backend(trs_fs_posix);
     delete trs_fs_posix;
   }
   trs_fs_posix = new TRS_FS_POSIX();
@@ -46,6 +125,7 @@ const char* init_trs_fs_posix() {
 
 const char* init_trs_fs_smb() {
   if (trs_fs_smb != NULL) {
+    release_backend(trs_fs_smb);
     delete trs_fs_smb;
   }
   trs_fs_smb = new TRS_FS_SMB();
@@ -93,6 +173,12 @@ public:
     addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doWrite), "BX");
     addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doRead), "BL");
     addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doClose), "B");
+    addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doOpenDir), "S");
+    addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doReadDirBatch), "BI");
+    addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doStat), "S");
+    addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doSeek), "BL");
+    addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doUnlink), "S");
+    addCommand(static_cast<cmd_t>(&TrsFileSystemModule::doCloseDir), "B");
   }
 
   uint8_t clientVersionMajor;
@@ -100,8 +186,31 @@ public:
   
   uint8_t nextFd = 0;
   unordered_map<uint8_t, FIL> fileMap;
-  
+
+  uint8_t nextDir = 0;
+  unordered_map<uint8_t, DIR_> dirMap;
+
+  void addFileInfo(FILINFO* fno) {
+    addLong(fno->fsize);
+    addInt(fno->fdate);
+    addInt(fno->ftime);
+    addByte(fno->fattrib);
+    addStr(fno->fname);
+  }
+
 public:
+  // The backend the files were opened on is about to go away
+  void closeAll() {
+    for (auto& it : fileMap) {
+      f_close(&it.second);
+    }
+    fileMap.clear();
+    for (auto& it : dirMap) {
+      f_closedir(&it.second);
+    }
+    dirMap.clear();
+  }
+
   void doVersion() {
     clientVersionMajor = B(0);
     clientVersionMinor = B(1);
@@ -126,8 +235,8 @@ public:
     FIL* fp = &fileMap[B(0)];
     uint32_t bufferLen = XL(0);
     uint8_t* buffer = X(0);
-    UINT bw;
-    FRESULT result = f_write(fp, buffer, bufferLen, &bw);
+    DWORD bw;
+    FRESULT result = f_write32(fp, buffer, bufferLen, &bw);
     addByte(result);
     if (result == FR_OK) {
       addLong(bw);
@@ -143,8 +252,10 @@ public:
     if (length > getSendBufferFreeSize()) {
       length = getSendBufferFreeSize();
     }
-    UINT br;
-    FRESULT result = f_read(fp, buf, length, &br);
+    // Backends split this up as they see fit, e.g. SMB keeps several
+    // requests in flight
+    DWORD br;
+    FRESULT result = f_read32(fp, buf, length, &br);
     if (result != FR_OK) {
       rewind();
       addByte(result);
@@ -156,10 +267,115 @@ public:
   
   void doClose() {
     FIL* fp = &fileMap[B(0)];
-    fileMap.erase(B(0));
     FRESULT result = f_close(fp);
+    fileMap.erase(B(0));
     addByte(result);
   }
+
+  void doOpenDir() {
+    uint8_t dd = nextDir++;
+    auto it = dirMap.find(dd);
+    if (it != dirMap.end()) {
+      // nextDir wrapped around onto a directory that was never closed
+      f_closedir(&it->second);
+    }
+    FRESULT result = f_opendir(&dirMap[dd], S(0));
+    addByte(result);
+    if (result == FR_OK) {
+      addByte(dd);
+    } else {
+      dirMap.erase(dd);
+      nextDir--;
+    }
+  }
+
+  /*
+   * Returns as many directory entries as fit into maxLen bytes (0 for the
+   * whole send buffer): result, a flag that is set once the end of the
+   * directory has been reached, the number of entries and a blob with the
+   * packed entries. The directory is closed when its end has been reached.
+   */
+  void doReadDirBatch() {
+    auto it = dirMap.find(B(0));
+    if (it == dirMap.end()) {
+      addByte(FR_INVALID_OBJECT);
+      return;
+    }
+    // Result, header and blob length
+    unsigned long room = getSendBufferFreeSize();
+    if (room < 1 + 3 + 2) {
+      addByte(FR_NOT_ENOUGH_CORE);
+      return;
+    }
+    room -= 1 + 3 + 2;
+    if (I(0) != 0 && I(0) < room) {
+      room = I(0);
+    }
+
+    addByte(FR_OK);
+    uint8_t* header = reserve(3);
+    uint16_t count = 0;
+    bool done = false;
+    startBlob16();
+    while (room >= TRS_FS_FILINFO_MAX) {
+      FILINFO fno;
+      FRESULT result = f_readdir(&it->second, &fno);
+      if (result != FR_OK) {
+        rewind();
+        addByte(result);
+        f_closedir(&it->second);
+        dirMap.erase(it);
+        return;
+      }
+      if (fno.fname[0] == '\0') {
+        done = true;
+        dirMap.erase(it);
+        break;
+      }
+      addFileInfo(&fno);
+      room -= 4 + 2 + 2 + 1 + strlen(fno.fname) + 1;
+      count++;
+    }
+    endBlob16();
+    header[0] = done;
+    header[1] = count & 0xff;
+    header[2] = count >> 8;
+  }
+
+  // Releases a directory that is not read to its end
+  void doCloseDir() {
+    auto it = dirMap.find(B(0));
+    if (it == dirMap.end()) {
+      addByte(FR_INVALID_OBJECT);
+      return;
+    }
+    FRESULT result = f_closedir(&it->second);
+    dirMap.erase(it);
+    addByte(result);
+  }
+
+  void doStat() {
+    FILINFO fno;
+    FRESULT result = f_stat(S(0), &fno);
+    addByte(result);
+    if (result == FR_OK) {
+      addFileInfo(&fno);
+    }
+  }
+
+  void doSeek() {
+    FIL* fp = &fileMap[B(0)];
+    FRESULT result = f_lseek(fp, L(0));
+    addByte(result);
+  }
+
+  void doUnlink() {
+    addByte(f_unlink(S(0)));
+  }
 };
 
 TrsFileSystemModule theTrsFileSystemModule(TRS_FS_MODULE_ID);
+
+static void close_module_files() {
+  theTrsFileSystemModule.closeAll();
+}
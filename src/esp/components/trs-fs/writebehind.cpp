@@ -0,0 +1,575 @@
+
+#include "writebehind.h"
+#include "esp_heap_caps.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+// Files of all wrapper instances share the lock and the flush task
+static SemaphoreHandle_t wb_lock = NULL;
+static TaskHandle_t wb_task = NULL;
+#endif
+
+#define WB(fp) ((wb_file_t*) (fp)->f)
+
+
+class WBLock {
+public:
+  WBLock() {
+#ifdef ESP_PLATFORM
+    xSemaphoreTakeRecursive(wb_lock, portMAX_DELAY);
+#endif
+  }
+  ~WBLock() {
+#ifdef ESP_PLATFORM
+    xSemaphoreGiveRecursive(wb_lock);
+#endif
+  }
+};
+
+static int64_t now_us()
+{
+#ifdef ESP_PLATFORM
+  return esp_timer_get_time();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#endif
+}
+
+static bool overlaps(FSIZE_t ofs, DWORD len, FSIZE_t pos, UINT n)
+{
+  return n > 0 && ofs < pos + n && pos < ofs + len;
+}
+
+
+wb_file_t* TRS_FS_WRITEBEHIND::files = NULL;
+wb_stats_t TRS_FS_WRITEBEHIND::stats;
+
+TRS_FS_WRITEBEHIND::TRS_FS_WRITEBEHIND(TRS_FS* fs) : fs(fs) {
+  err_msg = fs->get_err_msg();
+#ifdef ESP_PLATFORM
+  if (wb_lock == NULL) {
+    wb_lock = xSemaphoreCreateRecursiveMutex();
+    xTaskCreatePinnedToCore(flush_task_main, "wb", 4096, NULL, 1, &wb_task, 0);
+  }
+#endif
+}
+
+const wb_stats_t* TRS_FS_WRITEBEHIND::get_stats()
+{
+  return &stats;
+}
+
+FS_TYPE TRS_FS_WRITEBEHIND::type()
+{
+  return fs->type();
+}
+
+void TRS_FS_WRITEBEHIND::f_log(const char* msg) {
+  fs->f_log(msg);
+}
+
+/*
+ * Waits for the write in flight. A failure is kept in err for the next
+ * call on the file.
+ */
+FRESULT TRS_FS_WRITEBEHIND::complete(wb_file_t* f)
+{
+  if (f->fly_len == 0) {
+    return FR_OK;
+  }
+  UINT n;
+  int64_t t = now_us();
+  FRESULT res = f->fs->f_wait(&f->fut, &n);
+  stats.backend_us += now_us() - t;
+  if (res == FR_OK && n != f->fly_len) {
+    res = FR_DISK_FULL;
+  }
+  if (res != FR_OK && f->err == FR_OK) {
+    f->err = res;
+  }
+  f->fly_len = 0;
+  return res;
+}
+
+/*
+ * Hands the buffered data to the backend. The two buffers swap roles so
+ * that new writes can be collected while the old ones are in flight.
+ */
+void TRS_FS_WRITEBEHIND::flush(wb_file_t* f)
+{
+  if (f->buf_len == 0) {
+    return;
+  }
+  complete(f);
+
+  uint8_t* b = f->fly;
+  f->fly = f->buf;
+  f->buf = b;
+  f->fly_pos = f->buf_pos;
+  f->fly_len = f->buf_len;
+  f->buf_len = 0;
+
+  stats.backend_writes++;
+  stats.backend_bytes += f->fly_len;
+  int64_t t = now_us();
+  FRESULT res = f->fs->f_pwrite_async(&f->fil, f->fly, f->fly_len, f->fly_pos, &f->fut);
+  stats.backend_us += now_us() - t;
+  if (res != FR_OK) {
+    if (f->err == FR_OK) {
+      f->err = res;
+    }
+    f->fly_len = 0;
+  }
+}
+
+// Makes sure that the given range of the file is up to date on the backend
+void TRS_FS_WRITEBEHIND::settle(wb_file_t* f, FSIZE_t ofs, DWORD len)
+{
+  if (overlaps(ofs, len, f->buf_pos, f->buf_len)) {
+    flush(f);
+  }
+  if (overlaps(ofs, len, f->fly_pos, f->fly_len)) {
+    complete(f);
+  }
+}
+
+FRESULT TRS_FS_WRITEBEHIND::take_err(wb_file_t* f)
+{
+  FRESULT res = f->err;
+  f->err = FR_OK;
+  return res;
+}
+
+/*
+ * Settles the range to be read and returns a pending error. The read itself
+ * runs without the lock so that other files are not held up by it
+ */
+FRESULT TRS_FS_WRITEBEHIND::prepare_read(wb_file_t* f, FSIZE_t ofs, DWORD len)
+{
+  WBLock l;
+  settle(f, ofs, len);
+  return take_err(f);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::write(wb_file_t* f, const void* buff, UINT btw, FSIZE_t ofs)
+{
+  const uint8_t* p = (const uint8_t*) buff;
+
+  if (f->buf == NULL) {
+    f->buf = (uint8_t*) heap_caps_malloc_prefer(TRS_FS_WRITEBEHIND_SIZE, 2,
+                                                MALLOC_CAP_SPIRAM,
+                                                MALLOC_CAP_8BIT);
+    f->fly = (uint8_t*) heap_caps_malloc_prefer(TRS_FS_WRITEBEHIND_SIZE, 2,
+                                                MALLOC_CAP_SPIRAM,
+                                                MALLOC_CAP_8BIT);
+    if (f->buf == NULL || f->fly == NULL) {
+      heap_caps_free(f->buf);
+      heap_caps_free(f->fly);
+      f->buf = f->fly = NULL;
+      // Out of memory. Write synchronously
+      UINT bw;
+      stats.backend_writes++;
+      stats.backend_bytes += btw;
+      int64_t t = now_us();
+      FRESULT res = f->fs->f_pwrite(&f->fil, buff, btw, ofs, &bw);
+      stats.backend_us += now_us() - t;
+      return (res == FR_OK && bw != btw) ? FR_DISK_FULL : res;
+    }
+  }
+
+  while (btw > 0) {
+    // Only writes that overwrite or extend the buffered data are collected
+    if (f->buf_len > 0 && (ofs < f->buf_pos || ofs > f->buf_pos + f->buf_len)) {
+      flush(f);
+    }
+    if (f->buf_len == 0) {
+      f->buf_pos = ofs;
+      f->buf_time = now_us();
+    }
+    FSIZE_t end = f->buf_pos - f->buf_pos % TRS_FS_WRITEBEHIND_SIZE + TRS_FS_WRITEBEHIND_SIZE;
+    UINT n = (end - ofs < btw) ? end - ofs : btw;
+    memcpy(f->buf + (ofs - f->buf_pos), p, n);
+    if (ofs + n - f->buf_pos > f->buf_len) {
+      f->buf_len = ofs + n - f->buf_pos;
+    }
+    ofs += n;
+    p += n;
+    btw -= n;
+    if (f->buf_pos + f->buf_len == end) {
+      flush(f);
+    }
+  }
+  return FR_OK;
+}
+
+void TRS_FS_WRITEBEHIND::flush_all()
+{
+  if (files == NULL) {
+    return;
+  }
+  WBLock l;
+  for (wb_file_t* f = files; f != NULL; f = f->next) {
+    flush(f);
+    complete(f);
+  }
+}
+
+#ifdef ESP_PLATFORM
+void TRS_FS_WRITEBEHIND::flush_task_main(void* arg)
+{
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(TRS_FS_WRITEBEHIND_DELAY_MS / 2));
+    WBLock l;
+    int64_t now = now_us();
+    for (wb_file_t* f = files; f != NULL; f = f->next) {
+      if (f->buf_len > 0 && now - f->buf_time >= TRS_FS_WRITEBEHIND_DELAY_MS * 1000) {
+        flush(f);
+      }
+      if (f->fly_len > 0 && f->fut.done) {
+        complete(f);
+      }
+    }
+  }
+}
+#endif
+
+FRESULT TRS_FS_WRITEBEHIND::f_open (
+                                    FIL* fp,           /* [OUT] Pointer to the file object structure */
+                                    const TCHAR* path, /* [IN] File name */
+                                    BYTE mode          /* [IN] Mode flags */
+                                    ) {
+  WBLock l;
+  wb_file_t* f = (wb_file_t*) calloc(1, sizeof(wb_file_t));
+  if (f == NULL) {
+    return FR_NOT_ENOUGH_CORE;
+  }
+  FRESULT res = fs->f_open(&f->fil, path, mode);
+  if (res != FR_OK) {
+    free(f);
+    fp->f = NULL;
+    return res;
+  }
+  f->fs = fs;
+  // The backend decides where appended data goes
+  f->direct = (mode & FA_OPEN_APPEND) == FA_OPEN_APPEND;
+  f->pos = fs->f_tell(&f->fil);
+  f->next = files;
+  files = f;
+  fp->f = f;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_opendir (
+                                       DIR_* dp,           /* [OUT] Pointer to the directory object structure */
+                                       const TCHAR* path  /* [IN] Directory name */
+                                       ) {
+  flush_all();
+  return fs->f_opendir(dp, path);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_write (
+                                     FIL* fp,          /* [IN] Pointer to the file object structure */
+                                     const void* buff, /* [IN] Pointer to the data to be written */
+                                     UINT btw,         /* [IN] Number of bytes to write */
+                                     UINT* bw          /* [OUT] Pointer to the variable to return number of bytes written */
+                                     ) {
+  WBLock l;
+  wb_file_t* f = WB(fp);
+  if (f->direct) {
+    return f->fs->f_write(&f->fil, buff, btw, bw);
+  }
+  int64_t t = now_us();
+  FRESULT res = take_err(f);
+  if (res == FR_OK) {
+    res = write(f, buff, btw, f->pos);
+  }
+  if (res == FR_OK) {
+    f->pos += btw;
+    *bw = btw;
+  } else {
+    *bw = 0;
+  }
+  stats.writes++;
+  stats.bytes += btw;
+  stats.write_us += now_us() - t;
+  return res;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_read (
+                                    FIL* fp,     /* [IN] File object */
+                                    void* buff,  /* [OUT] Buffer to store read data */
+                                    UINT btr,    /* [IN] Number of bytes to read */
+                                    UINT* br     /* [OUT] Number of bytes read */
+                                    ) {
+  wb_file_t* f = WB(fp);
+  if (f->direct) {
+    return f->fs->f_read(&f->fil, buff, btr, br);
+  }
+  FRESULT res = prepare_read(f, f->pos, btr);
+  if (res != FR_OK) {
+    *br = 0;
+    return res;
+  }
+  res = f->fs->f_pread(&f->fil, buff, btr, f->pos, br);
+  if (res == FR_OK) {
+    f->pos += *br;
+  }
+  return res;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_readdir (
+                                       DIR_* dp,      /* [IN] Directory object */
+                                       FILINFO* fno  /* [OUT] File information structure */
+                                       ) {
+  return fs->f_readdir(dp, fno);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_closedir (
+                                        DIR_* dp  /* [IN] Directory object */
+                                        ) {
+  return fs->f_closedir(dp);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_pread (
+                                     FIL* fp,     /* [IN] File object */
+                                     void* buff,  /* [OUT] Buffer to store read data */
+                                     UINT btr,    /* [IN] Number of bytes to read */
+                                     FSIZE_t ofs, /* [IN] File offset to read from */
+                                     UINT* br     /* [OUT] Number of bytes read */
+                                     ) {
+  wb_file_t* f = WB(fp);
+  FRESULT res = prepare_read(f, ofs, btr);
+  if (res != FR_OK) {
+    *br = 0;
+    return res;
+  }
+  return f->fs->f_pread(&f->fil, buff, btr, ofs, br);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_pwrite (
+                                      FIL* fp,          /* [IN] File object */
+                                      const void* buff, /* [IN] Pointer to the data to be written */
+                                      UINT btw,         /* [IN] Number of bytes to write */
+                                      FSIZE_t ofs,      /* [IN] File offset to write to */
+                                      UINT* bw          /* [OUT] Number of bytes written */
+                                      ) {
+  WBLock l;
+  wb_file_t* f = WB(fp);
+  if (f->direct) {
+    return f->fs->f_pwrite(&f->fil, buff, btw, ofs, bw);
+  }
+  int64_t t = now_us();
+  FRESULT res = take_err(f);
+  if (res == FR_OK) {
+    res = write(f, buff, btw, ofs);
+  }
+  *bw = (res == FR_OK) ? btw : 0;
+  stats.writes++;
+  stats.bytes += btw;
+  stats.write_us += now_us() - t;
+  return res;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_read32 (
+                                      FIL* fp,     /* [IN] File object */
+                                      void* buff,  /* [OUT] Buffer to store read data */
+                                      DWORD btr,   /* [IN] Number of bytes to read */
+                                      DWORD* br    /* [OUT] Number of bytes read */
+                                      ) {
+  wb_file_t* f = WB(fp);
+  if (f->direct) {
+    return f->fs->f_read32(&f->fil, buff, btr, br);
+  }
+  FRESULT res = f_pread32(fp, buff, btr, f->pos, br);
+  if (res == FR_OK) {
+    f->pos += *br;
+  }
+  return res;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_write32 (
+                                       FIL* fp,          /* [IN] Pointer to the file object structure */
+                                       const void* buff, /* [IN] Pointer to the data to be written */
+                                       DWORD btw,        /* [IN] Number of bytes to write */
+                                       DWORD* bw         /* [OUT] Pointer to the variable to return number of bytes written */
+                                       ) {
+  WBLock l;
+  wb_file_t* f = WB(fp);
+  if (f->direct) {
+    return f->fs->f_write32(&f->fil, buff, btw, bw);
+  }
+  FRESULT res = f_pwrite32(fp, buff, btw, f->pos, bw);
+  f->pos += *bw;
+  return res;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_pread32 (
+                                       FIL* fp,     /* [IN] File object */
+                                       void* buff,  /* [OUT] Buffer to store read data */
+                                       DWORD btr,   /* [IN] Number of bytes to read */
+                                       FSIZE_t ofs, /* [IN] File offset to read from */
+                                       DWORD* br    /* [OUT] Number of bytes read */
+                                       ) {
+  wb_file_t* f = WB(fp);
+  FRESULT res = prepare_read(f, ofs, btr);
+  if (res != FR_OK) {
+    *br = 0;
+    return res;
+  }
+  return f->fs->f_pread32(&f->fil, buff, btr, ofs, br);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_pwrite32 (
+                                        FIL* fp,          /* [IN] File object */
+                                        const void* buff, /* [IN] Pointer to the data to be written */
+                                        DWORD btw,        /* [IN] Number of bytes to write */
+                                        FSIZE_t ofs,      /* [IN] File offset to write to */
+                                        DWORD* bw         /* [OUT] Number of bytes written */
+                                        ) {
+  WBLock l;
+  wb_file_t* f = WB(fp);
+  if (f->direct) {
+    return f->fs->f_pwrite32(&f->fil, buff, btw, ofs, bw);
+  }
+  if (btw < TRS_FS_WRITEBEHIND_SIZE) {
+    UINT n;
+    FRESULT res = f_pwrite(fp, buff, btw, ofs, &n);
+    *bw = n;
+    return res;
+  }
+  // Nothing to gain from buffering. Buffered data in the range must not
+  // overwrite this write later on
+  int64_t t = now_us();
+  settle(f, ofs, btw);
+  FRESULT res = take_err(f);
+  if (res == FR_OK) {
+    res = f->fs->f_pwrite32(&f->fil, buff, btw, ofs, bw);
+    stats.backend_writes++;
+    stats.backend_bytes += *bw;
+  } else {
+    *bw = 0;
+  }
+  stats.writes++;
+  stats.bytes += btw;
+  stats.write_us += now_us() - t;
+  return res;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_pread_async (
+                                           FIL* fp,     /* [IN] File object */
+                                           void* buff,  /* [OUT] Buffer to store read data */
+                                           UINT btr,    /* [IN] Number of bytes to read */
+                                           FSIZE_t ofs, /* [IN] File offset to read from */
+                                           FFUTURE* fut /* [OUT] Completion record */
+                                           ) {
+  WBLock l;
+  wb_file_t* f = WB(fp);
+  settle(f, ofs, btr);
+  FRESULT res = take_err(f);
+  if (res != FR_OK) {
+    return res;
+  }
+  return f->fs->f_pread_async(&f->fil, buff, btr, ofs, fut);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_pwrite_async (
+                                            FIL* fp,          /* [IN] File object */
+                                            const void* buff, /* [IN] Pointer to the data to be written */
+                                            UINT btw,         /* [IN] Number of bytes to write */
+                                            FSIZE_t ofs,      /* [IN] File offset to write to */
+                                            FFUTURE* fut      /* [OUT] Completion record */
+                                            ) {
+  // The data is copied right away, so the request is complete on return
+  fut->res = f_pwrite(fp, buff, btw, ofs, &fut->n);
+  fut->done = 1;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_wait (
+                                    FFUTURE* fut, /* [IN] Completion record */
+                                    UINT* n       /* [OUT] Number of bytes transferred */
+                                    ) {
+  if (fut->done) {
+    *n = fut->n;
+    return fut->res;
+  }
+  return fs->f_wait(fut, n);
+}
+
+FSIZE_t TRS_FS_WRITEBEHIND::f_tell (
+                                    FIL* fp   /* [IN] File object */
+                                    ) {
+  wb_file_t* f = WB(fp);
+  return f->direct ? f->fs->f_tell(&f->fil) : f->pos;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_sync (
+                                    FIL* fp     /* [IN] File object */
+                                    ) {
+  WBLock l;
+  wb_file_t* f = WB(fp);
+  flush(f);
+  complete(f);
+  FRESULT res = take_err(f);
+  FRESULT res_sync = f->fs->f_sync(&f->fil);
+  return (res != FR_OK) ? res : res_sync;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_lseek (
+                                     FIL*    fp,  /* [IN] File object */
+                                     FSIZE_t ofs  /* [IN] File read/write pointer */
+                                     ) {
+  wb_file_t* f = WB(fp);
+  if (f->direct) {
+    return f->fs->f_lseek(&f->fil, ofs);
+  }
+  f->pos = ofs;
+  return FR_OK;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_close (
+                                     FIL* fp     /* [IN] Pointer to the file object */
+                                     ) {
+  WBLock l;
+  wb_file_t* f = WB(fp);
+  flush(f);
+  complete(f);
+  FRESULT res = take_err(f);
+  FRESULT res_close = f->fs->f_close(&f->fil);
+
+  for (wb_file_t** p = &files; *p != NULL; p = &(*p)->next) {
+    if (*p == f) {
+      *p = f->next;
+      break;
+    }
+  }
+  heap_caps_free(f->buf);
+  heap_caps_free(f->fly);
+  free(f);
+  return (res != FR_OK) ? res : res_close;
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_unlink (
+                                      const TCHAR* path  /* [IN] Object name */
+                                      ) {
+  flush_all();
+  return fs->f_unlink(path);
+}
+
+FRESULT TRS_FS_WRITEBEHIND::f_stat (
+                                    const TCHAR* path,  /* [IN] Object name */
+                                    FILINFO* fno        /* [OUT] FILINFO structure */
+                                    ) {
+  flush_all();
+  return fs->f_stat(path, fno);
+}
@@ -0,0 +1,35 @@
+
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Number of host names whose addresses are remembered
+#define RESOLVER_CACHE_SIZE 8
+#define RESOLVER_MAX_HOST 64
+// Time (s) for which a resolved address is used
+#define RESOLVER_TTL_S 300
+// Time (s) for which a failed lookup is not repeated
+#define RESOLVER_NEGATIVE_TTL_S 10
+
+typedef enum {
+  RESOLVE_OK,       // The address is known
+  RESOLVE_PENDING,  // A lookup is in progress, ask again later
+  RESOLVE_FAILED    // The host name does not resolve
+} resolve_result_t;
+
+typedef struct {
+  uint32_t hits;          // Answered from the cache
+  uint32_t negative_hits; // Answered from the cache with a failure
+  uint32_t misses;        // Needed a lookup
+  uint32_t lookups;       // Lookups done by the worker task
+  uint32_t failures;      // Lookups that failed
+} resolver_stats_t;
+
+void init_resolver();
+// Returns the cached IPv4 address of host. Never waits: a missing or
+// expired address is looked up in the background
+resolve_result_t resolve(const char* host, struct in_addr* addr);
+// Like resolve(), but a missing address is looked up on the calling task
+bool resolve_now(const char* host, struct in_addr* addr);
+void resolver_get_stats(resolver_stats_t* stats);
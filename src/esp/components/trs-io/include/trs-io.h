@@ -93,6 +93,12 @@ protected:
         commands[numCommands].signature = signature;
         numCommands++;
     }
+
+    // Registers the command that the protocol numbers cmd
+    void addCommand(uint8_t cmd, cmd_t proc, const char* signature) {
+        assert(cmd == numCommands);
+        addCommand(proc, signature);
+    }
 public:
 
     explicit TrsIO(int id) {
@@ -212,6 +218,14 @@ protected:
         sendPtr += len;
     }
 
+    // Returns room for len bytes that are filled in later
+    inline static uint8_t* reserve(uint32_t len) {
+        assert(sendPtr + len <= sendBuffer + TRS_IO_MAX_SEND_BUFFER);
+        uint8_t* p = sendPtr;
+        sendPtr += len;
+        return p;
+    }
+
     inline static uint8_t* startBlob16() {
         assert(sendPtr + sizeof(uint16_t) <= sendBuffer + TRS_IO_MAX_SEND_BUFFER);
         assert(blob16 == nullptr);
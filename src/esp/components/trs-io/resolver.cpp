@@ -0,0 +1,234 @@
+
+#include "resolver.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "lwip/netdb.h"
+
+#include <string.h>
+
+/*
+ * Host name lookups shared by the TCP/IP module and RetroStore. Lookups
+ * run on a worker task and their results are cached. resolve() never
+ * waits for the worker; the caller asks again until the address is in
+ * the cache. lwIP does not hand out the TTL of the DNS records, so
+ * addresses are kept for RESOLVER_TTL_S and failures for
+ * RESOLVER_NEGATIVE_TTL_S. lwIP's own DNS table does honour the record
+ * TTLs when the worker asks again.
+ */
+
+typedef struct {
+  char host[RESOLVER_MAX_HOST]; // Empty if the slot is free
+  struct in_addr addr;
+  bool ok;                      // Lookup succeeded
+  bool pending;                 // Waiting for the worker task
+  TickType_t expires;
+  TickType_t used;
+} resolver_entry_t;
+
+static SemaphoreHandle_t lock = NULL;
+static TaskHandle_t worker = NULL;
+static resolver_entry_t cache[RESOLVER_CACHE_SIZE];
+static resolver_stats_t stats;
+
+
+static bool lookup(const char* host, struct in_addr* addr)
+{
+  struct addrinfo hints;
+  struct addrinfo* res;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0 || res == NULL) {
+    return false;
+  }
+  *addr = ((struct sockaddr_in*) res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+  return true;
+}
+
+static resolver_entry_t* find(const char* host)
+{
+  for (int i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+    if (strcmp(cache[i].host, host) == 0) {
+      return &cache[i];
+    }
+  }
+  return NULL;
+}
+
+// Takes a free or the least recently used slot that is not being resolved
+static resolver_entry_t* claim(const char* host)
+{
+  resolver_entry_t* e = NULL;
+
+  for (int i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+    resolver_entry_t* c = &cache[i];
+    if (c->host[0] == '\0') {
+      e = c;
+      break;
+    }
+    if (!c->pending && (e == NULL || (int32_t) (c->used - e->used) < 0)) {
+      e = c;
+    }
+  }
+  if (e != NULL) {
+    strcpy(e->host, host);
+    e->ok = false;
+    e->pending = false;
+    e->used = xTaskGetTickCount();
+  }
+  return e;
+}
+
+static bool expired(resolver_entry_t* e)
+{
+  return (int32_t) (xTaskGetTickCount() - e->expires) >= 0;
+}
+
+// Returns the entry of host if it can be used as is. Called with lock held
+static resolver_entry_t* fresh(const char* host)
+{
+  resolver_entry_t* e = find(host);
+  if (e == NULL || e->pending || expired(e)) {
+    return NULL;
+  }
+  e->used = xTaskGetTickCount();
+  if (e->ok) {
+    stats.hits++;
+  } else {
+    stats.negative_hits++;
+  }
+  return e;
+}
+
+// Records the outcome of a lookup. Called with lock held
+static void store(resolver_entry_t* e, bool ok, struct in_addr* addr)
+{
+  e->addr = *addr;
+  e->ok = ok;
+  e->pending = false;
+  e->used = xTaskGetTickCount();
+  e->expires = e->used + pdMS_TO_TICKS(1000 * (ok ? RESOLVER_TTL_S :
+                                               RESOLVER_NEGATIVE_TTL_S));
+  stats.lookups++;
+  if (!ok) {
+    stats.failures++;
+  }
+}
+
+static void resolver_task(void* p)
+{
+  char host[RESOLVER_MAX_HOST];
+
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    while (true) {
+      xSemaphoreTake(lock, portMAX_DELAY);
+      resolver_entry_t* e = NULL;
+      for (int i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+        if (cache[i].pending) {
+          e = &cache[i];
+          break;
+        }
+      }
+      if (e != NULL) {
+        strcpy(host, e->host);
+      }
+      xSemaphoreGive(lock);
+      if (e == NULL) {
+        break;
+      }
+
+      // Pending slots are not reused, so e still belongs to host
+      struct in_addr addr;
+      memset(&addr, 0, sizeof(addr));
+      bool ok = lookup(host, &addr);
+
+      xSemaphoreTake(lock, portMAX_DELAY);
+      store(e, ok, &addr);
+      xSemaphoreGive(lock);
+    }
+  }
+}
+
+resolve_result_t resolve(const char* host, struct in_addr* addr)
+{
+  if (strlen(host) >= RESOLVER_MAX_HOST) {
+    return RESOLVE_FAILED;
+  }
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  resolver_entry_t* e = fresh(host);
+  if (e != NULL) {
+    *addr = e->addr;
+    bool ok = e->ok;
+    xSemaphoreGive(lock);
+    return ok ? RESOLVE_OK : RESOLVE_FAILED;
+  }
+  e = find(host);
+  if (e == NULL || !e->pending) {
+    stats.misses++;
+    if (e == NULL) {
+      // If every slot is being resolved, the next call tries again
+      e = claim(host);
+    }
+    if (e != NULL) {
+      e->pending = true;
+      xTaskNotifyGive(worker);
+    }
+  }
+  xSemaphoreGive(lock);
+  return RESOLVE_PENDING;
+}
+
+bool resolve_now(const char* host, struct in_addr* addr)
+{
+  if (strlen(host) >= RESOLVER_MAX_HOST) {
+    return lookup(host, addr);
+  }
+
+  xSemaphoreTake(lock, portMAX_DELAY);
+  resolver_entry_t* e = fresh(host);
+  if (e != NULL) {
+    *addr = e->addr;
+    bool ok = e->ok;
+    xSemaphoreGive(lock);
+    return ok;
+  }
+  stats.misses++;
+  xSemaphoreGive(lock);
+
+  struct in_addr a;
+  memset(&a, 0, sizeof(a));
+  bool ok = lookup(host, &a);
+  *addr = a;
+
+  // Keep the result unless the worker is about to deliver its own
+  xSemaphoreTake(lock, portMAX_DELAY);
+  e = find(host);
+  if (e == NULL) {
+    e = claim(host);
+  }
+  if (e != NULL && !e->pending) {
+    store(e, ok, &a);
+  }
+  xSemaphoreGive(lock);
+  return ok;
+}
+
+void resolver_get_stats(resolver_stats_t* s)
+{
+  xSemaphoreTake(lock, portMAX_DELAY);
+  *s = stats;
+  xSemaphoreGive(lock);
+}
+
+void init_resolver()
+{
+  lock = xSemaphoreCreateMutex();
+  xTaskCreatePinnedToCore(resolver_task, "resolver", 3072, NULL, 1, &worker, 0);
+}
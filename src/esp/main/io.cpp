@@ -288,7 +288,13 @@ static void io_task(void* p)
   
   while(true) {
     // Wait for access the GAL to trigger this ESP
-    while ((GPIO.in & MASK_ESP_SEL_N) && (intr_event == 0)) ;
+    while ((GPIO.in & MASK_ESP_SEL_N) && (intr_event == 0)) {
+#ifdef CONFIG_TRS_IO_MODEL_1
+      // Keeps the clock of the floppy controller emulation running while
+      // the Z80 is not talking to us. Cheap unless a timer is due
+      trs_disk_poll();
+#endif
+    }
 
     if (intr_event != 0) {
       if (intr_event & IO_CORE1_ENABLE_INTR) {
@@ -366,15 +372,13 @@ static void io_task(void* p)
   }
 }
 
-static void action_task(void* p)
+/*
+ * TrsIO requests run in their own task so that they do not queue up behind
+ * FreHD requests. Each task gets its own SMB session (see smb.cpp)
+ */
+static void trs_io_task(void* p)
 {
-  // Clear any spurious interrupts
-  is_button_short_press();
-  is_button_long_press();
-
   while (true) {
-    frehd_check_action();
-
     if (trigger_trs_io_action) {
       if (printer_data == -1) {
         TrsIO::processInBackground();
@@ -391,6 +395,18 @@ static void action_task(void* p)
         trigger_trs_io_action = false;
       }
     }
+    vTaskDelay(1);
+  }
+}
+
+static void action_task(void* p)
+{
+  // Clear any spurious interrupts
+  is_button_short_press();
+  is_button_long_press();
+
+  while (true) {
+    frehd_check_action();
 
     if (is_button_long_press()) {
       storage_erase();
@@ -483,4 +499,5 @@ void init_io()
   xTaskCreatePinnedToCore(io_task, "io", 6000, NULL, tskIDLE_PRIORITY + 2,
                           NULL, 1);
   xTaskCreatePinnedToCore(action_task, "action", 6000, NULL, 1, NULL, 0);
+  xTaskCreatePinnedToCore(trs_io_task, "trs-io", 6000, NULL, 1, NULL, 0);
 }
@@ -6,6 +6,7 @@
 #include "ota.h"
 #include "storage.h"
 #include "event.h"
+#include "resolver.h"
 #include "esp_event.h"
 
 #include "retrostore.h"
@@ -20,6 +21,7 @@ extern "C" {
 void app_main(void)
 {
   init_events();
+  init_resolver();
   init_trs_io();
   init_led();
   init_button();
@@ -0,0 +1,749 @@
+
+/*
+ * Host benchmark for the FreHD controller emulation. Drives frehd_in() and
+ * frehd_out() with the register sequences a TRS-80 driver would use and
+ * measures the time spent in the emulation against a directory on the
+ * host file system. By default the directory is created on tmpfs
+ * (/dev/shm) so that the numbers show the cost of the code rather than
+ * that of the disk. Before timing anything it checks that a floppy
+ * controller snapshot survives a save and load.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "trs-fs.h"
+#include "posix.h"
+#include "readahead.h"
+#include "writebehind.h"
+
+extern "C" {
+#include "frehd.h"
+#include "trs_hard.h"
+#include "trs_extra.h"
+#include "trs_disk.h"
+}
+
+// WD1010 registers and commands (see trs_hard.h)
+#define PORT_DATA     0xC8
+#define PORT_SECCNT   0xCA
+#define PORT_SECNUM   0xCB
+#define PORT_CYLLO    0xCC
+#define PORT_CYLHI    0xCD
+#define PORT_SDH      0xCE
+#define PORT_STATUS   0xCF
+#define PORT_COMMAND  0xCF
+#define PORT_DATA2    0xC2
+#define PORT_SIZE2    0xC3
+#define PORT_COMMAND2 0xC4
+
+#define CMD_READ      0x20
+#define CMD_WRITE     0x30
+
+#define STATUS_BUSY   0x80
+#define STATUS_DRQ    0x08
+#define STATUS_ERR    0x01
+
+// Geometry of the image created by write_header()
+#define BENCH_HEADS   6
+#define BENCH_SECS    32
+#define BENCH_SECSIZE 256
+
+#define BENCH_NUM_FILES 64
+#define BENCH_FILE_SIZE (64 * 1024)
+
+// JV1 floppy image and snapshot file used by check_snapshot()
+#define BENCH_FLOPPY    "FLOPPY.DSK"
+#define BENCH_FLOPPY_SIZE (35 * 10 * 256)
+#define BENCH_SNAPSHOT  "FLOPPY.SNP"
+
+
+/*
+ * TRS_FS on top of a host directory using stdio. Serves as the baseline
+ * for TRS_FS_POSIX (-x).
+ */
+class TRS_FS_HOST : virtual public TRS_FS {
+private:
+  const char* root;
+
+  char* abs_path(const char* path) {
+    char* p;
+    asprintf(&p, "%s/%s", root, path);
+    return p;
+  }
+
+public:
+  TRS_FS_HOST(const char* root) : root(root) {
+    err_msg = NULL;
+  }
+
+  FS_TYPE type() {
+    return FS_POSIX;
+  }
+
+  void f_log(const char* msg) {
+  }
+
+  FRESULT f_open(FIL* fp, const TCHAR* path, BYTE mode) {
+    const char* m;
+
+    switch(mode) {
+    case FA_READ:
+      m = "r";
+      break;
+    case FA_READ | FA_WRITE:
+      m = "r+";
+      break;
+    case FA_OPEN_APPEND | FA_WRITE:
+      m = "a";
+      break;
+    case FA_OPEN_APPEND | FA_WRITE | FA_READ:
+      m = "a+";
+      break;
+    case FA_CREATE_ALWAYS | FA_WRITE:
+    case FA_CREATE_NEW | FA_WRITE:
+      m = "w";
+      break;
+    default:
+      m = "w+";
+    }
+    char* p = abs_path(path);
+    fp->f = fopen(p, m);
+    free(p);
+    if (fp->f == NULL) {
+      return (errno == EMFILE || errno == ENFILE) ? FR_TOO_MANY_OPEN_FILES : FR_NO_FILE;
+    }
+    return FR_OK;
+  }
+
+  FRESULT f_opendir(DIR_* dp, const TCHAR* path) {
+    if ((strcmp(path, ".") == 0) || (strcmp(path, "/") == 0)) {
+      path = "";
+    }
+    char* p = abs_path(path);
+    dp->dir = opendir(p);
+    free(p);
+    return (dp->dir != NULL) ? FR_OK : FR_DISK_ERR;
+  }
+
+  FRESULT f_write(FIL* fp, const void* buff, UINT btw, UINT* bw) {
+    *bw = fwrite(buff, 1, btw, (FILE*) fp->f);
+    return FR_OK;
+  }
+
+  FRESULT f_read(FIL* fp, void* buff, UINT btr, UINT* br) {
+    *br = fread(buff, 1, btr, (FILE*) fp->f);
+    return FR_OK;
+  }
+
+  FRESULT f_readdir(DIR_* dp, FILINFO* fno) {
+    while (1) {
+      struct dirent* entry = readdir((DIR*) dp->dir);
+      if (entry == NULL) {
+        closedir((DIR*) dp->dir);
+        fno->fname[0] = '\0';
+        break;
+      }
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+        continue;
+      }
+      if (strlen(entry->d_name) > 12) {
+        continue;
+      }
+      strcpy(fno->fname, entry->d_name);
+      f_stat(fno->fname, fno);
+      break;
+    }
+    return FR_OK;
+  }
+
+  FRESULT f_pread(FIL* fp, void* buff, UINT btr, FSIZE_t ofs, UINT* br) {
+    FILE* f = (FILE*) fp->f;
+    fflush(f);
+    int _br = pread(fileno(f), buff, btr, ofs);
+    *br = (_br >= 0) ? _br : 0;
+    return (_br >= 0) ? FR_OK : FR_DISK_ERR;
+  }
+
+  FRESULT f_pwrite(FIL* fp, const void* buff, UINT btw, FSIZE_t ofs, UINT* bw) {
+    FILE* f = (FILE*) fp->f;
+    fflush(f);
+    int _bw = pwrite(fileno(f), buff, btw, ofs);
+    fseek(f, 0, SEEK_CUR);
+    *bw = (_bw >= 0) ? _bw : 0;
+    return (_bw >= 0) ? FR_OK : FR_DISK_ERR;
+  }
+
+  FSIZE_t f_tell(FIL* fp) {
+    long pos = ftell((FILE*) fp->f);
+    return (pos < 0) ? 0 : pos;
+  }
+
+  FRESULT f_sync(FIL* fp) {
+    return (fflush((FILE*) fp->f) == 0) ? FR_OK : FR_DISK_ERR;
+  }
+
+  FRESULT f_lseek(FIL* fp, FSIZE_t ofs) {
+    fseek((FILE*) fp->f, ofs, SEEK_SET);
+    return FR_OK;
+  }
+
+  FRESULT f_close(FIL* fp) {
+    fclose((FILE*) fp->f);
+    return FR_OK;
+  }
+
+  FRESULT f_unlink(const TCHAR* path) {
+    char* p = abs_path(path);
+    int r = unlink(p);
+    free(p);
+    return r ? FR_NO_FILE : FR_OK;
+  }
+
+  FRESULT f_stat(const TCHAR* path, FILINFO* fno) {
+    struct stat s;
+    char* p = abs_path(path);
+    int r = stat(p, &s);
+    free(p);
+    if (r != 0) {
+      return FR_NO_FILE;
+    }
+    // f_readdir() passes fno->fname itself as the path
+    const char* name = strrchr(path, '/');
+    name = (name == NULL) ? path : name + 1;
+    if (name != fno->fname) {
+      size_t len = std::min(strlen(name), sizeof(fno->fname) - 1);
+      memmove(fno->fname, name, len);
+      fno->fname[len] = '\0';
+    }
+    fno->fsize = s.st_size;
+    fno->fattrib = 1;
+    return FR_OK;
+  }
+};
+
+
+using namespace std::chrono;
+
+/*
+ * Synthetic latency (-l): every request costs one fixed round trip.
+ * Synchronous requests sleep for it, asynchronous ones complete a round
+ * trip after they were issued. This is not a model of SMB: requests do not
+ * queue on a shared connection and there is no server time, so the
+ * numbers only show how much of a round trip the code can hide. They have
+ * not been compared against a real Samba server.
+ */
+class TRS_FS_LATENCY : public TRS_FS_HOST {
+private:
+  microseconds rtt;
+  std::map<FFUTURE*, steady_clock::time_point> due;
+
+public:
+  TRS_FS_LATENCY(const char* root, int rtt_us) : TRS_FS_HOST(root), rtt(rtt_us) {
+  }
+
+  FRESULT f_pread(FIL* fp, void* buff, UINT btr, FSIZE_t ofs, UINT* br) {
+    std::this_thread::sleep_for(rtt);
+    return TRS_FS_HOST::f_pread(fp, buff, btr, ofs, br);
+  }
+
+  FRESULT f_pwrite(FIL* fp, const void* buff, UINT btw, FSIZE_t ofs, UINT* bw) {
+    std::this_thread::sleep_for(rtt);
+    return TRS_FS_HOST::f_pwrite(fp, buff, btw, ofs, bw);
+  }
+
+  FRESULT f_pread_async(FIL* fp, void* buff, UINT btr, FSIZE_t ofs, FFUTURE* fut) {
+    fut->res = TRS_FS_HOST::f_pread(fp, buff, btr, ofs, &fut->n);
+    fut->done = 0;
+    due[fut] = steady_clock::now() + rtt;
+    return FR_OK;
+  }
+
+  FRESULT f_pwrite_async(FIL* fp, const void* buff, UINT btw, FSIZE_t ofs, FFUTURE* fut) {
+    fut->res = TRS_FS_HOST::f_pwrite(fp, buff, btw, ofs, &fut->n);
+    fut->done = 0;
+    due[fut] = steady_clock::now() + rtt;
+    return FR_OK;
+  }
+
+  FRESULT f_wait(FFUTURE* fut, UINT* n) {
+    auto it = due.find(fut);
+    if (it != due.end()) {
+      std::this_thread::sleep_until(it->second);
+      due.erase(it);
+    }
+    fut->done = 1;
+    *n = fut->n;
+    return fut->res;
+  }
+};
+
+TRS_FS* trs_fs = NULL;
+
+// Time the Z80 is assumed to need to transfer a sector through the data
+// port (-z). Not measured on real hardware
+static microseconds z80_sector_time(0);
+
+
+/*
+ * Latency of the emulator actions (the time the TRS-80 sees BUSY) and the
+ * total time of an operation including the port I/O.
+ */
+class Stats {
+private:
+  const char* name;
+  std::vector<double> latency;
+  steady_clock::time_point start;
+  double elapsed = 0;
+  unsigned long ops = 0;
+  unsigned long bytes = 0;
+
+public:
+  Stats(const char* name) : name(name) {}
+
+  void begin() {
+    start = steady_clock::now();
+  }
+
+  void end(unsigned long nbytes) {
+    elapsed += duration<double>(steady_clock::now() - start).count();
+    ops++;
+    bytes += nbytes;
+  }
+
+  void action() {
+    steady_clock::time_point t0 = steady_clock::now();
+    frehd_check_action();
+    latency.push_back(duration<double, std::micro>(steady_clock::now() - t0).count());
+  }
+
+  double percentile(double p) {
+    if (latency.empty()) {
+      return 0;
+    }
+    size_t i = (size_t) (p * (latency.size() - 1));
+    return latency[i];
+  }
+
+  void report() {
+    double sum = 0;
+    for (double l : latency) {
+      sum += l;
+    }
+    std::sort(latency.begin(), latency.end());
+    printf("%-14s %8lu %12.0f %10.1f %9.2f %9.2f %9.2f %9.2f\n",
+           name, ops, ops / elapsed, bytes / elapsed / 1024,
+           latency.empty() ? 0 : sum / latency.size(),
+           percentile(0.5), percentile(0.99), percentile(1.0));
+  }
+};
+
+
+static bool fail(const char* what) {
+  fprintf(stderr, "%s failed (status %02x, error %02x, error2 %02x)\n", what,
+          frehd_in(PORT_STATUS), frehd_in(0xC9), frehd_in(0xC5));
+  return false;
+}
+
+static void select_sector(uint8_t drive, uint32_t lba) {
+  uint16_t cyl = lba / (BENCH_HEADS * BENCH_SECS);
+  uint8_t head = (lba / BENCH_SECS) % BENCH_HEADS;
+
+  frehd_out(PORT_SDH, (drive << 3) | head); // 256 byte sectors
+  frehd_out(PORT_CYLLO, cyl & 0xff);
+  frehd_out(PORT_CYLHI, cyl >> 8);
+  frehd_out(PORT_SECNUM, lba % BENCH_SECS);
+  frehd_out(PORT_SECCNT, 1);
+}
+
+static void fill_sector(uint8_t* buf, uint32_t lba, uint32_t gen) {
+  for (int i = 0; i < BENCH_SECSIZE; i++) {
+    buf[i] = (uint8_t) (lba * 7 + gen * 13 + i);
+  }
+}
+
+static bool read_sector(Stats& st, uint32_t lba, uint8_t* buf) {
+  st.begin();
+  select_sector(0, lba);
+  frehd_out(PORT_COMMAND, CMD_READ);
+  st.action();
+  if (frehd_in(PORT_STATUS) & STATUS_ERR) {
+    return fail("read");
+  }
+  for (int i = 0; i < BENCH_SECSIZE; i++) {
+    buf[i] = frehd_in(PORT_DATA);
+  }
+  std::this_thread::sleep_for(z80_sector_time);
+  st.end(BENCH_SECSIZE);
+  return true;
+}
+
+static bool write_sector(Stats& st, uint32_t lba, const uint8_t* buf) {
+  st.begin();
+  select_sector(0, lba);
+  frehd_out(PORT_COMMAND, CMD_WRITE);
+  for (int i = 0; i < BENCH_SECSIZE; i++) {
+    frehd_out(PORT_DATA, buf[i]);
+  }
+  std::this_thread::sleep_for(z80_sector_time);
+  st.action();
+  if (frehd_in(PORT_STATUS) & STATUS_ERR) {
+    return fail("write");
+  }
+  st.end(BENCH_SECSIZE);
+  return true;
+}
+
+/*
+ * Issue an extra command. size2 is written first if len >= 0; the data
+ * phase (if any) triggers the second step of the command.
+ */
+static uint8_t extra(Stats& st, uint8_t cmd, const uint8_t* data, int len) {
+  if (len >= 0) {
+    frehd_out(PORT_SIZE2, len & 0xff);
+  }
+  frehd_out(PORT_COMMAND2, cmd);
+  st.action();
+  if (len > 0) {
+    for (int i = 0; i < len; i++) {
+      frehd_out(PORT_DATA2, data[i]);
+    }
+    st.action();
+  }
+  return frehd_in(PORT_STATUS);
+}
+
+static int read_data2(uint8_t* buf) {
+  int n = frehd_in(PORT_SIZE2);
+  if (n == 0) {
+    n = 256;
+  }
+  for (int i = 0; i < n; i++) {
+    buf[i] = frehd_in(PORT_DATA2);
+  }
+  return n;
+}
+
+static bool mount_drive(const char* name) {
+  Stats st("mount");
+  uint8_t data[2 + 13];
+
+  data[0] = 0;
+  data[1] = TRS_EXTRA_MOUNT_CREATE;
+  strcpy((char*) &data[2], name);
+  if (extra(st, TRS_EXTRA_MOUNTDRIVE, data, 2 + strlen(name) + 1) & STATUS_ERR) {
+    return fail("mount");
+  }
+  return true;
+}
+
+static uint32_t next_random(uint32_t* seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 8);
+}
+
+static bool bench_sectors(uint32_t nsectors) {
+  uint8_t buf[BENCH_SECSIZE], expect[BENCH_SECSIZE];
+  Stats seq_write("seq write"), seq_read("seq read");
+  Stats rnd_read("random read"), rnd_write("random write");
+  uint32_t seed = 1;
+
+  for (uint32_t lba = 0; lba < nsectors; lba++) {
+    fill_sector(buf, lba, 0);
+    if (!write_sector(seq_write, lba, buf)) return false;
+  }
+  for (uint32_t lba = 0; lba < nsectors; lba++) {
+    if (!read_sector(seq_read, lba, buf)) return false;
+    fill_sector(expect, lba, 0);
+    if (memcmp(buf, expect, BENCH_SECSIZE) != 0) {
+      fprintf(stderr, "data mismatch in sector %u\n", lba);
+      return false;
+    }
+  }
+  for (uint32_t i = 0; i < nsectors; i++) {
+    uint32_t lba = next_random(&seed) % nsectors;
+    if (!read_sector(rnd_read, lba, buf)) return false;
+  }
+  for (uint32_t i = 0; i < nsectors; i++) {
+    uint32_t lba = next_random(&seed) % nsectors;
+    fill_sector(buf, lba, 1);
+    if (!write_sector(rnd_write, lba, buf)) return false;
+  }
+
+  seq_write.report();
+  seq_read.report();
+  rnd_read.report();
+  rnd_write.report();
+  return true;
+}
+
+static bool create_files(const char* dir) {
+  std::vector<uint8_t> data(BENCH_FILE_SIZE, 0x5a);
+
+  for (int i = 0; i < BENCH_NUM_FILES; i++) {
+    char* path;
+    asprintf(&path, "%s/FILE%02d.DAT", dir, i);
+    FILE* f = fopen(path, "w");
+    free(path);
+    if (f == NULL || fwrite(data.data(), 1, data.size(), f) != data.size()) {
+      perror("create");
+      return false;
+    }
+    fclose(f);
+  }
+  return true;
+}
+
+static bool bench_readdir(int passes) {
+  Stats st("readdir");
+  uint8_t buf[256];
+  const uint8_t path[] = ".";
+
+  for (int p = 0; p < passes; p++) {
+    st.begin();
+    if (extra(st, TRS_EXTRA_OPENDIR, path, sizeof(path)) & STATUS_ERR) {
+      return fail("opendir");
+    }
+    st.end(0);
+    while (1) {
+      st.begin();
+      uint8_t status = extra(st, TRS_EXTRA_READDIR, NULL, -1);
+      if (status & STATUS_ERR) {
+        return fail("readdir");
+      }
+      if (!(status & STATUS_DRQ)) {
+        st.end(0);
+        break;
+      }
+      st.end(read_data2(buf));
+    }
+  }
+  st.report();
+  return true;
+}
+
+static bool bench_readfile(int passes) {
+  Stats st("readfile");
+  uint8_t buf[256];
+
+  for (int p = 0; p < passes; p++) {
+    uint8_t data[1 + 13];
+    int len = 1 + sprintf((char*) &data[1], "FILE%02d.DAT", p % BENCH_NUM_FILES) + 1;
+    data[0] = FA_READ;
+    st.begin();
+    if (extra(st, TRS_EXTRA_OPENFILE, data, len) & STATUS_ERR) {
+      return fail("openfile");
+    }
+    st.end(0);
+    while (1) {
+      st.begin();
+      // a size2 of 0 means 256 bytes
+      uint8_t status = extra(st, TRS_EXTRA_READFILE, NULL, 0);
+      if (status & STATUS_ERR) {
+        return fail("readfile");
+      }
+      if (!(status & STATUS_DRQ)) {
+        st.end(0);
+        break;
+      }
+      st.end(read_data2(buf));
+    }
+    st.begin();
+    extra(st, TRS_EXTRA_CLOSEFILE, NULL, -1);
+    st.end(0);
+  }
+  st.report();
+  return true;
+}
+
+static bool snapshot_fail(const char* what) {
+  fprintf(stderr, "snapshot: %s\n", what);
+  return false;
+}
+
+static FSIZE_t snapshot_size() {
+  FILINFO fno;
+  return (trs_fs->f_stat(BENCH_SNAPSHOT, &fno) == FR_OK) ? fno.fsize : 0;
+}
+
+/*
+ * Round trip of the floppy controller snapshot: a full save, an
+ * incremental save that only appends what changed, and a load that must
+ * restore the last checkpoint. A checkpoint that was cut short must be
+ * ignored in favour of the one before it.
+ */
+static bool check_snapshot(const char* dir) {
+  std::vector<uint8_t> image(BENCH_FLOPPY_SIZE, 0xe5);
+  char* path;
+
+  // A JV1 image starts with 0x00 0xfe
+  image[0] = 0x00;
+  image[1] = 0xfe;
+  asprintf(&path, "%s/" BENCH_FLOPPY, dir);
+  FILE* f = fopen(path, "w");
+  free(path);
+  if (f == NULL || fwrite(image.data(), 1, image.size(), f) != image.size()) {
+    perror("create");
+    return false;
+  }
+  fclose(f);
+
+  trs_disk_insert(0, BENCH_FLOPPY);
+  if (strcmp(trs_disk_getfilename(0), BENCH_FLOPPY) != 0) {
+    return snapshot_fail("insert failed");
+  }
+  trs_disk_track_write(12);
+  trs_disk_sector_write(3);
+  if (trs_disk_snapshot_save(BENCH_SNAPSHOT, 1) != 0) {
+    return snapshot_fail("full save failed");
+  }
+  FSIZE_t full = snapshot_size();
+
+  trs_disk_track_write(20);
+  trs_disk_sector_write(7);
+  if (trs_disk_snapshot_save(BENCH_SNAPSHOT, 0) != 0) {
+    return snapshot_fail("incremental save failed");
+  }
+  FSIZE_t incremental = snapshot_size() - full;
+  if (incremental == 0 || incremental >= full) {
+    return snapshot_fail("incremental save did not append a delta");
+  }
+
+  trs_disk_remove(0);
+  trs_disk_track_write(0);
+  trs_disk_sector_write(0);
+  if (trs_disk_snapshot_load(BENCH_SNAPSHOT) != 0) {
+    return snapshot_fail("load failed");
+  }
+  if (strcmp(trs_disk_getfilename(0), BENCH_FLOPPY) != 0 ||
+      trs_disk_track_read() != 20 || trs_disk_sector_read() != 7) {
+    return snapshot_fail("load did not restore the last checkpoint");
+  }
+
+  asprintf(&path, "%s/" BENCH_SNAPSHOT, dir);
+  int r = truncate(path, full + incremental - 1);
+  free(path);
+  if (r != 0 || trs_disk_snapshot_load(BENCH_SNAPSHOT) != 0) {
+    return snapshot_fail("load of a cut short file failed");
+  }
+  if (trs_disk_track_read() != 12 || trs_disk_sector_read() != 3) {
+    return snapshot_fail("load did not fall back to the previous checkpoint");
+  }
+  trs_disk_remove(0);
+
+  printf("snapshot: full %u bytes, incremental %u bytes, round trip ok\n",
+         (unsigned) full, (unsigned) incremental);
+  return true;
+}
+
+static void report_writebehind() {
+  const wb_stats_t* s = TRS_FS_WRITEBEHIND::get_stats();
+  if (s->writes == 0 || s->backend_writes == 0) {
+    return;
+  }
+  // Without the wrapper every write would have cost a backend write
+  double backend_avg = (double) s->backend_us / s->backend_writes;
+  double saved = backend_avg * s->writes - s->write_us;
+  printf("write-behind: %u writes (%llu KB) -> %u backend writes (%llu KB), "
+         "amplification %.2f, saved %.0f us\n",
+         s->writes, (unsigned long long) s->bytes / 1024,
+         s->backend_writes, (unsigned long long) s->backend_bytes / 1024,
+         (double) s->backend_bytes / s->bytes, saved);
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage: %s [-n sectors] [-p passes] [-d dir] [-l rtt_us] [-z us] "
+          "[-r] [-w] [-x]\n"
+          "  -l and -z add synthetic delays; they are not calibrated against SMB\n", prog);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t nsectors = 4096;
+  int passes = 16;
+  char shm_tmpl[] = "/dev/shm/frehd-bench-XXXXXX";
+  char tmpl[] = "/tmp/frehd-bench-XXXXXX";
+  const char* dir = NULL;
+  bool readahead = false;
+  bool writebehind = false;
+  bool posix = false;
+  int rtt_us = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:p:d:l:z:rwx")) != -1) {
+    switch (opt) {
+    case 'n':
+      nsectors = atoi(optarg);
+      break;
+    case 'p':
+      passes = atoi(optarg);
+      break;
+    case 'd':
+      dir = optarg;
+      break;
+    case 'l':
+      rtt_us = atoi(optarg);
+      break;
+    case 'z':
+      z80_sector_time = microseconds(atoi(optarg));
+      break;
+    case 'r':
+      readahead = true;
+      break;
+    case 'w':
+      writebehind = true;
+      break;
+    case 'x':
+      posix = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (dir == NULL && (dir = mkdtemp(shm_tmpl)) == NULL &&
+      (dir = mkdtemp(tmpl)) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  if (posix) {
+    trs_fs = new TRS_FS_POSIX(dir);
+  } else if (rtt_us > 0) {
+    trs_fs = new TRS_FS_LATENCY(dir, rtt_us);
+  } else {
+    trs_fs = new TRS_FS_HOST(dir);
+  }
+  if (writebehind) {
+    trs_fs = new TRS_FS_WRITEBEHIND(trs_fs);
+  }
+  if (readahead) {
+    trs_fs = new TRS_FS_READAHEAD(trs_fs);
+  }
+  init_frehd();
+  if (!mount_drive("hard4-0") || !create_files(dir) || !check_snapshot(dir)) {
+    return 1;
+  }
+
+  printf("FreHD benchmark in %s (%s, %u sectors, %d passes)\n", dir,
+         posix ? "TRS_FS_POSIX" : (rtt_us > 0 ? "stdio + synthetic latency" : "stdio"),
+         nsectors, passes);
+  printf("%-14s %8s %12s %10s %9s %9s %9s %9s\n", "", "ops", "ops/s", "KB/s",
+         "avg(us)", "p50(us)", "p99(us)", "max(us)");
+  bool ok = bench_sectors(nsectors) && bench_readdir(passes) && bench_readfile(passes);
+  close_drives();
+  if (writebehind) {
+    report_writebehind();
+  }
+  return ok ? 0 : 1;
+}
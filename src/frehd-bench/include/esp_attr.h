@@ -0,0 +1,11 @@
+/*
+ * Host replacement for the ESP-IDF section attributes used by the FreHD
+ * sources.
+ */
+#ifndef __ESP_ATTR_H__
+#define __ESP_ATTR_H__
+
+#define IRAM_ATTR
+#define EXT_RAM_ATTR
+
+#endif
@@ -0,0 +1,16 @@
+/*
+ * Host replacement for the ESP-IDF heap_caps API used by the FreHD sources.
+ */
+#ifndef __ESP_HEAP_CAPS_H__
+#define __ESP_HEAP_CAPS_H__
+
+#include <stdlib.h>
+
+#define MALLOC_CAP_8BIT   (1 << 2)
+#define MALLOC_CAP_SPIRAM (1 << 10)
+
+#define heap_caps_malloc(size, caps) malloc(size)
+#define heap_caps_malloc_prefer(size, num, ...) malloc(size)
+#define heap_caps_free(ptr) free(ptr)
+
+#endif
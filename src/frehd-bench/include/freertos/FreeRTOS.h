@@ -0,0 +1,18 @@
+/*
+ * Host replacement for the parts of FreeRTOS used by the TRS_FS sources.
+ */
+#ifndef __FREERTOS_H__
+#define __FREERTOS_H__
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define portMAX_DELAY 0xffffffff
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Host replacement for FreeRTOS mutexes.
+ */
+#ifndef __SEMPHR_H__
+#define __SEMPHR_H__
+
+#include "FreeRTOS.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+typedef pthread_mutex_t* SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateMutex() {
+  SemaphoreHandle_t m = (SemaphoreHandle_t) malloc(sizeof(pthread_mutex_t));
+  if (m != NULL) {
+    pthread_mutex_init(m, NULL);
+  }
+  return m;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t m, TickType_t wait) {
+  if (wait == 0) {
+    return (pthread_mutex_trylock(m) == 0) ? pdTRUE : pdFALSE;
+  }
+  return (pthread_mutex_lock(m) == 0) ? pdTRUE : pdFALSE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t m) {
+  return (pthread_mutex_unlock(m) == 0) ? pdTRUE : pdFALSE;
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t m) {
+  pthread_mutex_destroy(m);
+  free(m);
+}
+
+#endif
@@ -0,0 +1,17 @@
+/*
+ * Host replacement for the FreeRTOS tick counter.
+ */
+#ifndef __TASK_H__
+#define __TASK_H__
+
+#include "FreeRTOS.h"
+
+#include <time.h>
+
+static inline TickType_t xTaskGetTickCount() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (TickType_t) (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+#endif
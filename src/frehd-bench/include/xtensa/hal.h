@@ -0,0 +1,18 @@
+/*
+ * Host replacement for the Xtensa cycle counter used by the floppy
+ * emulation. Counts at CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ and wraps like
+ * the real register.
+ */
+#ifndef __XTENSA_HAL_H__
+#define __XTENSA_HAL_H__
+
+#include <time.h>
+
+static inline unsigned xthal_get_ccount() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned) (ts.tv_sec * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000ULL +
+                     ts.tv_nsec * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ / 1000);
+}
+
+#endif
@@ -47,6 +47,23 @@ public class BaseIO {
         return data;
     }
 
+    public byte[] readBytes(int len) {
+        byte[] data = new byte[len];
+        try {
+            int read = 0;
+            while (read != len) {
+                int br = in.read(data, read, len - read);
+                if (br == -1) {
+                    continue;
+                }
+                read += br;
+            }
+        } catch (IOException e) {
+            return null;
+        }
+        return data;
+    }
+
     public void writeByte(byte b) {
         try {
             out.write((int) b & 0xff);
@@ -65,4 +82,30 @@ public class BaseIO {
         } catch (IOException e) {
         }
     }
+
+    public void writeBytes(byte[] data) {
+        try {
+            out.write(data);
+            out.flush();
+        } catch (IOException e) {
+        }
+    }
+
+    public boolean waitForData(int len, int timeoutMs) {
+        long deadline = System.currentTimeMillis() + timeoutMs;
+        try {
+            while (in.available() < len) {
+                if (System.currentTimeMillis() >= deadline) {
+                    return false;
+                }
+                Thread.sleep(1);
+            }
+        } catch (IOException | InterruptedException e) {
+            return false;
+        }
+        return true;
+    }
+
+    public void setBaudRate(int baud) {
+    }
 }
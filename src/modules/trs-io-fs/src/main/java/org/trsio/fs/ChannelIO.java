@@ -3,6 +3,10 @@ package org.trsio.fs;
 public interface ChannelIO {
     byte readByte();
     byte[] readBlob();
+    byte[] readBytes(int len);
     void writeByte(byte b);
     void writeBlob(byte[] data);
+    void writeBytes(byte[] data);
+    boolean waitForData(int len, int timeoutMs);
+    void setBaudRate(int baud);
 }
@@ -0,0 +1,18 @@
+package org.trsio.fs;
+
+/**
+ * CRC16-CCITT (polynomial 0x1021) as used by the framed protocol.
+ */
+public class Crc16 {
+    final public static int INIT = 0xffff;
+
+    public static int update(int crc, byte[] data, int offset, int len) {
+        for (int i = offset; i < offset + len; i++) {
+            crc ^= (data[i] & 0xff) << 8;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = ((crc & 0x8000) != 0) ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc & 0xffff;
+    }
+}
@@ -2,7 +2,9 @@ package org.trsio.fs;
 
 import java.io.File;
 import java.io.IOException;
+import java.nio.BufferUnderflowException;
 import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.nio.channels.SeekableByteChannel;
 import java.nio.file.*;
 import java.util.*;
@@ -14,11 +16,13 @@ public class FileIO {
             name = "";
             size = 0;
             attrib = 0;
+            modified = 0;
         }
 
         String name;
         long size;
         byte attrib;
+        long modified;
     }
 
     final static String MARKER = "TRS-IO:FS:";
@@ -33,6 +37,31 @@ public class FileIO {
     final static byte F_OPENDIR = 6;
     final static byte F_READDIR = 7;
     final static byte F_STAT = 8;
+    final static byte F_HELLO = 9;
+    final static byte F_PREAD = 10;
+    final static byte F_PWRITE = 11;
+
+    /*
+     * Framed protocol (see serial.h of the trs-fs component):
+     *
+     *   SYNC0 SYNC1 seq cmd len(2) payload[len] crc(2)
+     *
+     * Requests are handled strictly in sequence order. Replies are kept so
+     * that a request the client sends again can be answered without
+     * executing it twice.
+     */
+    final static int SYNC0 = 0xa5;
+    final static int SYNC1 = 0x5a;
+    final static int REPLY = 0x80;
+    final static int VERSION = 2;
+    final static int HEADER_SIZE = 6;
+    final static int BLOCK_SIZE = 4096;
+    final static int MAX_PAYLOAD = BLOCK_SIZE + 16;
+    final static int HISTORY = 32;
+    final static int DEFAULT_BAUD = 115200;
+    final static int MAX_BAUD = 921600;
+    // Back to DEFAULT_BAUD if no valid frame arrives this long after switching
+    final static int BAUD_TIMEOUT_MS = 2000;
 
     private ChannelIO io;
 
@@ -40,11 +69,25 @@ public class FileIO {
     private Map<Short, SeekableByteChannel> files;
     private Map<Short, List<FileInfo>> directoryFiles;
 
+    private int maxBaud;
+    private int baud;
+    private long baudDeadline;
+    private int expectedSeq;
+    private byte[][] replies;
+
     public FileIO(ChannelIO io) {
+        this(io, DEFAULT_BAUD);
+    }
+
+    public FileIO(ChannelIO io, int maxBaud) {
         this.io = io;
+        this.maxBaud = maxBaud;
         nextID = 0;
         files = new HashMap<>();
         directoryFiles = new HashMap<>();
+        baud = DEFAULT_BAUD;
+        expectedSeq = -1;
+        replies = new byte[256][];
     }
 
     private byte readByte() {
@@ -93,25 +136,59 @@ public class FileIO {
         writeWord((int) ((l >> 16) & 0xffff));
     }
 
-    private void scanForMarker() {
+    /**
+     * Waits for len bytes while a new baud rate has not been confirmed by a
+     * valid frame yet. Returns false after falling back to DEFAULT_BAUD if
+     * they do not arrive in time; the client falls back as well.
+     */
+    private boolean awaitData(int len) {
+        if (baudDeadline == 0) {
+            return true;
+        }
+        long left = baudDeadline - System.currentTimeMillis();
+        if (left > 0 && io.waitForData(len, (int) left)) {
+            return true;
+        }
+        baudDeadline = 0;
+        baud = DEFAULT_BAUD;
+        io.setBaudRate(baud);
+        return false;
+    }
+
+    /**
+     * Returns true if the start of a frame was found rather than the marker.
+     */
+    private boolean scanForMarker() {
         int markerPos = 0;
+        boolean sync = false;
 
         while (true) {
+            if (!awaitData(1)) {
+                sync = false;
+                continue;
+            }
             byte b = io.readByte();
+            if (sync && (b & 0xff) == SYNC1) {
+                return true;
+            }
+            sync = (b & 0xff) == SYNC0;
             if (b != MARKER.charAt(markerPos)) {
                 markerPos = MARKER.charAt(0) == b ? 1 : 0;
                 continue;
             }
             markerPos++;
             if (markerPos == MARKER.length()) {
-                return;
+                return false;
             }
         }
     }
 
     public void start() {
         while(true) {
-            scanForMarker();
+            if (scanForMarker()) {
+                doFrame();
+                continue;
+            }
             switch (io.readByte()) {
                 case F_LOG:
                     doLog();
@@ -156,6 +233,25 @@ public class FileIO {
     private void doOpen() {
         byte mode = readByte();
         String path = readString();
+        Set<StandardOpenOption> openOptions = getOpenOptions(mode);
+        if (openOptions == null) {
+            writeByte(FRESULT.FR_INVALID_PARAMETER);
+            return;
+        }
+        try {
+            SeekableByteChannel channel= Files.newByteChannel(Paths.get(path), openOptions);
+            short id = nextID++;
+            files.put(id, channel);
+            writeByte(FRESULT.FR_OK);
+            writeWord(id);
+        } catch (AccessDeniedException e) {
+            writeByte(FRESULT.FR_DENIED);
+        } catch (IOException e) {
+            writeByte(FRESULT.FR_NO_FILE);
+        }
+    }
+
+    private Set<StandardOpenOption> getOpenOptions(byte mode) {
         Set<StandardOpenOption> openOptions = new HashSet<>();
         if ((mode & OpenMode.FA_READ) != 0) {
             openOptions.add(StandardOpenOption.READ);
@@ -180,19 +276,7 @@ public class FileIO {
             openOptions.add(StandardOpenOption.APPEND);
             mode &= ~OpenMode.FA_OPEN_APPEND;
         }
-        if (mode != 0) {
-            writeByte(FRESULT.FR_INVALID_PARAMETER);
-            return;
-        }
-        try {
-            SeekableByteChannel channel= Files.newByteChannel(Paths.get(path), openOptions);
-            short id = nextID++;
-            files.put(id, channel);
-            writeByte(FRESULT.FR_OK);
-            writeWord(id);
-        } catch (IOException e) {
-            writeByte(FRESULT.FR_NO_FILE);
-        }
+        return (mode == 0) ? openOptions : null;
     }
 
     private SeekableByteChannel getChannel() {
@@ -324,6 +408,12 @@ public class FileIO {
         String directory = readString();
         //XXX
         directory = ".";
+        short id = openDir(directory);
+        writeByte(FRESULT.FR_OK);
+        writeWord(id);
+    }
+
+    private short openDir(String directory) {
         List<FileInfo> fileInfos = new ArrayList<>();
         short id = nextID++;
         directoryFiles.put(id, fileInfos);
@@ -346,11 +436,11 @@ public class FileIO {
                 fileInfo.name = p;
                 fileInfo.size = Files.size(path);
                 fileInfo.attrib = getFileAttributes(path);
+                fileInfo.modified = Files.getLastModifiedTime(path).toMillis();
                 fileInfos.add(fileInfo);
             }
         } catch (IOException ex) {}
-        writeByte(FRESULT.FR_OK);
-        writeWord(id);
+        return id;
     }
 
     private byte getFileAttributes(Path path) {
@@ -372,24 +462,29 @@ public class FileIO {
 
     private void doReadDir() {
         short id = readWord();
-        if (!directoryFiles.containsKey(id)) {
+        FileInfo fileInfo = nextFileInfo(id);
+        if (fileInfo == null) {
             writeByte(FRESULT.FR_INVALID_OBJECT);
             return;
         }
+        writeByte(FRESULT.FR_OK);
+        writeString(fileInfo.name);
+        writeLong(fileInfo.size);
+        writeByte(fileInfo.attrib);
+    }
+
+    private FileInfo nextFileInfo(short id) {
+        if (!directoryFiles.containsKey(id)) {
+            return null;
+        }
         List<FileInfo> fileInfos = directoryFiles.get(id);
-        FileInfo fileInfo;
 
         if (fileInfos.isEmpty()) {
+            // An empty name marks the end of the directory
             directoryFiles.remove(id);
-            fileInfo = new FileInfo();
-        } else {
-            fileInfo = fileInfos.get(0);
-            fileInfos.remove(0);
+            return new FileInfo();
         }
-        writeByte(FRESULT.FR_OK);
-        writeString(fileInfo.name);
-        writeLong(fileInfo.size);
-        writeByte(fileInfo.attrib);
+        return fileInfos.remove(0);
     }
 
     private void doStat() {
@@ -411,4 +506,245 @@ public class FileIO {
         writeLong(size);
         writeByte(getFileAttributes(path));
     }
+
+    private void doFrame() {
+        if (!awaitData(4)) {
+            return;
+        }
+        byte[] header = io.readBytes(4);
+        if (header == null) {
+            return;
+        }
+        int seq = header[0] & 0xff;
+        int cmd = header[1] & 0xff;
+        int len = (header[2] & 0xff) | ((header[3] & 0xff) << 8);
+        if (len > MAX_PAYLOAD) {
+            return;
+        }
+        if (!awaitData(len + 2)) {
+            return;
+        }
+        byte[] rest = io.readBytes(len + 2);
+        if (rest == null) {
+            return;
+        }
+        int crc = Crc16.update(Crc16.update(Crc16.INIT, header, 0, 4), rest, 0, len);
+        if (crc != ((rest[len] & 0xff) | ((rest[len + 1] & 0xff) << 8))) {
+            // Corrupted. The client will send it again
+            return;
+        }
+        baudDeadline = 0;
+
+        if (cmd != F_HELLO && expectedSeq >= 0 && seq != expectedSeq) {
+            int age = (expectedSeq - seq) & 0xff;
+            if (age >= 1 && age <= HISTORY && replies[seq] != null) {
+                io.writeBytes(replies[seq]);
+            }
+            // Requests after a lost one are dropped until it arrives again
+            return;
+        }
+
+        ByteBuffer request = ByteBuffer.wrap(rest, 0, len).order(ByteOrder.LITTLE_ENDIAN);
+        ByteBuffer reply = ByteBuffer.allocate(HEADER_SIZE + MAX_PAYLOAD + 2).order(ByteOrder.LITTLE_ENDIAN);
+        reply.put((byte) SYNC0).put((byte) SYNC1).put((byte) seq).put((byte) (cmd | REPLY)).putShort((short) 0);
+        reply.put(FRESULT.FR_OK);
+        int previousBaud = baud;
+        byte res;
+        try {
+            res = doFrameCommand((byte) cmd, request, reply);
+        } catch (BufferUnderflowException e) {
+            res = FRESULT.FR_INVALID_PARAMETER;
+        } catch (IOException e) {
+            res = FRESULT.FR_DISK_ERR;
+        }
+        if (res != FRESULT.FR_OK) {
+            reply.position(HEADER_SIZE);
+            reply.put(res);
+        }
+        reply.putShort(4, (short) (reply.position() - HEADER_SIZE));
+        reply.putShort((short) Crc16.update(Crc16.INIT, reply.array(), 2, reply.position() - 2));
+
+        byte[] frame = Arrays.copyOf(reply.array(), reply.position());
+        replies[seq] = frame;
+        expectedSeq = (seq + 1) & 0xff;
+        io.writeBytes(frame);
+        if (cmd == F_HELLO && baud != previousBaud) {
+            // Both sides switch once the reply has been sent. A HELLO that
+            // keeps the rate only resets the sequence number
+            io.setBaudRate(baud);
+            if (baud != DEFAULT_BAUD) {
+                baudDeadline = System.currentTimeMillis() + BAUD_TIMEOUT_MS;
+            }
+        }
+    }
+
+    private byte doFrameCommand(byte cmd, ByteBuffer request, ByteBuffer reply) throws IOException {
+        switch (cmd) {
+            case F_LOG:
+                System.out.println(getString(request));
+                return FRESULT.FR_OK;
+            case F_HELLO:
+                return doHello(request, reply);
+            case F_OPEN:
+                return doOpen(request, reply);
+            case F_PREAD:
+                return doPread(request, reply);
+            case F_PWRITE:
+                return doPwrite(request, reply);
+            case F_WRITE:
+                return doAppend(request, reply);
+            case F_CLOSE:
+                return doClose(request);
+            case F_UNLINK:
+                return new File(getString(request)).delete() ? FRESULT.FR_OK : FRESULT.FR_NO_FILE;
+            case F_OPENDIR:
+                return doOpenDir(request, reply);
+            case F_READDIR:
+                return doReadDir(request, reply);
+            case F_STAT:
+                return doStat(request, reply);
+            default:
+                return FRESULT.FR_INVALID_PARAMETER;
+        }
+    }
+
+    private static String getString(ByteBuffer buffer) {
+        StringBuilder s = new StringBuilder();
+        while (true) {
+            byte b = buffer.get();
+            if (b == 0) {
+                return s.toString();
+            }
+            s.append((char) (b & 0xff));
+        }
+    }
+
+    private static void putFileInfo(ByteBuffer reply, long size, byte attrib, long modified) {
+        Calendar c = Calendar.getInstance();
+        c.setTimeInMillis(modified);
+        int year = Math.max(c.get(Calendar.YEAR) - 1980, 0);
+        reply.putInt((int) size);
+        reply.put(attrib);
+        reply.putShort((short) ((year << 9) | ((c.get(Calendar.MONTH) + 1) << 5) | c.get(Calendar.DAY_OF_MONTH)));
+        reply.putShort((short) ((c.get(Calendar.HOUR_OF_DAY) << 11) | (c.get(Calendar.MINUTE) << 5) | (c.get(Calendar.SECOND) / 2)));
+    }
+
+    private SeekableByteChannel getChannel(ByteBuffer request) {
+        return files.get(request.getShort());
+    }
+
+    private byte doHello(ByteBuffer request, ByteBuffer reply) {
+        if (request.get() != VERSION) {
+            return FRESULT.FR_INVALID_PARAMETER;
+        }
+        baud = Math.min(request.getInt(), maxBaud);
+        reply.put((byte) VERSION);
+        reply.putInt(baud);
+        reply.putShort((short) BLOCK_SIZE);
+        return FRESULT.FR_OK;
+    }
+
+    private byte doOpen(ByteBuffer request, ByteBuffer reply) {
+        byte mode = request.get();
+        String path = getString(request);
+        Set<StandardOpenOption> openOptions = getOpenOptions(mode);
+        if (openOptions == null) {
+            return FRESULT.FR_INVALID_PARAMETER;
+        }
+        try {
+            SeekableByteChannel channel = Files.newByteChannel(Paths.get(path), openOptions);
+            short id = nextID++;
+            files.put(id, channel);
+            reply.putShort(id);
+            reply.putInt((int) (openOptions.contains(StandardOpenOption.APPEND) ? channel.size() : 0));
+            return FRESULT.FR_OK;
+        } catch (AccessDeniedException e) {
+            return FRESULT.FR_DENIED;
+        } catch (IOException e) {
+            return FRESULT.FR_NO_FILE;
+        }
+    }
+
+    private byte doPread(ByteBuffer request, ByteBuffer reply) throws IOException {
+        SeekableByteChannel channel = getChannel(request);
+        if (channel == null) {
+            return FRESULT.FR_INVALID_OBJECT;
+        }
+        long ofs = request.getInt() & 0xffffffffL;
+        int btr = Math.min(request.getShort() & 0xffff, BLOCK_SIZE);
+        channel.position(ofs);
+        ByteBuffer data = reply.slice();
+        data.limit(btr);
+        while (data.hasRemaining()) {
+            if (channel.read(data) == -1) {
+                break;
+            }
+        }
+        reply.position(reply.position() + data.position());
+        return FRESULT.FR_OK;
+    }
+
+    private byte doPwrite(ByteBuffer request, ByteBuffer reply) throws IOException {
+        SeekableByteChannel channel = getChannel(request);
+        if (channel == null) {
+            return FRESULT.FR_INVALID_OBJECT;
+        }
+        channel.position(request.getInt() & 0xffffffffL);
+        int bw = channel.write(request);
+        reply.putShort((short) bw);
+        return FRESULT.FR_OK;
+    }
+
+    private byte doAppend(ByteBuffer request, ByteBuffer reply) throws IOException {
+        SeekableByteChannel channel = getChannel(request);
+        if (channel == null) {
+            return FRESULT.FR_INVALID_OBJECT;
+        }
+        int bw = channel.write(request);
+        reply.putShort((short) bw);
+        reply.putInt((int) channel.position());
+        return FRESULT.FR_OK;
+    }
+
+    private byte doClose(ByteBuffer request) throws IOException {
+        SeekableByteChannel channel = files.remove(request.getShort());
+        if (channel == null) {
+            return FRESULT.FR_INVALID_OBJECT;
+        }
+        channel.close();
+        return FRESULT.FR_OK;
+    }
+
+    private byte doOpenDir(ByteBuffer request, ByteBuffer reply) {
+        String directory = getString(request);
+        if (directory.isEmpty()) {
+            directory = ".";
+        }
+        if (!Files.isDirectory(Paths.get(directory))) {
+            return FRESULT.FR_NO_PATH;
+        }
+        reply.putShort(openDir(directory));
+        return FRESULT.FR_OK;
+    }
+
+    private byte doReadDir(ByteBuffer request, ByteBuffer reply) {
+        FileInfo fileInfo = nextFileInfo(request.getShort());
+        if (fileInfo == null) {
+            return FRESULT.FR_INVALID_OBJECT;
+        }
+        reply.put(fileInfo.name.getBytes());
+        reply.put((byte) 0);
+        putFileInfo(reply, fileInfo.size, fileInfo.attrib, fileInfo.modified);
+        return FRESULT.FR_OK;
+    }
+
+    private byte doStat(ByteBuffer request, ByteBuffer reply) throws IOException {
+        Path path = Paths.get(getString(request));
+        if (!Files.exists(path)) {
+            return FRESULT.FR_NO_FILE;
+        }
+        putFileInfo(reply, Files.size(path), getFileAttributes(path),
+                    Files.getLastModifiedTime(path).toMillis());
+        return FRESULT.FR_OK;
+    }
 }
@@ -4,17 +4,26 @@ package org.trsio.fs;
 public class Main {
 
     public static void main(String[] args) {
-        if (args.length != 1) {
-            System.err.println("Usage: trs-io-fs <serial-port>");
+        if (args.length != 1 && args.length != 2) {
+            System.err.println("Usage: trs-io-fs <serial-port> [max-baud]");
             System.exit(-1);
         }
+        int maxBaud = FileIO.MAX_BAUD;
+        if (args.length == 2) {
+            try {
+                maxBaud = Integer.parseInt(args[1]);
+            } catch (NumberFormatException e) {
+                System.err.println("Invalid baud rate " + args[1]);
+                System.exit(-1);
+            }
+        }
         //SocketIO channel = new SocketIO();
         SerialIO channel = new SerialIO(args[0]);
         if (!channel.isOpen()) {
             System.err.println("Could not open " + args[0]);
             System.exit(-1);
         }
-        FileIO fileIO = new FileIO(channel);
+        FileIO fileIO = new FileIO(channel, maxBaud);
         fileIO.start();
     }
 }
@@ -5,12 +5,14 @@ import com.fazecast.jSerialComm.SerialPort;
 
 public class SerialIO extends BaseIO implements ChannelIO {
 
+    private SerialPort comPort;
+
     public SerialIO(String portName) {
         connect(portName);
     }
 
     private void connect(String portName) {
-        SerialPort comPort = SerialPort.getCommPort(portName);
+        comPort = SerialPort.getCommPort(portName);
         comPort.setBaudRate(115200);
         comPort.setNumDataBits(8);
         comPort.setNumStopBits(1);
@@ -20,4 +22,17 @@ public class SerialIO extends BaseIO implements ChannelIO {
         in = comPort.getInputStream();
         out = comPort.getOutputStream();
     }
+
+    @Override
+    public void setBaudRate(int baud) {
+        if (baud == comPort.getBaudRate()) {
+            return;
+        }
+        try {
+            // Let the last reply leave the UART at the old rate
+            Thread.sleep(20);
+        } catch (InterruptedException e) {
+        }
+        comPort.setBaudRate(baud);
+    }
 }
@@ -0,0 +1,689 @@
+
+/*
+ * Loopback benchmark for the framed serial file protocol. TRS_FS_SERIAL
+ * talks to a server thread over a pseudo-terminal pair. Both ends are
+ * throttled to the negotiated baud rate, so the numbers approximate a real
+ * UART link. The server serves a temporary directory on the host.
+ * With -x the built-in server is not started; instead the client waits
+ * for an external one, such as the trs-io-fs Java server, to answer on
+ * the printed pseudo-terminal.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trs-fs.h"
+#include "serial.h"
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * One end of the pseudo-terminal. A reader thread drains the descriptor
+ * like the UART driver does, so that neither side blocks the other.
+ * Writes are delayed until the bytes would have left the wire at the
+ * current baud rate (8N1, ten bits per byte). Bytes arrive garbled if the
+ * two ends use different rates or the rate is above what the link handles.
+ */
+class PtyPort : public SerialPort {
+private:
+  int fd;
+  std::atomic<int> baud{SERIAL_DEFAULT_BAUD};
+  PtyPort* peer = NULL;
+  int max_link_baud = 0;
+  Clock::time_point next_free = Clock::now();
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::deque<uint8_t> rx;
+  std::thread reader;
+  bool closed = false;
+
+  void receive() {
+    uint8_t buf[4096];
+    while (true) {
+      int n = ::read(fd, buf, sizeof(buf));
+      std::lock_guard<std::mutex> l(mutex);
+      if (n <= 0) {
+        closed = true;
+        cond.notify_all();
+        return;
+      }
+      rx.insert(rx.end(), buf, buf + n);
+      cond.notify_all();
+    }
+  }
+
+public:
+  PtyPort(int fd) : fd(fd) {
+    reader = std::thread(&PtyPort::receive, this);
+  }
+
+  ~PtyPort() {
+    reader.detach();
+  }
+
+  // max_baud is the highest rate the link works at, 0 for any
+  void connect(PtyPort* peer, int max_baud) {
+    this->peer = peer;
+    max_link_baud = max_baud;
+  }
+
+  int read(void* buf, int len, int timeout_ms) {
+    std::unique_lock<std::mutex> l(mutex);
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+    while ((int) rx.size() < len && !closed) {
+      if (cond.wait_until(l, deadline) == std::cv_status::timeout) {
+        break;
+      }
+    }
+    int n = std::min(len, (int) rx.size());
+    std::copy(rx.begin(), rx.begin() + n, (uint8_t*) buf);
+    rx.erase(rx.begin(), rx.begin() + n);
+    return n;
+  }
+
+  void write(const void* buf, int len) {
+    Clock::time_point now = Clock::now();
+    next_free = std::max(now, next_free) +
+      std::chrono::microseconds(len * 10000000LL / baud);
+    // The other end sees the bytes once they have been transmitted
+    std::this_thread::sleep_until(next_free);
+    const uint8_t* p = (const uint8_t*) buf;
+    std::vector<uint8_t> garbled;
+    if (peer != NULL && (peer->baud != baud ||
+                         (max_link_baud != 0 && baud > max_link_baud))) {
+      garbled.assign(p, p + len);
+      for (uint8_t& b : garbled) {
+        b ^= 0x55;
+      }
+      p = garbled.data();
+    }
+    while (len > 0) {
+      int n = ::write(fd, p, len);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("write");
+        exit(1);
+      }
+      p += n;
+      len -= n;
+    }
+  }
+
+  void drain() {
+    std::this_thread::sleep_until(next_free);
+  }
+
+  bool set_baud(int baud) {
+    this->baud = baud;
+    return true;
+  }
+
+  int get_baud() {
+    return baud;
+  }
+};
+
+
+// Mirrors the server in modules/trs-io-fs (see serial.h for the framing)
+class Server {
+private:
+  PtyPort* port;
+  std::string root;
+  int max_baud;
+  int latency_ms;
+  int error_pct = 0;
+  int expected = -1;
+  bool verifying = false;
+  Clock::time_point baud_deadline;
+  unsigned outage_at = 0;
+  int outage_ms = 0;
+  Clock::time_point outage_end;
+  std::vector<uint8_t> history[256];
+  std::vector<int> files;
+  std::vector<DIR*> dirs;
+  std::vector<uint8_t> reply;
+
+public:
+  unsigned frames = 0;
+  unsigned crc_errors = 0;
+  unsigned duplicates = 0;
+  unsigned dropped = 0;
+  unsigned injected = 0;
+  unsigned fallbacks = 0;
+  unsigned lost = 0;
+
+  Server(PtyPort* port, const char* root, int max_baud, int latency_ms)
+    : port(port), root(root), max_baud(max_baud), latency_ms(latency_ms) {}
+
+  void set_errors(int pct) {
+    error_pct = pct;
+  }
+
+  // Loses every frame for ms once frame number at has arrived
+  void set_outage(unsigned at, int ms) {
+    outage_at = at;
+    outage_ms = ms;
+  }
+
+  void run() {
+    std::vector<uint8_t> frame(SERIAL_MAX_FRAME);
+    while (true) {
+      int len = receive(frame.data());
+      if (len >= 0) {
+        handle(frame[0], frame[1], frame.data() + 4, len);
+      }
+    }
+  }
+
+private:
+  static uint16_t crc16(const uint8_t* p, int len) {
+    uint16_t crc = 0xffff;
+    while (len-- > 0) {
+      crc ^= *p++ << 8;
+      for (int i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+      }
+    }
+    return crc;
+  }
+
+  static uint16_t get16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+  }
+
+  static uint32_t get32(const uint8_t* p) {
+    return get16(p) | ((uint32_t) get16(p + 2) << 16);
+  }
+
+  void put16(uint16_t w) {
+    reply.push_back(w & 0xff);
+    reply.push_back(w >> 8);
+  }
+
+  void put32(uint32_t l) {
+    put16(l & 0xffff);
+    put16(l >> 16);
+  }
+
+  bool inject() {
+    return error_pct > 0 && rand() % 100 < error_pct;
+  }
+
+  // Returns the payload length, or -1 if the frame was corrupted
+  int receive(uint8_t* frame) {
+    uint8_t b;
+    int state = 0;
+
+    while (state < 2) {
+      int timeout_ms = 1000000;
+      if (verifying) {
+        timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+          baud_deadline - Clock::now()).count();
+        if (timeout_ms <= 0) {
+          // No valid frame at the new rate. The client falls back as well
+          port->set_baud(SERIAL_DEFAULT_BAUD);
+          verifying = false;
+          fallbacks++;
+          continue;
+        }
+      }
+      if (port->read(&b, 1, timeout_ms) != 1) {
+        continue;
+      }
+      if (state == 1 && b == SERIAL_SYNC1) {
+        state = 2;
+      } else {
+        state = (b == SERIAL_SYNC0) ? 1 : 0;
+      }
+    }
+    if (port->read(frame, 4, SERIAL_TIMEOUT_MS) != 4) {
+      return -1;
+    }
+    int len = get16(frame + 2);
+    if (len > SERIAL_MAX_PAYLOAD ||
+        port->read(frame + 4, len + 2, SERIAL_TIMEOUT_MS) != len + 2 ||
+        crc16(frame, len + 4) != get16(frame + 4 + len)) {
+      crc_errors++;
+      return -1;
+    }
+    frames++;
+    verifying = false;
+    return len;
+  }
+
+  void send(std::vector<uint8_t>& f) {
+    if (inject()) {
+      // Corrupt the reply on the way to the client
+      std::vector<uint8_t> bad = f;
+      bad[4 + rand() % (bad.size() - 4)] ^= 0x55;
+      injected++;
+      port->write(bad.data(), bad.size());
+      return;
+    }
+    port->write(f.data(), f.size());
+  }
+
+  /*
+   * Requests are handled strictly in sequence order. A request from the
+   * recent past is answered from the history, anything else out of order
+   * is dropped and the client will send it again.
+   */
+  void handle(uint8_t seq, uint8_t cmd, uint8_t* p, int len) {
+    if (outage_ms > 0 && frames == outage_at) {
+      outage_end = Clock::now() + std::chrono::milliseconds(outage_ms);
+    }
+    if (outage_ms > 0 && frames >= outage_at && Clock::now() < outage_end) {
+      lost++;
+      return;
+    }
+    if (cmd != F_HELLO && expected >= 0 && seq != expected) {
+      uint8_t age = expected - seq;
+      if (age >= 1 && age <= 32 && !history[seq].empty()) {
+        duplicates++;
+        send(history[seq]);
+      } else {
+        dropped++;
+      }
+      return;
+    }
+    if (cmd != F_HELLO && inject()) {
+      // Lose the request
+      injected++;
+      return;
+    }
+    if (latency_ms > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(latency_ms));
+    }
+    uint32_t baud = 0;
+    reply.assign({SERIAL_SYNC0, SERIAL_SYNC1, seq, (uint8_t) (cmd | SERIAL_REPLY), 0, 0});
+    reply.push_back(FR_OK);
+    FRESULT res = execute(cmd, p, len, &baud);
+    if (res != FR_OK) {
+      reply.resize(SERIAL_HEADER_SIZE);
+      reply.push_back(res);
+    }
+    int n = reply.size() - SERIAL_HEADER_SIZE;
+    reply[4] = n & 0xff;
+    reply[5] = n >> 8;
+    put16(crc16(reply.data() + 2, reply.size() - 2));
+    history[seq] = reply;
+    expected = (seq + 1) & 0xff;
+    send(reply);
+    if (baud != 0 && baud != port->get_baud()) {
+      port->drain();
+      port->set_baud(baud);
+      verifying = baud != SERIAL_DEFAULT_BAUD;
+      baud_deadline = Clock::now() + std::chrono::milliseconds(SERIAL_BAUD_TIMEOUT_MS);
+    }
+  }
+
+  std::string path(const uint8_t* p, int len) {
+    std::string name((const char*) p, strnlen((const char*) p, len));
+    while (!name.empty() && name[0] == '/') {
+      name.erase(0, 1);
+    }
+    return root + "/" + name;
+  }
+
+  static FRESULT error() {
+    switch (errno) {
+    case ENOENT:
+      return FR_NO_FILE;
+    case EEXIST:
+      return FR_EXIST;
+    case EACCES:
+      return FR_DENIED;
+    default:
+      return FR_DISK_ERR;
+    }
+  }
+
+  int file(const uint8_t* p) {
+    uint16_t id = get16(p);
+    return (id < files.size()) ? files[id] : -1;
+  }
+
+  void put_info(const struct stat* st) {
+    struct tm tm;
+    localtime_r(&st->st_mtime, &tm);
+    put32(st->st_size);
+    reply.push_back(S_ISDIR(st->st_mode) ? AM_DIR : 0);
+    put16(((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+    put16((tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+  }
+
+  FRESULT execute(uint8_t cmd, uint8_t* p, int len, uint32_t* baud) {
+    switch (cmd) {
+    case F_HELLO: {
+      uint32_t rate = std::min((uint32_t) max_baud, get32(p + 1));
+      reply.push_back(SERIAL_VERSION);
+      put32(rate);
+      put16(SERIAL_BLOCK_SIZE);
+      *baud = rate;
+      return FR_OK;
+    }
+    case F_OPEN: {
+      BYTE mode = p[0];
+      int flags = (mode & FA_WRITE) ? ((mode & FA_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+      if (mode & FA_CREATE_NEW) {
+        flags |= O_CREAT | O_EXCL;
+      } else if (mode & FA_CREATE_ALWAYS) {
+        flags |= O_CREAT | O_TRUNC;
+      } else if (mode & FA_OPEN_ALWAYS) {
+        flags |= O_CREAT;
+      }
+      bool append = (mode & FA_OPEN_APPEND) == FA_OPEN_APPEND;
+      if (append) {
+        flags |= O_APPEND;
+      }
+      int fd = open(path(p + 1, len - 1).c_str(), flags, 0644);
+      if (fd < 0) {
+        return error();
+      }
+      put16(files.size());
+      put32(append ? lseek(fd, 0, SEEK_END) : 0);
+      files.push_back(fd);
+      return FR_OK;
+    }
+    case F_CLOSE: {
+      int fd = file(p);
+      if (fd < 0) {
+        return FR_INVALID_OBJECT;
+      }
+      files[get16(p)] = -1;
+      return (close(fd) == 0) ? FR_OK : error();
+    }
+    case F_PREAD: {
+      int fd = file(p);
+      if (fd < 0) {
+        return FR_INVALID_OBJECT;
+      }
+      UINT n = std::min((int) get16(p + 6), SERIAL_BLOCK_SIZE);
+      reply.resize(reply.size() + n);
+      ssize_t r = pread(fd, reply.data() + reply.size() - n, n, get32(p + 2));
+      if (r < 0) {
+        return error();
+      }
+      reply.resize(reply.size() - n + r);
+      return FR_OK;
+    }
+    case F_PWRITE: {
+      int fd = file(p);
+      if (fd < 0) {
+        return FR_INVALID_OBJECT;
+      }
+      ssize_t w = pwrite(fd, p + 6, len - 6, get32(p + 2));
+      if (w < 0) {
+        return error();
+      }
+      put16(w);
+      return FR_OK;
+    }
+    case F_WRITE: {
+      int fd = file(p);
+      if (fd < 0) {
+        return FR_INVALID_OBJECT;
+      }
+      ssize_t w = write(fd, p + 2, len - 2);
+      if (w < 0) {
+        return error();
+      }
+      put16(w);
+      put32(lseek(fd, 0, SEEK_CUR));
+      return FR_OK;
+    }
+    case F_UNLINK:
+      return (unlink(path(p, len).c_str()) == 0) ? FR_OK : error();
+    case F_STAT: {
+      struct stat st;
+      if (stat(path(p, len).c_str(), &st) != 0) {
+        return error();
+      }
+      put_info(&st);
+      return FR_OK;
+    }
+    case F_OPENDIR: {
+      DIR* dir = opendir(path(p, len).c_str());
+      if (dir == NULL) {
+        return error();
+      }
+      put16(dirs.size());
+      dirs.push_back(dir);
+      return FR_OK;
+    }
+    case F_READDIR: {
+      uint16_t id = get16(p);
+      if (id >= dirs.size() || dirs[id] == NULL) {
+        return FR_INVALID_OBJECT;
+      }
+      struct dirent* de;
+      while ((de = readdir(dirs[id])) != NULL && de->d_name[0] == '.') {
+      }
+      if (de == NULL) {
+        // End of directory: an empty name
+        closedir(dirs[id]);
+        dirs[id] = NULL;
+        reply.push_back(0);
+        reply.insert(reply.end(), 9, 0);
+        return FR_OK;
+      }
+      struct stat st;
+      std::string name = de->d_name;
+      if (stat((root + "/" + name).c_str(), &st) != 0) {
+        return error();
+      }
+      name.resize(std::min(name.size(), (size_t) 12));
+      reply.insert(reply.end(), name.begin(), name.end());
+      reply.push_back(0);
+      put_info(&st);
+      return FR_OK;
+    }
+    case F_LOG:
+      return FR_OK;
+    default:
+      return FR_INVALID_PARAMETER;
+    }
+  }
+};
+
+
+static int open_pty(int* slave) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("posix_openpt");
+    exit(1);
+  }
+  *slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (*slave < 0) {
+    perror(ptsname(master));
+    exit(1);
+  }
+  struct termios tio;
+  tcgetattr(*slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(*slave, TCSANOW, &tio);
+  return master;
+}
+
+static double now_ms() {
+  return std::chrono::duration<double, std::milli>(Clock::now().time_since_epoch()).count();
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr, "usage: %s [-s KB] [-b baud] [-u baud] [-w window] [-k chunk] "
+          "[-l ms] [-e %%] [-o ms] [-x]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char* argv[]) {
+  DWORD size = 256 * 1024;
+  int baud = SERIAL_MAX_BAUD;
+  int link_baud = 0;
+  int window = SERIAL_WINDOW;
+  DWORD chunk = 32 * 1024;
+  int latency_ms = 0;
+  int error_pct = 0;
+  int outage_ms = 0;
+  bool external = false;
+  char tmpl[] = "/tmp/serial-bench-XXXXXX";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:b:u:w:k:l:e:o:x")) != -1) {
+    switch (opt) {
+    case 's':
+      size = atoi(optarg) * 1024;
+      break;
+    case 'b':
+      baud = atoi(optarg);
+      break;
+    case 'u':
+      link_baud = atoi(optarg);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 'k':
+      chunk = atoi(optarg);
+      break;
+    case 'l':
+      latency_ms = atoi(optarg);
+      break;
+    case 'e':
+      error_pct = atoi(optarg);
+      break;
+    case 'o':
+      outage_ms = atoi(optarg);
+      break;
+    case 'x':
+      external = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (size == 0 || chunk == 0) {
+    usage(argv[0]);
+  }
+  const char* dir = external ? "external server" : mkdtemp(tmpl);
+  if (dir == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  int slave;
+  int master = open_pty(&slave);
+  Server* server = NULL;
+  TRS_FS_SERIAL* fs;
+  if (external) {
+    // The slave stays open so that the master does not see a hangup
+    // while the external server opens and closes the device
+    PtyPort* client_port = new PtyPort(master);
+    printf("Waiting for a server on %s\n", ptsname(master));
+    fflush(stdout);
+    while (true) {
+      fs = new TRS_FS_SERIAL(client_port, baud);
+      if (fs->get_err_msg() == NULL) {
+        break;
+      }
+      delete fs;
+    }
+    baud = client_port->get_baud();
+  } else {
+    PtyPort* server_port = new PtyPort(master);
+    PtyPort* client_port = new PtyPort(slave);
+    server_port->connect(client_port, link_baud);
+    client_port->connect(server_port, link_baud);
+    server = new Server(server_port, dir, baud, latency_ms);
+    std::thread(&Server::run, server).detach();
+
+    fs = new TRS_FS_SERIAL(client_port, baud);
+    if (fs->get_err_msg() != NULL) {
+      fprintf(stderr, "%s\n", fs->get_err_msg());
+      return 1;
+    }
+    baud = client_port->get_baud();
+    server->set_errors(error_pct);
+    // Long enough for the client to give up on the requests in flight
+    server->set_outage(server->frames + 8, outage_ms);
+  }
+  fs->set_window(window);
+
+  std::vector<uint8_t> data(size);
+  std::vector<uint8_t> check(size);
+  for (DWORD i = 0; i < size; i++) {
+    data[i] = rand();
+  }
+
+  printf("Serial benchmark in %s (%u KB, %d baud, window %d, chunk %u, "
+         "latency %d ms, errors %d%%)\n", dir, size / 1024, baud, window,
+         chunk, latency_ms, error_pct);
+  FIL fil;
+  FRESULT res = fs->f_open(&fil, "bench.dat", FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+  if (res != FR_OK) {
+    fprintf(stderr, "f_open: %d\n", res);
+    return 1;
+  }
+
+  double line = baud / 10.0 / 1024;
+  for (int pass = 0; pass < 2; pass++) {
+    bool write = (pass == 0);
+    uint8_t* buf = write ? data.data() : check.data();
+    fs->f_lseek(&fil, 0);
+    double start = now_ms();
+    for (DWORD ofs = 0; ofs < size; ofs += chunk) {
+      DWORD len = std::min(chunk, size - ofs);
+      DWORD n;
+      res = write ? fs->f_write32(&fil, buf + ofs, len, &n) :
+                    fs->f_read32(&fil, buf + ofs, len, &n);
+      if (res == FR_TIMEOUT && outage_ms > 0) {
+        // The link has to come back for the next request
+        printf("%s at %u timed out, retrying\n", write ? "write" : "read", ofs);
+        fs->f_lseek(&fil, ofs);
+        res = write ? fs->f_write32(&fil, buf + ofs, len, &n) :
+                      fs->f_read32(&fil, buf + ofs, len, &n);
+      }
+      if (res != FR_OK || n != len) {
+        fprintf(stderr, "%s at %u: %d (%u of %u bytes)\n", write ? "write" : "read",
+                ofs, res, n, len);
+        return 1;
+      }
+    }
+    double ms = now_ms() - start;
+    double kbs = size / 1024.0 / (ms / 1000);
+    printf("%-6s %10.0f ms %10.1f KB/s %6.1f%% of line rate\n",
+           write ? "write" : "read", ms, kbs, 100 * kbs / line);
+  }
+  fs->f_close(&fil);
+
+  if (server != NULL) {
+    printf("server: %u frames, %u CRC errors, %u duplicates, %u dropped, %u injected, "
+           "%u baud fallbacks, %u lost in outage\n", server->frames, server->crc_errors,
+           server->duplicates, server->dropped, server->injected, server->fallbacks,
+           server->lost);
+  }
+  if (data != check) {
+    fprintf(stderr, "data read back differs\n");
+    return 1;
+  }
+  return 0;
+}